@@ -8,9 +8,17 @@
 #include <stdio.h>
 #include <string.h>
 
+#define UE_VERSION "0.1.0"
+
 #define READ_U32(ptr) (*((uint32_t*)(ptr)))
 #define READ_U16(ptr) (*((uint16_t*)(ptr)))
 
+// 64-bit FNV-1a, for cache keys and hash tables. Chain calls by passing the
+// previous result as hash, starting from FNV_OFFSET_BASIS.
+#define FNV_OFFSET_BASIS  (0xcbf29ce484222325ULL)
+#define FNV_PRIME         (0x100000001b3ULL)
+
 size_t GetFileSize(FILE* fp);
+uint64_t fnv1a(uint64_t hash, const void* data, size_t size);
 
 #endif // COMMON_H
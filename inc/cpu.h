@@ -7,7 +7,9 @@ enum {
   ENDBR64,
   XOR_31,
   MOV_89,
+  MOV_8B,
   MOV_C7,
+  LEA_8D,
   POP_58,
   PUSH_50,
 
@@ -19,6 +21,45 @@ enum {
   SUB_83,
   XOR_83,
   CMP_83,
+
+  CMP_39,
+  CMP_3B,
+  TEST_85,
+  JCC,
+  JMP,
+  CALL_E8,
+  RET_C3,
+  CALL_FF, // call r/m64
+  JMP_FF,  // jmp r/m64
+
+  SYSCALL,
+  XCHG_87,
+  CMPXCHG_B1,
+  XADD_C1,
+  RDTSC,
+
+  // Floating point, each type covering a group of opcodes (see ue-fpu.h)
+  SSE_MOV,
+  SSE_ARITH,
+  SSE_CVT,
+  SSE_COMI,
+  SSE_LOGIC,
+  SSE_MXCSR,
+  X87,
+
+  // Superinstructions, only ever produced by the block builder (see ue-block.c)
+  FUSED_ZERO_REG,   // xor r32, r32 (same register)
+  FUSED_PUSH_FRAME, // push rbp; mov rbp, rsp
+  FUSED_CMP_JCC,    // cmp/test; jcc
+  FUSED_POP_RET,    // pop reg; ret
+
+  NUM_INSTR_TYPES
+};
+
+// Condition codes, as encoded in the low nibble of jcc/setcc/cmovcc
+enum {
+  CC_O, CC_NO, CC_B, CC_AE, CC_E, CC_NE, CC_BE, CC_A,
+  CC_S, CC_NS, CC_P, CC_NP, CC_L, CC_GE, CC_LE, CC_G,
 };
 
 typedef struct rflags_t {
@@ -45,6 +86,16 @@ typedef struct rflags_t {
   uint64_t id   : 1; // ID Flag
 } rflags_t;
 
+#define SHADOW_STACK_SIZE  (128)
+
+// Segment override prefixes. Only fs and gs have a base in 64-bit mode.
+enum {
+  SEG_NONE,
+  SEG_FS,
+  SEG_GS,
+  SEG_NUM_OVERRIDES
+};
+
 typedef struct cr0_t {
   uint64_t pe   : 1;
   uint64_t mp   : 1;
@@ -101,26 +152,41 @@ typedef struct cr4_t {
   uint64_t pks        : 1;
 } cr4_t;
 
+// An SSE register, viewed however the instruction using it needs
+typedef union xmm_t {
+  uint64_t u64[2];
+  uint32_t u32[4];
+} xmm_t;
+
 typedef struct cpu_x86_64_t {
-  uint64_t rax;
-  uint64_t rbx;
-  uint64_t rcx;
-  uint64_t rdx;
-  uint64_t rsi;
-  uint64_t rdi;
-  uint64_t rsp;
-  uint64_t rbp;
-  uint64_t r8;
-  uint64_t r9;
-  uint64_t r10;
-  uint64_t r11;
-  uint64_t r12;
-  uint64_t r13;
-  uint64_t r14;
-  uint64_t r15;
+  // General purpose registers, indexed directly by the 4-bit REX+ModRM
+  // register number (see the modrm_* enum below)
+  uint64_t regs[16];
 
   uint64_t rip;
 
+  // Only updated at block exits, never per instruction. Execution stops at the
+  // first block exit where instructions_retired >= budget_end. Block exits
+  // only compare against next_event, which is the earlier of budget_end and
+  // the next instruction count profiling sample (see ue-profile.c), so setting
+  // both to 0 is how to make a running cpu stop early.
+  uint64_t instructions_retired;
+  uint64_t budget_end;
+  uint64_t next_event;
+
+  // Set by another guest thread's exit_group() (see ue-syscall.c), along with
+  // next_event being zeroed, to stop this one at its next block exit
+  bool exit_requested;
+
+  // Return addresses of the calls currently in progress, innermost last, for
+  // the profiler. shadow_depth keeps counting past SHADOW_STACK_SIZE so that
+  // calls and returns stay balanced, but only the outermost frames are kept.
+  uint64_t shadow_stack[SHADOW_STACK_SIZE];
+  uint32_t shadow_depth;
+
+  // ID of the previous block (shifted) for edge coverage, see ue-coverage.h
+  uint32_t coverage_prev;
+
   uint16_t cs;
   uint16_t ds;
   uint16_t ss;
@@ -128,8 +194,32 @@ typedef struct cpu_x86_64_t {
   uint16_t fs;
   uint16_t gs;
 
+  // Segment bases, indexed by an instruction's segment override (SEG_*).
+  // seg_base[SEG_NONE] is always 0, so addresses never need a branch on it.
+  uint64_t seg_base[SEG_NUM_OVERRIDES];
+
   rflags_t rflags;
 
+  // Flags left pending by a fused compare-and-branch. They are only written
+  // back into rflags if something actually reads them.
+  struct {
+    bool pending;
+    uint16_t type;
+    uint8_t opsize;
+    uint64_t dst;
+    uint64_t src;
+  } lazy_flags;
+
+  // SSE and x87 state (see ue-fpu.h). While the guest runs, the host's MXCSR
+  // and x87 control word hold its settings, and the exception flags it raises
+  // only reach mxcsr and fsw when it stops.
+  xmm_t xmm[16];
+  uint32_t mxcsr;
+  long double st[8]; // By physical register; st(i) is st[(TOP + i) & 7], with TOP in fsw
+  uint16_t fcw;
+  uint16_t fsw;
+  uint8_t ftw; // A bit per physical register, set if it holds a value
+
   cr0_t     cr0;
   uint64_t  cr2;
   cr4_t     cr4;
@@ -150,6 +240,26 @@ typedef struct modrm_t {
   uint8_t mod : 2;
 } modrm_t;
 
+typedef struct sib_t {
+  uint8_t base  : 3;
+  uint8_t index : 3;
+  uint8_t scale : 2;
+} sib_t;
+
+// Every ModRM/SIB/displacement form is resolved at decode time to one of these
+// address computation kernels. At run time only the selected kernel is called.
+enum {
+  EA_REG,             // mod == 3, the operand is a register, not memory
+  EA_BASE,            // [base]
+  EA_BASE_DISP,       // [base + disp8/disp32]
+  EA_BASE_INDEX,      // [base + index*scale]
+  EA_BASE_INDEX_DISP, // [base + index*scale + disp8/disp32]
+  EA_INDEX_DISP,      // [index*scale + disp32]
+  EA_DISP,            // [disp32]
+  EA_RIP_DISP,        // [rip + disp32]
+  EA_NUM_KINDS
+};
+
 enum {
   modrm_rax,  // 0b0000
   modrm_rcx,  // 0b0001
@@ -180,31 +290,104 @@ enum {
   SIGN_EXTEND_CMP,  // 111
 };
 
+// Size-specialised register accessors. Each operand size gets its own pair of
+// functions, so handlers never have to build masks at run time.
+//
+// 64 and 32-bit writes replace the whole register - for 32-bit operands this is
+// exactly the architectural zero-extension rule. 16 and 8-bit writes merge into
+// the low bits and leave the rest of the register untouched.
+#define DEFINE_REG_ACCESSORS_ZX(bits)                                                  \
+  static inline uint##bits##_t reg_read_##bits(const cpu_x86_64_t* cpu, uint8_t index) { \
+    return (uint##bits##_t)cpu->regs[index];                                           \
+  }                                                                                    \
+  static inline void reg_write_##bits(cpu_x86_64_t* cpu, uint8_t index, uint##bits##_t value) { \
+    cpu->regs[index] = value;                                                          \
+  }
+
+#define DEFINE_REG_ACCESSORS_MERGE(bits)                                               \
+  static inline uint##bits##_t reg_read_##bits(const cpu_x86_64_t* cpu, uint8_t index) { \
+    return (uint##bits##_t)cpu->regs[index];                                           \
+  }                                                                                    \
+  static inline void reg_write_##bits(cpu_x86_64_t* cpu, uint8_t index, uint##bits##_t value) { \
+    cpu->regs[index] = (cpu->regs[index] & ~(uint64_t)(uint##bits##_t)~0) | value;      \
+  }
+
+DEFINE_REG_ACCESSORS_ZX(64)
+DEFINE_REG_ACCESSORS_ZX(32)
+DEFINE_REG_ACCESSORS_MERGE(16)
+
+// 8-bit registers are special: without a REX prefix, indices 4-7 select
+// AH, CH, DH and BH (the second byte of rax..rbx) instead of SPL..DIL
+static inline bool reg_is_high_8(uint8_t index, bool rex) {
+  return !rex && index >= modrm_rsp && index <= modrm_rdi;
+}
+
+static inline uint8_t reg_read_8(const cpu_x86_64_t* cpu, uint8_t index, bool rex) {
+  if (reg_is_high_8(index, rex)) {
+    return (uint8_t)(cpu->regs[index - modrm_rsp] >> 8);
+  }
+  return (uint8_t)cpu->regs[index];
+}
+
+static inline void reg_write_8(cpu_x86_64_t* cpu, uint8_t index, bool rex, uint8_t value) {
+  if (reg_is_high_8(index, rex)) {
+    uint64_t* reg = &cpu->regs[index - modrm_rsp];
+    *reg = (*reg & ~0xff00ULL) | ((uint64_t)value << 8);
+  } else {
+    cpu->regs[index] = (cpu->regs[index] & ~0xffULL) | value;
+  }
+}
+
 typedef struct prefixes_t {
   bool p66;
+  bool p67;
   bool pREX;
+  bool pLOCK;
+  bool pF2; // Only meaningful as SSE's mandatory prefixes
+  bool pF3;
+  uint8_t seg; // SEG_*
 } prefixes_t;
 
 #define MAX_INSTRUCTIONS_BYTES  (15)
 typedef struct x86_64_instr_t {
+  uint64_t address;
   uint16_t type;
   uint8_t size;
+  // Number of following instructions folded into this one by the block builder,
+  // and the original type of this instruction before it was fused
+  uint8_t num_fused;
+  uint16_t fused_type;
   uint8_t as_bytes[15];
 
   modrm_t modrm;
   rex_prefix_t rex;
   prefixes_t prefixes;
 
+  // Operand size in bytes (2, 4 or 8), resolved once at decode time
+  uint8_t opsize;
   uint8_t reg_index;
+  uint8_t cc;
   uint64_t imm64;
 
-  // SIB etc
+  // Memory operand, pre-resolved into an address kernel and its inputs
+  sib_t sib;
+  uint8_t ea_kind;
+  uint8_t ea_base;
+  uint8_t ea_index;
+  uint8_t ea_scale; // As a shift amount
+  int64_t disp;
 
 } x86_64_instr_t;
 
+uint64_t effective_address(const cpu_x86_64_t* cpu, const x86_64_instr_t* instr);
+
 int fetch_decode_execute(cpu_x86_64_t* cpu);
+int execute_instr(cpu_x86_64_t* cpu, const x86_64_instr_t* instr);
+void materialize_flags(cpu_x86_64_t* cpu);
+bool condition_met(cpu_x86_64_t* cpu, uint8_t cc);
+bool is_block_terminator(const x86_64_instr_t* instr);
 int decode_at_address(const uint64_t address, cpu_x86_64_t* cpu, x86_64_instr_t* instr_out);
-uint64_t* reg_from_nibble(const cpu_x86_64_t* cpu, const uint8_t nibble);
+int decode_modrm(const uint64_t address, x86_64_instr_t* instr, uint64_t* offset);
 int pop_stack(cpu_x86_64_t* cpu, uint64_t* data_out);
 int push_stack(cpu_x86_64_t* cpu, uint64_t data);
 
@@ -216,6 +399,10 @@ enum {
   CPU_ERR_UNABLE_TO_READ,
   CPU_ERR_INVALID_STACK_POINTER,
   CPU_ERR_NOT_IMPLEMENTED_YET,
+  CPU_ERR_INVALID_MEMORY_ACCESS,
+  CPU_ERR_SEGMENTATION_FAULT,
+  CPU_ERR_REPLAY_DIVERGED,
+  CPU_ERR_FP_EXCEPTION,
   // ...
   CPU_ERR_NUM_ERRORS
 };
@@ -0,0 +1,87 @@
+#ifndef UE_BLOCK_H
+#define UE_BLOCK_H
+
+#include "common.h"
+#include "cpu.h"
+
+// A block is a straight-line run of decoded instructions, ending at the first
+// instruction which changes control flow (or after BLOCK_MAX_INSTRUCTIONS)
+#define BLOCK_MAX_INSTRUCTIONS  (64)
+#define BLOCK_CACHE_BUCKETS     (4096)
+
+// Returned by run_blocks() when the instruction budget runs out
+#define RUN_BUDGET_EXHAUSTED    (1)
+// Returned by run_blocks() when the guest thread exits, or is stopped by the
+// exit of its whole thread group (see ue-syscall.c)
+#define RUN_GUEST_EXITED        (2)
+#define RUN_UNLIMITED           (UINT64_MAX)
+
+// Execution tiers. Code is interpreted an instruction at a time until it has
+// been reached build_threshold times, then built into a cached block, fused
+// into superinstructions as it's built (the optimized tier). Blocks built for
+// plugins are left at the baseline tier, one entry per guest instruction.
+#define BLOCK_BUILD_THRESHOLD_DEFAULT  (1)
+#define BLOCK_BUILD_THRESHOLD_MAX      (255)
+
+enum {
+  BLOCK_TIER_BASELINE,
+  BLOCK_TIER_OPTIMIZED,
+  BLOCK_NUM_TIERS
+};
+
+typedef struct block_tiers_t {
+  uint32_t build_threshold;    // Times code is interpreted before it gets a block, 0 to build straight away
+} block_tiers_t;
+
+enum {
+  FUSE_ENDBR64,     // endbr64 dropped entirely
+  FUSE_ZERO_REG,    // xor r32, r32
+  FUSE_PUSH_FRAME,  // push rbp; mov rbp, rsp
+  FUSE_CMP_JCC,     // cmp/test; jcc
+  FUSE_POP_RET,     // pop reg; ret
+  FUSE_NUM_KINDS
+};
+
+struct block_t {
+  uint64_t address;
+  uint64_t size; // Bytes of guest code covered by the block
+  size_t num_instrs;
+  uint64_t num_guest_instrs; // Guest instructions covered, before fusion
+  uint16_t fused[FUSE_NUM_KINDS]; // Superinstructions made when the block was built
+  uint32_t coverage_id; // Edge coverage ID, fixed when the block is cached
+  uint8_t tier; // BLOCK_TIER_*
+  x86_64_instr_t* instrs;
+  struct block_instrumentation_t* instrumentation; // Plugin callbacks, NULL if none (see ue-plugin.h)
+  bool mapped; // instrs points into a mapped translation cache file, not the heap
+  struct block_t* next; // Next block in the same cache bucket
+  struct block_t* retired_next; // Next block in the retired list, once it's out of the cache
+};
+
+typedef struct block_t block_t;
+
+typedef struct block_stats_t {
+  uint64_t blocks_built;
+  uint64_t fused[FUSE_NUM_KINDS];
+  uint64_t blocks_invalidated;
+} block_stats_t;
+
+typedef void (*block_visitor_t)(const block_t* block, void* ctx);
+
+block_t* block_lookup(uint64_t address);
+void block_set_tiers(const block_tiers_t* tiers);
+int block_build(cpu_x86_64_t* cpu, uint64_t address, int tier, block_t** block_out);
+block_t* block_insert(block_t* block);
+size_t block_invalidate_range(uint64_t address, uint64_t size);
+void for_each_block(block_visitor_t visitor, void* ctx);
+int execute_block(cpu_x86_64_t* cpu);
+int run_blocks(cpu_x86_64_t* cpu, uint64_t budget, bool trace);
+int step_instruction(cpu_x86_64_t* cpu);
+uint64_t current_instr_address(void);
+// Whether the block this thread is executing overlaps the range
+bool block_executing_in(uint64_t address, uint64_t size);
+int free_blocks(void);
+
+const block_stats_t* get_block_stats(void);
+void print_block_stats(FILE* fp);
+
+#endif // UE_BLOCK_H
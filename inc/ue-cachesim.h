@@ -0,0 +1,59 @@
+#ifndef UE_CACHESIM_H
+#define UE_CACHESIM_H
+
+#include "common.h"
+#include "ue-elf.h"
+
+// Cache and branch predictor simulation, for seeing how the guest would fare
+// on other hardware. Every guest data access goes through a set-associative
+// L1/L2/LLC hierarchy with LRU replacement and a TLB, and every conditional
+// branch through a gshare predictor. Results are reported per symbol.
+//
+// It's built on the plugin API (see inc/ue-plugin.h): blocks are instrumented
+// when they're translated, and the callbacks only append to a per-thread
+// buffer. The models run over a whole buffer at once when it fills up, or when
+// the guest makes a syscall, so the per-access cost in the guest is small.
+//
+// The configuration is a comma separated list, where anything left out keeps
+// its default:
+//
+//   l1=32k:8,l2=1m:16,llc=8m:16,line=64,tlb=64:4,bp=14:12
+//
+// Caches are size:ways, the TLB is entries:ways of 4 KiB pages, and the
+// predictor is log2 of its table size and the number of history bits.
+
+#define CACHESIM_BUFFER_ENTRIES  (4096)
+#define CACHESIM_PAGE_SHIFT      (12)
+
+typedef struct cachesim_level_config_t {
+  uint64_t size; // Bytes, or entries for the TLB
+  uint32_t ways;
+} cachesim_level_config_t;
+
+typedef struct cachesim_config_t {
+  cachesim_level_config_t l1;
+  cachesim_level_config_t l2;
+  cachesim_level_config_t llc;
+  cachesim_level_config_t tlb;
+  uint32_t line_size;
+  uint32_t predictor_bits;
+  uint32_t history_bits;
+} cachesim_config_t;
+
+int cachesim_parse_config(const char* spec, cachesim_config_t* config_out);
+int cachesim_start(const cachesim_config_t* config);
+void cachesim_report(FILE* fp, const elf_symtab_t* symtab);
+void cachesim_free(void);
+
+enum {
+  CACHESIM_ERR_UNKNOWN = 0,
+  CACHESIM_ERR_CONFIG,
+  CACHESIM_ERR_GEOMETRY,
+  CACHESIM_ERR_MALLOC,
+  CACHESIM_ERR_PLUGIN,
+  // ...
+  CACHESIM_ERR_NUM_ERRORS
+};
+char* cachesim_err_message(int errorIndex);
+
+#endif // UE_CACHESIM_H
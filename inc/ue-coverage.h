@@ -0,0 +1,76 @@
+#ifndef UE_COVERAGE_H
+#define UE_COVERAGE_H
+
+#include "common.h"
+#include "cpu.h"
+
+// AFL-style edge coverage. Every block gets an ID when it's translated (a hash
+// of its address, so it's the same in every run and every forkserver child),
+// and each block entry bumps the bitmap entry for the edge prev_id ^ cur_id.
+// The bitmap is the fuzzer's shared memory when run under AFL/AFL++.
+
+#define COVERAGE_MAP_SIZE_DEFAULT  (1 << 16)
+#define COVERAGE_SHM_ENV           "__AFL_SHM_ID"
+#define COVERAGE_MAP_SIZE_ENV      "AFL_MAP_SIZE"
+
+// The forkserver's control and status pipes, as set up by afl-fuzz
+#define FORKSRV_FD                 (198)
+
+// Blocks a forkserver child builds are reported back to the parent, which
+// builds them too so that later children start with them. Any past this many
+// in one run are left for a later child to report.
+#define COVERAGE_MAX_NEW_BLOCKS    (65536)
+
+typedef struct coverage_new_blocks_t {
+  uint32_t count;
+  uint64_t addresses[COVERAGE_MAX_NEW_BLOCKS];
+} coverage_new_blocks_t;
+
+// NULL unless coverage is enabled
+extern uint8_t* coverage_map;
+extern uint32_t coverage_map_mask;
+// Shared with the forkserver parent, NULL outside of a forkserver
+extern coverage_new_blocks_t* coverage_new_blocks;
+
+int coverage_init(bool force);
+bool coverage_under_fuzzer(void);
+uint32_t coverage_block_id(uint64_t address);
+int coverage_forkserver(void);
+void coverage_reset(cpu_x86_64_t* cpu);
+size_t coverage_num_edges(void);
+
+// The block prologue. Counters use AFL++'s NeverZero scheme, skipping 0 when
+// they wrap so a hot edge never looks unvisited.
+static inline void coverage_visit(cpu_x86_64_t* cpu, uint32_t block_id) {
+  uint8_t* map = coverage_map;
+  if (!map) return;
+
+  uint32_t cur = block_id & coverage_map_mask;
+  uint8_t* counter = &map[cur ^ cpu->coverage_prev];
+  uint8_t value = *counter + 1;
+  *counter = value + (value == 0);
+  cpu->coverage_prev = cur >> 1;
+}
+
+// When a block is built while running the guest
+static inline void coverage_note_block(uint64_t address) {
+  coverage_new_blocks_t* new_blocks = coverage_new_blocks;
+  if (!new_blocks) return;
+
+  uint32_t index = __atomic_fetch_add(&new_blocks->count, 1, __ATOMIC_RELAXED);
+  if (index < COVERAGE_MAX_NEW_BLOCKS) {
+    new_blocks->addresses[index] = address;
+  }
+}
+
+enum {
+  COVERAGE_ERR_UNKNOWN = 0,
+  COVERAGE_ERR_SHM,
+  COVERAGE_ERR_MAP_SIZE,
+  COVERAGE_ERR_MALLOC,
+  // ...
+  COVERAGE_ERR_NUM_ERRORS
+};
+char* coverage_err_message(int errorIndex);
+
+#endif // UE_COVERAGE_H
@@ -18,12 +18,31 @@ enum {
   ELF_ERR_EXECUTABLE,
   ELF_ERR_ISA,
   ELF_ERR_BAD_PHDR,
+  ELF_ERR_BAD_SHDR,
+  ELF_ERR_NO_SYMTAB,
+  ELF_ERR_MALLOC,
   // ...
   ELF_ERR_NUM_ERRORS
 };
 char* elf_err_message(int errorIndex);
 
+typedef struct elf_symbol_t {
+  uint64_t address;
+  uint64_t size;
+  uint8_t type; // STT_FUNC, STT_OBJECT, etc
+  const char* name; // Points into the owning elf_symtab_t's strtab
+} elf_symbol_t;
+
+typedef struct elf_symtab_t {
+  elf_symbol_t* symbols;
+  size_t num_symbols;
+  char* strtab;
+} elf_symtab_t;
+
 int elf_parse_header(FILE* fp, Elf64_Ehdr* header);
 int elf_parse_program_headers(FILE* fp, const Elf64_Ehdr* header, Elf64_Phdr* phdr);
+int elf_parse_symbols(FILE* fp, const Elf64_Ehdr* header, uint64_t bias, elf_symtab_t* symtab_out);
+const elf_symbol_t* elf_find_function(const elf_symtab_t* symtab, uint64_t address);
+void elf_free_symbols(elf_symtab_t* symtab);
 
 #endif // UE_ELF_H
@@ -0,0 +1,71 @@
+#ifndef UE_FPU_H
+#define UE_FPU_H
+
+#include "common.h"
+#include "cpu.h"
+
+// Floating point: x87 and scalar SSE/SSE2. Each instruction is carried out by
+// the same instruction on the host, on copies of the guest's registers, so
+// results (including NaN payloads, denormals and rounding) are bit-for-bit
+// what the guest would get natively.
+//
+// The guest's MXCSR and x87 control word are only switched into the host by
+// fpu_enter() when run_blocks() starts, and back out by fpu_leave() when it
+// stops, rather than around every instruction. Exception flags the host raises
+// in between are collected into the guest's MXCSR and x87 status word then.
+// ldmxcsr and fldcw update both the guest's copy and the host.
+//
+// Anything that runs inside run_blocks() but isn't guest code (syscalls,
+// plugin callbacks, watchpoint reports) goes between fpu_host_begin() and
+// fpu_host_end(), so that it gets the host's rounding and masked exceptions,
+// and whatever it raises isn't put down to the guest.
+//
+// An exception the guest has unmasked traps on the host just as it would
+// natively, and stops the guest with CPU_ERR_FP_EXCEPTION.
+//
+// Covered so far is what compilers emit for scalar code:
+//   SSE:  movss/sd/ups/upd/aps/apd, movd/movq, add/sub/mul/div/min/max/sqrt
+//         ss/sd, cvt(t) between ss/sd/si, (u)comiss/sd, and/andn/or/xorps/pd,
+//         pxor, ldmxcsr/stmxcsr
+//   x87:  fld/fst(p)/fild/fist(p)/fisttp, add/sub(r)/mul/div(r) in all their
+//         forms, fxch, fchs, fabs, fsqrt, fld1, fldz, f(u)comi(p), fldcw,
+//         fnstcw, fnstsw ax, fnclex
+
+#define MXCSR_DEFAULT      (0x1f80) // All exceptions masked, round to nearest
+#define MXCSR_FLAGS        (0x003f)
+#define FCW_DEFAULT        (0x037f) // All exceptions masked, 64-bit precision, round to nearest
+#define FSW_EXCEPTIONS     (0x003f)
+#define FSW_STACK_FAULT    (1 << 6)
+#define FSW_C1             (1 << 9)
+#define FSW_TOP_SHIFT      (11)
+
+// Called from decode_instr() in cpu.c. opcode is the byte after 0F for SSE,
+// and the escape byte (D8-DF) for x87; offset is just past it.
+int fpu_decode_sse(const uint64_t address, uint8_t opcode, x86_64_instr_t* instr, uint64_t* offset);
+int fpu_decode_x87(const uint64_t address, uint8_t opcode, x86_64_instr_t* instr, uint64_t* offset);
+bool fpu_is_sse_opcode(uint8_t opcode);
+
+int fpu_execute(cpu_x86_64_t* cpu, const x86_64_instr_t* instr);
+
+// The size of a floating point instruction's memory operand, and whether it's
+// read and/or written
+uint32_t fpu_memory_operand(const x86_64_instr_t* instr, bool* read_out, bool* write_out);
+
+void fpu_enter(cpu_x86_64_t* cpu);
+void fpu_leave(cpu_x86_64_t* cpu);
+// Switch the host's settings back in for a while, and the guest's out again.
+// These nest, and do nothing on a thread that isn't running a guest.
+void fpu_host_begin(void);
+void fpu_host_end(void);
+
+int fpu_install_exception_handler(void);
+
+enum {
+  FPU_ERR_UNKNOWN = 0,
+  FPU_ERR_SIGNAL,
+  // ...
+  FPU_ERR_NUM_ERRORS
+};
+char* fpu_err_message(int errorIndex);
+
+#endif // UE_FPU_H
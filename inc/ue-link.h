@@ -0,0 +1,124 @@
+#ifndef UE_LINK_H
+#define UE_LINK_H
+
+#include "common.h"
+#include "ue-loader.h"
+
+// Dynamic linking done by the emulator, in place of the guest's own dynamic
+// linker. The libraries a program needs (DT_NEEDED, transitively) are loaded
+// with the loader, and every relocation in them and in the program is resolved
+// up front, so the guest starts straight at the program's entry point with its
+// GOT and PLT already filled in. All that's left for the guest to do first,
+// in link_start_guest(), is what needs guest code: running the IFUNC
+// resolvers and the libraries' initializers. Static TLS is set up there too,
+// laid out as ld.so would, for the initial exec and local exec models and the
+// DTPMOD64/DTPOFF64 relocations.
+//
+// The result of that (where each library went, and the value written at every
+// relocated address) can be kept in a prelink cache file, keyed by the program
+// and its load base. A later run that finds the file, and finds each library
+// it names unchanged, maps the libraries at the same bases and replays the
+// writes without looking up a single symbol. That's the cost ld.so pays on
+// every run, but only for programs this linker can start: the guest's ld.so,
+// and so its own startup work, is skipped entirely with -L/-D. glibc's libc.so
+// reaches into ld.so's internal state (and ld.so provides __tls_get_addr() for
+// the general dynamic TLS model), so glibc programs still need ld.so.
+//
+// Library search follows ld.so: DT_RUNPATH (or DT_RPATH) with $ORIGIN, then
+// LD_LIBRARY_PATH, then the system directories. Symbols are looked up through
+// DT_GNU_HASH or DT_HASH, in load order with the program first, ignoring symbol
+// versions. Not supported: text relocations, and TLS in libraries loaded later
+// with dlopen().
+
+#define LINK_MAX_OBJECTS        (64)  // The program and its libraries
+#define LINK_LIBRARY_BASE       (0xfe0000000ULL)
+#define LINK_LIBRARY_ALIGN      (2ULL * 1024 * 1024)
+#define LINK_SYSTEM_PATH        "/lib/x86_64-linux-gnu:/usr/lib/x86_64-linux-gnu:/lib64:/usr/lib64:/lib:/usr/lib"
+#define LINK_TCB_SIZE           (0x1000) // Above the thread pointer, zeroed apart from the self pointers
+#define LINK_TCB_ALIGN          (64)
+// Where guest functions called by the emulator return to. It's never mapped
+// (it's below GUEST_MMAP_BOTTOM), so getting there stops the guest.
+#define LINK_RETURN_ADDRESS     (0x1000ULL)
+
+#define PRELINK_MAGIC           (0x4b4e494c4552504dULL) // "MPRELINK"
+#define PRELINK_FORMAT_VERSION  (2)
+
+typedef struct link_result_t {
+  size_t num_libraries;
+  size_t num_fixups;
+  bool from_cache;
+} link_result_t;
+
+// Loads and links everything the program at path (already loaded as exe) needs
+int link_program(const char* path, const loader_image_t* exe, link_result_t* result_out);
+// Once the guest's initial stack and process are set up, after linking or
+// prelink_load(). Sets the thread pointer, and runs guest code until the
+// program itself can start. Anything that stops the guest on the way (it
+// exiting, or faulting) is left in guest->result for the caller to report
+// rather than starting the program.
+struct guest_context_t;
+int link_start_guest(struct guest_context_t* guest, bool trace);
+// The library or symbol behind the last error, if there was one
+const char* link_error_detail(void);
+
+typedef struct prelink_header_t {
+  uint64_t magic;
+  uint32_t format_version;
+  uint32_t reserved;
+  char emulator_version[16];
+  uint64_t key;
+  uint64_t num_objects;
+  uint64_t num_fixups;
+  uint64_t strings_size;
+} prelink_header_t;
+
+// Followed in the file by the fixups, then the paths the objects point into.
+// The program is the first object, and is only there to be checked.
+typedef struct prelink_object_t {
+  uint64_t base;
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  uint64_t mtime;
+  uint64_t path_offset;
+} prelink_object_t;
+
+// value is stored at address. If copy_size is non-zero it's an R_X86_64_COPY,
+// and copy_size bytes are copied to address from value instead.
+#define PRELINK_FIXUP_IFUNC     (1 << 0) // value is a resolver, and what it returns is stored
+
+typedef struct prelink_fixup_t {
+  uint64_t address;
+  uint64_t value;
+  uint64_t copy_size;
+  uint64_t flags; // PRELINK_FIXUP_*
+} prelink_fixup_t;
+
+// Hash of the program file's identity, its load base, LD_LIBRARY_PATH and the
+// emulator version
+uint64_t prelink_key(const char* path, const loader_image_t* exe);
+// In place of link_program(), if the cache is still good
+int prelink_load(const char* dir, uint64_t key, const char* path, const loader_image_t* exe, link_result_t* result_out);
+// After link_program()
+int prelink_save(const char* dir, uint64_t key);
+
+enum {
+  LINK_ERR_UNKNOWN = 0,
+  LINK_ERR_NOT_FOUND,
+  LINK_ERR_TOO_MANY,
+  LINK_ERR_LOAD,
+  LINK_ERR_DYNAMIC,
+  LINK_ERR_SYMBOL,
+  LINK_ERR_RELOCATION,
+  LINK_ERR_READ_ONLY,
+  LINK_ERR_MALLOC,
+  LINK_ERR_CACHE_NOT_FOUND,
+  LINK_ERR_CACHE_BAD_FILE,
+  LINK_ERR_CACHE_STALE,
+  LINK_ERR_CACHE_WRITE,
+  // ...
+  LINK_ERR_NUM_ERRORS
+};
+char* link_err_message(int errorIndex);
+
+#endif // UE_LINK_H
@@ -0,0 +1,68 @@
+#ifndef UE_LOADER_H
+#define UE_LOADER_H
+
+#include "common.h"
+#include "ue-elf.h"
+
+// Loads the guest program and builds its initial stack, as execve() does.
+//
+// ET_EXEC executables go where their program headers say. ET_DYN ones
+// (position independent executables, and libraries) are loaded at a base of
+// our choosing, and the difference (the load bias) is added to every address
+// in them. Only PT_LOAD segments are mapped; PT_TLS is only noted, for
+// whatever sets up thread local storage.
+//
+// A dynamically linked program names its dynamic linker in PT_INTERP. That's
+// loaded as a second guest image and the guest starts in it, finding the
+// program through the auxiliary vector, just as under the kernel. The emulator
+// can also do the linking itself instead (see ue-link.h).
+
+// Where Linux puts PIEs and ld.so without ASLR, scaled down into the guest
+// address space (see ue-memory.h)
+#define LOADER_PIE_BASE        (0x555554000ULL)
+#define LOADER_INTERP_BASE     (0xff7fc3000ULL)
+#define LOADER_MAX_PATH        (4096)
+#define LOADER_MAX_ARGS_SIZE   (128 * 1024) // All of argv's strings together
+#define LOADER_RANDOM_BYTES    (16)  // For AT_RANDOM
+#define LOADER_PLATFORM        "x86_64"
+
+typedef struct loader_image_t {
+  uint64_t bias;    // Added to every address in the file, 0 for ET_EXEC
+  uint64_t entry;
+  uint64_t phdr;    // Guest address of the program headers, for AT_PHDR
+  uint16_t phnum;
+  uint64_t dynamic; // Guest address of the dynamic section, or 0 if there isn't one
+  uint64_t end;     // Guest address just past the last segment
+  // The PT_TLS segment's initialization image, if there is one
+  uint64_t tls_image;
+  uint64_t tls_filesz;
+  uint64_t tls_memsz;
+  uint64_t tls_align;
+} loader_image_t;
+
+// Maps an already opened and parsed ELF file. interp_out, if given, receives
+// the PT_INTERP path, or an empty string if there isn't one.
+int loader_load_image(FILE* fp, const Elf64_Ehdr* header, uint64_t base, loader_image_t* image_out, char* interp_out);
+// As loader_load_image(), for an interpreter or library by path
+int loader_load_file(const char* path, uint64_t base, loader_image_t* image_out);
+
+// Lays out argc, argv (argv[0] being the program's path), an empty environment
+// and the auxiliary vector below stack_top. interp is NULL if the program is
+// started directly. random is LOADER_RANDOM_BYTES bytes for AT_RANDOM, which
+// the caller gets from the host (see replay_random()).
+int loader_build_stack(int argc, char** argv, const uint8_t* random, const loader_image_t* exe, const loader_image_t* interp, uint64_t stack_top, uint64_t* rsp_out);
+
+enum {
+  LOADER_ERR_UNKNOWN = 0,
+  LOADER_ERR_OPEN,
+  LOADER_ERR_ELF,
+  LOADER_ERR_MALLOC,
+  LOADER_ERR_MAP,
+  LOADER_ERR_INTERP,
+  LOADER_ERR_STACK,
+  // ...
+  LOADER_ERR_NUM_ERRORS
+};
+char* loader_err_message(int errorIndex);
+
+#endif // UE_LOADER_H
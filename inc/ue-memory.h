@@ -1,17 +1,54 @@
 #ifndef UE_MEMORY_H
 #define UE_MEMORY_H
 
+#include <setjmp.h>
 #include "common.h"
 #include "ue-elf.h"
 
+// The whole guest address space is one contiguous host reservation, so a guest
+// address becomes a host one with a single addition. Everything the guest
+// hasn't mapped stays PROT_NONE, and any access to it faults on the host.
+//
+// The space is much smaller than the 47 bits a real process gets, so that many
+// of them fit in one host process. The places the emulator picks for the stack,
+// PIEs, libraries and the program interpreter are all scaled down into it.
+#define GUEST_SPACE_BITS      (36)
+#define GUEST_SPACE_SIZE      (1ULL << GUEST_SPACE_BITS) // 64GiB
+
 // TODO: Make these configurable
 // Finger in the wind: 1MiB of stack size
 #define STACK_SIZE            (1024 * 1024)
-#define STACK_START_ADDRESS  (0x7fffffffffffd2a0ULL)
+#define STACK_START_ADDRESS   (GUEST_SPACE_SIZE - 0x2d60)
+
+// With hugepages enabled, regions at least this big are backed by 2MiB pages
+#define HUGE_PAGE_SIZE            (2ULL * 1024 * 1024)
+#define HUGEPAGE_MIN_REGION_SIZE  (HUGE_PAGE_SIZE)
+
+#define GUEST_PAGE_SHIFT      (12)
+#define GUEST_PAGE_SIZE       (1ULL << GUEST_PAGE_SHIFT)
+
+// Per-page flags in the memory map
+#define PAGE_HAS_CODE         (1 << 0) // At least one decoded block covers this page
+#define PAGE_WATCHED          (1 << 1) // Holds watched bytes (see ue-watch.h)
+#define PAGE_EXECUTABLE       (1 << 2) // Part of a region mapped with PF_X
+#define PAGE_WRITABLE         (1 << 3) // Part of a region mapped with PF_W
+#define PAGE_WRITE_PROTECTED  (1 << 4) // Writable, but read-only on the host since it has code
 
+// Stores never look at the page flags. A writable page with code in it is made
+// read-only on the host instead, and the first store to it faults: the fault
+// handler throws away every block in the page and makes it writable again, and
+// the store is retried. If the block making the store was one of those, it's
+// left at the store (see MEMORY_FAULT_CODE_WRITE), so that nothing after it
+// runs from the old bytes. Invalidating by page means a page holding both code
+// and data keeps faulting while both are in use, which only JITs tend to do.
+
+// A mapped part of the guest address space. Regions only describe what's
+// mapped, for the emulator's own bookkeeping; guest accesses never look at them.
 struct memory_region_t {
-  uint8_t* buffer;
+  uint8_t* buffer; // Host address of the region's first byte
   Elf64_Phdr header;
+  bool dynamic;    // Mapped by the guest at run time, with mmap() or brk()
+  bool shared;     // MAP_SHARED
   struct memory_region_t* next;
 };
 
@@ -22,8 +59,64 @@ size_t get_num_memory_regions(void);
 int free_memory_regions(void);
 int load_memory_region(Elf64_Phdr* program_header, FILE* fp);
 int create_stack_region(const uint64_t start_address);
+void set_memory_hugepages(bool enabled);
 
 bool region_contains_address(memory_region_t* region, uint64_t address);
+// Whether address is in a region mapped with PF_X, for decoding ahead of time
+bool is_executable_address(uint64_t address);
+// Whether instruction bytes can be fetched from [address, address + size), from
+// the per-page flags. Where they can't, the first byte which can't is taken as
+// the fault address (see get_last_fault_address()).
+bool can_fetch(uint64_t address, uint64_t size);
+
+// Guest memory mapped and unmapped at run time, for mmap(), munmap(),
+// mprotect() and brk(). Addresses and sizes are page aligned, and p_flags are
+// the region's PF_* permissions. fd is -1 for anonymous memory. On
+// -MEM_ERR_MMAP, errno is as the host mmap() left it.
+#define GUEST_MMAP_TOP        (0xfe0000000ULL) // Just below the libraries (see ue-link.h)
+#define GUEST_MMAP_BOTTOM     (0x10000ULL)     // As Linux's default mmap_min_addr
+
+enum {
+  MAP_PLACE_ANYWHERE, // The address is only a hint; otherwise mapped as high as fits below GUEST_MMAP_TOP
+  MAP_PLACE_EXACT,    // Fails with -MEM_ERR_RANGE if anything is already there
+  MAP_PLACE_REPLACE,  // Replaces whatever is already there, as MAP_FIXED does
+};
+
+int map_guest_memory(uint64_t* address_inout, uint64_t size, int placement, uint32_t p_flags, bool shared, int fd, uint64_t offset);
+int unmap_guest_memory(uint64_t address, uint64_t size);
+// For mprotect(): every page of the range has to be mapped already, or
+// nothing changes and it fails with -MEM_ERR_RANGE
+int protect_guest_memory(uint64_t address, uint64_t size, uint32_t p_flags);
+
+// The program break starts just past the end of the program, and moves in
+// whole pages, never into another mapping. Returns the new break, or the old
+// one if it can't be moved there.
+void set_guest_brk_start(uint64_t address);
+uint64_t set_guest_brk(uint64_t address);
+// Whether any code in the range was modified (or unmapped) after being decoded
+bool was_code_modified(uint64_t address, uint64_t size);
+void mark_code_pages(uint64_t address, uint64_t size);
+void unmark_code_page(uint64_t address);
+bool mark_watched_pages(uint64_t address, uint64_t size);
+
+// Guest memory faults are caught by a SIGSEGV handler, which jumps to the
+// calling thread's recovery point (if it has one) with the faulting guest
+// address available from get_last_fault_address()
+extern __thread sigjmp_buf* memory_fault_recovery;
+// What the recovery point gets, instead of a CPU_ERR_*, when the block being
+// executed wrote to its own page. The store hasn't been made, and the page is
+// writable again.
+#define MEMORY_FAULT_CODE_WRITE  (-1)
+int install_memory_fault_handler(void);
+uint64_t get_last_fault_address(void);
+
+// Leaving the handler by siglongjmp() skips everything between the fault and
+// the recovery point, including unlocking any of the emulator's own locks the
+// thread holds. Code which takes one brackets the critical section with these,
+// and a fault in between is treated as a crash in the emulator itself.
+extern __thread int memory_fault_recovery_blocked;
+static inline void block_fault_recovery(void) { memory_fault_recovery_blocked++; }
+static inline void allow_fault_recovery(void) { memory_fault_recovery_blocked--; }
 
 bool read_u8(uint64_t address, uint8_t* data_out);
 bool read_u16(uint64_t address, uint16_t* data_out);
@@ -35,10 +128,34 @@ bool write_u16(uint64_t address, uint16_t data);
 bool write_u32(uint64_t address, uint32_t data);
 bool write_u64(uint64_t address, uint64_t data);
 
+// Host pointers to guest memory, for operations which have to act on the memory
+// itself (host atomics, futexes). guest_to_host() is NULL if the address isn't
+// mapped. guest_to_host_for_write() is for the guest's own accesses, and is
+// only NULL outside the guest address space; the host MMU faults the rest.
+void* guest_to_host(uint64_t address);
+void* guest_to_host_for_write(uint64_t address, uint64_t size);
+
+// For syscall arguments: a host pointer to [address, address + size), only if
+// all of it is mapped (by one region or several adjacent ones) with the guest
+// permission to read it, or to write it if for_write. Writes are seen by code
+// invalidation and watchpoints, as with guest_to_host_for_write().
+void* guest_range_to_host(uint64_t address, uint64_t size, bool for_write);
+
+// Copies of all of the guest's writable memory, for replay checkpoints (see
+// ue-replay.c), along with the layout of the whole address space and the
+// program break. Restoring maps and unmaps whatever has changed since, then
+// throws away any blocks decoded from bytes it changes.
+size_t memory_snapshot_size(void);
+void memory_snapshot(uint8_t* buffer_out);
+void memory_restore(const uint8_t* buffer);
+
 enum {
   MEM_ERR_UNKNOWN = 0,
   MEM_ERR_MALLOC,
   MEM_ERR_ELF_READ,
+  MEM_ERR_MMAP,
+  MEM_ERR_SIGNAL,
+  MEM_ERR_RANGE,
   // ...
   MEM_ERR_NUM_ERRORS
 };
@@ -0,0 +1,114 @@
+#ifndef UE_PLUGIN_H
+#define UE_PLUGIN_H
+
+#include "common.h"
+#include "cpu.h"
+
+// Instrumentation plugins. A plugin is a shared object loaded with dlopen()
+// which exports:
+//
+//   int ue_plugin_version = UE_PLUGIN_API_VERSION;
+//   int ue_plugin_install(ue_plugin_id_t id, const char* args);
+//
+// ue_plugin_install() subscribes to the events the plugin wants. Blocks are
+// instrumented when they're translated: a translate callback sees each new
+// block and attaches callbacks to the block, or to individual instructions in
+// it. Only those blocks pay anything at run time; every other block runs as
+// usual, and a plugin which never subscribes costs nothing at all.
+//
+// Instrumented blocks keep one entry per guest instruction (they're never
+// fused into superinstructions), so instruction indices are guest
+// instructions in order. Callbacks run on whichever thread runs the guest, so
+// a plugin watching a threaded guest has to do its own locking.
+
+#define UE_PLUGIN_API_VERSION     (1)
+#define UE_PLUGIN_VERSION_SYMBOL  "ue_plugin_version"
+#define UE_PLUGIN_INSTALL_SYMBOL  "ue_plugin_install"
+#define PLUGIN_MAX_PLUGINS        (16)
+
+typedef uint32_t ue_plugin_id_t;
+typedef struct block_t ue_block_t;
+
+typedef int (*ue_plugin_install_t)(ue_plugin_id_t id, const char* args);
+
+// Called once per block as it's translated, to instrument it
+typedef void (*ue_translate_cb_t)(ue_plugin_id_t id, ue_block_t* block, void* userdata);
+// Block entry, and before each instrumented instruction executes
+typedef void (*ue_block_cb_t)(cpu_x86_64_t* cpu, uint64_t address, void* userdata);
+typedef void (*ue_instr_cb_t)(cpu_x86_64_t* cpu, uint64_t address, void* userdata);
+// After the instruction at address has accessed size bytes at mem_address.
+// Read-modify-write instructions report the read and then the write.
+typedef void (*ue_mem_cb_t)(cpu_x86_64_t* cpu, uint64_t address, uint64_t mem_address, uint32_t size, bool is_write, void* userdata);
+// Before a syscall runs, with its number in rax and arguments in the usual registers
+typedef void (*ue_syscall_cb_t)(cpu_x86_64_t* cpu, uint64_t number, void* userdata);
+// When the guest has finished, for the plugin to report what it found
+typedef void (*ue_exit_cb_t)(ue_plugin_id_t id, void* userdata);
+
+// Subscriptions, from ue_plugin_install()
+void ue_plugin_on_translate(ue_plugin_id_t id, ue_translate_cb_t cb, void* userdata);
+void ue_plugin_on_syscall(ue_plugin_id_t id, ue_syscall_cb_t cb, void* userdata);
+void ue_plugin_on_exit(ue_plugin_id_t id, ue_exit_cb_t cb, void* userdata);
+
+// Translation time, from a translate callback
+uint64_t ue_block_address(const ue_block_t* block);
+size_t ue_block_num_instrs(const ue_block_t* block);
+const x86_64_instr_t* ue_block_instr(const ue_block_t* block, size_t index);
+bool ue_instr_accesses_memory(const x86_64_instr_t* instr);
+void ue_block_on_entry(ue_block_t* block, ue_block_cb_t cb, void* userdata);
+void ue_block_instr_on_exec(ue_block_t* block, size_t index, ue_instr_cb_t cb, void* userdata);
+void ue_block_instr_on_mem(ue_block_t* block, size_t index, ue_mem_cb_t cb, void* userdata);
+
+// Emulator side
+
+enum {
+  PLUGIN_CB_ENTRY,
+  PLUGIN_CB_EXEC,
+  PLUGIN_CB_MEM,
+};
+
+typedef struct plugin_callback_t {
+  uint16_t index; // Instruction index in the block (0 for block entry)
+  uint8_t kind;   // PLUGIN_CB_*
+  void* fn;
+  void* userdata;
+} plugin_callback_t;
+
+// Attached to a block by its translate callbacks, ordered by instruction index
+// and then kind, so that execution can walk them alongside the instructions
+typedef struct block_instrumentation_t {
+  size_t count;
+  size_t capacity;
+  plugin_callback_t* callbacks;
+} block_instrumentation_t;
+
+typedef struct plugin_mem_access_t {
+  uint64_t address;
+  uint32_t size;
+  bool is_write;
+} plugin_mem_access_t;
+
+// Whether any plugin instruments blocks, or watches syscalls
+extern bool plugins_instrumenting;
+extern bool plugins_watching_syscalls;
+
+int plugin_load(const char* path, const char* args);
+int plugin_install_builtin(ue_plugin_install_t install, const char* args);
+void plugin_translate_block(struct block_t* block);
+void plugin_free_instrumentation(block_instrumentation_t* instrumentation);
+size_t plugin_memory_accesses(const cpu_x86_64_t* cpu, const x86_64_instr_t* instr, plugin_mem_access_t* accesses_out);
+void plugin_syscall(cpu_x86_64_t* cpu);
+void plugin_exit(void);
+
+enum {
+  PLUGIN_ERR_UNKNOWN = 0,
+  PLUGIN_ERR_TOO_MANY,
+  PLUGIN_ERR_DLOPEN,
+  PLUGIN_ERR_VERSION,
+  PLUGIN_ERR_NO_INSTALL,
+  PLUGIN_ERR_INSTALL,
+  // ...
+  PLUGIN_ERR_NUM_ERRORS
+};
+char* plugin_err_message(int errorIndex);
+
+#endif // UE_PLUGIN_H
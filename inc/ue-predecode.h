@@ -0,0 +1,12 @@
+#ifndef UE_PREDECODE_H
+#define UE_PREDECODE_H
+
+#include "common.h"
+#include "ue-elf.h"
+
+// Initial capacity of the pre-decoder's work queue; it grows as needed
+#define PREDECODE_QUEUE_SIZE  (4096)
+
+int predecode_executable(uint64_t entry, const elf_symtab_t* symtab, int num_threads);
+
+#endif // UE_PREDECODE_H
@@ -0,0 +1,47 @@
+#ifndef UE_PROFILE_H
+#define UE_PROFILE_H
+
+#include "common.h"
+#include "cpu.h"
+#include "ue-elf.h"
+
+// Sampling profiler. Each sample is the guest rip plus the shadow call stack
+// kept by the cpu, taken either from a SIGPROF timer on each host thread's CPU
+// time or every so many retired guest instructions (checked at block exits,
+// like the run budget). Stacks deeper than SHADOW_STACK_SIZE keep only their
+// outermost frames, and are counted as truncated.
+// Samples go into preallocated per-thread buffers and are only symbolized at
+// the end, when they're written out as collapsed stacks for flamegraph tools.
+
+#define PROFILE_DEFAULT_INTERVAL_US  (1000)
+#define PROFILE_BUFFER_ENTRIES       (1024 * 1024) // Per host thread
+
+typedef struct profile_config_t {
+  uint64_t interval_us;           // Timer sampling period, 0 for PROFILE_DEFAULT_INTERVAL_US
+  uint64_t instruction_interval;  // If set, sample by instruction count instead
+} profile_config_t;
+
+int profile_start(const profile_config_t* config);
+void profile_stop(void);
+int profile_write_collapsed(const char* path, const elf_symtab_t* symtab);
+uint64_t profile_num_samples(uint64_t* dropped_out, uint64_t* truncated_out);
+void profile_free(void);
+
+// Used by run_blocks()
+void profile_attach(const cpu_x86_64_t* cpu);
+void profile_detach(void);
+void profile_sample(const cpu_x86_64_t* cpu);
+uint64_t profile_next_event(const cpu_x86_64_t* cpu);
+
+enum {
+  PROFILE_ERR_UNKNOWN = 0,
+  PROFILE_ERR_SIGNAL,
+  PROFILE_ERR_TIMER,
+  PROFILE_ERR_MALLOC,
+  PROFILE_ERR_OPEN,
+  // ...
+  PROFILE_ERR_NUM_ERRORS
+};
+char* profile_err_message(int errorIndex);
+
+#endif // UE_PROFILE_H
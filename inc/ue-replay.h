@@ -0,0 +1,89 @@
+#ifndef UE_REPLAY_H
+#define UE_REPLAY_H
+
+#include "common.h"
+#include "cpu.h"
+
+// Deterministic record and replay. A recording logs only what the guest can't
+// work out for itself: the results of syscalls which depend on the outside
+// world (along with the bytes they write into guest memory), rdtsc values, and
+// the random bytes the guest starts with (AT_RANDOM).
+// Everything else follows from the binary and the log, so a replay runs blocks
+// at full speed and has the same inputs fed back to it from the log.
+//
+// Replay is single threaded. Thread interleavings aren't logged, so clone() is
+// refused while recording or replaying.
+
+#define REPLAY_MAGIC                (0x59414c5045524555ULL) // "UEREPLAY"
+#define REPLAY_FORMAT_VERSION       (2)
+
+// Instructions between replay checkpoints, to start with. The interval doubles
+// whenever REPLAY_MAX_CHECKPOINTS are held, and every other one is dropped.
+#define REPLAY_CHECKPOINT_INTERVAL  (10000000)
+#define REPLAY_MAX_CHECKPOINTS      (64)
+
+enum {
+  REPLAY_OFF,
+  REPLAY_RECORDING,
+  REPLAY_REPLAYING,
+};
+
+typedef struct replay_header_t {
+  uint64_t magic;
+  uint32_t format_version;
+  uint32_t pid; // The recording's process id, which the guest may have seen
+  uint64_t key; // tcache_key() of the recorded binary
+} replay_header_t;
+
+enum {
+  REPLAY_EVENT_SYSCALL,
+  REPLAY_EVENT_RDTSC,
+  REPLAY_EVENT_RANDOM,
+};
+
+// Followed in the log by size bytes of data
+typedef struct replay_event_t {
+  uint16_t kind;
+  uint16_t number; // Syscall number
+  uint32_t size;
+  int64_t value;   // Syscall result or rdtsc value
+} replay_event_t;
+
+extern int replay_mode;
+
+int replay_record_start(const char* path, uint64_t key);
+int replay_open(const char* path, uint64_t key);
+int replay_close(void);
+uint32_t replay_process_id(void);
+
+// Event logging, for the syscall layer and the cpu. Reading an event which
+// doesn't match what the guest is doing fails with -CPU_ERR_REPLAY_DIVERGED.
+// Write errors don't stop the guest, but are reported by replay_close().
+void replay_write_event(uint16_t kind, uint16_t number, int64_t value, const void* data, uint32_t size);
+int replay_read_event(uint16_t kind, uint16_t number, int64_t* value_out, uint32_t* size_out);
+int replay_read_data(void* data_out, uint32_t size);
+int replay_rdtsc(uint64_t* tsc_out);
+// Random bytes from the host's getrandom(), except when replaying
+int replay_random(void* data_out, uint32_t size);
+
+// Replays up to exactly the given instruction count (or RUN_UNLIMITED to the
+// end), returning 0 once there or the run_blocks() result that stopped it
+// sooner. A watchpoint stopping it sets the guest's stop_reason and returns
+// RUN_BUDGET_EXHAUSTED. Seeking backwards restores the nearest earlier
+// checkpoint first.
+struct guest_context_t;
+int replay_run(struct guest_context_t* guest, uint64_t instructions, bool trace);
+int replay_seek(struct guest_context_t* guest, uint64_t instructions, bool trace);
+
+enum {
+  REPLAY_ERR_UNKNOWN = 0,
+  REPLAY_ERR_OPEN,
+  REPLAY_ERR_WRITE,
+  REPLAY_ERR_BAD_HEADER,
+  REPLAY_ERR_WRONG_BINARY,
+  // ...
+  REPLAY_ERR_NUM_ERRORS
+};
+char* replay_err_message(int errorIndex);
+
+#endif // UE_REPLAY_H
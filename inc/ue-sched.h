@@ -0,0 +1,111 @@
+#ifndef UE_SCHED_H
+#define UE_SCHED_H
+
+#include "common.h"
+#include "cpu.h"
+
+// Cooperative M:N scheduler. Guest contexts (the initial guest thread and the
+// ones it clone()s, see ue-syscall.c) are time-sliced over a fixed pool of
+// host threads, switching only at block exits once a slice's instruction
+// budget has run out. Instruction limits and timeouts are checked per slice,
+// so nothing is added to the per-instruction path.
+//
+// A guest which would block (in a futex wait) is parked, off the run queue,
+// rather than holding its host thread, so any number of guest threads can wait
+// on each other over a pool of any size. Host syscalls which block, such as a
+// read() from a pipe, still hold their host thread.
+//
+// Note: guest memory is process-wide (see ue-memory.c), so every context run
+// by the scheduler shares one address space.
+
+#define SCHED_DEFAULT_SLICE  (100000)
+// How often a guest is interrupted again, while it's still to stop
+#define SCHED_INTERRUPT_INTERVAL_NS  (1000000)
+
+// The emulator's exit status when the scheduler stops a guest, so a truncated
+// run can be told from the guest exiting by itself (124 is timeout(1)'s)
+#define SCHED_STATUS_INSTRUCTION_LIMIT  (123)
+#define SCHED_STATUS_TIMEOUT            (124)
+#define SCHED_STATUS_WATCHPOINT         (125)
+
+enum {
+  GUEST_RUNNABLE,
+  GUEST_RUNNING,
+  GUEST_BLOCKED, // Parked, e.g. in an emulated syscall, until sched_wake()
+  GUEST_DONE,
+};
+
+// Why the scheduler stopped a guest, when it didn't stop by itself
+enum {
+  GUEST_STOP_NONE,
+  GUEST_STOP_INSTRUCTION_LIMIT,
+  GUEST_STOP_TIMEOUT,
+  GUEST_STOP_WATCHPOINT,
+  GUEST_NUM_STOP_REASONS
+};
+
+struct sched_worker_t;
+
+struct guest_context_t {
+  cpu_x86_64_t cpu;
+  uint64_t instruction_limit; // 0 for no limit
+  uint64_t timeout_ns;        // 0 for no timeout
+
+  // Linux thread state, managed by the syscall layer (see ue-syscall.c)
+  uint64_t tid;
+  uint64_t clear_child_tid;
+  uint64_t robust_list;
+  uint32_t* futex_word; // The host address of the futex it's waiting on, if any
+  uint32_t futex_bitset;
+  struct guest_context_t* next_thread; // Thread group link
+  struct guest_context_t* next_waiter; // Futex wait list link
+
+  // Managed by the scheduler
+  int state;
+  bool park_requested;
+  bool wake_pending;
+  bool park_timed_out;
+  uint64_t park_deadline_ns; // 0 to park until woken
+  void (*timed_out)(struct guest_context_t* guest);
+  int interrupt_signal; // Sent to its host thread until it stops, 0 for none
+  int result;      // The run_blocks() error the guest stopped with
+  int stop_reason; // GUEST_STOP_*
+  uint64_t deadline_ns; // CLOCK_MONOTONIC, like every scheduler time
+  struct sched_worker_t* worker; // Running it, if it's running
+  struct guest_context_t* next; // Run queue or sleeping list link
+};
+
+typedef struct guest_context_t guest_context_t;
+
+typedef struct sched_config_t {
+  int num_threads;     // 0 for one per online core
+  uint64_t slice;      // Instructions per time slice, 0 for SCHED_DEFAULT_SLICE
+  bool trace;
+  // Called once a guest has stopped for good, from a worker with no scheduler
+  // lock held. The guest is the scheduler's no longer, and may be freed.
+  void (*finished)(guest_context_t* guest);
+} sched_config_t;
+
+int sched_run(guest_context_t* guests, size_t num_guests, const sched_config_t* config);
+bool sched_running(void);
+// Adds a guest started by parent (e.g. by clone()) to the running scheduler.
+// It shares the parent's deadline.
+int sched_spawn(guest_context_t* guest, const guest_context_t* parent);
+void sched_park(guest_context_t* guest, uint64_t deadline_ns, void (*timed_out)(guest_context_t* guest));
+void sched_wake(guest_context_t* guest);
+void sched_preempt(guest_context_t* guest);
+void sched_interrupt(guest_context_t* guest, int signal);
+uint64_t sched_now_ns(void);
+const char* sched_stop_message(int stop_reason);
+int sched_stop_status(int stop_reason);
+
+enum {
+  SCHED_ERR_UNKNOWN = 0,
+  SCHED_ERR_THREAD,
+  SCHED_ERR_NOT_RUNNING,
+  // ...
+  SCHED_ERR_NUM_ERRORS
+};
+char* sched_err_message(int errorIndex);
+
+#endif // UE_SCHED_H
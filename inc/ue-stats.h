@@ -0,0 +1,114 @@
+#ifndef UE_STATS_H
+#define UE_STATS_H
+
+#include "common.h"
+#include "cpu.h"
+
+// Hot path counters. Each host thread counts into its own thread-local,
+// cache-line aligned copy, so guest threads running on different cores never
+// write to a shared line; the copies are only summed when someone asks.
+//
+// Counting is compiled in with -DUE_STATS (STATS=1 in the Makefile, the
+// default). Without it every STATS_* macro expands to nothing. These counters
+// are bumped per block, syscall or slow path; the per-instruction histogram
+// of instruction types costs an extra store for every guest instruction, so
+// it's only compiled in with -DUE_STATS_INSTR_TYPES as well (STATS=2).
+
+#define CACHE_LINE_SIZE       (64)
+#define STATS_NUM_SYSCALLS    (512) // Anything higher is counted in the last slot
+#define STATS_PAGE_MAGIC      "UESTATS"
+#define STATS_PAGE_VERSION    (3)
+#define STATS_PUBLISH_INTERVAL_MS  (100)
+
+// Where time goes, per host thread running guest code
+enum {
+  STATS_TIER_BUILD,   // Decoding and building blocks
+  STATS_TIER_BLOCKS,  // Executing cached blocks
+  STATS_TIER_SYSCALL, // In emulated syscalls
+  STATS_NUM_TIERS
+};
+
+typedef struct stats_counters_t {
+  uint64_t instructions_retired;
+  uint64_t blocks_executed;
+  uint64_t blocks_interpreted; // Run an instruction at a time, before being built
+  uint64_t block_cache_hits;
+  uint64_t block_cache_misses;
+  uint64_t code_write_faults;
+  uint64_t tier_ns[STATS_NUM_TIERS];
+  uint64_t syscalls[STATS_NUM_SYSCALLS];
+  uint64_t instr_types[NUM_INSTR_TYPES];
+} __attribute__((aligned(CACHE_LINE_SIZE))) stats_counters_t;
+
+// The live stats surface: a file mapped MAP_SHARED (e.g. in /dev/shm) that an
+// external tool can map and poll while the guest runs. It's refreshed every
+// STATS_PUBLISH_INTERVAL_MS under a sequence lock; readers should retry if
+// sequence is odd, or changes while they copy the counters.
+typedef struct stats_page_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_instr_types;
+  uint64_t pid;
+  uint64_t sequence;
+  uint64_t timestamp_ns;
+  uint64_t num_threads;
+  stats_counters_t counters;
+} stats_page_t;
+
+#ifdef UE_STATS
+
+extern __thread stats_counters_t stats_thread_counters;
+extern __thread bool stats_thread_registered;
+
+void stats_register_thread(void);
+uint64_t stats_now_ns(void);
+
+// Only the owning thread writes its counters, so a relaxed store (a plain add
+// on x86) is enough for concurrent readers to see whole values
+#define STATS_ADD(field, n) \
+  __atomic_store_n(&stats_thread_counters.field, stats_thread_counters.field + (n), __ATOMIC_RELAXED)
+#define STATS_INC(field) STATS_ADD(field, 1)
+
+// Makes the calling thread's counters visible to stats_snapshot()
+#define STATS_ATTACH() \
+  do { if (!stats_thread_registered) stats_register_thread(); } while (0)
+
+#define STATS_TIME_START(name) uint64_t name = stats_now_ns()
+#define STATS_TIME_END(tier, name) STATS_ADD(tier_ns[tier], stats_now_ns() - (name))
+#define STATS_READ(field) (stats_thread_counters.field)
+
+#ifdef UE_STATS_INSTR_TYPES
+#define STATS_INSTR_TYPE(type) STATS_INC(instr_types[type])
+#else
+#define STATS_INSTR_TYPE(type) ((void)0)
+#endif
+
+#else
+
+#define STATS_ADD(field, n) ((void)0)
+#define STATS_INC(field) ((void)0)
+#define STATS_ATTACH() ((void)0)
+#define STATS_TIME_START(name) ((void)0)
+#define STATS_TIME_END(tier, name) ((void)0)
+#define STATS_READ(field) (0)
+#define STATS_INSTR_TYPE(type) ((void)0)
+
+#endif // UE_STATS
+
+void stats_snapshot(stats_counters_t* out, uint64_t* num_threads_out);
+int stats_publish_start(const char* path);
+void stats_publish_stop(void);
+void print_stats_summary(FILE* fp);
+
+enum {
+  STATS_ERR_UNKNOWN = 0,
+  STATS_ERR_DISABLED,
+  STATS_ERR_OPEN,
+  STATS_ERR_MMAP,
+  STATS_ERR_THREAD,
+  // ...
+  STATS_ERR_NUM_ERRORS
+};
+char* stats_err_message(int errorIndex);
+
+#endif // UE_STATS_H
@@ -0,0 +1,49 @@
+#ifndef UE_SYSCALL_H
+#define UE_SYSCALL_H
+
+#include "common.h"
+#include "cpu.h"
+
+// Linux x86-64 syscall numbers which are emulated
+#define SYSCALL_NR_READ               (0)
+#define SYSCALL_NR_WRITE              (1)
+#define SYSCALL_NR_OPEN               (2)
+#define SYSCALL_NR_CLOSE              (3)
+#define SYSCALL_NR_FSTAT              (5)
+#define SYSCALL_NR_LSEEK              (8)
+#define SYSCALL_NR_MMAP               (9)
+#define SYSCALL_NR_MPROTECT           (10)
+#define SYSCALL_NR_MUNMAP             (11)
+#define SYSCALL_NR_BRK                (12)
+#define SYSCALL_NR_PREAD64            (17)
+#define SYSCALL_NR_ACCESS             (21)
+#define SYSCALL_NR_SCHED_YIELD        (24)
+#define SYSCALL_NR_GETPID             (39)
+#define SYSCALL_NR_CLONE              (56)
+#define SYSCALL_NR_EXIT               (60)
+#define SYSCALL_NR_GETTIMEOFDAY       (96)
+#define SYSCALL_NR_ARCH_PRCTL         (158)
+#define SYSCALL_NR_GETTID             (186)
+#define SYSCALL_NR_FUTEX              (202)
+#define SYSCALL_NR_SET_TID_ADDRESS    (218)
+#define SYSCALL_NR_CLOCK_GETTIME      (228)
+#define SYSCALL_NR_EXIT_GROUP         (231)
+#define SYSCALL_NR_OPENAT             (257)
+#define SYSCALL_NR_NEWFSTATAT         (262)
+#define SYSCALL_NR_SET_ROBUST_LIST    (273)
+#define SYSCALL_NR_GETRANDOM          (318)
+
+// Every cpu passed to emulate_syscall() must be embedded in a guest_context_t
+// (see ue-sched.h), which holds the guest thread's kernel-side state.
+struct guest_context_t;
+void syscall_init_process(struct guest_context_t* main_thread);
+// The scheduler's finished callback (see sched_config_t)
+void syscall_thread_finished(struct guest_context_t* guest);
+// Once every guest thread has stopped
+void syscall_end_process(void);
+int emulate_syscall(cpu_x86_64_t* cpu);
+int get_guest_exit_status(void);
+// The signal which killed the guest, if one did, or 0
+int get_guest_fatal_signal(void);
+
+#endif // UE_SYSCALL_H
@@ -0,0 +1,51 @@
+#ifndef UE_TCACHE_H
+#define UE_TCACHE_H
+
+#include "common.h"
+
+// Persistent translation cache. Decoded blocks are written to a file keyed by
+// a hash of the executable segments and the emulator version, and later runs
+// of the same binary mmap that file and start with a warm block cache.
+
+#define TCACHE_MAGIC             (0x45484341434d4555ULL) // "UEMCACHE"
+#define TCACHE_FORMAT_VERSION    (7)
+#define TCACHE_MAX_PATH          (4096)
+#define TCACHE_MAX_KEYED_RANGES  (64) // Executable segments whose blocks can be saved
+
+typedef struct tcache_header_t {
+  uint64_t magic;
+  uint32_t format_version;
+  uint32_t instr_size; // sizeof(x86_64_instr_t), guards against layout changes
+  char emulator_version[16];
+  uint64_t key;
+  uint64_t num_blocks;
+} tcache_header_t;
+
+// Followed in the file by num_instrs x86_64_instr_t's at instrs_offset
+typedef struct tcache_block_t {
+  uint64_t address;
+  uint64_t size;
+  uint64_t num_instrs;
+  uint64_t num_guest_instrs;
+  uint64_t tier;
+  uint64_t instrs_offset;
+} tcache_block_t;
+
+uint64_t tcache_key(void);
+int tcache_load(const char* dir, uint64_t key);
+int tcache_save(const char* dir, uint64_t key);
+void tcache_unmap(void);
+
+enum {
+  TCACHE_ERR_UNKNOWN = 0,
+  TCACHE_ERR_NOT_FOUND,
+  TCACHE_ERR_BAD_FILE,
+  TCACHE_ERR_STALE,
+  TCACHE_ERR_MALLOC,
+  TCACHE_ERR_WRITE,
+  // ...
+  TCACHE_ERR_NUM_ERRORS
+};
+char* tcache_err_message(int errorIndex);
+
+#endif // UE_TCACHE_H
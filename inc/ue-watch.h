@@ -0,0 +1,80 @@
+#ifndef UE_WATCH_H
+#define UE_WATCH_H
+
+#include "common.h"
+#include "cpu.h"
+
+// Data watchpoints. Watching a range sets PAGE_WATCHED on the guest pages it
+// covers (see ue-memory.h). Only an access which lands on a watched page goes
+// on to compare its exact range against the watchpoints. Without watchpoints,
+// accesses pay nothing; with them, loads and stores pay a test of a global flag
+// for each kind watched, and then of the page flags.
+//
+// A hit is logged with the instruction's rip and the old and new values. A
+// watchpoint can also stop the guest. It stops at the end of the block that
+// hit it, since that's the next point where execution can be stopped.
+//
+// Writes through host pointers (atomics and syscall buffers) are logged once
+// the instruction or syscall has finished. Reads through host pointers aren't
+// seen at all.
+
+#define WATCH_MAX_WATCHPOINTS  (16)
+#define WATCH_MAX_SIZE         (8)  // Bytes, as for hardware watchpoints
+
+enum {
+  WATCH_WRITE = 1 << 0,
+  WATCH_READ  = 1 << 1,
+};
+
+enum {
+  WATCH_ACTION_LOG,
+  WATCH_ACTION_STOP,
+};
+
+typedef struct watchpoint_t {
+  uint64_t address;
+  uint64_t size;
+  int kinds;  // WATCH_WRITE and/or WATCH_READ
+  int action; // WATCH_ACTION_*
+} watchpoint_t;
+
+// Whether any watchpoint watches reads, checked on every load, and writes,
+// checked on every store
+extern bool watch_reads;
+extern bool watch_writes;
+
+// Written as address[,size][,r|w|rw][,stop], e.g. 0x404010,4,w,stop. The
+// defaults are 8 bytes, writes and logging.
+int watch_parse(const char* spec, watchpoint_t* watchpoint_out);
+// Only once the guest's memory is loaded
+int watch_add(const watchpoint_t* watchpoint);
+
+// Used by run_blocks() and step_instruction()
+void watch_attach(cpu_x86_64_t* cpu);
+bool watch_take_stop(void); // Whether a watchpoint has stopped this thread's guest
+
+// Slow paths, from ue-memory.c. The access is at host, and data is what's
+// about to be stored. A store with no data is being made in place through a
+// host pointer, and is logged by watch_finish_in_place() once it's made.
+void watch_access(uint64_t address, uint64_t size, bool is_write, const void* host, const void* data);
+extern __thread size_t watch_num_in_place;
+void watch_report_in_place(void);
+
+static inline void watch_finish_in_place(void) {
+  if (watch_num_in_place) {
+    watch_report_in_place();
+  }
+}
+
+enum {
+  WATCH_ERR_UNKNOWN = 0,
+  WATCH_ERR_SPEC,
+  WATCH_ERR_SIZE,
+  WATCH_ERR_TOO_MANY,
+  WATCH_ERR_NOT_MAPPED,
+  // ...
+  WATCH_ERR_NUM_ERRORS
+};
+char* watch_err_message(int errorIndex);
+
+#endif // UE_WATCH_H
@@ -6,3 +6,12 @@ size_t GetFileSize(FILE* fp) {
   rewind(fp);
   return fileSize;
 }
+
+uint64_t fnv1a(uint64_t hash, const void* data, size_t size) {
+  const uint8_t* bytes = data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
@@ -1,10 +1,44 @@
 #include "cpu.h"
 #include "ue-memory.h"
+#include "ue-syscall.h"
+#include "ue-replay.h"
+#include "ue-watch.h"
+#include "ue-fpu.h"
 
 #define ENDBR64_U32           (0xfa1e0ff3)
 #define XOR_31_OPCODE         (0x31)
 #define MOV_89_OPCODE         (0x89)
+#define MOV_8B_OPCODE         (0x8B)
 #define MOV_C7_OPCODE         (0xC7)
+#define LEA_8D_OPCODE         (0x8D)
+#define CMP_39_OPCODE         (0x39)
+#define CMP_3B_OPCODE         (0x3B)
+#define TEST_85_OPCODE        (0x85)
+#define JCC_REL8_BASE         (0x70)
+#define JCC_REL32_BASE        (0x80) // Preceded by 0x0F
+#define JMP_REL8_OPCODE       (0xEB)
+#define JMP_REL32_OPCODE      (0xE9)
+#define CALL_E8_OPCODE        (0xE8)
+#define RET_C3_OPCODE         (0xC3)
+#define GROUP_FF_OPCODE       (0xFF)
+#define GROUP_FF_CALL         (2) // ModRM reg field
+#define GROUP_FF_JMP          (4)
+#define TWO_BYTE_ESCAPE       (0x0F)
+#define XCHG_87_OPCODE        (0x87)
+#define SYSCALL_OPCODE        (0x05) // Preceded by 0x0F
+#define RDTSC_OPCODE          (0x31) // Preceded by 0x0F
+#define CMPXCHG_B1_OPCODE     (0xB1) // Preceded by 0x0F
+#define XADD_C1_OPCODE        (0xC1) // Preceded by 0x0F
+#define X87_ESCAPE_FIRST      (0xD8)
+#define X87_ESCAPE_LAST       (0xDF)
+
+#define LOCK_PREFIX           (0xF0)
+#define REPNE_PREFIX          (0xF2)
+#define REP_PREFIX            (0xF3)
+#define FS_PREFIX             (0x64)
+#define GS_PREFIX             (0x65)
+
+#define OP4MSB_CC4LSB         (0xf0)
 #define POP_58_BASE           (0x58)
 #define PUSH_50_BASE          (0x50)
 #define SEXTEND_OP_OPCODE     (0x83)
@@ -14,6 +48,84 @@
 #define SIGN_EXTEND_8_TO_64   (0xffffffffffffff00ULL)
 #define SIGN_EXTEND_32_TO_64  (0xffffffff00000000ULL)
 
+#define SIB_NO_INDEX          (0b100)
+#define SIB_NO_BASE           (0b101)
+
+// Effective address kernels, one per addressing form (see the EA_* enum)
+static uint64_t ea_kernel_base(const cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  return cpu->regs[instr->ea_base];
+}
+
+static uint64_t ea_kernel_base_disp(const cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  return cpu->regs[instr->ea_base] + instr->disp;
+}
+
+static uint64_t ea_kernel_base_index(const cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  return cpu->regs[instr->ea_base] + (cpu->regs[instr->ea_index] << instr->ea_scale);
+}
+
+static uint64_t ea_kernel_base_index_disp(const cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  return cpu->regs[instr->ea_base] + (cpu->regs[instr->ea_index] << instr->ea_scale) + instr->disp;
+}
+
+static uint64_t ea_kernel_index_disp(const cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  return (cpu->regs[instr->ea_index] << instr->ea_scale) + instr->disp;
+}
+
+static uint64_t ea_kernel_disp(const cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  return instr->disp;
+}
+
+// RIP-relative addresses are relative to the *next* instruction
+static uint64_t ea_kernel_rip_disp(const cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  return instr->address + instr->size + instr->disp;
+}
+
+typedef uint64_t (*ea_kernel_t)(const cpu_x86_64_t* cpu, const x86_64_instr_t* instr);
+
+static const ea_kernel_t ea_kernels[EA_NUM_KINDS] = {
+  [EA_REG]             = NULL,
+  [EA_BASE]            = ea_kernel_base,
+  [EA_BASE_DISP]       = ea_kernel_base_disp,
+  [EA_BASE_INDEX]      = ea_kernel_base_index,
+  [EA_BASE_INDEX_DISP] = ea_kernel_base_index_disp,
+  [EA_INDEX_DISP]      = ea_kernel_index_disp,
+  [EA_DISP]            = ea_kernel_disp,
+  [EA_RIP_DISP]        = ea_kernel_rip_disp,
+};
+
+// The address within the segment, which is all lea ever sees. An address size
+// prefix (0x67) makes it a 32-bit address, wrapping around at 4 GiB.
+static inline uint64_t effective_offset(const cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  uint64_t offset = ea_kernels[instr->ea_kind](cpu, instr);
+  return instr->prefixes.p67 ? (uint32_t)offset : offset;
+}
+
+uint64_t effective_address(const cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  return effective_offset(cpu, instr) + cpu->seg_base[instr->prefixes.seg];
+}
+
+static inline void shadow_call(cpu_x86_64_t* cpu, uint64_t return_address) {
+  if (cpu->shadow_depth < SHADOW_STACK_SIZE) {
+    cpu->shadow_stack[cpu->shadow_depth] = return_address;
+  }
+  cpu->shadow_depth++;
+}
+
+// Normally pops just the top frame. Anything which unwinds several frames at
+// once (longjmp, exceptions) is caught up with by searching down the stack for
+// the return address; if it isn't there at all, the stack is left alone.
+static inline void shadow_ret(cpu_x86_64_t* cpu, uint64_t return_address) {
+  uint32_t depth = cpu->shadow_depth;
+  while (depth > 0) {
+    depth--;
+    if (depth >= SHADOW_STACK_SIZE || cpu->shadow_stack[depth] == return_address) {
+      cpu->shadow_depth = depth;
+      return;
+    }
+  }
+}
+
 static uint8_t parity(uint64_t x) {
   uint8_t count = 0;
   while (x) {
@@ -23,9 +135,480 @@ static uint8_t parity(uint64_t x) {
   return (count & 1) ? 0 : 1;
 }
 
-int decode_at_address(const uint64_t address, cpu_x86_64_t* cpu, x86_64_instr_t* instr_out) {
+// REX.W takes priority over the operand size override prefix
+static uint8_t operand_size(const x86_64_instr_t* instr) {
+  if (instr->prefixes.pREX && instr->rex.w) return 8;
+  if (instr->prefixes.p66) return 2;
+  return 4;
+}
+
+// Flags for logical operations (and, or, xor, test). PF only considers the low byte.
+#define DEFINE_SET_LOGIC_FLAGS(bits)                                               \
+  static inline void set_logic_flags_##bits(cpu_x86_64_t* cpu, uint##bits##_t result) { \
+    cpu->lazy_flags.pending = false;                                               \
+    cpu->rflags.cf = 0;                                                            \
+    cpu->rflags.of = 0;                                                            \
+    cpu->rflags.sf = result >> (bits - 1);                                         \
+    cpu->rflags.zf = (result == 0) ? 1 : 0;                                        \
+    cpu->rflags.pf = parity(result & 0xff);                                        \
+  }
+
+DEFINE_SET_LOGIC_FLAGS(16)
+DEFINE_SET_LOGIC_FLAGS(32)
+DEFINE_SET_LOGIC_FLAGS(64)
+
+// Flags for subtraction (sub, cmp), computing dst - src
+#define DEFINE_SET_SUB_FLAGS(bits)                                                 \
+  static inline void set_sub_flags_##bits(cpu_x86_64_t* cpu, uint##bits##_t dst, uint##bits##_t src) { \
+    uint##bits##_t result = dst - src;                                             \
+    cpu->lazy_flags.pending = false;                                               \
+    cpu->rflags.cf = (dst < src) ? 1 : 0;                                          \
+    cpu->rflags.of = ((dst ^ src) & (dst ^ result)) >> (bits - 1);                 \
+    cpu->rflags.sf = result >> (bits - 1);                                         \
+    cpu->rflags.zf = (result == 0) ? 1 : 0;                                        \
+    cpu->rflags.af = ((dst ^ src ^ result) >> 4) & 1;                              \
+    cpu->rflags.pf = parity(result & 0xff);                                        \
+  }
+
+DEFINE_SET_SUB_FLAGS(16)
+DEFINE_SET_SUB_FLAGS(32)
+DEFINE_SET_SUB_FLAGS(64)
+
+// Flags for addition (add, xadd), computing dst + src
+#define DEFINE_SET_ADD_FLAGS(bits)                                                 \
+  static inline void set_add_flags_##bits(cpu_x86_64_t* cpu, uint##bits##_t dst, uint##bits##_t src) { \
+    uint##bits##_t result = dst + src;                                             \
+    cpu->lazy_flags.pending = false;                                               \
+    cpu->rflags.cf = (result < dst) ? 1 : 0;                                       \
+    cpu->rflags.of = (~(dst ^ src) & (dst ^ result)) >> (bits - 1);                \
+    cpu->rflags.sf = result >> (bits - 1);                                         \
+    cpu->rflags.zf = (result == 0) ? 1 : 0;                                        \
+    cpu->rflags.af = ((dst ^ src ^ result) >> 4) & 1;                              \
+    cpu->rflags.pf = parity(result & 0xff);                                        \
+  }
+
+DEFINE_SET_ADD_FLAGS(16)
+DEFINE_SET_ADD_FLAGS(32)
+DEFINE_SET_ADD_FLAGS(64)
+
+void materialize_flags(cpu_x86_64_t* cpu) {
+  if (!cpu->lazy_flags.pending) return;
+
+  uint64_t dst = cpu->lazy_flags.dst;
+  uint64_t src = cpu->lazy_flags.src;
+  bool is_test = cpu->lazy_flags.type == TEST_85;
+
+  switch (cpu->lazy_flags.opsize) {
+    case 2: if (is_test) set_logic_flags_16(cpu, dst & src); else set_sub_flags_16(cpu, dst, src); break;
+    case 4: if (is_test) set_logic_flags_32(cpu, dst & src); else set_sub_flags_32(cpu, dst, src); break;
+    case 8: if (is_test) set_logic_flags_64(cpu, dst & src); else set_sub_flags_64(cpu, dst, src); break;
+  }
+}
+
+bool condition_met(cpu_x86_64_t* cpu, uint8_t cc) {
+  materialize_flags(cpu);
+  const rflags_t* f = &cpu->rflags;
+
+  switch (cc) {
+    case CC_O:  return f->of;
+    case CC_NO: return !f->of;
+    case CC_B:  return f->cf;
+    case CC_AE: return !f->cf;
+    case CC_E:  return f->zf;
+    case CC_NE: return !f->zf;
+    case CC_BE: return f->cf || f->zf;
+    case CC_A:  return !f->cf && !f->zf;
+    case CC_S:  return f->sf;
+    case CC_NS: return !f->sf;
+    case CC_P:  return f->pf;
+    case CC_NP: return !f->pf;
+    case CC_L:  return f->sf != f->of;
+    case CC_GE: return f->sf == f->of;
+    case CC_LE: return f->zf || (f->sf != f->of);
+    case CC_G:  return !f->zf && (f->sf == f->of);
+  }
+  return false;
+}
+
+// Evaluates a condition code directly from the operands of a cmp (dst - src) or
+// test (dst & src), without computing any flags. Returns false in *handled for
+// conditions that aren't supported, in which case the caller must fall back.
+#define DEFINE_COMPARE_CONDITION(bits)                                             \
+  static inline bool compare_condition_##bits(bool is_test, uint##bits##_t dst, uint##bits##_t src, uint8_t cc, bool* handled) { \
+    *handled = true;                                                               \
+    int##bits##_t sdst = (int##bits##_t)dst;                                       \
+    int##bits##_t ssrc = (int##bits##_t)src;                                       \
+    if (is_test) {                                                                 \
+      int##bits##_t result = (int##bits##_t)(dst & src);                           \
+      switch (cc) {                                                                \
+        case CC_E:  return result == 0;                                            \
+        case CC_NE: return result != 0;                                            \
+        case CC_S:  case CC_L:  return result < 0;                                 \
+        case CC_NS: case CC_GE: return result >= 0;                                \
+        case CC_LE: return result <= 0;                                            \
+        case CC_G:  return result > 0;                                             \
+      }                                                                            \
+    } else {                                                                       \
+      switch (cc) {                                                                \
+        case CC_B:  return dst < src;                                              \
+        case CC_AE: return dst >= src;                                             \
+        case CC_E:  return dst == src;                                             \
+        case CC_NE: return dst != src;                                             \
+        case CC_BE: return dst <= src;                                             \
+        case CC_A:  return dst > src;                                              \
+        case CC_L:  return sdst < ssrc;                                            \
+        case CC_GE: return sdst >= ssrc;                                           \
+        case CC_LE: return sdst <= ssrc;                                           \
+        case CC_G:  return sdst > ssrc;                                            \
+      }                                                                            \
+    }                                                                              \
+    *handled = false;                                                              \
+    return false;                                                                  \
+  }
+
+DEFINE_COMPARE_CONDITION(16)
+DEFINE_COMPARE_CONDITION(32)
+DEFINE_COMPARE_CONDITION(64)
+
+// The r/m operand of a ModRM instruction is either a register or memory
+static inline uint8_t rm_index(const x86_64_instr_t* instr) {
+  return (instr->rex.b << 3) | instr->modrm.rm;
+}
+
+static inline uint8_t reg_field_index(const x86_64_instr_t* instr) {
+  return (instr->rex.r << 3) | instr->modrm.reg;
+}
+
+#define DEFINE_RM_ACCESSORS(bits)                                                \
+  static inline int rm_read_##bits(const cpu_x86_64_t* cpu, const x86_64_instr_t* instr, uint##bits##_t* value_out) { \
+    if (instr->ea_kind == EA_REG) {                                              \
+      *value_out = reg_read_##bits(cpu, rm_index(instr));                        \
+      return 0;                                                                  \
+    }                                                                            \
+    if (!read_u##bits(effective_address(cpu, instr), value_out)) {               \
+      return -CPU_ERR_INVALID_MEMORY_ACCESS;                                     \
+    }                                                                            \
+    return 0;                                                                    \
+  }                                                                              \
+  static inline int rm_write_##bits(cpu_x86_64_t* cpu, const x86_64_instr_t* instr, uint##bits##_t value) { \
+    if (instr->ea_kind == EA_REG) {                                              \
+      reg_write_##bits(cpu, rm_index(instr), value);                             \
+      return 0;                                                                  \
+    }                                                                            \
+    if (!write_u##bits(effective_address(cpu, instr), value)) {                  \
+      return -CPU_ERR_INVALID_MEMORY_ACCESS;                                     \
+    }                                                                            \
+    return 0;                                                                    \
+  }
+
+DEFINE_RM_ACCESSORS(16)
+DEFINE_RM_ACCESSORS(32)
+DEFINE_RM_ACCESSORS(64)
+
+// Memory operands of atomic instructions are operated on in place with host
+// atomics, so guest threads on different host cores see them exactly as they
+// would on hardware. Faults are caught by the host MMU as for any other access.
+// Watchpoints they hit are reported once the operation is done.
+#define DEFINE_RM_HOST(bits)                                                     \
+  static inline uint##bits##_t* rm_host_##bits(const cpu_x86_64_t* cpu, const x86_64_instr_t* instr) { \
+    return guest_to_host_for_write(effective_address(cpu, instr), bits / 8);     \
+  }
+
+DEFINE_RM_HOST(16)
+DEFINE_RM_HOST(32)
+DEFINE_RM_HOST(64)
+
+// Dispatch to a size specialised handler generated by one of the macros below
+#define DISPATCH_OPSIZE(handler, cpu, instr)          \
+  switch ((instr)->opsize) {                          \
+    case 2: ret = handler##_16(cpu, instr); break;    \
+    case 4: ret = handler##_32(cpu, instr); break;    \
+    case 8: ret = handler##_64(cpu, instr); break;    \
+  }
+
+// Flags are only set once the store has gone through, so a store which faults
+// leaves them as they were
+#define DEFINE_XOR_RM_R(bits)                                                    \
+  static inline int xor_rm_r_##bits(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) { \
+    uint##bits##_t value;                                                        \
+    if (instr->prefixes.pLOCK) {                                                 \
+      uint##bits##_t* host = rm_host_##bits(cpu, instr);                         \
+      if (!host) return -CPU_ERR_INVALID_MEMORY_ACCESS;                          \
+      value = __atomic_xor_fetch(host, reg_read_##bits(cpu, reg_field_index(instr)), __ATOMIC_SEQ_CST); \
+      watch_finish_in_place();                                                   \
+      set_logic_flags_##bits(cpu, value);                                        \
+      return 0;                                                                  \
+    }                                                                            \
+    int ret = rm_read_##bits(cpu, instr, &value);                                \
+    if (ret != 0) return ret;                                                    \
+    value ^= reg_read_##bits(cpu, reg_field_index(instr));                       \
+    ret = rm_write_##bits(cpu, instr, value);                                    \
+    if (ret != 0) return ret;                                                    \
+    set_logic_flags_##bits(cpu, value);                                          \
+    return 0;                                                                    \
+  }
+
+#define DEFINE_AND_RM_IMM(bits)                                                  \
+  static inline int and_rm_imm_##bits(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) { \
+    uint##bits##_t value;                                                        \
+    if (instr->prefixes.pLOCK) {                                                 \
+      uint##bits##_t* host = rm_host_##bits(cpu, instr);                         \
+      if (!host) return -CPU_ERR_INVALID_MEMORY_ACCESS;                          \
+      value = __atomic_and_fetch(host, (uint##bits##_t)instr->imm64, __ATOMIC_SEQ_CST); \
+      watch_finish_in_place();                                                   \
+      set_logic_flags_##bits(cpu, value);                                        \
+      return 0;                                                                  \
+    }                                                                            \
+    int ret = rm_read_##bits(cpu, instr, &value);                                \
+    if (ret != 0) return ret;                                                    \
+    value &= (uint##bits##_t)instr->imm64;                                       \
+    ret = rm_write_##bits(cpu, instr, value);                                    \
+    if (ret != 0) return ret;                                                    \
+    set_logic_flags_##bits(cpu, value);                                          \
+    return 0;                                                                    \
+  }
+
+#define DEFINE_MOV_RM_R(bits)                                                    \
+  static inline int mov_rm_r_##bits(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) { \
+    return rm_write_##bits(cpu, instr, reg_read_##bits(cpu, reg_field_index(instr))); \
+  }
+
+#define DEFINE_MOV_R_RM(bits)                                                    \
+  static inline int mov_r_rm_##bits(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) { \
+    uint##bits##_t value;                                                        \
+    int ret = rm_read_##bits(cpu, instr, &value);                                \
+    if (ret != 0) return ret;                                                    \
+    reg_write_##bits(cpu, reg_field_index(instr), value);                        \
+    return 0;                                                                    \
+  }
+
+#define DEFINE_MOV_RM_IMM(bits)                                                  \
+  static inline int mov_rm_imm_##bits(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) { \
+    return rm_write_##bits(cpu, instr, (uint##bits##_t)instr->imm64);            \
+  }
+
+// cmp and test only read their operands. Reading them out separately lets the
+// fused compare-and-branch reuse the same decoding.
+#define DEFINE_COMPARE_OPERANDS(bits)                                            \
+  static inline int compare_operands_##bits(cpu_x86_64_t* cpu, const x86_64_instr_t* instr, uint16_t type, uint64_t* dst_out, uint64_t* src_out) { \
+    uint##bits##_t rm_value;                                                     \
+    int ret = rm_read_##bits(cpu, instr, &rm_value);                             \
+    if (ret != 0) return ret;                                                    \
+    uint##bits##_t reg_value = reg_read_##bits(cpu, reg_field_index(instr));     \
+    switch (type) {                                                              \
+      case CMP_83:  *dst_out = rm_value;  *src_out = (uint##bits##_t)instr->imm64; break; \
+      case CMP_39:  *dst_out = rm_value;  *src_out = reg_value; break;           \
+      case CMP_3B:  *dst_out = reg_value; *src_out = rm_value;  break;           \
+      case TEST_85: *dst_out = rm_value;  *src_out = reg_value; break;           \
+    }                                                                            \
+    return 0;                                                                    \
+  }                                                                              \
+  static inline int compare_##bits(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) { \
+    uint64_t dst, src;                                                           \
+    int ret = compare_operands_##bits(cpu, instr, instr->type, &dst, &src);      \
+    if (ret != 0) return ret;                                                    \
+    if (instr->type == TEST_85) {                                                \
+      set_logic_flags_##bits(cpu, (uint##bits##_t)(dst & src));                  \
+    } else {                                                                     \
+      set_sub_flags_##bits(cpu, (uint##bits##_t)dst, (uint##bits##_t)src);       \
+    }                                                                            \
+    return 0;                                                                    \
+  }                                                                              \
+  static inline int compare_branch_##bits(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) { \
+    uint64_t dst, src;                                                           \
+    int ret = compare_operands_##bits(cpu, instr, instr->fused_type, &dst, &src); \
+    if (ret != 0) return ret;                                                    \
+    const x86_64_instr_t* jcc = instr + 1;                                       \
+    bool handled;                                                                \
+    bool taken = compare_condition_##bits(instr->fused_type == TEST_85, dst, src, jcc->cc, &handled); \
+    cpu->lazy_flags.pending = true;                                              \
+    cpu->lazy_flags.type = instr->fused_type;                                    \
+    cpu->lazy_flags.opsize = bits / 8;                                           \
+    cpu->lazy_flags.dst = dst;                                                   \
+    cpu->lazy_flags.src = src;                                                   \
+    if (!handled) {                                                              \
+      taken = condition_met(cpu, jcc->cc);                                \
+    }                                                                            \
+    cpu->rip = taken ? jcc->imm64 : jcc->address + jcc->size;                    \
+    return 0;                                                                    \
+  }
+
+// lea only computes the address, it never touches memory (or adds a segment base)
+#define DEFINE_LEA(bits)                                                         \
+  static inline int lea_##bits(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) { \
+    reg_write_##bits(cpu, reg_field_index(instr), (uint##bits##_t)effective_offset(cpu, instr)); \
+    return 0;                                                                    \
+  }
+
+// xchg with a memory operand is always atomic, with or without LOCK
+#define DEFINE_XCHG_RM_R(bits)                                                   \
+  static inline int xchg_rm_r_##bits(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) { \
+    uint##bits##_t reg_value = reg_read_##bits(cpu, reg_field_index(instr));     \
+    if (instr->ea_kind == EA_REG) {                                              \
+      reg_write_##bits(cpu, reg_field_index(instr), reg_read_##bits(cpu, rm_index(instr))); \
+      reg_write_##bits(cpu, rm_index(instr), reg_value);                         \
+      return 0;                                                                  \
+    }                                                                            \
+    uint##bits##_t* host = rm_host_##bits(cpu, instr);                           \
+    if (!host) return -CPU_ERR_INVALID_MEMORY_ACCESS;                            \
+    reg_write_##bits(cpu, reg_field_index(instr), __atomic_exchange_n(host, reg_value, __ATOMIC_SEQ_CST)); \
+    watch_finish_in_place();                                                     \
+    return 0;                                                                    \
+  }
+
+// Compares the accumulator with r/m. If equal r/m = reg, otherwise the
+// accumulator is loaded with r/m. Flags are set as for cmp accumulator, r/m.
+#define DEFINE_CMPXCHG_RM_R(bits)                                                \
+  static inline int cmpxchg_rm_r_##bits(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) { \
+    uint##bits##_t expected = reg_read_##bits(cpu, modrm_rax);                   \
+    uint##bits##_t desired = reg_read_##bits(cpu, reg_field_index(instr));       \
+    uint##bits##_t actual;                                                       \
+    bool swapped;                                                                \
+    if (instr->ea_kind == EA_REG) {                                              \
+      actual = reg_read_##bits(cpu, rm_index(instr));                            \
+      swapped = actual == expected;                                              \
+      if (swapped) reg_write_##bits(cpu, rm_index(instr), desired);              \
+    } else {                                                                     \
+      uint##bits##_t* host = rm_host_##bits(cpu, instr);                         \
+      if (!host) return -CPU_ERR_INVALID_MEMORY_ACCESS;                          \
+      actual = expected;                                                         \
+      swapped = __atomic_compare_exchange_n(host, &actual, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+      watch_finish_in_place();                                                   \
+    }                                                                            \
+    set_sub_flags_##bits(cpu, expected, actual);                                 \
+    if (!swapped) reg_write_##bits(cpu, modrm_rax, actual);                      \
+    return 0;                                                                    \
+  }
+
+// r/m = r/m + reg, with the old r/m value loaded into reg
+#define DEFINE_XADD_RM_R(bits)                                                   \
+  static inline int xadd_rm_r_##bits(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) { \
+    uint##bits##_t src = reg_read_##bits(cpu, reg_field_index(instr));           \
+    uint##bits##_t old;                                                          \
+    if (instr->ea_kind == EA_REG) {                                              \
+      old = reg_read_##bits(cpu, rm_index(instr));                               \
+      reg_write_##bits(cpu, reg_field_index(instr), old);                        \
+      reg_write_##bits(cpu, rm_index(instr), old + src);                         \
+    } else {                                                                     \
+      uint##bits##_t* host = rm_host_##bits(cpu, instr);                         \
+      if (!host) return -CPU_ERR_INVALID_MEMORY_ACCESS;                          \
+      old = __atomic_fetch_add(host, src, __ATOMIC_SEQ_CST);                     \
+      watch_finish_in_place();                                                   \
+      reg_write_##bits(cpu, reg_field_index(instr), old);                        \
+    }                                                                            \
+    set_add_flags_##bits(cpu, old, src);                                         \
+    return 0;                                                                    \
+  }
+
+#define DEFINE_SIZED_HANDLERS(definer) \
+  definer(16)                          \
+  definer(32)                          \
+  definer(64)
+
+DEFINE_SIZED_HANDLERS(DEFINE_XOR_RM_R)
+DEFINE_SIZED_HANDLERS(DEFINE_AND_RM_IMM)
+DEFINE_SIZED_HANDLERS(DEFINE_MOV_RM_R)
+DEFINE_SIZED_HANDLERS(DEFINE_MOV_R_RM)
+DEFINE_SIZED_HANDLERS(DEFINE_LEA)
+DEFINE_SIZED_HANDLERS(DEFINE_COMPARE_OPERANDS)
+DEFINE_SIZED_HANDLERS(DEFINE_MOV_RM_IMM)
+DEFINE_SIZED_HANDLERS(DEFINE_XCHG_RM_R)
+DEFINE_SIZED_HANDLERS(DEFINE_CMPXCHG_RM_R)
+DEFINE_SIZED_HANDLERS(DEFINE_XADD_RM_R)
+
+// Decodes the ModRM byte, and any SIB and displacement bytes that follow it.
+// The addressing form is resolved here into one of the EA_* kernels, so that
+// executing the instruction never needs to look at mod/rm/sib again.
+int decode_modrm(const uint64_t address, x86_64_instr_t* instr, uint64_t* offset) {
+  uint8_t next_u8;
+  if (!read_u8(address + *offset, &next_u8)) {
+    return -CPU_ERR_UNABLE_TO_READ;
+  }
+  memcpy(&instr->modrm, &next_u8, 1);
+  instr->as_bytes[*offset] = next_u8;
+  *offset += 1;
+
+  if (instr->modrm.mod == 3) {
+    instr->ea_kind = EA_REG;
+    return 0;
+  }
+
+  uint8_t disp_size = (instr->modrm.mod == 1) ? 1 : (instr->modrm.mod == 2) ? 4 : 0;
+  bool has_base = true;
+  bool has_index = false;
+
+  if (instr->modrm.rm == 0b100) {
+    // A SIB byte follows
+    if (!read_u8(address + *offset, &next_u8)) {
+      return -CPU_ERR_UNABLE_TO_READ;
+    }
+    memcpy(&instr->sib, &next_u8, 1);
+    instr->as_bytes[*offset] = next_u8;
+    *offset += 1;
+
+    instr->ea_base = (instr->rex.b << 3) | instr->sib.base;
+    instr->ea_index = (instr->rex.x << 3) | instr->sib.index;
+    instr->ea_scale = instr->sib.scale;
+
+    // An index of 0b100 means "no index", but only when REX.X is clear (r12 is valid)
+    has_index = instr->ea_index != SIB_NO_INDEX;
+
+    // With mod == 0, a base of 0b101 (rbp/r13) means "no base, disp32"
+    if (instr->modrm.mod == 0 && instr->sib.base == SIB_NO_BASE) {
+      has_base = false;
+      disp_size = 4;
+    }
+  } else if (instr->modrm.mod == 0 && instr->modrm.rm == 0b101) {
+    // [rip + disp32]
+    has_base = false;
+    disp_size = 4;
+  } else {
+    instr->ea_base = (instr->rex.b << 3) | instr->modrm.rm;
+  }
+
+  // Read and sign extend the displacement
+  instr->disp = 0;
+  if (disp_size == 1) {
+    uint8_t disp8;
+    if (!read_u8(address + *offset, &disp8)) {
+      return -CPU_ERR_UNABLE_TO_READ;
+    }
+    instr->disp = (int8_t)disp8;
+  } else if (disp_size == 4) {
+    uint32_t disp32;
+    if (!read_u32(address + *offset, &disp32)) {
+      return -CPU_ERR_UNABLE_TO_READ;
+    }
+    instr->disp = (int32_t)disp32;
+  }
+  if (disp_size > 0) {
+    for (uint8_t i = 0; i < disp_size; i++) {
+      instr->as_bytes[*offset + i] = (uint8_t)(instr->disp >> (i * 8));
+    }
+    *offset += disp_size;
+  }
+
+  // Select the kernel
+  if (instr->modrm.rm != 0b100 && !has_base) {
+    instr->ea_kind = EA_RIP_DISP;
+  } else if (has_base && has_index) {
+    instr->ea_kind = (disp_size > 0) ? EA_BASE_INDEX_DISP : EA_BASE_INDEX;
+  } else if (has_base) {
+    instr->ea_kind = (disp_size > 0) ? EA_BASE_DISP : EA_BASE;
+  } else if (has_index) {
+    instr->ea_kind = EA_INDEX_DISP;
+  } else {
+    instr->ea_kind = EA_DISP;
+  }
+
+  return 0;
+}
+
+static int decode_instr(const uint64_t address, x86_64_instr_t* instr_out) {
+  instr_out->address = address;
+
   uint32_t next_u32;
-  if (!read_u32(cpu->rip, &next_u32)) {
+  if (!read_u32(address, &next_u32)) {
     return -CPU_ERR_UNABLE_TO_READ;
   }
 
@@ -42,7 +625,7 @@ int decode_at_address(const uint64_t address, cpu_x86_64_t* cpu, x86_64_instr_t*
 
   // Search for prefixes
   while (true) {
-    if (!read_u8(cpu->rip + offset, &next_u8)) {
+    if (!read_u8(address + offset, &next_u8)) {
       return -CPU_ERR_UNABLE_TO_READ;
     }
 
@@ -53,6 +636,35 @@ int decode_at_address(const uint64_t address, cpu_x86_64_t* cpu, x86_64_instr_t*
       continue;
     }
 
+    if (next_u8 == 0x67) {
+      instr_out->prefixes.p67 = true;
+      instr_out->as_bytes[offset] = next_u8;
+      offset += 1;
+      continue;
+    }
+
+    if (next_u8 == LOCK_PREFIX) {
+      instr_out->prefixes.pLOCK = true;
+      instr_out->as_bytes[offset] = next_u8;
+      offset += 1;
+      continue;
+    }
+
+    if (next_u8 == REPNE_PREFIX || next_u8 == REP_PREFIX) {
+      instr_out->prefixes.pF2 = (next_u8 == REPNE_PREFIX);
+      instr_out->prefixes.pF3 = (next_u8 == REP_PREFIX);
+      instr_out->as_bytes[offset] = next_u8;
+      offset += 1;
+      continue;
+    }
+
+    if (next_u8 == FS_PREFIX || next_u8 == GS_PREFIX) {
+      instr_out->prefixes.seg = (next_u8 == FS_PREFIX) ? SEG_FS : SEG_GS;
+      instr_out->as_bytes[offset] = next_u8;
+      offset += 1;
+      continue;
+    }
+
     if ((next_u8 >> 4) == 0b0100) {
       instr_out->prefixes.pREX = true;
       instr_out->as_bytes[offset] = next_u8;
@@ -64,90 +676,247 @@ int decode_at_address(const uint64_t address, cpu_x86_64_t* cpu, x86_64_instr_t*
     break;
   }
 
+  instr_out->opsize = operand_size(instr_out);
+
+  if (next_u8 >= X87_ESCAPE_FIRST && next_u8 <= X87_ESCAPE_LAST) {
+    instr_out->as_bytes[offset] = next_u8;
+    offset += 1;
+    return fpu_decode_x87(address, next_u8, instr_out, &offset);
+  }
+
   if (next_u8 == XOR_31_OPCODE) {
-    instr_out->size = 2 + offset;
     instr_out->type = XOR_31;
+    instr_out->as_bytes[offset] = next_u8;
+    offset += 1;
 
-    if (!read_u8(cpu->rip + offset + 1, &next_u8)) {
-      return -CPU_ERR_UNABLE_TO_READ;
+    int ret = decode_modrm(address, instr_out, &offset);
+    if (ret != 0) {
+      return ret;
     }
-    memcpy(&instr_out->modrm, &next_u8, 1);
-
-    instr_out->as_bytes[offset + 0] = XOR_31_OPCODE;
-    instr_out->as_bytes[offset + 1] = next_u8;
 
+    instr_out->size = offset;
     return 0;
   }
 
   // This opcode relates to multiple instructions,
   // depending on the "reg" field in the ModRM byte
   if (next_u8 == SEXTEND_OP_OPCODE) {
-    // Read the ModRM byte
-    if (!read_u8(cpu->rip + offset + 1, &next_u8)) {
-      return -CPU_ERR_UNABLE_TO_READ;
+    instr_out->as_bytes[offset] = next_u8;
+    offset += 1;
+
+    int ret = decode_modrm(address, instr_out, &offset);
+    if (ret != 0) {
+      return ret;
     }
-    memcpy(&instr_out->modrm, &next_u8, 1);
 
     if (instr_out->modrm.reg == SIGN_EXTEND_AND) {
       instr_out->type = AND_83;
+    } else if (instr_out->modrm.reg == SIGN_EXTEND_CMP) {
+      instr_out->type = CMP_83;
     } else {
       return -CPU_ERR_NOT_IMPLEMENTED_YET;
     }
 
-    instr_out->size = 3 + offset;
-    instr_out->reg_index = instr_out->modrm.rm;
-
     // Read the imm8 to be sign extended
-    if (!read_u8(cpu->rip + offset + 2, (uint8_t*)(&instr_out->imm64))) {
+    uint8_t imm8;
+    if (!read_u8(address + offset, &imm8)) {
       return -CPU_ERR_UNABLE_TO_READ;
     }
+    instr_out->as_bytes[offset] = imm8;
+    offset += 1;
 
     // Perform sign extension
-    instr_out->imm64 |= (instr_out->imm64 & 0x80) ? : 0;
-
-    instr_out->as_bytes[offset + 0] = SEXTEND_OP_OPCODE;
-    instr_out->as_bytes[offset + 1] = next_u8;
-    instr_out->as_bytes[offset + 2] = instr_out->imm64 & 0xff;
+    instr_out->imm64 = imm8;
+    instr_out->imm64 |= (instr_out->imm64 & 0x80) ? SIGN_EXTEND_8_TO_64 : 0;
 
+    instr_out->size = offset;
     return 0;
   }
 
-  if (instr_out->prefixes.pREX && instr_out->rex.w == 1 && next_u8 == MOV_89_OPCODE) {
-    instr_out->size = 2 + offset;
-    instr_out->type = MOV_89;
+  if (next_u8 == MOV_89_OPCODE || next_u8 == MOV_8B_OPCODE || next_u8 == LEA_8D_OPCODE) {
+    switch (next_u8) {
+      case MOV_89_OPCODE: instr_out->type = MOV_89; break;
+      case MOV_8B_OPCODE: instr_out->type = MOV_8B; break;
+      case LEA_8D_OPCODE: instr_out->type = LEA_8D; break;
+    }
+    instr_out->as_bytes[offset] = next_u8;
+    offset += 1;
 
-    if (!read_u8(cpu->rip + offset + 1, &next_u8)) {
-      return -CPU_ERR_UNABLE_TO_READ;
+    int ret = decode_modrm(address, instr_out, &offset);
+    if (ret != 0) {
+      return ret;
     }
-    memcpy(&instr_out->modrm, &next_u8, 1);
 
-    instr_out->as_bytes[offset + 0] = 0x89;
-    instr_out->as_bytes[offset + 1] = next_u8;
+    // lea with a register operand is undefined
+    if (instr_out->type == LEA_8D && instr_out->ea_kind == EA_REG) {
+      return -CPU_ERR_UNABLE_TO_DECODE;
+    }
 
+    instr_out->size = offset;
     return 0;
   }
 
-  if (instr_out->prefixes.pREX && instr_out->rex.w == 1 && next_u8 == MOV_C7_OPCODE) {
-    instr_out->size = 6 + offset;
+  if (next_u8 == MOV_C7_OPCODE) {
     instr_out->type = MOV_C7;
+    instr_out->as_bytes[offset] = next_u8;
+    offset += 1;
+
+    int ret = decode_modrm(address, instr_out, &offset);
+    if (ret != 0) {
+      return ret;
+    }
+
+    // The immediate is imm16 with an operand size override, and imm32 otherwise
+    if (instr_out->opsize == 2) {
+      uint16_t imm16;
+      if (!read_u16(address + offset, &imm16)) {
+        return -CPU_ERR_UNABLE_TO_READ;
+      }
+      memcpy(instr_out->as_bytes + offset, &imm16, 2);
+      offset += 2;
+      instr_out->imm64 = imm16;
+    } else {
+      // Read the imm32 and sign extend
+      uint32_t imm32;
+      if (!read_u32(address + offset, &imm32)) {
+        return -CPU_ERR_UNABLE_TO_READ;
+      }
+      memcpy(instr_out->as_bytes + offset, &imm32, 4);
+      offset += 4;
+      instr_out->imm64 = (uint64_t)imm32;
+      instr_out->imm64 |= (instr_out->imm64 & 0x80000000) ? SIGN_EXTEND_32_TO_64 : 0;
+    }
 
-    if (!read_u8(cpu->rip + offset + 1, &next_u8)) {
+    instr_out->size = offset;
+    return 0;
+  }
+
+  if (next_u8 == CMP_39_OPCODE || next_u8 == CMP_3B_OPCODE || next_u8 == TEST_85_OPCODE || next_u8 == XCHG_87_OPCODE) {
+    switch (next_u8) {
+      case CMP_39_OPCODE:  instr_out->type = CMP_39; break;
+      case CMP_3B_OPCODE:  instr_out->type = CMP_3B; break;
+      case TEST_85_OPCODE: instr_out->type = TEST_85; break;
+      case XCHG_87_OPCODE: instr_out->type = XCHG_87; break;
+    }
+    instr_out->as_bytes[offset] = next_u8;
+    offset += 1;
+
+    int ret = decode_modrm(address, instr_out, &offset);
+    if (ret != 0) {
+      return ret;
+    }
+
+    instr_out->size = offset;
+    return 0;
+  }
+
+  // Relative branches store their absolute target in imm64
+  if ((next_u8 & OP4MSB_CC4LSB) == JCC_REL8_BASE || next_u8 == JMP_REL8_OPCODE) {
+    instr_out->type = (next_u8 == JMP_REL8_OPCODE) ? JMP : JCC;
+    instr_out->cc = next_u8 & ~(OP4MSB_CC4LSB);
+    instr_out->as_bytes[offset] = next_u8;
+    offset += 1;
+
+    uint8_t rel8;
+    if (!read_u8(address + offset, &rel8)) {
       return -CPU_ERR_UNABLE_TO_READ;
     }
-    memcpy(&instr_out->modrm, &next_u8, 1);
-    instr_out->reg_index = instr_out->modrm.rm;
+    instr_out->as_bytes[offset] = rel8;
+    offset += 1;
+
+    instr_out->size = offset;
+    instr_out->imm64 = address + offset + (int8_t)rel8;
+    return 0;
+  }
+
+  if (next_u8 == TWO_BYTE_ESCAPE || next_u8 == JMP_REL32_OPCODE || next_u8 == CALL_E8_OPCODE) {
+    instr_out->as_bytes[offset] = next_u8;
+    offset += 1;
+
+    if (next_u8 == TWO_BYTE_ESCAPE) {
+      if (!read_u8(address + offset, &next_u8)) {
+        return -CPU_ERR_UNABLE_TO_READ;
+      }
+
+      if (next_u8 == SYSCALL_OPCODE || next_u8 == RDTSC_OPCODE) {
+        instr_out->type = (next_u8 == SYSCALL_OPCODE) ? SYSCALL : RDTSC;
+        instr_out->as_bytes[offset] = next_u8;
+        instr_out->size = 1 + offset;
+        return 0;
+      }
+
+      if (next_u8 == CMPXCHG_B1_OPCODE || next_u8 == XADD_C1_OPCODE) {
+        instr_out->type = (next_u8 == CMPXCHG_B1_OPCODE) ? CMPXCHG_B1 : XADD_C1;
+        instr_out->as_bytes[offset] = next_u8;
+        offset += 1;
+
+        int ret = decode_modrm(address, instr_out, &offset);
+        if (ret != 0) {
+          return ret;
+        }
 
-    instr_out->as_bytes[offset + 0] = MOV_C7_OPCODE;
-    instr_out->as_bytes[offset + 1] = next_u8;
+        instr_out->size = offset;
+        return 0;
+      }
+
+      if (fpu_is_sse_opcode(next_u8)) {
+        instr_out->as_bytes[offset] = next_u8;
+        offset += 1;
+        return fpu_decode_sse(address, next_u8, instr_out, &offset);
+      }
 
-    // Read the imm32 and sign extend
-    uint32_t imm32;
-    if (!read_u32(cpu->rip + offset + 2, &imm32)) {
+      // Otherwise only 0F 8x (jcc rel32) is supported so far
+      if ((next_u8 & OP4MSB_CC4LSB) != JCC_REL32_BASE) {
+        return -CPU_ERR_UNABLE_TO_DECODE;
+      }
+      instr_out->type = JCC;
+      instr_out->cc = next_u8 & ~(OP4MSB_CC4LSB);
+      instr_out->as_bytes[offset] = next_u8;
+      offset += 1;
+    } else {
+      instr_out->type = (next_u8 == CALL_E8_OPCODE) ? CALL_E8 : JMP;
+    }
+
+    uint32_t rel32;
+    if (!read_u32(address + offset, &rel32)) {
       return -CPU_ERR_UNABLE_TO_READ;
     }
-    instr_out->imm64 = (uint64_t)imm32;
-    instr_out->imm64 |= (instr_out->imm64 & 0x80000000) ? SIGN_EXTEND_32_TO_64 : 0;
+    memcpy(instr_out->as_bytes + offset, &rel32, 4);
+    offset += 4;
+
+    instr_out->size = offset;
+    instr_out->imm64 = address + offset + (int32_t)rel32;
+    return 0;
+  }
+
+  // Indirect branches, as used by PLT stubs and calls through function pointers.
+  // They're always 64-bit, whatever the operand size.
+  if (next_u8 == GROUP_FF_OPCODE) {
+    instr_out->as_bytes[offset] = next_u8;
+    offset += 1;
+
+    int ret = decode_modrm(address, instr_out, &offset);
+    if (ret != 0) {
+      return ret;
+    }
 
+    if (instr_out->modrm.reg == GROUP_FF_CALL) {
+      instr_out->type = CALL_FF;
+    } else if (instr_out->modrm.reg == GROUP_FF_JMP) {
+      instr_out->type = JMP_FF;
+    } else {
+      return -CPU_ERR_NOT_IMPLEMENTED_YET;
+    }
+
+    instr_out->opsize = 8;
+    instr_out->size = offset;
+    return 0;
+  }
+
+  if (next_u8 == RET_C3_OPCODE) {
+    instr_out->type = RET_C3;
+    instr_out->as_bytes[offset] = next_u8;
+    instr_out->size = 1 + offset;
     return 0;
   }
 
@@ -170,6 +939,69 @@ int decode_at_address(const uint64_t address, cpu_x86_64_t* cpu, x86_64_instr_t*
   return -CPU_ERR_UNABLE_TO_DECODE;
 }
 
+// Only these read-modify-write instructions accept LOCK, and only with a memory operand
+static bool is_lockable(const x86_64_instr_t* instr) {
+  switch (instr->type) {
+    case XOR_31:
+    case AND_83:
+    case XCHG_87:
+    case CMPXCHG_B1:
+    case XADD_C1:
+      return instr->ea_kind != EA_REG;
+  }
+  return false;
+}
+
+// F2 and F3 are only accepted where they don't change what the instruction
+// does: as SSE's mandatory prefixes (whose forms the SSE decoder checks), as
+// BND on branches, and in "rep ret". Anywhere else they select a different
+// instruction (e.g. F3 0F BC is tzcnt, not bsf), which isn't supported.
+static bool accepts_rep_prefix(const x86_64_instr_t* instr) {
+  switch (instr->type) {
+    case SSE_MOV:
+    case SSE_ARITH:
+    case SSE_CVT:
+    case SSE_COMI:
+    case SSE_LOGIC:
+    case SSE_MXCSR:
+      return true;
+    case JCC:
+    case JMP:
+    case CALL_E8:
+    case CALL_FF:
+    case JMP_FF:
+      return !instr->prefixes.pF3;
+    case RET_C3:
+      return true;
+  }
+  return false;
+}
+
+// Only code in executable pages is ever decoded, which covers building blocks,
+// interpreting and stepping alike. Fetching from anywhere else faults, as it
+// would natively.
+int decode_at_address(const uint64_t address, cpu_x86_64_t* cpu, x86_64_instr_t* instr_out) {
+  if (!can_fetch(address, 1)) {
+    return -CPU_ERR_SEGMENTATION_FAULT;
+  }
+
+  int ret = decode_instr(address, instr_out);
+  if (ret != 0) {
+    return ret;
+  }
+  if (!can_fetch(address, instr_out->size)) {
+    return -CPU_ERR_SEGMENTATION_FAULT;
+  }
+
+  if (instr_out->prefixes.pLOCK && !is_lockable(instr_out)) {
+    return -CPU_ERR_UNABLE_TO_DECODE;
+  }
+  if ((instr_out->prefixes.pF2 || instr_out->prefixes.pF3) && !accepts_rep_prefix(instr_out)) {
+    return -CPU_ERR_UNABLE_TO_DECODE;
+  }
+  return 0;
+}
+
 int fetch_decode_execute(cpu_x86_64_t* cpu) {
   x86_64_instr_t instr = {0};
 
@@ -178,148 +1010,293 @@ int fetch_decode_execute(cpu_x86_64_t* cpu) {
     return ret;
   }
 
-  switch (instr.type) {
+  return execute_instr(cpu, &instr);
+}
+
+// Instructions which change control flow, and therefore end a block
+bool is_block_terminator(const x86_64_instr_t* instr) {
+  switch (instr->type) {
+    case JCC:
+    case JMP:
+    case CALL_E8:
+    case RET_C3:
+    case CALL_FF:
+    case JMP_FF:
+    case SYSCALL:
+    case FUSED_CMP_JCC:
+    case FUSED_POP_RET:
+      return true;
+  }
+  return false;
+}
+
+int execute_instr(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  int ret = 0;
+
+  switch (instr->type) {
 
     case ENDBR64: {
-      cpu->rip += instr.size;
+      cpu->rip = instr->address + instr->size;
       return 0;
     }
 
     case XOR_31: {
-      // By default, treat as a 32 bit operation
-      uint64_t mask = 0xffffffff;
-      if (instr.prefixes.p66) {
-        mask = 0xffff;
-      } else if (instr.prefixes.pREX) {
-        mask = 0xffffffffffffffff;
+      DISPATCH_OPSIZE(xor_rm_r, cpu, instr);
+      if (ret != 0) {
+        return ret;
       }
 
-      uint8_t r_bit = (instr.rex.r) << 3;
-      uint8_t b_bit = (instr.rex.b) << 3;
-      uint64_t* src = reg_from_nibble(cpu, r_bit | instr.modrm.reg);
-      uint64_t* dst = reg_from_nibble(cpu, b_bit | instr.modrm.rm);
+      // Increment the instruction pointer
+      cpu->rip = instr->address + instr->size;
+      return 0;
+    }
 
-      if (src == NULL || dst == NULL) {
-        return -CPU_ERR_INVALID_MODRM_INDEX;
+    case AND_83: {
+      DISPATCH_OPSIZE(and_rm_imm, cpu, instr);
+      if (ret != 0) {
+        return ret;
       }
 
-      // Clear any bits in the masked region
-      *dst &= ~mask;
+      // Increment the instruction pointer
+      cpu->rip = instr->address + instr->size;
+      return 0;
+    }
 
-      // Compute the xor
-      *dst |= (*src ^ *dst) & mask;
+    case MOV_89: {
+      DISPATCH_OPSIZE(mov_rm_r, cpu, instr);
+      if (ret != 0) {
+        return ret;
+      }
 
-      // Set the flags
-      cpu->rflags.cf = 0;
-      cpu->rflags.of = 0;
-      cpu->rflags.sf = (*dst & (1UL << 63UL)) > 0 ? 1 : 0;
-      cpu->rflags.zf = (*dst == 0) ? 1 : 0;
-      cpu->rflags.pf = parity(*dst);
+      // No flags affected with mov
 
       // Increment the instruction pointer
-      cpu->rip += instr.size;
+      cpu->rip = instr->address + instr->size;
       return 0;
     }
 
-    case AND_83: {
-      // By default, treat as a 32 bit operation
-      uint64_t mask = 0xffffffff;
-      if (instr.prefixes.p66) {
-        mask = 0xffff;
-      } else if (instr.prefixes.pREX) {
-        mask = 0xffffffffffffffff;
+    case MOV_8B: {
+      DISPATCH_OPSIZE(mov_r_rm, cpu, instr);
+      if (ret != 0) {
+        return ret;
       }
 
-      uint8_t w_bit = (instr.rex.w) << 3;
-      uint64_t* dst = reg_from_nibble(cpu, w_bit | instr.reg_index);
+      // Increment the instruction pointer
+      cpu->rip = instr->address + instr->size;
+      return 0;
+    }
 
-      if (dst == NULL) {
-        return -CPU_ERR_INVALID_MODRM_INDEX;
+    case MOV_C7: {
+      DISPATCH_OPSIZE(mov_rm_imm, cpu, instr);
+      if (ret != 0) {
+        return ret;
       }
 
-      // Compute the and
-      *dst = (*dst & ~mask) | (*dst & instr.imm64 & mask);
+      // Increment the instruction pointer
+      cpu->rip = instr->address + instr->size;
+      return 0;
+    }
 
-      // Set the flags
-      cpu->rflags.cf = 0;
-      cpu->rflags.of = 0;
-      cpu->rflags.sf = (*dst & (1UL << 63UL)) > 0 ? 1 : 0;
-      cpu->rflags.zf = (*dst == 0) ? 1 : 0;
-      cpu->rflags.pf = parity(*dst);
+    case CMP_83:
+    case CMP_39:
+    case CMP_3B:
+    case TEST_85: {
+      DISPATCH_OPSIZE(compare, cpu, instr);
+      if (ret != 0) {
+        return ret;
+      }
 
       // Increment the instruction pointer
-      cpu->rip += instr.size;
+      cpu->rip = instr->address + instr->size;
       return 0;
     }
 
-    case MOV_89: {
-      // By default, treat as a 32 bit operation
-      uint64_t mask = 0xffffffff;
-      if (instr.prefixes.p66) {
-        mask = 0xffff;
-      } else if (instr.prefixes.pREX) {
-        mask = 0xffffffffffffffff;
+    case JCC: {
+      cpu->rip = condition_met(cpu, instr->cc) ? instr->imm64 : instr->address + instr->size;
+      return 0;
+    }
+
+    case JMP: {
+      cpu->rip = instr->imm64;
+      return 0;
+    }
+
+    case CALL_E8: {
+      // Push the return address
+      ret = push_stack(cpu, instr->address + instr->size);
+      if (ret != 0) {
+        return ret;
       }
+      shadow_call(cpu, instr->address + instr->size);
 
-      uint8_t r_bit = (instr.rex.r) << 3;
-      uint8_t b_bit = (instr.rex.b) << 3;
-      uint64_t* src = reg_from_nibble(cpu, r_bit | instr.modrm.reg);
-      uint64_t* dst = reg_from_nibble(cpu, b_bit | instr.modrm.rm);
+      cpu->rip = instr->imm64;
+      return 0;
+    }
+
+    case RET_C3: {
+      ret = pop_stack(cpu, &cpu->rip);
+      if (ret != 0) {
+        return ret;
+      }
+      shadow_ret(cpu, cpu->rip);
+      return 0;
+    }
 
-      if (src == NULL || dst == NULL) {
-        return -CPU_ERR_INVALID_MODRM_INDEX;
+    case CALL_FF:
+    case JMP_FF: {
+      // The target is read before anything is pushed, as call r/m64 can
+      // address the stack
+      uint64_t target;
+      ret = rm_read_64(cpu, instr, &target);
+      if (ret != 0) {
+        return ret;
       }
 
-      // Clear any bits in the masked region
-      *dst &= ~mask;
+      if (instr->type == CALL_FF) {
+        ret = push_stack(cpu, instr->address + instr->size);
+        if (ret != 0) {
+          return ret;
+        }
+        shadow_call(cpu, instr->address + instr->size);
+      }
 
-      // Write the masked src to dst
-      *dst |= *src & mask;
+      cpu->rip = target;
+      return 0;
+    }
 
-      // No flags affected with mov
+    case SYSCALL: {
+      // rip has to be past the syscall before it runs, so that a new thread
+      // created by clone starts at the right place
+      cpu->rip = instr->address + instr->size;
+      return emulate_syscall(cpu);
+    }
+
+    case XCHG_87: {
+      DISPATCH_OPSIZE(xchg_rm_r, cpu, instr);
+      if (ret != 0) {
+        return ret;
+      }
+
+      // No flags affected with xchg
 
       // Increment the instruction pointer
-      cpu->rip += instr.size;
+      cpu->rip = instr->address + instr->size;
       return 0;
     }
 
-    case MOV_C7: {
-      // By default, treat as a 32 bit operation
-      uint64_t mask = 0xffffffff;
-      if (instr.prefixes.p66) {
-        mask = 0xffff;
-      } else if (instr.prefixes.pREX) {
-        mask = 0xffffffffffffffff;
+    case CMPXCHG_B1: {
+      DISPATCH_OPSIZE(cmpxchg_rm_r, cpu, instr);
+      if (ret != 0) {
+        return ret;
       }
 
-      uint8_t w_bit = (instr.rex.w) << 3;
-      uint64_t* dst = reg_from_nibble(cpu, w_bit | instr.reg_index);
+      // Increment the instruction pointer
+      cpu->rip = instr->address + instr->size;
+      return 0;
+    }
 
-      if (dst == NULL) {
-        return -CPU_ERR_INVALID_MODRM_INDEX;
+    case XADD_C1: {
+      DISPATCH_OPSIZE(xadd_rm_r, cpu, instr);
+      if (ret != 0) {
+        return ret;
       }
 
-      // Clear any bits in the masked region
-      *dst &= ~mask;
+      // Increment the instruction pointer
+      cpu->rip = instr->address + instr->size;
+      return 0;
+    }
 
-      // Write the masked src to dst
-      *dst |= instr.imm64 & mask;
+    case RDTSC: {
+      // The host's counter, or the recorded one when replaying (see ue-replay.c)
+      uint64_t tsc;
+      ret = replay_rdtsc(&tsc);
+      if (ret != 0) {
+        return ret;
+      }
 
-      // No flags affected with mov
+      cpu->regs[modrm_rax] = (uint32_t)tsc;
+      cpu->regs[modrm_rdx] = tsc >> 32;
 
       // Increment the instruction pointer
-      cpu->rip += instr.size;
+      cpu->rip = instr->address + instr->size;
       return 0;
     }
 
-    case POP_58: {
-      // Determine destination register
-      uint8_t b_bit = (instr.rex.b) << 3;
-      uint64_t* dst = reg_from_nibble(cpu, b_bit | instr.reg_index);
+    case SSE_MOV:
+    case SSE_ARITH:
+    case SSE_CVT:
+    case SSE_COMI:
+    case SSE_LOGIC:
+    case SSE_MXCSR:
+    case X87: {
+      return fpu_execute(cpu, instr);
+    }
+
+    case FUSED_ZERO_REG: {
+      reg_write_64(cpu, rm_index(instr), 0);
+
+      // The flags are constant for a zeroing idiom
+      cpu->lazy_flags.pending = false;
+      cpu->rflags.cf = 0;
+      cpu->rflags.of = 0;
+      cpu->rflags.sf = 0;
+      cpu->rflags.zf = 1;
+      cpu->rflags.pf = 1;
+
+      cpu->rip = instr->address + instr->size;
+      return 0;
+    }
+
+    case FUSED_PUSH_FRAME: {
+      // push rbp; mov rbp, rsp
+      ret = push_stack(cpu, cpu->regs[modrm_rbp]);
+      if (ret != 0) {
+        return ret;
+      }
+      cpu->regs[modrm_rbp] = cpu->regs[modrm_rsp];
+
+      const x86_64_instr_t* mov = instr + 1;
+      cpu->rip = mov->address + mov->size;
+      return 0;
+    }
+
+    case FUSED_CMP_JCC: {
+      DISPATCH_OPSIZE(compare_branch, cpu, instr);
+      return ret;
+    }
+
+    case FUSED_POP_RET: {
+      // pop reg; ret
+      uint64_t stack_value;
+      ret = pop_stack(cpu, &stack_value);
+      if (ret != 0) {
+        return ret;
+      }
+      reg_write_64(cpu, (instr->rex.b << 3) | instr->reg_index, stack_value);
 
-      if (dst == NULL) {
-        return -CPU_ERR_INVALID_MODRM_INDEX;
+      ret = pop_stack(cpu, &cpu->rip);
+      if (ret != 0) {
+        // Leave rip pointing at the ret which faulted
+        cpu->rip = instr[1].address;
+        return ret;
       }
+      shadow_ret(cpu, cpu->rip);
+      return 0;
+    }
+
+    case LEA_8D: {
+      DISPATCH_OPSIZE(lea, cpu, instr);
+
+      // No flags affected with lea
+
+      // Increment the instruction pointer
+      cpu->rip = instr->address + instr->size;
+      return 0;
+    }
+
+    case POP_58: {
+      // Determine destination register
+      uint8_t dst = (instr->rex.b << 3) | instr->reg_index;
 
       // Pop the actual value from the stack
       uint64_t stack_value;
@@ -329,27 +1306,22 @@ int fetch_decode_execute(cpu_x86_64_t* cpu) {
       }
 
       // Write to the destination register
-      *dst = stack_value;
+      reg_write_64(cpu, dst, stack_value);
 
       // No flags affected with pop
 
       // Increment the instruction pointer
-      cpu->rip += instr.size;
+      cpu->rip = instr->address + instr->size;
 
       return 0;
     }
 
     case PUSH_50: {
-      // Determine destination register
-      uint8_t b_bit = (instr.rex.b) << 3;
-      uint64_t* src = reg_from_nibble(cpu, b_bit | instr.reg_index);
-
-      if (src == NULL) {
-        return -CPU_ERR_INVALID_MODRM_INDEX;
-      }
+      // Determine source register
+      uint8_t src = (instr->rex.b << 3) | instr->reg_index;
 
       // Push the actual value to the stack
-      ret = push_stack(cpu, *src);
+      ret = push_stack(cpu, reg_read_64(cpu, src));
       if (ret != 0) {
         return ret;
       }
@@ -357,53 +1329,34 @@ int fetch_decode_execute(cpu_x86_64_t* cpu) {
       // No flags affected with push
 
       // Increment the instruction pointer
-      cpu->rip += instr.size;
+      cpu->rip = instr->address + instr->size;
 
       return 0;
     }
   }
 
-  return 1;
+  // A type the decoder produced but nothing here handles. That's a bug, and
+  // must not look like any of run_blocks()'s positive results.
+  return -CPU_ERR_UNABLE_TO_EXECUTE;
 }
 
 int pop_stack(cpu_x86_64_t* cpu, uint64_t* data_out) {
-  if (!read_u64(cpu->rsp, data_out)) {
+  if (!read_u64(cpu->regs[modrm_rsp], data_out)) {
     return -CPU_ERR_INVALID_STACK_POINTER;
   }
-  cpu->rsp += 8;
+  cpu->regs[modrm_rsp] += 8;
   return 0;
 }
 
 int push_stack(cpu_x86_64_t* cpu, uint64_t data) {
-  cpu->rsp -= 8;
-  if (!write_u64(cpu->rsp, data)) {
+  // Only move rsp once the write has succeeded, so a fault leaves it untouched
+  if (!write_u64(cpu->regs[modrm_rsp] - 8, data)) {
     return -CPU_ERR_INVALID_STACK_POINTER;
   }
+  cpu->regs[modrm_rsp] -= 8;
   return 0;
 }
 
-uint64_t* reg_from_nibble(const cpu_x86_64_t* cpu, const uint8_t nibble) {
-  switch (nibble) {
-    case modrm_rax: return (uint64_t*)&cpu->rax;
-    case modrm_rcx: return (uint64_t*)&cpu->rcx;
-    case modrm_rdx: return (uint64_t*)&cpu->rdx;
-    case modrm_rbx: return (uint64_t*)&cpu->rbx;
-    case modrm_rsp: return (uint64_t*)&cpu->rsp;
-    case modrm_rbp: return (uint64_t*)&cpu->rbp;
-    case modrm_rsi: return (uint64_t*)&cpu->rsi;
-    case modrm_rdi: return (uint64_t*)&cpu->rdi;
-    case modrm_r8:  return (uint64_t*)&cpu->r8;
-    case modrm_r9:  return (uint64_t*)&cpu->r9;
-    case modrm_r10: return (uint64_t*)&cpu->r10;
-    case modrm_r11: return (uint64_t*)&cpu->r11;
-    case modrm_r12: return (uint64_t*)&cpu->r12;
-    case modrm_r13: return (uint64_t*)&cpu->r13;
-    case modrm_r14: return (uint64_t*)&cpu->r14;
-    case modrm_r15: return (uint64_t*)&cpu->r15;
-  }
-  return NULL;
-}
-
 static char* cpu_errors[] = {
   "Unknown",
   "Unable to decode instruction",
@@ -412,6 +1365,10 @@ static char* cpu_errors[] = {
   "Unable to fetch instruction bytes from memory",
   "Unable to fetch from invalid stack pointer address",
   "Not yet implemented",
+  "Invalid memory access",
+  "Segmentation fault",
+  "Execution diverged from the replay log",
+  "Unmasked floating point exception",
 };
 
 char* cpu_err_message(int errorIndex) {
@@ -419,8 +1376,8 @@ char* cpu_err_message(int errorIndex) {
     errorIndex *= -1;
   }
 
-  if (errorIndex >= ELF_ERR_NUM_ERRORS) {
-    return cpu_errors[ELF_ERR_UNKNOWN];
+  if (errorIndex >= CPU_ERR_NUM_ERRORS) {
+    return cpu_errors[CPU_ERR_UNKNOWN];
   }
   return cpu_errors[errorIndex];
 }
\ No newline at end of file
@@ -1,12 +1,222 @@
+#include <signal.h>
+#include <unistd.h>
+
 #include "main.h"
 #include "ue-elf.h"
 #include "ue-memory.h"
 #include "cpu.h"
+#include "ue-block.h"
+#include "ue-predecode.h"
+#include "ue-tcache.h"
+#include "ue-sched.h"
+#include "ue-syscall.h"
+#include "ue-profile.h"
+#include "ue-stats.h"
+#include "ue-coverage.h"
+#include "ue-replay.h"
+#include "ue-plugin.h"
+#include "ue-cachesim.h"
+#include "ue-watch.h"
+#include "ue-fpu.h"
+#include "ue-loader.h"
+#include "ue-link.h"
 
 #define TEST_BIN "./testcases/true"
+#define MAX_SEEKS (16)
+
+static const char* reg_names[16] = {
+  "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+  "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+static void print_registers(const cpu_x86_64_t* cpu) {
+  printf("Instruction %lu: rip 0x%016lx\n", cpu->instructions_retired, cpu->rip);
+  for (size_t i = 0; i < 16; i++) {
+    printf("  %-3s 0x%016lx%s", reg_names[i], cpu->regs[i], (i % 4 == 3) ? "\n" : "");
+  }
+}
+
+// Links the program in the emulator, from the prelink cache if there's a usable
+// one there, and saving to it otherwise
+static int link_guest(const char* path, const loader_image_t* exe, const char* prelink_dir, link_result_t* result_out) {
+  uint64_t key = 0;
+  if (prelink_dir) {
+    key = prelink_key(path, exe);
+    int ret = prelink_load(prelink_dir, key, path, exe, result_out);
+    if (ret == 0) {
+      return 0;
+    }
+
+    // Nothing has been mapped unless the cache was usable
+    if (ret != -LINK_ERR_CACHE_NOT_FOUND && ret != -LINK_ERR_CACHE_STALE && ret != -LINK_ERR_CACHE_BAD_FILE) {
+      return ret;
+    }
+    if (ret != -LINK_ERR_CACHE_NOT_FOUND) {
+      printf("Prelink cache not loaded: %s\n", link_err_message(ret));
+    }
+  }
+
+  int ret = link_program(path, exe, result_out);
+  if (ret == 0 && prelink_dir) {
+    int save_ret = prelink_save(prelink_dir, key);
+    if (save_ret != 0) {
+      printf("Prelink cache not saved: %s\n", link_err_message(save_ret));
+    }
+  }
+  return ret;
+}
+
+// Replays to each seek target in turn, showing the registers at each one, or
+// straight through to the end if there aren't any
+static int run_replay(guest_context_t* guest, const uint64_t* seeks, size_t num_seeks) {
+  if (num_seeks == 0) {
+    return replay_run(guest, RUN_UNLIMITED, false);
+  }
+
+  for (size_t i = 0; i < num_seeks; i++) {
+    int ret = replay_seek(guest, seeks[i], false);
+    if (ret != 0) {
+      return ret;
+    }
+    print_registers(&guest->cpu);
+  }
+  return 0;
+}
 
 int main(int argc, char** argv) {
-  FILE* fp = fopen(TEST_BIN, "rb");
+  const char* bin_path = TEST_BIN;
+  char* default_argv[] = { TEST_BIN };
+  char** guest_argv = default_argv;
+  int guest_argc = 1;
+  bool print_stats = false;
+  bool predecode = false;
+  const char* tcache_dir = NULL;
+  uint64_t pie_base = LOADER_PIE_BASE;
+  bool link_in_emulator = false;
+  const char* prelink_dir = NULL;
+  uint64_t instruction_limit = 0;
+  uint64_t timeout_ms = 0;
+  int sched_threads = 0; // Host threads to run guest threads on, 0 for one per core
+  const char* profile_path = NULL;
+  const char* stats_page_path = NULL;
+  bool coverage = false;
+  const char* record_path = NULL;
+  const char* replay_path = NULL;
+  uint64_t seeks[MAX_SEEKS];
+  size_t num_seeks = 0;
+  char* plugin_specs[PLUGIN_MAX_PLUGINS];
+  size_t num_plugin_specs = 0;
+  const char* cachesim_spec = NULL;
+  watchpoint_t watchpoints[WATCH_MAX_WATCHPOINTS];
+  size_t num_watchpoints = 0;
+  block_tiers_t tiers = {
+    .build_threshold = BLOCK_BUILD_THRESHOLD_DEFAULT,
+  };
+  profile_config_t profile_config = {0};
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0) {
+      print_stats = true;
+    } else if (strcmp(argv[i], "-p") == 0) {
+      predecode = true;
+    } else if (strcmp(argv[i], "-H") == 0) {
+      set_memory_hugepages(true);
+    } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+      instruction_limit = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+      timeout_ms = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      sched_threads = strtol(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+      profile_path = argv[++i];
+    } else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+      profile_config.instruction_interval = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-M") == 0 && i + 1 < argc) {
+      stats_page_path = argv[++i];
+    } else if (strcmp(argv[i], "-C") == 0) {
+      coverage = true;
+    } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+      tiers.build_threshold = strtoul(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+      if (num_plugin_specs == PLUGIN_MAX_PLUGINS) {
+        printf("Plugin %s not loaded: %s\n", argv[i + 1], plugin_err_message(-PLUGIN_ERR_TOO_MANY));
+        return 1;
+      }
+      plugin_specs[num_plugin_specs++] = argv[++i];
+    } else if (strcmp(argv[i], "-A") == 0 && i + 1 < argc) {
+      cachesim_spec = argv[++i];
+    } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+      if (num_watchpoints == WATCH_MAX_WATCHPOINTS) {
+        printf("Watchpoint %s not set: %s\n", argv[i + 1], watch_err_message(-WATCH_ERR_TOO_MANY));
+        return 1;
+      }
+      int watch_ret = watch_parse(argv[++i], &watchpoints[num_watchpoints++]);
+      if (watch_ret != 0) {
+        printf("Bad watchpoint %s: %s\n", argv[i], watch_err_message(watch_ret));
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      record_path = argv[++i];
+    } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+      replay_path = argv[++i];
+    } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+      if (num_seeks == MAX_SEEKS) {
+        printf("Seek to %s not made: at most %d seeks can be given\n", argv[i + 1], MAX_SEEKS);
+        return 1;
+      }
+      seeks[num_seeks++] = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      tcache_dir = argv[++i];
+    } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      pie_base = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-D") == 0) {
+      link_in_emulator = true;
+    } else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc) {
+      prelink_dir = argv[++i];
+      link_in_emulator = true;
+    } else {
+      // The program, and everything after it is its own arguments
+      bin_path = argv[i];
+      guest_argv = &argv[i];
+      guest_argc = argc - i;
+      break;
+    }
+  }
+
+  block_set_tiers(&tiers);
+
+  // Plugins are given as path[,args], and have to be in place before anything is translated
+  for (size_t i = 0; i < num_plugin_specs; i++) {
+    char* args = strchr(plugin_specs[i], ',');
+    if (args) {
+      *args++ = '\0';
+    }
+
+    int plugin_ret = plugin_load(plugin_specs[i], args);
+    if (plugin_ret != 0) {
+      printf("Plugin %s not loaded: %s\n", plugin_specs[i], plugin_err_message(plugin_ret));
+      return 1;
+    }
+  }
+
+  // The cache simulation instruments blocks in the same way, so goes in here too
+  if (cachesim_spec) {
+    cachesim_config_t cachesim_config;
+    int cachesim_ret = cachesim_parse_config(cachesim_spec, &cachesim_config);
+    if (cachesim_ret == 0) {
+      cachesim_ret = cachesim_start(&cachesim_config);
+    }
+    if (cachesim_ret != 0) {
+      printf("Cache simulation not started: %s\n", cachesim_err_message(cachesim_ret));
+      return 1;
+    }
+  }
+
+  FILE* fp = fopen(bin_path, "rb");
+  if (!fp) {
+    printf("Couldn't open %s\n", bin_path);
+    return 1;
+  }
 
   Elf64_Ehdr elf_header = {0};
   int ret = elf_parse_header(fp, &elf_header);
@@ -16,50 +226,299 @@ int main(int argc, char** argv) {
     return 1;
   }
 
-  Elf64_Phdr* elf_program_headers = malloc(elf_header.e_phnum * elf_header.e_phentsize);
-  if (!elf_program_headers) {
-    printf("Couldn't allocate memory for program headers\n");
+  // Position independent executables go at pie_base
+  loader_image_t exe_image;
+  char interp_path[LOADER_MAX_PATH];
+  ret = loader_load_image(fp, &elf_header, pie_base, &exe_image, interp_path);
+  if (ret != 0) {
+    printf("Program not loaded: %s\n", loader_err_message(ret));
+    return 1;
+  }
+
+  // A dynamically linked program starts in its dynamic linker, unless the
+  // emulator links it instead
+  uint64_t entry = exe_image.entry;
+  loader_image_t interp_image;
+  bool has_interp = false;
+  link_result_t link_result = {0};
+  if (interp_path[0] && link_in_emulator) {
+    ret = link_guest(bin_path, &exe_image, prelink_dir, &link_result);
+    if (ret != 0) {
+      printf("Dynamic linking failed: %s: %s\n", link_err_message(ret), link_error_detail());
+      return 1;
+    }
+  } else if (interp_path[0]) {
+    ret = loader_load_file(interp_path, LOADER_INTERP_BASE, &interp_image);
+    if (ret != 0) {
+      printf("Program interpreter %s not loaded: %s\n", interp_path, loader_err_message(ret));
+      return 1;
+    }
+    has_interp = true;
+    entry = interp_image.entry;
+  }
+
+  // The heap starts just past the program, as it does under the kernel
+  set_guest_brk_start(exe_image.end);
+
+  ret = create_stack_region(STACK_START_ADDRESS);
+  if (ret != 0) {
+    printf("Stack not mapped: %s\n", memory_err_message(ret));
+    return 1;
+  }
+
+  // Recording and replaying have to start before the guest's process id is
+  // set up, and before it's given its random bytes
+  if (record_path) {
+    ret = replay_record_start(record_path, tcache_key());
+    if (ret != 0) {
+      printf("Not recording: %s\n", replay_err_message(ret));
+      return 1;
+    }
+  } else if (replay_path) {
+    ret = replay_open(replay_path, tcache_key());
+    if (ret != 0) {
+      printf("Can't replay %s: %s\n", replay_path, replay_err_message(ret));
+      return 1;
+    }
+  }
+
+  uint8_t random[LOADER_RANDOM_BYTES];
+  ret = replay_random(random, sizeof(random));
+  if (ret != 0) {
+    printf("Initial stack not built: %s\n", cpu_err_message(ret));
     return 1;
   }
 
-  ret = elf_parse_program_headers(fp, &elf_header, elf_program_headers);
+  uint64_t initial_rsp;
+  ret = loader_build_stack(guest_argc, guest_argv, random, &exe_image, has_interp ? &interp_image : NULL, STACK_START_ADDRESS, &initial_rsp);
   if (ret != 0) {
-    printf("ELF Program Headers Error: %s\n", elf_err_message(ret));
+    printf("Initial stack not built: %s\n", loader_err_message(ret));
     return 1;
   }
 
-  for (size_t i = 0; i < elf_header.e_phnum; i++) {
-    ret = load_memory_region(&elf_program_headers[i], fp);
+  for (size_t i = 0; i < num_watchpoints; i++) {
+    ret = watch_add(&watchpoints[i]);
     if (ret != 0) {
-      printf("Memory region load error: %s\n", memory_err_message(ret));
+      printf("Watchpoint at 0x%016lx not set: %s\n", watchpoints[i].address, watch_err_message(ret));
       return 1;
     }
   }
 
-  // The raw headers are no longer needed after the memory regions are loaded
-  free(elf_program_headers);
+  // Guest memory protection is enforced by the host MMU from here on
+  ret = install_memory_fault_handler();
+  if (ret != 0) {
+    printf("Memory error: %s\n", memory_err_message(ret));
+    return 1;
+  }
+
+  // As are the floating point exceptions the guest unmasks
+  ret = fpu_install_exception_handler();
+  if (ret != 0) {
+    printf("FPU error: %s\n", fpu_err_message(ret));
+    return 1;
+  }
 
-  create_stack_region(STACK_START_ADDRESS);
+  // Start from the blocks decoded by a previous run of the same binary, if any.
+  // Cached blocks were never shown to the plugins, so they can't be used with them.
+  if (plugins_instrumenting) {
+    tcache_dir = NULL;
+  }
+  uint64_t tcache_key_value = 0;
+  if (tcache_dir) {
+    tcache_key_value = tcache_key();
+    ret = tcache_load(tcache_dir, tcache_key_value);
+    if (ret != 0 && ret != -TCACHE_ERR_NOT_FOUND) {
+      printf("Translation cache not loaded: %s\n", tcache_err_message(ret));
+    }
+  }
+
+  // Symbols are only used as extra pre-decoding entry points and to symbolize
+  // profiles and cache simulation reports, so they're not required
+  elf_symtab_t symtab = {0};
+  if (predecode || profile_path || cachesim_spec) {
+    elf_parse_symbols(fp, &elf_header, exe_image.bias, &symtab);
+  }
+
+  // Optionally decode as much of the program as we can find up front, on all cores
+  if (predecode) {
+    if (predecode_executable(exe_image.entry, &symtab, 0) != 0) {
+      printf("Pre-decoding failed, continuing without it\n");
+    }
+  }
 
-  cpu_x86_64_t cpu = {
-    .rip = elf_header.e_entry,
-    // Most programs include a `pop` in their _start, so we need to ensure
-    // that there is at least a one slot there to accommodate
-    .rsp = STACK_START_ADDRESS - 8,
+  // Edge coverage is always collected under a fuzzer, and on request otherwise
+  ret = coverage_init(coverage);
+  if (ret != 0) {
+    printf("Coverage error: %s\n", coverage_err_message(ret));
+    return 1;
+  }
+
+  guest_context_t guest = {
+    .cpu = {
+      .rip = entry,
+      .regs[modrm_rsp] = initial_rsp,
+      .mxcsr = MXCSR_DEFAULT,
+      .fcw = FCW_DEFAULT,
+    },
+    .instruction_limit = instruction_limit,
+    .timeout_ns = timeout_ms * 1000000ULL,
   };
+  cpu_x86_64_t* cpu = &guest.cpu;
+  syscall_init_process(&guest);
+
+  sched_config_t sched_config = {
+    .num_threads = sched_threads,
+    .finished = syscall_thread_finished,
+    // Keep the fuzzer's view of stdout to what the guest itself writes
+    .trace = !coverage_map,
+  };
+
+  // Under a fuzzer, everything up to here (loading, pre-decoding, the tcache)
+  // is done once and each test case runs in a child forked from this point
+  bool forkserver_child = coverage_forkserver() == 1;
+
+  // What ld.so would have done in guest code before the program starts: the
+  // thread pointer, IFUNCs and library initializers. Those run once per test
+  // case, since they can have side effects.
+  if (interp_path[0] && link_in_emulator) {
+    ret = link_start_guest(&guest, sched_config.trace);
+    if (ret != 0) {
+      printf("Dynamic linking failed: %s: %s\n", link_err_message(ret), link_error_detail());
+      return 1;
+    }
+  }
 
-  x86_64_instr_t instr;
-  while (1) {
-    printf("[0x%016x]\n", cpu.rip);
-    ret = fetch_decode_execute(&cpu);
+  if (profile_path) {
+    ret = profile_start(&profile_config);
     if (ret != 0) {
-      printf("Execution error: %s\n", cpu_err_message(ret));
+      printf("Profiler error: %s\n", profile_err_message(ret));
       return 1;
     }
   }
 
+  if (stats_page_path) {
+    ret = stats_publish_start(stats_page_path);
+    if (ret != 0) {
+      printf("Stats page not published: %s\n", stats_err_message(ret));
+    }
+  }
+
+  // The guest may have stopped already, before the program itself started
+  if (guest.result == 0 && replay_mode == REPLAY_REPLAYING) {
+    guest.result = run_replay(&guest, seeks, num_seeks);
+  } else if (guest.result == 0) {
+    ret = sched_run(&guest, 1, &sched_config);
+  }
+  syscall_end_process();
+  stats_publish_stop();
+  if (ret != 0) {
+    printf("Scheduler error: %s\n", sched_err_message(ret));
+    return 1;
+  }
+
+  ret = guest.result;
+  if (ret == RUN_GUEST_EXITED) {
+    ret = 0;
+  } else if (guest.stop_reason != GUEST_STOP_NONE) {
+    printf("Stopped at 0x%016lx after %lu instructions: %s\n", cpu->rip, cpu->instructions_retired, sched_stop_message(guest.stop_reason));
+  } else if (ret == -CPU_ERR_SEGMENTATION_FAULT) {
+    printf("Segmentation fault at 0x%016lx, accessing 0x%016lx\n", cpu->rip, get_last_fault_address());
+  } else if (ret != 0) {
+    printf("Execution error at 0x%016lx: %s\n", cpu->rip, cpu_err_message(ret));
+  }
+
+  // A forkserver child reports back through its exit status alone, crashing the
+  // way the guest did so the fuzzer sees it
+  if (forkserver_child) {
+    fflush(stdout);
+    if (guest.result == RUN_GUEST_EXITED && !get_guest_fatal_signal()) {
+      _exit(get_guest_exit_status());
+    } else if (guest.stop_reason != GUEST_STOP_NONE) {
+      _exit(sched_stop_status(guest.stop_reason));
+    } else if (ret == -CPU_ERR_SEGMENTATION_FAULT || ret == -CPU_ERR_INVALID_MEMORY_ACCESS || get_guest_fatal_signal() == SIGSEGV) {
+      signal(SIGSEGV, SIG_DFL);
+      raise(SIGSEGV);
+    } else if (ret == -CPU_ERR_UNABLE_TO_DECODE) {
+      signal(SIGILL, SIG_DFL);
+      raise(SIGILL);
+    } else if (ret == -CPU_ERR_FP_EXCEPTION) {
+      signal(SIGFPE, SIG_DFL);
+      raise(SIGFPE);
+    }
+    abort();
+  }
+
+  plugin_exit();
+
+  if (replay_close() != 0) {
+    printf("Recording incomplete: %s\n", replay_err_message(-REPLAY_ERR_WRITE));
+  }
+
+  if (coverage && !coverage_under_fuzzer()) {
+    printf("Coverage: %lu edges\n", coverage_num_edges());
+  }
+
+  if (cachesim_spec) {
+    cachesim_report(stdout, &symtab);
+  }
+
+  if (print_stats) {
+    if (interp_path[0] && link_in_emulator) {
+      printf("Dynamic linking: %zu libraries, %zu relocations%s\n", link_result.num_libraries,
+             link_result.num_fixups, link_result.from_cache ? " (prelink cache)" : "");
+    }
+    print_block_stats(stdout);
+    print_stats_summary(stdout);
+  }
+
+  if (profile_path) {
+    profile_stop();
+
+    uint64_t dropped;
+    uint64_t truncated;
+    uint64_t samples = profile_num_samples(&dropped, &truncated);
+    int profile_ret = profile_write_collapsed(profile_path, &symtab);
+    if (profile_ret != 0) {
+      printf("Profile not written: %s\n", profile_err_message(profile_ret));
+    } else {
+      printf("Profile: %lu samples (%lu dropped) written to %s\n", samples, dropped, profile_path);
+    }
+    if (truncated) {
+      printf("Profile: %lu samples had more than %d frames, and lost their innermost ones\n", truncated, SHADOW_STACK_SIZE);
+    }
+  }
+  elf_free_symbols(&symtab);
+
+  if (tcache_dir) {
+    int tcache_ret = tcache_save(tcache_dir, tcache_key_value);
+    if (tcache_ret != 0) {
+      printf("Translation cache not saved: %s\n", tcache_err_message(tcache_ret));
+    }
+  }
+
+  // No other guest threads are left by now (see syscall_end_process())
+  free_blocks();
+  tcache_unmap();
   free_memory_regions();
+  profile_free();
+  cachesim_free();
   fclose(fp);
 
-  return 0;
+  // The guest can't handle signals (rt_sigaction() isn't emulated), so a fault
+  // kills it, and the emulator with it, as SIGSEGV's default action would
+  int fatal_signal = (ret == -CPU_ERR_SEGMENTATION_FAULT) ? SIGSEGV : get_guest_fatal_signal();
+  if (fatal_signal) {
+    fflush(stdout);
+    signal(fatal_signal, SIG_DFL);
+    raise(fatal_signal);
+  }
+
+  if (guest.result == RUN_GUEST_EXITED) {
+    return get_guest_exit_status();
+  }
+  // Stopped by the emulator rather than exiting, so the run was cut short
+  if (guest.stop_reason != GUEST_STOP_NONE) {
+    return sched_stop_status(guest.stop_reason);
+  }
+  return (ret == 0) ? 0 : 1;
 }
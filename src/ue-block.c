@@ -0,0 +1,797 @@
+#include <pthread.h>
+#include "ue-block.h"
+#include "ue-memory.h"
+#include "ue-profile.h"
+#include "ue-stats.h"
+#include "ue-coverage.h"
+#include "ue-plugin.h"
+#include "ue-watch.h"
+#include "ue-fpu.h"
+
+#define ENDBR64_SIZE  (4)
+
+// Blocks can be built from several threads at once (see ue-predecode.c).
+// Lookups are lock-free: blocks are only ever pushed onto the front of a
+// bucket with a release store, so a reader always sees a complete chain.
+// Insertion takes a lock so that two threads can't add the same block.
+static block_t* block_cache[BLOCK_CACHE_BUCKETS];
+static pthread_mutex_t block_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Nothing under the lock touches guest memory, but a guest fault recovered from
+// there would leave the lock held for good, so it's a crash instead
+static void lock_block_cache(void) {
+  pthread_mutex_lock(&block_cache_lock);
+  block_fault_recovery();
+}
+
+static void unlock_block_cache(void) {
+  allow_fault_recovery();
+  pthread_mutex_unlock(&block_cache_lock);
+}
+
+// Invalidated blocks may still be executing (or be looked up
+// concurrently), so they're kept here and only freed along with the rest of
+// the cache. They keep their next links, for readers still walking a bucket.
+static block_t* retired_blocks = NULL;
+
+// The instruction currently executing on this thread, so that a guest memory
+// fault caught by the host MMU can be attributed to it
+static __thread const x86_64_instr_t* current_instr = NULL;
+// The block it's in, if it's in one
+static __thread const block_t* current_block = NULL;
+
+// Counters for the (cold) block building side. Hot path counters are in ue-stats.h.
+static block_stats_t stats;
+
+static block_tiers_t tiers = {
+  .build_threshold = BLOCK_BUILD_THRESHOLD_DEFAULT,
+};
+
+// How many times code at each address has been interpreted, indexed like the
+// block cache. Collisions only mean that some code gets built a little early.
+static uint8_t cold_counts[BLOCK_CACHE_BUCKETS];
+
+#define STAT_INC(field) __atomic_fetch_add(&(field), 1, __ATOMIC_RELAXED)
+
+static const char* fuse_names[FUSE_NUM_KINDS] = {
+  "endbr64",
+  "xor zeroing",
+  "push rbp; mov rbp, rsp",
+  "cmp/test; jcc",
+  "pop; ret",
+};
+
+// Fusions are counted as blocks enter the cache, so a block built twice (by two
+// threads at once) isn't counted twice. Must be called
+// with the block cache lock held.
+static void count_fused(const block_t* block) {
+  for (size_t i = 0; i < FUSE_NUM_KINDS; i++) {
+    stats.fused[i] += block->fused[i];
+  }
+}
+
+static size_t bucket_index(uint64_t address) {
+  return (address ^ (address >> 12)) & (BLOCK_CACHE_BUCKETS - 1);
+}
+
+const block_stats_t* get_block_stats(void) {
+  return &stats;
+}
+
+void block_set_tiers(const block_tiers_t* new_tiers) {
+  tiers = *new_tiers;
+  if (tiers.build_threshold > BLOCK_BUILD_THRESHOLD_MAX) {
+    tiers.build_threshold = BLOCK_BUILD_THRESHOLD_MAX;
+  }
+}
+
+block_t* block_lookup(uint64_t address) {
+  block_t* block = __atomic_load_n(&block_cache[bucket_index(address)], __ATOMIC_ACQUIRE);
+  while (block) {
+    if (block->address == address) break;
+    block = block->next;
+  }
+  return block;
+}
+
+static bool is_zeroing_xor(const x86_64_instr_t* instr) {
+  return (
+    instr->type == XOR_31
+    && instr->ea_kind == EA_REG
+    && instr->opsize >= 4
+    && instr->modrm.reg == instr->modrm.rm
+    && instr->rex.r == instr->rex.b
+  );
+}
+
+static bool is_push_frame(const x86_64_instr_t* push, const x86_64_instr_t* mov) {
+  return (
+    push->type == PUSH_50
+    && ((push->rex.b << 3) | push->reg_index) == modrm_rbp
+    && mov->type == MOV_89
+    && mov->opsize == 8
+    && mov->ea_kind == EA_REG
+    && ((mov->rex.r << 3) | mov->modrm.reg) == modrm_rsp
+    && ((mov->rex.b << 3) | mov->modrm.rm) == modrm_rbp
+  );
+}
+
+static bool is_compare(const x86_64_instr_t* instr) {
+  switch (instr->type) {
+    case CMP_83:
+    case CMP_39:
+    case CMP_3B:
+    case TEST_85:
+      return true;
+  }
+  return false;
+}
+
+// Rewrites the decoded stream in place, replacing common compiler idioms with
+// superinstructions. Fused pairs keep both instructions in the array; the
+// first is retyped and records how many of its successors it absorbed. Each kind
+// of fusion made is tallied in fused_out.
+static size_t fuse_instructions(x86_64_instr_t* instrs, size_t num_instrs, uint16_t* fused_out) {
+  size_t out = 0;
+
+  for (size_t i = 0; i < num_instrs; i++) {
+    x86_64_instr_t* instr = &instrs[i];
+    x86_64_instr_t* next = (i + 1 < num_instrs) ? &instrs[i + 1] : NULL;
+
+    // endbr64 is a nop as far as we're concerned, so it simply disappears
+    if (instr->type == ENDBR64) {
+      fused_out[FUSE_ENDBR64]++;
+      continue;
+    }
+
+    if (out != i) {
+      instrs[out] = *instr;
+      if (next) instrs[out + 1] = *next;
+      instr = &instrs[out];
+      next = next ? &instrs[out + 1] : NULL;
+    }
+
+    if (is_zeroing_xor(instr)) {
+      instr->fused_type = instr->type;
+      instr->type = FUSED_ZERO_REG;
+      fused_out[FUSE_ZERO_REG]++;
+    } else if (next && is_push_frame(instr, next)) {
+      instr->fused_type = instr->type;
+      instr->type = FUSED_PUSH_FRAME;
+      instr->num_fused = 1;
+      fused_out[FUSE_PUSH_FRAME]++;
+    } else if (next && is_compare(instr) && next->type == JCC) {
+      instr->fused_type = instr->type;
+      instr->type = FUSED_CMP_JCC;
+      instr->num_fused = 1;
+      fused_out[FUSE_CMP_JCC]++;
+    } else if (next && instr->type == POP_58 && next->type == RET_C3) {
+      instr->fused_type = instr->type;
+      instr->type = FUSED_POP_RET;
+      instr->num_fused = 1;
+      fused_out[FUSE_POP_RET]++;
+    }
+
+    // Skip over (but keep) any absorbed instructions
+    out += 1 + instr->num_fused;
+    i += instr->num_fused;
+  }
+
+  return out;
+}
+
+// Decoding can run off the end of a segment into unmapped memory, which just means
+// that the instruction can't be decoded
+static int decode_guarded(uint64_t address, cpu_x86_64_t* cpu, x86_64_instr_t* instr) {
+  sigjmp_buf recovery;
+  sigjmp_buf* outer = memory_fault_recovery;
+
+  if (sigsetjmp(recovery, 0) != 0) {
+    memory_fault_recovery = outer;
+    return -CPU_ERR_UNABLE_TO_READ;
+  }
+
+  memory_fault_recovery = &recovery;
+  int ret = decode_at_address(address, cpu, instr);
+  memory_fault_recovery = outer;
+  return ret;
+}
+
+// Makes a block out of decoded instructions. For the optimized tier they're
+// fused into superinstructions first, in place.
+static block_t* new_block(uint64_t address, uint64_t size, x86_64_instr_t* decoded, size_t num_guest_instrs, int tier) {
+  block_t* block = calloc(1, sizeof(block_t));
+  if (!block) {
+    return NULL;
+  }
+
+  block->address = address;
+  block->size = size;
+  block->tier = tier;
+  block->num_guest_instrs = num_guest_instrs;
+  block->num_instrs = (tier == BLOCK_TIER_OPTIMIZED) ? fuse_instructions(decoded, num_guest_instrs, block->fused) : num_guest_instrs;
+
+  // A block made up entirely of endbr64s still needs to move rip along
+  if (block->num_instrs == 0) {
+    decoded[0].type = JMP;
+    decoded[0].imm64 = address + size;
+    block->num_instrs = 1;
+  }
+
+  block->instrs = malloc(block->num_instrs * sizeof(x86_64_instr_t));
+  if (!block->instrs) {
+    free(block);
+    return NULL;
+  }
+  memcpy(block->instrs, decoded, block->num_instrs * sizeof(x86_64_instr_t));
+  return block;
+}
+
+static int build_block(cpu_x86_64_t* cpu, uint64_t address, int tier, block_t** block_out) {
+  // Plugins see one entry per guest instruction
+  if (plugins_instrumenting) {
+    tier = BLOCK_TIER_BASELINE;
+  }
+
+  x86_64_instr_t decoded[BLOCK_MAX_INSTRUCTIONS];
+  size_t num_instrs = 0;
+  uint64_t pc = address;
+
+  while (num_instrs < BLOCK_MAX_INSTRUCTIONS) {
+    x86_64_instr_t* instr = &decoded[num_instrs];
+    memset(instr, 0, sizeof(x86_64_instr_t));
+
+    int ret = decode_guarded(pc, cpu, instr);
+    if (ret != 0) {
+      // Report the failure if it's the very first instruction, otherwise end
+      // the block here and let the error surface when execution reaches it
+      if (num_instrs == 0) {
+        return ret;
+      }
+      break;
+    }
+
+    num_instrs++;
+    pc += instr->size;
+
+    if (is_block_terminator(instr)) break;
+  }
+
+  block_t* block = new_block(address, pc - address, decoded, num_instrs, tier);
+  if (!block) {
+    return -CPU_ERR_UNKNOWN;
+  }
+
+  if (plugins_instrumenting) {
+    fpu_host_begin();
+    plugin_translate_block(block);
+    fpu_host_end();
+  }
+
+  STAT_INC(stats.blocks_built);
+  *block_out = block_insert(block);
+  return 0;
+}
+
+// Time spent here counts towards the build tier
+int block_build(cpu_x86_64_t* cpu, uint64_t address, int tier, block_t** block_out) {
+  // Decoding reads guest memory, which mustn't be taken for the last
+  // instruction executed reading it (see current_instr_address())
+  current_instr = NULL;
+  STATS_ATTACH();
+  STATS_TIME_START(build_start);
+
+  int ret = build_block(cpu, address, tier, block_out);
+
+  STATS_TIME_END(STATS_TIER_BUILD, build_start);
+  return ret;
+}
+
+static void free_block(block_t* block) {
+  if (!block->mapped) {
+    free(block->instrs);
+  }
+  plugin_free_instrumentation(block->instrumentation);
+  free(block);
+}
+
+// Adds a block to the cache, returning the block that ends up cached. If another
+// thread already inserted a block at the same address, that one wins and the
+// new block is freed.
+block_t* block_insert(block_t* block) {
+  lock_block_cache();
+
+  block_t* existing = block_lookup(block->address);
+  if (existing) {
+    unlock_block_cache();
+    free_block(block);
+    return existing;
+  }
+
+  block->coverage_id = coverage_block_id(block->address);
+  count_fused(block);
+
+  // Writes to these pages now need to invalidate the block, which they will
+  // as soon as it can be found
+  mark_code_pages(block->address, block->size);
+
+  size_t bucket = bucket_index(block->address);
+  block->next = block_cache[bucket];
+  __atomic_store_n(&block_cache[bucket], block, __ATOMIC_RELEASE);
+
+  unlock_block_cache();
+  return block;
+}
+
+static bool block_overlaps(const block_t* block, uint64_t address, uint64_t size) {
+  return (address < block->address + block->size) && (block->address < address + size);
+}
+
+// Pages spanned by an invalidation which can be tracked without allocating
+#define INVALIDATE_STACK_PAGES  (4096)
+
+// Removes every block overlapping [address, address + size) from the cache,
+// so that they'll be re-decoded the next time they're reached, and returns how
+// many there were. Pages in the range which no longer hold any block stop
+// being treated as code. Both happen in one pass over the cache, under the
+// lock that block_insert() marks pages with, so a block inserted at the same
+// time can't have its page unmarked.
+size_t block_invalidate_range(uint64_t address, uint64_t size) {
+  uint64_t first_page = address & ~(GUEST_PAGE_SIZE - 1);
+  size_t num_pages = ((address + size - 1) >> GUEST_PAGE_SHIFT) - (first_page >> GUEST_PAGE_SHIFT) + 1;
+
+  // A bit for each page in the range, set while a surviving block covers it.
+  // Without one (if it can't be allocated), every page stays marked.
+  uint64_t stack_pages[INVALIDATE_STACK_PAGES / 64] = {0};
+  uint64_t* pages_with_code = stack_pages;
+  if (num_pages > INVALIDATE_STACK_PAGES) {
+    pages_with_code = calloc((num_pages + 63) / 64, sizeof(uint64_t));
+  }
+
+  size_t num_invalidated = 0;
+  lock_block_cache();
+
+  for (size_t i = 0; i < BLOCK_CACHE_BUCKETS; i++) {
+    block_t** link = &block_cache[i];
+    while (*link) {
+      block_t* block = *link;
+      if (block_overlaps(block, address, size)) {
+        __atomic_store_n(link, block->next, __ATOMIC_RELEASE);
+        block->retired_next = retired_blocks;
+        retired_blocks = block;
+        num_invalidated++;
+        STAT_INC(stats.blocks_invalidated);
+        continue;
+      }
+
+      if (pages_with_code && block_overlaps(block, first_page, num_pages * GUEST_PAGE_SIZE)) {
+        uint64_t start = (block->address > first_page) ? block->address : first_page;
+        uint64_t end = block->address + block->size;
+        for (uint64_t page = start & ~(GUEST_PAGE_SIZE - 1); page < end && page < first_page + num_pages * GUEST_PAGE_SIZE; page += GUEST_PAGE_SIZE) {
+          size_t index = (page - first_page) >> GUEST_PAGE_SHIFT;
+          pages_with_code[index / 64] |= 1ULL << (index % 64);
+        }
+      }
+      link = &block->next;
+    }
+  }
+
+  for (size_t index = 0; pages_with_code && index < num_pages; index++) {
+    if (!(pages_with_code[index / 64] & (1ULL << (index % 64)))) {
+      unmark_code_page(first_page + index * GUEST_PAGE_SIZE);
+    }
+  }
+
+  unlock_block_cache();
+
+  if (pages_with_code != stack_pages) {
+    free(pages_with_code);
+  }
+  return num_invalidated;
+}
+
+void for_each_block(block_visitor_t visitor, void* ctx) {
+  for (size_t i = 0; i < BLOCK_CACHE_BUCKETS; i++) {
+    const block_t* block = __atomic_load_n(&block_cache[i], __ATOMIC_ACQUIRE);
+    while (block) {
+      visitor(block, ctx);
+      block = block->next;
+    }
+  }
+}
+
+// Whether code at address has been reached often enough to be worth building
+static bool is_warm(uint64_t address) {
+  uint8_t* count = &cold_counts[bucket_index(address)];
+  uint8_t value = __atomic_load_n(count, __ATOMIC_RELAXED);
+  if (value >= tiers.build_threshold) {
+    return true;
+  }
+  __atomic_store_n(count, value + 1, __ATOMIC_RELAXED);
+  return false;
+}
+
+// The instruction being interpreted, for fault attribution. It can't be on the
+// stack, since run_blocks() only looks at it after a fault has unwound this frame.
+static __thread x86_64_instr_t interpreted_instr;
+
+// Guest instructions in the block ahead of instr. Entries are one instruction
+// each, fused or not, and the only gaps between them are endbr64s which fusion
+// dropped.
+static uint64_t guest_instrs_before(const block_t* block, const x86_64_instr_t* instr) {
+  uint64_t count = instr - block->instrs;
+  uint64_t next_address = block->address;
+  for (const x86_64_instr_t* entry = block->instrs; entry <= instr; entry++) {
+    count += (entry->address - next_address) / ENDBR64_SIZE;
+    next_address = entry->address + entry->size;
+  }
+  return count;
+}
+
+// An exit syscall stops its block with RUN_GUEST_EXITED, but has still run, as
+// has everything ahead of it
+static void retire_instrs(cpu_x86_64_t* cpu, uint64_t num_instrs) {
+  cpu->instructions_retired += num_instrs;
+  STATS_ADD(instructions_retired, num_instrs);
+}
+
+// Runs the instructions that a block at rip would hold, one at a time, without
+// building it. Stops exactly where the block would, so that budgets and
+// coverage edges come out the same either way.
+static int interpret_block(cpu_x86_64_t* cpu) {
+  STATS_INC(blocks_interpreted);
+  coverage_visit(cpu, coverage_block_id(cpu->rip));
+
+  x86_64_instr_t* instr = &interpreted_instr;
+  uint64_t num_instrs = 0;
+  while (num_instrs < BLOCK_MAX_INSTRUCTIONS) {
+    // Not executing anything while it's decoded
+    current_instr = NULL;
+    memset(instr, 0, sizeof(x86_64_instr_t));
+    int ret = decode_guarded(cpu->rip, cpu, instr);
+    if (ret != 0) {
+      // As in build_block(), the error surfaces once it's the first instruction
+      if (num_instrs == 0) {
+        return ret;
+      }
+      break;
+    }
+
+    current_instr = instr;
+    STATS_INSTR_TYPE(instr->type);
+    ret = execute_instr(cpu, instr);
+    if (ret != 0) {
+      cpu->rip = instr->address;
+      if (ret == RUN_GUEST_EXITED) {
+        retire_instrs(cpu, num_instrs + 1);
+      }
+      return ret;
+    }
+
+    num_instrs++;
+    if (is_block_terminator(instr)) break;
+  }
+
+  cpu->instructions_retired += num_instrs;
+  STATS_ADD(instructions_retired, num_instrs);
+  return 0;
+}
+
+// As the main loop of execute_block(), with the block's plugin callbacks run
+// alongside the instructions they're attached to
+static int execute_instrumented_block(cpu_x86_64_t* cpu, const block_t* block) {
+  const block_instrumentation_t* instrumentation = block->instrumentation;
+  const plugin_callback_t* cb = instrumentation->callbacks;
+  const plugin_callback_t* cb_end = cb + instrumentation->count;
+
+  // Callbacks are host code, and run with the host's floating point settings
+  fpu_host_begin();
+  for (; cb < cb_end && cb->kind == PLUGIN_CB_ENTRY; cb++) {
+    ((ue_block_cb_t)cb->fn)(cpu, block->address, cb->userdata);
+  }
+  fpu_host_end();
+
+  current_block = block;
+  for (size_t i = 0; i < block->num_instrs; i++) {
+    const x86_64_instr_t* instr = &block->instrs[i];
+
+    if (cb < cb_end && cb->index == i && cb->kind == PLUGIN_CB_EXEC) {
+      fpu_host_begin();
+      for (; cb < cb_end && cb->index == i && cb->kind == PLUGIN_CB_EXEC; cb++) {
+        ((ue_instr_cb_t)cb->fn)(cpu, instr->address, cb->userdata);
+      }
+      fpu_host_end();
+    }
+
+    // Anything left for this instruction watches its memory accesses, which
+    // have to be worked out before it changes any registers
+    plugin_mem_access_t accesses[2];
+    size_t num_accesses = 0;
+    if (cb < cb_end && cb->index == i) {
+      num_accesses = plugin_memory_accesses(cpu, instr, accesses);
+    }
+
+    current_instr = instr;
+    STATS_INSTR_TYPE(instr->type);
+    int ret = execute_instr(cpu, instr);
+    if (ret != 0) {
+      cpu->rip = instr->address;
+      if (ret == RUN_GUEST_EXITED) {
+        retire_instrs(cpu, guest_instrs_before(block, instr) + 1);
+      }
+      return ret;
+    }
+
+    if (cb < cb_end && cb->index == i) {
+      fpu_host_begin();
+      for (; cb < cb_end && cb->index == i; cb++) {
+        for (size_t j = 0; j < num_accesses; j++) {
+          ((ue_mem_cb_t)cb->fn)(cpu, instr->address, accesses[j].address, accesses[j].size, accesses[j].is_write, cb->userdata);
+        }
+      }
+      fpu_host_end();
+    }
+  }
+
+  cpu->instructions_retired += block->num_guest_instrs;
+  STATS_ADD(instructions_retired, block->num_guest_instrs);
+  return 0;
+}
+
+bool block_executing_in(uint64_t address, uint64_t size) {
+  // A syscall ends its block anyway, and has to finish once it's started
+  return current_block && current_instr && current_instr->type != SYSCALL
+    && block_overlaps(current_block, address, size);
+}
+
+// The block was left at a store to its own page (see MEMORY_FAULT_CODE_WRITE),
+// with everything ahead of it done. The store's instruction runs by itself,
+// decoded again, and execution goes on from a block built from whatever the
+// bytes after it are by then.
+static int finish_code_write(cpu_x86_64_t* cpu) {
+  cpu->instructions_retired += guest_instrs_before(current_block, current_instr);
+  STATS_ADD(instructions_retired, guest_instrs_before(current_block, current_instr));
+  cpu->rip = current_instr->address;
+  current_block = NULL;
+
+  x86_64_instr_t* instr = &interpreted_instr;
+  current_instr = NULL;
+  memset(instr, 0, sizeof(x86_64_instr_t));
+  int ret = decode_guarded(cpu->rip, cpu, instr);
+  if (ret != 0) {
+    return ret;
+  }
+
+  current_instr = instr;
+  ret = execute_instr(cpu, instr);
+  if (ret != 0) {
+    cpu->rip = instr->address;
+    return ret;
+  }
+  cpu->instructions_retired += 1;
+  STATS_INC(instructions_retired);
+  return 0;
+}
+
+// Executes the block at rip. Code which isn't cached yet is interpreted until
+// it's warm, and then built as a block.
+int execute_block(cpu_x86_64_t* cpu) {
+  block_t* block = block_lookup(cpu->rip);
+  if (block) {
+    STATS_INC(block_cache_hits);
+  } else {
+    STATS_INC(block_cache_misses);
+    // Plugins have to see all code translated, so nothing is interpreted
+    if (!plugins_instrumenting && !is_warm(cpu->rip)) {
+      return interpret_block(cpu);
+    }
+
+    int ret = block_build(cpu, cpu->rip, BLOCK_TIER_OPTIMIZED, &block);
+    if (ret != 0) {
+      return ret;
+    }
+    coverage_note_block(cpu->rip);
+  }
+
+  STATS_INC(blocks_executed);
+  coverage_visit(cpu, block->coverage_id);
+  if (block->instrumentation) {
+    return execute_instrumented_block(cpu, block);
+  }
+
+  current_block = block;
+  const x86_64_instr_t* instr = block->instrs;
+  const x86_64_instr_t* end = block->instrs + block->num_instrs;
+  while (instr < end) {
+    current_instr = instr;
+    STATS_INSTR_TYPE(instr->type);
+    int ret = execute_instr(cpu, instr);
+    if (ret != 0) {
+      // Leave rip at the faulting instruction
+      cpu->rip = instr->address;
+      if (ret == RUN_GUEST_EXITED) {
+        retire_instrs(cpu, guest_instrs_before(block, instr) + 1);
+      }
+      return ret;
+    }
+    instr += 1 + instr->num_fused;
+  }
+
+  cpu->instructions_retired += block->num_guest_instrs;
+  STATS_ADD(instructions_retired, block->num_guest_instrs);
+  return 0;
+}
+
+#ifdef UE_STATS
+// Thread-local rather than locals in run_blocks(), so that they survive a
+// guest memory fault's siglongjmp
+static __thread uint64_t run_start_ns;
+static __thread uint64_t run_start_other_ns;
+
+static uint64_t other_tier_ns(void) {
+  return STATS_READ(tier_ns[STATS_TIER_BUILD]) + STATS_READ(tier_ns[STATS_TIER_SYSCALL]);
+}
+
+static void stats_run_begin(void) {
+  STATS_ATTACH();
+  run_start_ns = stats_now_ns();
+  run_start_other_ns = other_tier_ns();
+}
+
+// Whatever run_blocks() spent that wasn't building blocks or in syscalls was
+// spent executing blocks
+static void stats_run_end(void) {
+  uint64_t elapsed = stats_now_ns() - run_start_ns;
+  uint64_t other = other_tier_ns() - run_start_other_ns;
+  STATS_ADD(tier_ns[STATS_TIER_BLOCKS], (elapsed > other) ? elapsed - other : 0);
+}
+#else
+#define stats_run_begin() ((void)0)
+#define stats_run_end() ((void)0)
+#endif
+
+// Runs blocks until an error occurs, or until at least budget instructions
+// have retired. The budget is only checked at block exits. Guest memory faults
+// are caught by the host MMU and arrive back here, where they are reported
+// precisely at the faulting instruction.
+int run_blocks(cpu_x86_64_t* cpu, uint64_t budget, bool trace) {
+  sigjmp_buf recovery;
+  int ret;
+  int fault = sigsetjmp(recovery, 0);
+  if (fault == MEMORY_FAULT_CODE_WRITE) {
+    // Still set up as it was, and carrying on from the store
+    ret = finish_code_write(cpu);
+    if (ret != 0) goto stop;
+    goto next_block;
+  }
+  if (fault != 0) {
+    memory_fault_recovery = NULL;
+    fpu_leave(cpu);
+    stats_run_end();
+    profile_detach();
+    if (current_instr) {
+      cpu->rip = current_instr->address;
+    }
+    current_instr = NULL;
+    current_block = NULL;
+    return -fault;
+  }
+  memory_fault_recovery = &recovery;
+
+  cpu->budget_end = (budget == RUN_UNLIMITED) ? RUN_UNLIMITED : cpu->instructions_retired + budget;
+  cpu->next_event = profile_next_event(cpu);
+  if (__atomic_load_n(&cpu->exit_requested, __ATOMIC_SEQ_CST)) {
+    // Asked before next_event was set just now, so stop at the first block exit
+    cpu->next_event = 0;
+  }
+  profile_attach(cpu);
+  watch_attach(cpu);
+  // The stats clock reads are host code, so they bracket the guest's settings
+  stats_run_begin();
+  fpu_enter(cpu);
+
+  while (1) {
+    if (trace) {
+      printf("[0x%016lx]\n", cpu->rip);
+    }
+
+    current_instr = NULL;
+    current_block = NULL;
+    ret = execute_block(cpu);
+    if (ret != 0) break;
+
+  next_block:
+    if (cpu->instructions_retired >= cpu->next_event) {
+      if (__atomic_load_n(&cpu->exit_requested, __ATOMIC_SEQ_CST)) {
+        ret = RUN_GUEST_EXITED;
+        break;
+      }
+      if (cpu->instructions_retired >= cpu->budget_end) {
+        ret = RUN_BUDGET_EXHAUSTED;
+        break;
+      }
+
+      // Otherwise this is an instruction count profiling sample point
+      profile_sample(cpu);
+      cpu->next_event = profile_next_event(cpu);
+    }
+  }
+
+stop:
+  current_block = NULL;
+  fpu_leave(cpu);
+  stats_run_end();
+  profile_detach();
+  memory_fault_recovery = NULL;
+  return ret;
+}
+
+// Executes the single instruction at rip, outside of any block, for stopping at
+// an exact instruction count (run_blocks() can only get to within a block of
+// one). Returns as execute_block() would.
+int step_instruction(cpu_x86_64_t* cpu) {
+  sigjmp_buf recovery;
+  int fault = sigsetjmp(recovery, 0);
+  if (fault != 0) {
+    memory_fault_recovery = NULL;
+    fpu_leave(cpu);
+    cpu->rip = current_instr->address;
+    current_instr = NULL;
+    return -fault;
+  }
+  memory_fault_recovery = &recovery;
+  current_block = NULL;
+  watch_attach(cpu);
+  fpu_enter(cpu);
+
+  x86_64_instr_t instr = {0};
+  int ret = decode_at_address(cpu->rip, cpu, &instr);
+  if (ret == 0) {
+    current_instr = &instr;
+    ret = execute_instr(cpu, &instr);
+    if (ret != 0) {
+      cpu->rip = instr.address;
+    } else {
+      cpu->instructions_retired += 1;
+    }
+  }
+
+  current_instr = NULL;
+  fpu_leave(cpu);
+  memory_fault_recovery = NULL;
+  return ret;
+}
+
+// The guest address of the instruction this thread is executing, or 0 if it
+// isn't executing one (e.g. it's decoding)
+uint64_t current_instr_address(void) {
+  return current_instr ? current_instr->address : 0;
+}
+
+int free_blocks(void) {
+  for (size_t i = 0; i < BLOCK_CACHE_BUCKETS; i++) {
+    block_t* block = block_cache[i];
+    while (block) {
+      block_t* temp = block;
+      block = block->next;
+      free_block(temp);
+    }
+    block_cache[i] = NULL;
+  }
+
+  while (retired_blocks) {
+    block_t* temp = retired_blocks;
+    retired_blocks = retired_blocks->retired_next;
+    free_block(temp);
+  }
+  return 0;
+}
+
+void print_block_stats(FILE* fp) {
+  fprintf(fp, "Blocks built: %lu\n", stats.blocks_built);
+  fprintf(fp, "Blocks invalidated: %lu\n", stats.blocks_invalidated);
+  fprintf(fp, "Fused instructions (in cached blocks):\n");
+  for (size_t i = 0; i < FUSE_NUM_KINDS; i++) {
+    fprintf(fp, "  %-24s %lu\n", fuse_names[i], stats.fused[i]);
+  }
+}
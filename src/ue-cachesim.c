@@ -0,0 +1,594 @@
+#include <pthread.h>
+#include "ue-cachesim.h"
+#include "ue-plugin.h"
+#include "cpu.h"
+
+#define PC_TABLE_INITIAL_CAPACITY  (1024)
+#define UNKNOWN_SYMBOL_NAME        "[unknown]"
+
+// One level of set-associative cache (or the TLB). Ways hold the line number
+// plus one, so that 0 is an empty way, and the time they were last used.
+typedef struct cache_level_t {
+  uint64_t* lines;
+  uint64_t* last_used;
+  uint64_t set_mask;
+  uint32_t ways;
+  uint64_t clock;
+} cache_level_t;
+
+typedef struct pc_stats_t {
+  uint64_t pc; // 0 for an empty slot
+  uint64_t accesses;
+  uint64_t l1_misses;
+  uint64_t l2_misses;
+  uint64_t llc_misses;
+  uint64_t tlb_misses;
+  uint64_t branches;
+  uint64_t mispredicts;
+} pc_stats_t;
+
+// Buffered by each thread, as structures of arrays so that the batch passes
+// over them are straight loops
+typedef struct sim_buffer_t {
+  uint64_t access_pc[CACHESIM_BUFFER_ENTRIES];
+  uint64_t access_address[CACHESIM_BUFFER_ENTRIES];
+  uint32_t access_size[CACHESIM_BUFFER_ENTRIES];
+  size_t num_accesses;
+  uint64_t branch_pc[CACHESIM_BUFFER_ENTRIES];
+  uint8_t branch_taken[CACHESIM_BUFFER_ENTRIES];
+  size_t num_branches;
+  struct sim_buffer_t* next;
+} sim_buffer_t;
+
+static cachesim_config_t config;
+static uint32_t line_shift;
+
+// The models and per-pc results are shared by every guest thread, as the LLC
+// would be, and only touched with sim_lock held
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_level_t l1, l2, llc, tlb;
+static uint8_t* predictor = NULL;
+static uint64_t predictor_mask;
+static uint64_t history;
+static uint64_t history_mask;
+
+static pc_stats_t* pc_table = NULL;
+static size_t pc_table_capacity = 0;
+static size_t pc_table_count = 0;
+
+// Batch scratch space, also under sim_lock
+static uint64_t first_lines[CACHESIM_BUFFER_ENTRIES];
+static uint64_t last_lines[CACHESIM_BUFFER_ENTRIES];
+static uint64_t pages[CACHESIM_BUFFER_ENTRIES];
+
+static sim_buffer_t* buffers = NULL;
+static __thread sim_buffer_t* thread_buffer = NULL;
+
+static const cachesim_config_t default_config = {
+  .l1 = { 32 * 1024, 8 },
+  .l2 = { 1024 * 1024, 16 },
+  .llc = { 8 * 1024 * 1024, 16 },
+  .tlb = { 64, 4 },
+  .line_size = 64,
+  .predictor_bits = 14,
+  .history_bits = 12,
+};
+
+static bool is_power_of_two(uint64_t value) {
+  return value != 0 && (value & (value - 1)) == 0;
+}
+
+static uint32_t log2_of(uint64_t value) {
+  uint32_t result = 0;
+  while (value > 1) {
+    value >>= 1;
+    result++;
+  }
+  return result;
+}
+
+// A byte count with an optional k or m suffix
+static int parse_size(const char* text, char** end_out, uint64_t* size_out) {
+  uint64_t size = strtoull(text, end_out, 0);
+  if (*end_out == text) {
+    return -CACHESIM_ERR_CONFIG;
+  }
+  if (**end_out == 'k' || **end_out == 'K') {
+    size *= 1024;
+    (*end_out)++;
+  } else if (**end_out == 'm' || **end_out == 'M') {
+    size *= 1024 * 1024;
+    (*end_out)++;
+  }
+  *size_out = size;
+  return 0;
+}
+
+// size:ways
+static int parse_level(const char* text, cachesim_level_config_t* level_out) {
+  char* end;
+  uint64_t size;
+  if (parse_size(text, &end, &size) != 0 || *end != ':') {
+    return -CACHESIM_ERR_CONFIG;
+  }
+  text = end + 1;
+  uint64_t ways = strtoull(text, &end, 0);
+  if (end == text || *end != '\0') {
+    return -CACHESIM_ERR_CONFIG;
+  }
+  *level_out = (cachesim_level_config_t){ size, ways };
+  return 0;
+}
+
+int cachesim_parse_config(const char* spec, cachesim_config_t* config_out) {
+  *config_out = default_config;
+  if (!spec || strcmp(spec, "default") == 0) {
+    return 0;
+  }
+
+  char* copy = strdup(spec);
+  if (!copy) {
+    return -CACHESIM_ERR_MALLOC;
+  }
+
+  int ret = 0;
+  char* saveptr;
+  for (char* item = strtok_r(copy, ",", &saveptr); item && ret == 0; item = strtok_r(NULL, ",", &saveptr)) {
+    char* value = strchr(item, '=');
+    if (!value) {
+      ret = -CACHESIM_ERR_CONFIG;
+      break;
+    }
+    *value++ = '\0';
+
+    char* end;
+    if (strcmp(item, "l1") == 0) {
+      ret = parse_level(value, &config_out->l1);
+    } else if (strcmp(item, "l2") == 0) {
+      ret = parse_level(value, &config_out->l2);
+    } else if (strcmp(item, "llc") == 0) {
+      ret = parse_level(value, &config_out->llc);
+    } else if (strcmp(item, "tlb") == 0) {
+      ret = parse_level(value, &config_out->tlb);
+    } else if (strcmp(item, "line") == 0) {
+      config_out->line_size = strtoul(value, &end, 0);
+      ret = (end != value && *end == '\0') ? 0 : -CACHESIM_ERR_CONFIG;
+    } else if (strcmp(item, "bp") == 0) {
+      config_out->predictor_bits = strtoul(value, &end, 0);
+      if (end != value && *end == ':') {
+        value = end + 1;
+        config_out->history_bits = strtoul(value, &end, 0);
+      }
+      ret = (end != value && *end == '\0') ? 0 : -CACHESIM_ERR_CONFIG;
+    } else {
+      ret = -CACHESIM_ERR_CONFIG;
+    }
+  }
+
+  free(copy);
+  return ret;
+}
+
+static int init_level(cache_level_t* level, const cachesim_level_config_t* level_config, uint64_t entry_size) {
+  if (level_config->ways == 0 || level_config->size % ((uint64_t)level_config->ways * entry_size) != 0) {
+    return -CACHESIM_ERR_GEOMETRY;
+  }
+  uint64_t num_sets = level_config->size / ((uint64_t)level_config->ways * entry_size);
+  if (!is_power_of_two(num_sets)) {
+    return -CACHESIM_ERR_GEOMETRY;
+  }
+
+  level->lines = calloc(num_sets * level_config->ways, sizeof(uint64_t));
+  level->last_used = calloc(num_sets * level_config->ways, sizeof(uint64_t));
+  if (!level->lines || !level->last_used) {
+    return -CACHESIM_ERR_MALLOC;
+  }
+  level->set_mask = num_sets - 1;
+  level->ways = level_config->ways;
+  level->clock = 0;
+  return 0;
+}
+
+static void free_level(cache_level_t* level) {
+  free(level->lines);
+  free(level->last_used);
+  *level = (cache_level_t){0};
+}
+
+// Returns whether line was present, and makes it present either way. A miss
+// replaces the least recently used way (empty ways have never been used).
+static bool cache_access(cache_level_t* level, uint64_t line) {
+  size_t base = (line & level->set_mask) * level->ways;
+  uint64_t* lines = &level->lines[base];
+  uint64_t* last_used = &level->last_used[base];
+  uint64_t tag = line + 1;
+
+  uint32_t victim = 0;
+  for (uint32_t way = 0; way < level->ways; way++) {
+    if (lines[way] == tag) {
+      last_used[way] = ++level->clock;
+      return true;
+    }
+    if (last_used[way] < last_used[victim]) {
+      victim = way;
+    }
+  }
+
+  lines[victim] = tag;
+  last_used[victim] = ++level->clock;
+  return false;
+}
+
+// gshare: the pc hashed with the global history picks a 2-bit counter
+static bool predict_branch(uint64_t pc, bool taken) {
+  uint8_t* counter = &predictor[(pc ^ history) & predictor_mask];
+  bool predicted = (*counter >= 2);
+
+  if (taken && *counter < 3) {
+    (*counter)++;
+  } else if (!taken && *counter > 0) {
+    (*counter)--;
+  }
+  history = ((history << 1) | taken) & history_mask;
+
+  return predicted == taken;
+}
+
+static uint64_t hash_pc(uint64_t pc) {
+  return pc * 0x9e3779b97f4a7c15ULL;
+}
+
+static bool grow_pc_table(void) {
+  size_t capacity = pc_table_capacity ? pc_table_capacity * 2 : PC_TABLE_INITIAL_CAPACITY;
+  pc_stats_t* table = calloc(capacity, sizeof(pc_stats_t));
+  if (!table) {
+    return false;
+  }
+
+  for (size_t i = 0; i < pc_table_capacity; i++) {
+    if (pc_table[i].pc == 0) continue;
+    size_t slot = hash_pc(pc_table[i].pc) & (capacity - 1);
+    while (table[slot].pc != 0) {
+      slot = (slot + 1) & (capacity - 1);
+    }
+    table[slot] = pc_table[i];
+  }
+
+  free(pc_table);
+  pc_table = table;
+  pc_table_capacity = capacity;
+  return true;
+}
+
+// Open addressing, kept at most half full. Returns NULL if it couldn't grow.
+static pc_stats_t* pc_stats(uint64_t pc) {
+  if ((pc_table_count + 1) * 2 > pc_table_capacity && !grow_pc_table()) {
+    return NULL;
+  }
+
+  size_t slot = hash_pc(pc) & (pc_table_capacity - 1);
+  while (pc_table[slot].pc != pc) {
+    if (pc_table[slot].pc == 0) {
+      pc_table[slot].pc = pc;
+      pc_table_count++;
+      break;
+    }
+    slot = (slot + 1) & (pc_table_capacity - 1);
+  }
+  return &pc_table[slot];
+}
+
+// Accesses are mostly from the same few pcs in a row, so the last lookup is
+// reused. It's always the most recent pc_stats() result, so it's never stale
+// after the table grows.
+static pc_stats_t* last_stats = NULL;
+
+static pc_stats_t* cached_pc_stats(uint64_t pc) {
+  if (!last_stats || last_stats->pc != pc) {
+    last_stats = pc_stats(pc);
+  }
+  return last_stats;
+}
+
+static void simulate_accesses(const sim_buffer_t* buffer) {
+  size_t count = buffer->num_accesses;
+
+  // Everything that doesn't depend on the cache state is worked out for the
+  // whole batch first, in loops with no dependencies between iterations
+  for (size_t i = 0; i < count; i++) {
+    uint64_t address = buffer->access_address[i];
+    uint64_t end = address + buffer->access_size[i] - 1;
+    first_lines[i] = address >> line_shift;
+    last_lines[i] = end >> line_shift;
+    pages[i] = address >> CACHESIM_PAGE_SHIFT;
+  }
+
+  // Then the models, in order. An access which straddles lines touches each.
+  for (size_t i = 0; i < count; i++) {
+    pc_stats_t* stats = cached_pc_stats(buffer->access_pc[i]);
+    if (!stats) continue;
+
+    stats->accesses++;
+    if (!cache_access(&tlb, pages[i])) {
+      stats->tlb_misses++;
+    }
+    for (uint64_t line = first_lines[i]; line <= last_lines[i]; line++) {
+      if (cache_access(&l1, line)) continue;
+      stats->l1_misses++;
+      if (cache_access(&l2, line)) continue;
+      stats->l2_misses++;
+      if (cache_access(&llc, line)) continue;
+      stats->llc_misses++;
+    }
+  }
+}
+
+static void simulate_branches(const sim_buffer_t* buffer) {
+  for (size_t i = 0; i < buffer->num_branches; i++) {
+    pc_stats_t* stats = cached_pc_stats(buffer->branch_pc[i]);
+    bool correct = predict_branch(buffer->branch_pc[i], buffer->branch_taken[i]);
+    if (!stats) continue;
+
+    stats->branches++;
+    if (!correct) {
+      stats->mispredicts++;
+    }
+  }
+}
+
+static void flush_buffer(sim_buffer_t* buffer) {
+  if (buffer->num_accesses == 0 && buffer->num_branches == 0) return;
+
+  pthread_mutex_lock(&sim_lock);
+  simulate_accesses(buffer);
+  simulate_branches(buffer);
+  pthread_mutex_unlock(&sim_lock);
+
+  buffer->num_accesses = 0;
+  buffer->num_branches = 0;
+}
+
+static sim_buffer_t* get_thread_buffer(void) {
+  if (thread_buffer) {
+    return thread_buffer;
+  }
+
+  sim_buffer_t* buffer = calloc(1, sizeof(sim_buffer_t));
+  if (!buffer) {
+    return NULL;
+  }
+  pthread_mutex_lock(&sim_lock);
+  buffer->next = buffers;
+  buffers = buffer;
+  pthread_mutex_unlock(&sim_lock);
+
+  thread_buffer = buffer;
+  return buffer;
+}
+
+// Instrumentation callbacks
+
+static void on_memory_access(cpu_x86_64_t* cpu, uint64_t address, uint64_t mem_address, uint32_t size, bool is_write, void* userdata) {
+  sim_buffer_t* buffer = get_thread_buffer();
+  if (!buffer) return;
+
+  size_t i = buffer->num_accesses;
+  buffer->access_pc[i] = address;
+  buffer->access_address[i] = mem_address;
+  buffer->access_size[i] = size ? size : 1;
+  buffer->num_accesses = i + 1;
+  if (buffer->num_accesses == CACHESIM_BUFFER_ENTRIES) {
+    flush_buffer(buffer);
+  }
+}
+
+// Runs before the jcc, so the flags it tests are already set
+static void on_branch(cpu_x86_64_t* cpu, uint64_t address, void* userdata) {
+  sim_buffer_t* buffer = get_thread_buffer();
+  if (!buffer) return;
+
+  size_t i = buffer->num_branches;
+  buffer->branch_pc[i] = address;
+  buffer->branch_taken[i] = condition_met(cpu, (uint8_t)(uintptr_t)userdata);
+  buffer->num_branches = i + 1;
+  if (buffer->num_branches == CACHESIM_BUFFER_ENTRIES) {
+    flush_buffer(buffer);
+  }
+}
+
+// Every guest thread leaves through a syscall, so nothing is left buffered by
+// the time the guest has exited
+static void on_syscall(cpu_x86_64_t* cpu, uint64_t number, void* userdata) {
+  if (thread_buffer) {
+    flush_buffer(thread_buffer);
+  }
+}
+
+static void on_translate(ue_plugin_id_t id, ue_block_t* block, void* userdata) {
+  size_t num_instrs = ue_block_num_instrs(block);
+  for (size_t i = 0; i < num_instrs; i++) {
+    const x86_64_instr_t* instr = ue_block_instr(block, i);
+    if (instr->type == JCC) {
+      ue_block_instr_on_exec(block, i, on_branch, (void*)(uintptr_t)instr->cc);
+    } else if (ue_instr_accesses_memory(instr)) {
+      ue_block_instr_on_mem(block, i, on_memory_access, NULL);
+    }
+  }
+}
+
+static int install(ue_plugin_id_t id, const char* args) {
+  ue_plugin_on_translate(id, on_translate, NULL);
+  ue_plugin_on_syscall(id, on_syscall, NULL);
+  return 0;
+}
+
+int cachesim_start(const cachesim_config_t* cachesim_config) {
+  config = *cachesim_config;
+  if (!is_power_of_two(config.line_size)
+      || config.predictor_bits == 0 || config.predictor_bits > 30
+      || config.history_bits > config.predictor_bits) {
+    return -CACHESIM_ERR_GEOMETRY;
+  }
+  line_shift = log2_of(config.line_size);
+
+  int ret;
+  if ((ret = init_level(&l1, &config.l1, config.line_size)) != 0
+      || (ret = init_level(&l2, &config.l2, config.line_size)) != 0
+      || (ret = init_level(&llc, &config.llc, config.line_size)) != 0
+      || (ret = init_level(&tlb, &config.tlb, 1)) != 0) {
+    cachesim_free();
+    return ret;
+  }
+
+  predictor_mask = (1ULL << config.predictor_bits) - 1;
+  history_mask = (1ULL << config.history_bits) - 1;
+  history = 0;
+  predictor = malloc(predictor_mask + 1);
+  if (!predictor) {
+    cachesim_free();
+    return -CACHESIM_ERR_MALLOC;
+  }
+  // Weakly taken
+  memset(predictor, 2, predictor_mask + 1);
+
+  if (plugin_install_builtin(install, NULL) != 0) {
+    cachesim_free();
+    return -CACHESIM_ERR_PLUGIN;
+  }
+  return 0;
+}
+
+typedef struct symbol_stats_t {
+  const char* name;
+  pc_stats_t totals; // pc unused
+} symbol_stats_t;
+
+static void add_stats(pc_stats_t* totals, const pc_stats_t* stats) {
+  totals->accesses += stats->accesses;
+  totals->l1_misses += stats->l1_misses;
+  totals->l2_misses += stats->l2_misses;
+  totals->llc_misses += stats->llc_misses;
+  totals->tlb_misses += stats->tlb_misses;
+  totals->branches += stats->branches;
+  totals->mispredicts += stats->mispredicts;
+}
+
+// Most L1 misses first, then most mispredictions
+static int compare_symbol_stats(const void* a, const void* b) {
+  const pc_stats_t* x = &((const symbol_stats_t*)a)->totals;
+  const pc_stats_t* y = &((const symbol_stats_t*)b)->totals;
+  if (x->l1_misses != y->l1_misses) {
+    return (x->l1_misses < y->l1_misses) ? 1 : -1;
+  }
+  if (x->mispredicts != y->mispredicts) {
+    return (x->mispredicts < y->mispredicts) ? 1 : -1;
+  }
+  return 0;
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+  return whole ? (100.0 * part / whole) : 0.0;
+}
+
+// Miss rates are local: L2 misses out of L1 misses, and LLC out of L2
+static void print_stats_line(FILE* fp, const char* name, const pc_stats_t* stats) {
+  fprintf(fp, "  %-32s %12lu %7.2f%% %7.2f%% %7.2f%% %7.2f%% %12lu %7.2f%%\n", name,
+          stats->accesses,
+          percent(stats->l1_misses, stats->accesses),
+          percent(stats->l2_misses, stats->l1_misses),
+          percent(stats->llc_misses, stats->l2_misses),
+          percent(stats->tlb_misses, stats->accesses),
+          stats->branches,
+          percent(stats->mispredicts, stats->branches));
+}
+
+void cachesim_report(FILE* fp, const elf_symtab_t* symtab) {
+  if (!predictor) return;
+
+  if (thread_buffer) {
+    flush_buffer(thread_buffer);
+  }
+
+  fprintf(fp, "Cache simulation: L1 %luK %u-way, L2 %luK %u-way, LLC %luK %u-way, %u byte lines, "
+          "TLB %lu entries %u-way, gshare 2^%u counters with %u history bits\n",
+          config.l1.size / 1024, config.l1.ways, config.l2.size / 1024, config.l2.ways,
+          config.llc.size / 1024, config.llc.ways, config.line_size,
+          config.tlb.size, config.tlb.ways, config.predictor_bits, config.history_bits);
+
+  // One entry per symbol, and a last one for everything outside them
+  size_t num_entries = symtab->num_symbols + 1;
+  symbol_stats_t* entries = calloc(num_entries, sizeof(symbol_stats_t));
+  if (!entries) {
+    fprintf(fp, "Cache simulation report failed: %s\n", cachesim_err_message(-CACHESIM_ERR_MALLOC));
+    return;
+  }
+
+  pc_stats_t totals = {0};
+  entries[num_entries - 1].name = UNKNOWN_SYMBOL_NAME;
+  for (size_t i = 0; i < pc_table_capacity; i++) {
+    const pc_stats_t* stats = &pc_table[i];
+    if (stats->pc == 0) continue;
+
+    const elf_symbol_t* symbol = elf_find_function(symtab, stats->pc);
+    symbol_stats_t* entry = symbol ? &entries[symbol - symtab->symbols] : &entries[num_entries - 1];
+    if (symbol) {
+      entry->name = symbol->name;
+    }
+    add_stats(&entry->totals, stats);
+    add_stats(&totals, stats);
+  }
+
+  qsort(entries, num_entries, sizeof(symbol_stats_t), compare_symbol_stats);
+
+  fprintf(fp, "  %-32s %12s %8s %8s %8s %8s %12s %8s\n",
+          "symbol", "accesses", "L1 miss", "L2 miss", "LLC miss", "TLB miss", "branches", "mispred");
+  print_stats_line(fp, "(total)", &totals);
+  for (size_t i = 0; i < num_entries; i++) {
+    const pc_stats_t* stats = &entries[i].totals;
+    if (stats->accesses == 0 && stats->branches == 0) continue;
+    print_stats_line(fp, entries[i].name, stats);
+  }
+
+  free(entries);
+}
+
+void cachesim_free(void) {
+  free_level(&l1);
+  free_level(&l2);
+  free_level(&llc);
+  free_level(&tlb);
+  free(predictor);
+  predictor = NULL;
+
+  free(pc_table);
+  pc_table = NULL;
+  pc_table_capacity = 0;
+  pc_table_count = 0;
+  last_stats = NULL;
+
+  while (buffers) {
+    sim_buffer_t* next = buffers->next;
+    free(buffers);
+    buffers = next;
+  }
+  thread_buffer = NULL;
+}
+
+static char* cachesim_errors[] = {
+  "Unknown",
+  "Invalid cache simulation configuration",
+  "Cache sizes must give a power of two number of sets",
+  "Couldn't allocate memory for the cache simulation",
+  "Couldn't install the cache simulation",
+};
+
+char* cachesim_err_message(int errorIndex) {
+  if (errorIndex < 0) {
+    errorIndex *= -1;
+  }
+
+  if (errorIndex >= CACHESIM_ERR_NUM_ERRORS) {
+    return cachesim_errors[CACHESIM_ERR_UNKNOWN];
+  }
+  return cachesim_errors[errorIndex];
+}
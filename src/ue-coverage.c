@@ -0,0 +1,186 @@
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "ue-coverage.h"
+#include "ue-block.h"
+#include "ue-memory.h"
+
+uint8_t* coverage_map = NULL;
+uint32_t coverage_map_mask = 0;
+coverage_new_blocks_t* coverage_new_blocks = NULL;
+
+static bool under_fuzzer = false;
+
+// Enables coverage if the fuzzer has handed us a shared memory bitmap, or with
+// a private one if force is set (for checking coverage outside of a fuzzer)
+int coverage_init(bool force) {
+  const char* shm_id = getenv(COVERAGE_SHM_ENV);
+  if (!shm_id && !force) {
+    return 0;
+  }
+
+  size_t map_size = COVERAGE_MAP_SIZE_DEFAULT;
+  const char* map_size_str = getenv(COVERAGE_MAP_SIZE_ENV);
+  if (map_size_str) {
+    map_size = strtoull(map_size_str, NULL, 0);
+    // Edge indices are masked, so the size has to be a power of two
+    if (map_size == 0 || (map_size & (map_size - 1)) != 0) {
+      return -COVERAGE_ERR_MAP_SIZE;
+    }
+  }
+
+  uint8_t* map;
+  if (shm_id) {
+    map = shmat(atoi(shm_id), NULL, 0);
+    if (map == (void*)-1) {
+      return -COVERAGE_ERR_SHM;
+    }
+    under_fuzzer = true;
+  } else {
+    map = calloc(map_size, 1);
+    if (!map) {
+      return -COVERAGE_ERR_MALLOC;
+    }
+  }
+
+  coverage_map_mask = map_size - 1;
+  coverage_map = map;
+  return 0;
+}
+
+bool coverage_under_fuzzer(void) {
+  return under_fuzzer;
+}
+
+// 64-bit finalizer from MurmurHash3, so that neighbouring blocks get unrelated IDs
+uint32_t coverage_block_id(uint64_t address) {
+  uint64_t x = address;
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return (uint32_t)x;
+}
+
+// Builds the blocks the last child reported, as long as they're still in the
+// parent's executable memory (not, say, in memory the child mapped itself)
+static void build_new_blocks(void) {
+  // Decoding doesn't touch the cpu state, so a scratch one will do
+  cpu_x86_64_t cpu = {0};
+
+  uint32_t count = coverage_new_blocks->count;
+  if (count > COVERAGE_MAX_NEW_BLOCKS) {
+    count = COVERAGE_MAX_NEW_BLOCKS;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    uint64_t address = coverage_new_blocks->addresses[i];
+    block_t* block;
+    if (is_executable_address(address) && !block_lookup(address)) {
+      block_build(&cpu, address, BLOCK_TIER_OPTIMIZED, &block);
+    }
+  }
+}
+
+// The AFL forkserver (the original protocol, which AFL++ still accepts). Called
+// once everything that's worth sharing between runs has been set up (memory
+// loaded, blocks pre-decoded or loaded from the translation cache), so every
+// child starts from that state for the cost of a fork. Blocks each child builds
+// are built in the parent afterwards, so the children keep getting warmer.
+//
+// Returns 1 in each forked child, which should go on to run the guest, or 0
+// straight away if there's no fuzzer on the other end of the pipes. The parent
+// never returns.
+int coverage_forkserver(void) {
+  if (!coverage_under_fuzzer()) return 0;
+
+  uint32_t hello = 0;
+  if (write(FORKSRV_FD + 1, &hello, sizeof(hello)) != sizeof(hello)) {
+    return 0;
+  }
+
+  // Without it, children just don't report back
+  coverage_new_blocks = mmap(NULL, sizeof(coverage_new_blocks_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (coverage_new_blocks == MAP_FAILED) {
+    coverage_new_blocks = NULL;
+  }
+
+  while (true) {
+    uint32_t was_killed;
+    if (read(FORKSRV_FD, &was_killed, sizeof(was_killed)) != sizeof(was_killed)) {
+      // The fuzzer has gone away
+      _exit(0);
+    }
+
+    if (coverage_new_blocks) {
+      coverage_new_blocks->count = 0;
+    }
+
+    pid_t child = fork();
+    if (child < 0) {
+      _exit(1);
+    }
+
+    if (child == 0) {
+      close(FORKSRV_FD);
+      close(FORKSRV_FD + 1);
+      return 1;
+    }
+
+    uint32_t child_pid = child;
+    if (write(FORKSRV_FD + 1, &child_pid, sizeof(child_pid)) != sizeof(child_pid)) {
+      _exit(1);
+    }
+
+    int status;
+    if (waitpid(child, &status, 0) < 0) {
+      _exit(1);
+    }
+
+    uint32_t status_out = status;
+    if (write(FORKSRV_FD + 1, &status_out, sizeof(status_out)) != sizeof(status_out)) {
+      _exit(1);
+    }
+
+    // While the fuzzer gets on with the result
+    if (coverage_new_blocks) {
+      build_new_blocks();
+    }
+  }
+}
+
+// For running the guest again in-process: the first block entered afterwards
+// starts a fresh edge chain, as it would in a new process. The bitmap itself
+// belongs to the fuzzer, which clears it between runs.
+void coverage_reset(cpu_x86_64_t* cpu) {
+  cpu->coverage_prev = 0;
+}
+
+size_t coverage_num_edges(void) {
+  if (!coverage_map) return 0;
+
+  size_t num_edges = 0;
+  for (size_t i = 0; i <= coverage_map_mask; i++) {
+    num_edges += coverage_map[i] != 0;
+  }
+  return num_edges;
+}
+
+static char* coverage_errors[] = {
+  "Unknown",
+  "Unable to attach the fuzzer's shared memory bitmap",
+  "The coverage map size must be a power of two",
+  "Unable to allocate the coverage map",
+};
+
+char* coverage_err_message(int errorIndex) {
+  if (errorIndex < 0) {
+    errorIndex *= -1;
+  }
+
+  if (errorIndex >= COVERAGE_ERR_NUM_ERRORS) {
+    return coverage_errors[COVERAGE_ERR_UNKNOWN];
+  }
+  return coverage_errors[errorIndex];
+}
@@ -43,9 +43,10 @@ int elf_parse_header(FILE* fp, Elf64_Ehdr* header) {
   // Skip over reserved padding
   ptr += 7;
 
-  // Check the file type is executable
+  // Check the file type is executable. Position independent executables,
+  // shared libraries and the dynamic linker are all ET_DYN.
   uint16_t elf_type = READ_U16(ptr);
-  if (elf_type != ET_EXEC) {
+  if (elf_type != ET_EXEC && elf_type != ET_DYN) {
     return -ELF_ERR_EXECUTABLE;
   }
   ptr += 2;
@@ -94,6 +95,139 @@ int elf_parse_program_headers(FILE* fp, const Elf64_Ehdr* header, Elf64_Phdr* ph
   return 0;
 }
 
+// Reads sh_size bytes of a section into a newly allocated buffer
+static int read_section(FILE* fp, const Elf64_Shdr* shdr, void** buf_out) {
+  *buf_out = malloc(shdr->sh_size);
+  if (!*buf_out) {
+    return -ELF_ERR_MALLOC;
+  }
+
+  if (fseek(fp, shdr->sh_offset, SEEK_SET) != 0 || fread(*buf_out, shdr->sh_size, 1, fp) != 1) {
+    free(*buf_out);
+    *buf_out = NULL;
+    return -ELF_ERR_BAD_SHDR;
+  }
+
+  return 0;
+}
+
+static int compare_symbol_addresses(const void* a, const void* b) {
+  const elf_symbol_t* sym_a = a;
+  const elf_symbol_t* sym_b = b;
+  if (sym_a->address < sym_b->address) return -1;
+  if (sym_a->address > sym_b->address) return 1;
+  return 0;
+}
+
+// Symbol addresses are moved by bias, the load bias of a position independent
+// executable (see ue-loader.h)
+int elf_parse_symbols(FILE* fp, const Elf64_Ehdr* header, uint64_t bias, elf_symtab_t* symtab_out) {
+  memset(symtab_out, 0, sizeof(elf_symtab_t));
+
+  if (header->e_shoff == 0 || header->e_shentsize != sizeof(Elf64_Shdr)) {
+    return -ELF_ERR_NO_SYMTAB;
+  }
+
+  // Find the (first) symbol table section
+  Elf64_Shdr symtab_shdr;
+  bool found = false;
+  for (size_t i = 0; i < header->e_shnum; i++) {
+    if (fseek(fp, header->e_shoff + (header->e_shentsize * i), SEEK_SET) != 0) {
+      return -ELF_ERR_BAD_SHDR;
+    }
+    if (fread(&symtab_shdr, sizeof(Elf64_Shdr), 1, fp) != 1) {
+      return -ELF_ERR_BAD_SHDR;
+    }
+    if (symtab_shdr.sh_type == SHT_SYMTAB) {
+      found = true;
+      break;
+    }
+  }
+
+  if (!found || symtab_shdr.sh_link >= header->e_shnum) {
+    return -ELF_ERR_NO_SYMTAB;
+  }
+
+  // The associated string table is given by sh_link
+  Elf64_Shdr strtab_shdr;
+  if (fseek(fp, header->e_shoff + (header->e_shentsize * symtab_shdr.sh_link), SEEK_SET) != 0) {
+    return -ELF_ERR_BAD_SHDR;
+  }
+  if (fread(&strtab_shdr, sizeof(Elf64_Shdr), 1, fp) != 1) {
+    return -ELF_ERR_BAD_SHDR;
+  }
+
+  Elf64_Sym* raw_symbols;
+  int ret = read_section(fp, &symtab_shdr, (void**)&raw_symbols);
+  if (ret != 0) {
+    return ret;
+  }
+
+  ret = read_section(fp, &strtab_shdr, (void**)&symtab_out->strtab);
+  if (ret != 0) {
+    free(raw_symbols);
+    return ret;
+  }
+
+  size_t num_raw = symtab_shdr.sh_size / sizeof(Elf64_Sym);
+  symtab_out->symbols = calloc(num_raw, sizeof(elf_symbol_t));
+  if (!symtab_out->symbols) {
+    free(raw_symbols);
+    elf_free_symbols(symtab_out);
+    return -ELF_ERR_MALLOC;
+  }
+
+  // Only keep defined symbols with an address
+  for (size_t i = 0; i < num_raw; i++) {
+    Elf64_Sym* sym = &raw_symbols[i];
+    if (sym->st_shndx == SHN_UNDEF || sym->st_value == 0) continue;
+    if (sym->st_name >= strtab_shdr.sh_size) continue;
+
+    elf_symbol_t* out = &symtab_out->symbols[symtab_out->num_symbols++];
+    out->address = sym->st_value + bias;
+    out->size = sym->st_size;
+    out->type = ELF64_ST_TYPE(sym->st_info);
+    out->name = symtab_out->strtab + sym->st_name;
+  }
+
+  free(raw_symbols);
+
+  // Sorted by address, for elf_find_function()
+  qsort(symtab_out->symbols, symtab_out->num_symbols, sizeof(elf_symbol_t), compare_symbol_addresses);
+  return 0;
+}
+
+// Finds the function symbol containing address, or NULL if there isn't one.
+// Functions without a size are assumed to extend up to the next symbol.
+const elf_symbol_t* elf_find_function(const elf_symtab_t* symtab, uint64_t address) {
+  // Binary search for the first symbol above the address
+  size_t low = 0;
+  size_t high = symtab->num_symbols;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (symtab->symbols[mid].address <= address) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  // Then walk back to the nearest function (there may be objects or labels in between)
+  while (low > 0) {
+    const elf_symbol_t* sym = &symtab->symbols[--low];
+    if (sym->type != STT_FUNC) continue;
+    if (sym->size != 0 && address >= sym->address + sym->size) return NULL;
+    return sym;
+  }
+  return NULL;
+}
+
+void elf_free_symbols(elf_symtab_t* symtab) {
+  free(symtab->symbols);
+  free(symtab->strtab);
+  memset(symtab, 0, sizeof(elf_symtab_t));
+}
+
 static char* elf_errors[] = {
   "Unknown",
   "The ELF file was too small to read a full header",
@@ -102,9 +236,12 @@ static char* elf_errors[] = {
   "Only little-endian ELF files supported",
   "Bad version number",
   "Only System V OS ABI supported",
-  "ELF file is not an executable",
+  "ELF file is not an executable or shared object",
   "Unsupported ISA",
   "Program headers couldn't be read",
+  "Section headers couldn't be read",
+  "No symbol table found",
+  "Unable to allocate memory",
 };
 
 char* elf_err_message(int errorIndex) {
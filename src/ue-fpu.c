@@ -0,0 +1,1093 @@
+#include <immintrin.h>
+#include <signal.h>
+#include <ucontext.h>
+#include "ue-fpu.h"
+#include "ue-memory.h"
+
+#define SSE_LDMXCSR        (2) // ModRM reg field of 0F AE
+#define SSE_STMXCSR        (3)
+#define MXCSR_RESERVED     (0xffff0000)
+
+#define FCW_IM             (1 << 0)
+#define FSW_IE             (1 << 0)
+#define FSW_ES             (1 << 7)
+#define FSW_BUSY           (1 << 15)
+
+// The x87 arithmetic operations, by ModRM reg field. Each is relative to the
+// destination, so "subr" is src - dst.
+enum {
+  X87_ADD  = 0,
+  X87_MUL  = 1,
+  X87_SUB  = 4,
+  X87_SUBR = 5,
+  X87_DIV  = 6,
+  X87_DIVR = 7,
+};
+
+// Register-only forms which are identified by their whole ModRM byte
+#define X87_FCHS           (0xE0) // D9
+#define X87_FABS           (0xE1) // D9
+#define X87_FLD1           (0xE8) // D9
+#define X87_FLDZ           (0xEE) // D9
+#define X87_FSQRT          (0xFA) // D9
+#define X87_FNCLEX         (0xE2) // DB
+#define X87_FNSTSW_AX      (0xE0) // DF
+
+// Which of the four forms of an SSE opcode its mandatory prefix selects
+enum {
+  SSE_PS, // None
+  SSE_PD, // 66
+  SSE_SS, // F3
+  SSE_SD, // F2
+};
+
+// Host exception flags from a trap, which the host FPU no longer holds by the
+// time fpu_leave() runs
+static __thread uint32_t trapped_mxcsr_flags = 0;
+static __thread uint16_t trapped_fsw_flags = 0;
+
+// The host's own settings, while the guest's are switched in
+static __thread uint32_t host_mxcsr;
+static __thread uint16_t host_fcw;
+
+// The guest whose settings fpu_enter() switched in on this thread, and how
+// many fpu_host_begin() calls have switched them back out
+static __thread cpu_x86_64_t* entered_cpu = NULL;
+static __thread uint32_t host_depth = 0;
+
+// GCC doesn't implement FENV_ACCESS, so it takes floating point arithmetic to
+// depend on no state at all, and is free to evaluate an operation at compile
+// time or move it past the asm that switches MXCSR or the control word in and
+// out. Passing operands and results through an empty asm volatile pins each
+// operation down to where it's written.
+#define SSE_BARRIER(value) asm volatile("" : "+x"(value))
+#define X87_BARRIER(value) asm volatile("" : "+t"(value))
+
+static inline uint32_t get_mxcsr(void) {
+  uint32_t value;
+  asm volatile("stmxcsr %0" : "=m"(value));
+  return value;
+}
+
+static inline void set_mxcsr(uint32_t value) {
+  asm volatile("ldmxcsr %0" : : "m"(value));
+}
+
+static inline uint8_t sse_form(const x86_64_instr_t* instr) {
+  if (instr->prefixes.pF3) return SSE_SS;
+  if (instr->prefixes.pF2) return SSE_SD;
+  if (instr->prefixes.p66) return SSE_PD;
+  return SSE_PS;
+}
+
+static inline bool rex_w(const x86_64_instr_t* instr) {
+  return instr->prefixes.pREX && instr->rex.w;
+}
+
+static inline uint8_t reg_index(const x86_64_instr_t* instr) {
+  return (instr->rex.r << 3) | instr->modrm.reg;
+}
+
+static inline uint8_t rm_index(const x86_64_instr_t* instr) {
+  return (instr->rex.b << 3) | instr->modrm.rm;
+}
+
+static inline uint8_t modrm_byte(const x86_64_instr_t* instr) {
+  uint8_t byte;
+  memcpy(&byte, &instr->modrm, 1);
+  return byte;
+}
+
+bool fpu_is_sse_opcode(uint8_t opcode) {
+  switch (opcode) {
+    case 0x10: case 0x11: case 0x28: case 0x29:
+    case 0x2A: case 0x2C: case 0x2D: case 0x2E: case 0x2F:
+    case 0x51: case 0x54: case 0x55: case 0x56: case 0x57:
+    case 0x58: case 0x59: case 0x5A: case 0x5C: case 0x5D: case 0x5E: case 0x5F:
+    case 0x6E: case 0x7E: case 0xAE: case 0xD6: case 0xEF:
+      return true;
+  }
+  return false;
+}
+
+// The instruction type for each form of an SSE opcode, or -1 where that form
+// isn't supported
+static int sse_type(uint8_t opcode, uint8_t form, modrm_t modrm) {
+  bool packed = (form == SSE_PS || form == SSE_PD);
+  switch (opcode) {
+    case 0x10: case 0x11:
+      return SSE_MOV;
+    case 0x28: case 0x29:
+      return packed ? SSE_MOV : -1;
+    case 0x6E: case 0xD6:
+      return (form == SSE_PD) ? SSE_MOV : -1;
+    case 0x7E:
+      return (form == SSE_PD || form == SSE_SS) ? SSE_MOV : -1;
+    case 0x51: case 0x58: case 0x59: case 0x5C: case 0x5D: case 0x5E: case 0x5F:
+      return packed ? -1 : SSE_ARITH;
+    case 0x2A: case 0x2C: case 0x2D: case 0x5A:
+      return packed ? -1 : SSE_CVT;
+    case 0x2E: case 0x2F:
+      return packed ? SSE_COMI : -1;
+    case 0x54: case 0x55: case 0x56: case 0x57:
+      return packed ? SSE_LOGIC : -1;
+    case 0xEF:
+      return (form == SSE_PD) ? SSE_LOGIC : -1;
+    case 0xAE:
+      return (form == SSE_PS && modrm.mod != 3 && (modrm.reg == SSE_LDMXCSR || modrm.reg == SSE_STMXCSR)) ? SSE_MXCSR : -1;
+  }
+  return -1;
+}
+
+int fpu_decode_sse(const uint64_t address, uint8_t opcode, x86_64_instr_t* instr, uint64_t* offset) {
+  int ret = decode_modrm(address, instr, offset);
+  if (ret != 0) {
+    return ret;
+  }
+
+  int type = sse_type(opcode, sse_form(instr), instr->modrm);
+  if (type < 0) {
+    return -CPU_ERR_UNABLE_TO_DECODE;
+  }
+
+  instr->type = type;
+  instr->imm64 = opcode;
+  instr->size = *offset;
+  return 0;
+}
+
+// The size of an x87 instruction's memory operand, or 0 if the memory form
+// isn't supported
+static uint32_t x87_memory_size(uint8_t opcode, uint8_t reg) {
+  switch (opcode) {
+    case 0xD8: return (reg == 2 || reg == 3) ? 0 : 4; // Arithmetic, m32
+    case 0xDC: return (reg == 2 || reg == 3) ? 0 : 8; // Arithmetic, m64
+    case 0xD9:
+      if (reg == 0 || reg == 2 || reg == 3) return 4; // fld/fst/fstp m32
+      if (reg == 5 || reg == 7) return 2;             // fldcw/fnstcw
+      return 0;
+    case 0xDB:
+      if (reg <= 3) return 4;                         // fild/fisttp/fist/fistp m32
+      if (reg == 5 || reg == 7) return 10;            // fld/fstp m80
+      return 0;
+    case 0xDD:
+      return (reg <= 3) ? 8 : 0;                      // fld/fisttp/fst/fstp m64
+    case 0xDF:
+      if (reg <= 3) return 2;                         // fild/fisttp/fist/fistp m16
+      if (reg == 5 || reg == 7) return 8;             // fild/fistp m64
+      return 0;
+  }
+  return 0;
+}
+
+static bool x87_register_form_supported(uint8_t opcode, uint8_t byte) {
+  uint8_t reg = (byte >> 3) & 7;
+  switch (opcode) {
+    case 0xD8: case 0xDC: case 0xDE:
+      return reg != 2 && reg != 3;
+    case 0xD9:
+      return reg == 0 || reg == 1 || byte == X87_FCHS || byte == X87_FABS
+          || byte == X87_FLD1 || byte == X87_FLDZ || byte == X87_FSQRT;
+    case 0xDB:
+      return reg == 5 || reg == 6 || byte == X87_FNCLEX; // fucomi, fcomi
+    case 0xDD:
+      return reg == 2 || reg == 3;                       // fst, fstp
+    case 0xDF:
+      return reg == 5 || reg == 6 || byte == X87_FNSTSW_AX; // fucomip, fcomip
+  }
+  return false;
+}
+
+int fpu_decode_x87(const uint64_t address, uint8_t opcode, x86_64_instr_t* instr, uint64_t* offset) {
+  int ret = decode_modrm(address, instr, offset);
+  if (ret != 0) {
+    return ret;
+  }
+
+  bool supported = (instr->ea_kind == EA_REG)
+    ? x87_register_form_supported(opcode, modrm_byte(instr))
+    : x87_memory_size(opcode, instr->modrm.reg) != 0;
+  if (!supported) {
+    return -CPU_ERR_UNABLE_TO_DECODE;
+  }
+
+  instr->type = X87;
+  instr->imm64 = opcode;
+  instr->size = *offset;
+  return 0;
+}
+
+static uint32_t sse_memory_operand(const x86_64_instr_t* instr, bool* read_out, bool* write_out) {
+  uint8_t opcode = instr->imm64;
+  uint8_t form = sse_form(instr);
+  uint32_t scalar_size = (form == SSE_SS || form == SSE_PS) ? 4 : 8;
+  *read_out = true;
+  *write_out = false;
+
+  switch (instr->type) {
+    case SSE_MOV:
+      switch (opcode) {
+        case 0x10: return (form == SSE_SS || form == SSE_SD) ? scalar_size : 16;
+        case 0x11:
+          *read_out = false;
+          *write_out = true;
+          return (form == SSE_SS || form == SSE_SD) ? scalar_size : 16;
+        case 0x28: return 16;
+        case 0x29: *read_out = false; *write_out = true; return 16;
+        case 0x6E: return rex_w(instr) ? 8 : 4;
+        case 0x7E:
+          if (form == SSE_SS) return 8;
+          *read_out = false;
+          *write_out = true;
+          return rex_w(instr) ? 8 : 4;
+        case 0xD6: *read_out = false; *write_out = true; return 8;
+      }
+      return 0;
+    case SSE_ARITH:
+      return (form == SSE_SS) ? 4 : 8;
+    case SSE_CVT:
+      if (opcode == 0x2A) return rex_w(instr) ? 8 : 4;
+      return (form == SSE_SS) ? 4 : 8;
+    case SSE_COMI:
+      return scalar_size;
+    case SSE_LOGIC:
+      return 16;
+    case SSE_MXCSR:
+      if (instr->modrm.reg == SSE_STMXCSR) {
+        *read_out = false;
+        *write_out = true;
+      }
+      return 4;
+  }
+  return 0;
+}
+
+uint32_t fpu_memory_operand(const x86_64_instr_t* instr, bool* read_out, bool* write_out) {
+  *read_out = false;
+  *write_out = false;
+  if (instr->ea_kind == EA_REG) {
+    return 0;
+  }
+  if (instr->type != X87) {
+    return sse_memory_operand(instr, read_out, write_out);
+  }
+
+  // Arithmetic, loads and fldcw read; the rest write
+  uint8_t opcode = instr->imm64;
+  uint8_t reg = instr->modrm.reg;
+  bool reads = (opcode == 0xD8 || opcode == 0xDC || reg == 0 || reg == 5);
+  *read_out = reads;
+  *write_out = !reads;
+  return x87_memory_size(opcode, reg);
+}
+
+// SSE operands. Memory operands of 16 bytes have to be aligned, except for
+// movups/movupd; anything else faults on hardware.
+static int read_xmm_operand(const cpu_x86_64_t* cpu, const x86_64_instr_t* instr, uint32_t size, bool aligned, xmm_t* value_out) {
+  if (instr->ea_kind == EA_REG) {
+    *value_out = cpu->xmm[rm_index(instr)];
+    return 0;
+  }
+
+  uint64_t address = effective_address(cpu, instr);
+  *value_out = (xmm_t){0};
+  bool ok;
+  switch (size) {
+    case 4:
+      ok = read_u32(address, &value_out->u32[0]);
+      break;
+    case 8:
+      ok = read_u64(address, &value_out->u64[0]);
+      break;
+    default:
+      if (aligned && (address & 15)) {
+        return -CPU_ERR_INVALID_MEMORY_ACCESS;
+      }
+      ok = read_u64(address, &value_out->u64[0]) && read_u64(address + 8, &value_out->u64[1]);
+      break;
+  }
+  return ok ? 0 : -CPU_ERR_INVALID_MEMORY_ACCESS;
+}
+
+static int write_m128(uint64_t address, const xmm_t* value, bool aligned) {
+  if (aligned && (address & 15)) {
+    return -CPU_ERR_INVALID_MEMORY_ACCESS;
+  }
+  if (!write_u64(address, value->u64[0]) || !write_u64(address + 8, value->u64[1])) {
+    return -CPU_ERR_INVALID_MEMORY_ACCESS;
+  }
+  return 0;
+}
+
+// General purpose r/m operands of movd/movq and cvtsi2ss/sd
+static int read_gp_operand(const cpu_x86_64_t* cpu, const x86_64_instr_t* instr, uint64_t* value_out) {
+  bool wide = rex_w(instr);
+  if (instr->ea_kind == EA_REG) {
+    uint64_t value = cpu->regs[rm_index(instr)];
+    *value_out = wide ? value : (uint32_t)value;
+    return 0;
+  }
+
+  uint64_t address = effective_address(cpu, instr);
+  uint32_t value32;
+  bool ok = wide ? read_u64(address, value_out) : read_u32(address, &value32);
+  if (!wide) {
+    *value_out = value32;
+  }
+  return ok ? 0 : -CPU_ERR_INVALID_MEMORY_ACCESS;
+}
+
+static int sse_mov(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  uint8_t opcode = instr->imm64;
+  uint8_t form = sse_form(instr);
+  bool scalar = (form == SSE_SS || form == SSE_SD);
+  uint32_t scalar_size = (form == SSE_SS) ? 4 : 8;
+  xmm_t* reg = &cpu->xmm[reg_index(instr)];
+  xmm_t value;
+  int ret;
+
+  switch (opcode) {
+    case 0x10:
+    case 0x28: {
+      ret = read_xmm_operand(cpu, instr, scalar ? scalar_size : 16, opcode == 0x28, &value);
+      if (ret != 0) return ret;
+
+      // Between registers, movss/movsd only replace the low element. From
+      // memory the rest is zeroed, which read_xmm_operand() has already done.
+      if (scalar && instr->ea_kind == EA_REG) {
+        if (form == SSE_SS) {
+          reg->u32[0] = value.u32[0];
+        } else {
+          reg->u64[0] = value.u64[0];
+        }
+      } else {
+        *reg = value;
+      }
+      return 0;
+    }
+
+    case 0x11:
+    case 0x29: {
+      if (instr->ea_kind == EA_REG) {
+        xmm_t* rm = &cpu->xmm[rm_index(instr)];
+        if (form == SSE_SS) {
+          rm->u32[0] = reg->u32[0];
+        } else if (form == SSE_SD) {
+          rm->u64[0] = reg->u64[0];
+        } else {
+          *rm = *reg;
+        }
+        return 0;
+      }
+
+      uint64_t address = effective_address(cpu, instr);
+      if (form == SSE_SS) {
+        return write_u32(address, reg->u32[0]) ? 0 : -CPU_ERR_INVALID_MEMORY_ACCESS;
+      }
+      if (form == SSE_SD) {
+        return write_u64(address, reg->u64[0]) ? 0 : -CPU_ERR_INVALID_MEMORY_ACCESS;
+      }
+      return write_m128(address, reg, opcode == 0x29);
+    }
+
+    case 0x6E: {
+      // movd/movq xmm, r/m
+      uint64_t gp;
+      ret = read_gp_operand(cpu, instr, &gp);
+      if (ret != 0) return ret;
+      *reg = (xmm_t){ .u64 = { gp, 0 } };
+      return 0;
+    }
+
+    case 0x7E: {
+      // F3: movq xmm, xmm/m64
+      if (form == SSE_SS) {
+        ret = read_xmm_operand(cpu, instr, 8, false, &value);
+        if (ret != 0) return ret;
+        *reg = (xmm_t){ .u64 = { value.u64[0], 0 } };
+        return 0;
+      }
+
+      // 66: movd/movq r/m, xmm
+      bool wide = rex_w(instr);
+      if (instr->ea_kind == EA_REG) {
+        cpu->regs[rm_index(instr)] = wide ? reg->u64[0] : reg->u32[0];
+        return 0;
+      }
+      uint64_t address = effective_address(cpu, instr);
+      bool ok = wide ? write_u64(address, reg->u64[0]) : write_u32(address, reg->u32[0]);
+      return ok ? 0 : -CPU_ERR_INVALID_MEMORY_ACCESS;
+    }
+
+    case 0xD6: {
+      // movq xmm/m64, xmm
+      if (instr->ea_kind == EA_REG) {
+        cpu->xmm[rm_index(instr)] = (xmm_t){ .u64 = { reg->u64[0], 0 } };
+        return 0;
+      }
+      return write_u64(effective_address(cpu, instr), reg->u64[0]) ? 0 : -CPU_ERR_INVALID_MEMORY_ACCESS;
+    }
+  }
+  return -CPU_ERR_UNABLE_TO_EXECUTE;
+}
+
+// Scalar arithmetic is done by the same instruction on the host, so that
+// rounding, NaN propagation and min/max's operand order all come out exactly
+// as they would natively
+static int sse_arith(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  uint8_t opcode = instr->imm64;
+  bool single = (sse_form(instr) == SSE_SS);
+  xmm_t* dst = &cpu->xmm[reg_index(instr)];
+  xmm_t src;
+  int ret = read_xmm_operand(cpu, instr, single ? 4 : 8, false, &src);
+  if (ret != 0) {
+    return ret;
+  }
+
+  if (single) {
+    __m128 a = _mm_loadu_ps((const float*)dst->u32);
+    __m128 b = _mm_loadu_ps((const float*)src.u32);
+    __m128 result;
+    SSE_BARRIER(a);
+    SSE_BARRIER(b);
+    switch (opcode) {
+      case 0x51: result = _mm_move_ss(a, _mm_sqrt_ss(b)); break;
+      case 0x58: result = _mm_add_ss(a, b); break;
+      case 0x59: result = _mm_mul_ss(a, b); break;
+      case 0x5C: result = _mm_sub_ss(a, b); break;
+      case 0x5D: result = _mm_min_ss(a, b); break;
+      case 0x5E: result = _mm_div_ss(a, b); break;
+      case 0x5F: result = _mm_max_ss(a, b); break;
+      default: return -CPU_ERR_UNABLE_TO_EXECUTE;
+    }
+    SSE_BARRIER(result);
+    _mm_storeu_ps((float*)dst->u32, result);
+  } else {
+    __m128d a = _mm_loadu_pd((const double*)dst->u64);
+    __m128d b = _mm_loadu_pd((const double*)src.u64);
+    __m128d result;
+    SSE_BARRIER(a);
+    SSE_BARRIER(b);
+    switch (opcode) {
+      case 0x51: result = _mm_sqrt_sd(a, b); break;
+      case 0x58: result = _mm_add_sd(a, b); break;
+      case 0x59: result = _mm_mul_sd(a, b); break;
+      case 0x5C: result = _mm_sub_sd(a, b); break;
+      case 0x5D: result = _mm_min_sd(a, b); break;
+      case 0x5E: result = _mm_div_sd(a, b); break;
+      case 0x5F: result = _mm_max_sd(a, b); break;
+      default: return -CPU_ERR_UNABLE_TO_EXECUTE;
+    }
+    SSE_BARRIER(result);
+    _mm_storeu_pd((double*)dst->u64, result);
+  }
+  return 0;
+}
+
+static int sse_cvt(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  uint8_t opcode = instr->imm64;
+  bool single = (sse_form(instr) == SSE_SS);
+  bool wide = rex_w(instr);
+  xmm_t* reg = &cpu->xmm[reg_index(instr)];
+  int ret;
+
+  // cvtsi2ss/sd xmm, r/m
+  if (opcode == 0x2A) {
+    uint64_t gp;
+    ret = read_gp_operand(cpu, instr, &gp);
+    if (ret != 0) return ret;
+
+    if (single) {
+      __m128 a = _mm_loadu_ps((const float*)reg->u32);
+      asm volatile("" : "+x"(a), "+r"(gp));
+      a = wide ? _mm_cvtsi64_ss(a, (int64_t)gp) : _mm_cvtsi32_ss(a, (int32_t)gp);
+      SSE_BARRIER(a);
+      _mm_storeu_ps((float*)reg->u32, a);
+    } else {
+      __m128d a = _mm_loadu_pd((const double*)reg->u64);
+      asm volatile("" : "+x"(a), "+r"(gp));
+      a = wide ? _mm_cvtsi64_sd(a, (int64_t)gp) : _mm_cvtsi32_sd(a, (int32_t)gp);
+      SSE_BARRIER(a);
+      _mm_storeu_pd((double*)reg->u64, a);
+    }
+    return 0;
+  }
+
+  xmm_t src;
+  ret = read_xmm_operand(cpu, instr, single ? 4 : 8, false, &src);
+  if (ret != 0) {
+    return ret;
+  }
+
+  // cvtss2sd/cvtsd2ss xmm, xmm/m
+  if (opcode == 0x5A) {
+    if (single) {
+      __m128d a = _mm_loadu_pd((const double*)reg->u64);
+      __m128 b = _mm_loadu_ps((const float*)src.u32);
+      SSE_BARRIER(a);
+      SSE_BARRIER(b);
+      a = _mm_cvtss_sd(a, b);
+      SSE_BARRIER(a);
+      _mm_storeu_pd((double*)reg->u64, a);
+    } else {
+      __m128 a = _mm_loadu_ps((const float*)reg->u32);
+      __m128d b = _mm_loadu_pd((const double*)src.u64);
+      SSE_BARRIER(a);
+      SSE_BARRIER(b);
+      a = _mm_cvtsd_ss(a, b);
+      SSE_BARRIER(a);
+      _mm_storeu_ps((float*)reg->u32, a);
+    }
+    return 0;
+  }
+
+  // cvt(t)ss2si/cvt(t)sd2si r, xmm/m, where 2C truncates and 2D rounds by MXCSR
+  bool truncate = (opcode == 0x2C);
+  uint64_t result;
+  if (single) {
+    __m128 b = _mm_loadu_ps((const float*)src.u32);
+    SSE_BARRIER(b);
+    if (wide) {
+      result = truncate ? _mm_cvttss_si64(b) : _mm_cvtss_si64(b);
+    } else {
+      result = (uint32_t)(truncate ? _mm_cvttss_si32(b) : _mm_cvtss_si32(b));
+    }
+  } else {
+    __m128d b = _mm_loadu_pd((const double*)src.u64);
+    SSE_BARRIER(b);
+    if (wide) {
+      result = truncate ? _mm_cvttsd_si64(b) : _mm_cvtsd_si64(b);
+    } else {
+      result = (uint32_t)(truncate ? _mm_cvttsd_si32(b) : _mm_cvtsd_si32(b));
+    }
+  }
+  asm volatile("" : "+r"(result));
+  cpu->regs[reg_index(instr)] = result;
+  return 0;
+}
+
+// Sets ZF, PF and CF from an unordered/ordered compare, and clears OF, SF and AF
+static void set_compare_flags(cpu_x86_64_t* cpu, bool zf, bool pf, bool cf) {
+  cpu->lazy_flags.pending = false;
+  cpu->rflags.zf = zf;
+  cpu->rflags.pf = pf;
+  cpu->rflags.cf = cf;
+  cpu->rflags.of = 0;
+  cpu->rflags.sf = 0;
+  cpu->rflags.af = 0;
+}
+
+#define SSE_COMPARE(insn, a, b)                                                  \
+  asm volatile(insn " %[src], %[dst]"                                            \
+               : "=@ccz"(zf), "=@ccp"(pf), "=@ccc"(cf)                           \
+               : [dst] "x"(a), [src] "x"(b))
+
+static int sse_comi(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  bool single = (sse_form(instr) == SSE_PS);
+  bool ordered = (instr->imm64 == 0x2F);
+  const xmm_t* dst = &cpu->xmm[reg_index(instr)];
+  xmm_t src;
+  int ret = read_xmm_operand(cpu, instr, single ? 4 : 8, false, &src);
+  if (ret != 0) {
+    return ret;
+  }
+
+  bool zf, pf, cf;
+  if (single) {
+    __m128 a = _mm_loadu_ps((const float*)dst->u32);
+    __m128 b = _mm_loadu_ps((const float*)src.u32);
+    if (ordered) {
+      SSE_COMPARE("comiss", a, b);
+    } else {
+      SSE_COMPARE("ucomiss", a, b);
+    }
+  } else {
+    __m128d a = _mm_loadu_pd((const double*)dst->u64);
+    __m128d b = _mm_loadu_pd((const double*)src.u64);
+    if (ordered) {
+      SSE_COMPARE("comisd", a, b);
+    } else {
+      SSE_COMPARE("ucomisd", a, b);
+    }
+  }
+  set_compare_flags(cpu, zf, pf, cf);
+  return 0;
+}
+
+// and/andn/or/xor ps/pd and pxor, which are all the same bitwise operation
+// whatever the element type
+static int sse_logic(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  xmm_t* dst = &cpu->xmm[reg_index(instr)];
+  xmm_t src;
+  int ret = read_xmm_operand(cpu, instr, 16, true, &src);
+  if (ret != 0) {
+    return ret;
+  }
+
+  for (size_t i = 0; i < 2; i++) {
+    switch (instr->imm64) {
+      case 0x54: dst->u64[i] &= src.u64[i]; break;
+      case 0x55: dst->u64[i] = ~dst->u64[i] & src.u64[i]; break;
+      case 0x56: dst->u64[i] |= src.u64[i]; break;
+      case 0x57:
+      case 0xEF: dst->u64[i] ^= src.u64[i]; break;
+    }
+  }
+  return 0;
+}
+
+static int sse_mxcsr(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  uint64_t address = effective_address(cpu, instr);
+  if (instr->modrm.reg == SSE_STMXCSR) {
+    return write_u32(address, get_mxcsr()) ? 0 : -CPU_ERR_INVALID_MEMORY_ACCESS;
+  }
+
+  uint32_t value;
+  if (!read_u32(address, &value)) {
+    return -CPU_ERR_INVALID_MEMORY_ACCESS;
+  }
+  if (value & MXCSR_RESERVED) {
+    return -CPU_ERR_UNABLE_TO_EXECUTE;
+  }
+  cpu->mxcsr = value;
+  set_mxcsr(value);
+  return 0;
+}
+
+// The x87 register stack. st(i) is held in physical register (TOP + i) & 7,
+// and ftw has a bit set for each physical register that holds a value.
+static inline uint8_t x87_top(const cpu_x86_64_t* cpu) {
+  return (cpu->fsw >> FSW_TOP_SHIFT) & 7;
+}
+
+static inline uint8_t x87_physical(const cpu_x86_64_t* cpu, uint8_t i) {
+  return (x87_top(cpu) + i) & 7;
+}
+
+static inline void x87_set_top(cpu_x86_64_t* cpu, uint8_t top) {
+  cpu->fsw = (cpu->fsw & ~(7 << FSW_TOP_SHIFT)) | ((top & 7) << FSW_TOP_SHIFT);
+}
+
+// The "real indefinite" a masked invalid operation produces
+static long double x87_indefinite(void) {
+  uint8_t bytes[16] = {0};
+  uint64_t significand = 0xc000000000000000ULL;
+  uint16_t sign_exponent = 0xffff;
+  memcpy(bytes, &significand, 8);
+  memcpy(bytes + 8, &sign_exponent, 2);
+  long double value;
+  memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+// Stack overflow and underflow are invalid operations, with C1 telling them
+// apart. Masked, the operation goes on with the indefinite value instead.
+static int x87_stack_fault(cpu_x86_64_t* cpu, bool overflow) {
+  cpu->fsw |= FSW_IE | FSW_STACK_FAULT;
+  cpu->fsw = overflow ? (cpu->fsw | FSW_C1) : (cpu->fsw & ~FSW_C1);
+  return (cpu->fcw & FCW_IM) ? 0 : -CPU_ERR_FP_EXCEPTION;
+}
+
+static int x87_get(cpu_x86_64_t* cpu, uint8_t i, long double* value_out) {
+  uint8_t physical = x87_physical(cpu, i);
+  if (!(cpu->ftw & (1 << physical))) {
+    *value_out = x87_indefinite();
+    return x87_stack_fault(cpu, false);
+  }
+  *value_out = cpu->st[physical];
+  return 0;
+}
+
+static void x87_set(cpu_x86_64_t* cpu, uint8_t i, long double value) {
+  uint8_t physical = x87_physical(cpu, i);
+  cpu->st[physical] = value;
+  cpu->ftw |= 1 << physical;
+}
+
+static int x87_push(cpu_x86_64_t* cpu, long double value) {
+  uint8_t top = (x87_top(cpu) - 1) & 7;
+  if (cpu->ftw & (1 << top)) {
+    int ret = x87_stack_fault(cpu, true);
+    if (ret != 0) return ret;
+    value = x87_indefinite();
+  }
+  x87_set_top(cpu, top);
+  x87_set(cpu, 0, value);
+  return 0;
+}
+
+static void x87_pop(cpu_x86_64_t* cpu) {
+  uint8_t top = x87_top(cpu);
+  cpu->ftw &= ~(1 << top);
+  x87_set_top(cpu, top + 1);
+}
+
+static long double x87_arith(uint8_t op, long double dst, long double src) {
+  long double result;
+  X87_BARRIER(dst);
+  X87_BARRIER(src);
+  switch (op) {
+    case X87_ADD:  result = dst + src; break;
+    case X87_MUL:  result = dst * src; break;
+    case X87_SUB:  result = dst - src; break;
+    case X87_SUBR: result = src - dst; break;
+    case X87_DIV:  result = dst / src; break;
+    case X87_DIVR: result = src / dst; break;
+    default: return x87_indefinite();
+  }
+  X87_BARRIER(result);
+  return result;
+}
+
+// fist/fistp/fisttp, which have no C equivalent that honours the rounding mode
+static void x87_store_int(long double value, uint8_t reg, uint32_t size, uint8_t* out) {
+  switch (size) {
+    case 2:
+      if (reg == 1)      asm volatile("fisttps %0" : "=m"(*(int16_t*)out) : "t"(value) : "st");
+      else               asm volatile("fists %0" : "=m"(*(int16_t*)out) : "t"(value));
+      break;
+    case 4:
+      if (reg == 1)      asm volatile("fisttpl %0" : "=m"(*(int32_t*)out) : "t"(value) : "st");
+      else               asm volatile("fistl %0" : "=m"(*(int32_t*)out) : "t"(value));
+      break;
+    case 8:
+      if (reg == 1)      asm volatile("fisttpll %0" : "=m"(*(int64_t*)out) : "t"(value) : "st");
+      else               asm volatile("fistpll %0" : "=m"(*(int64_t*)out) : "t"(value) : "st");
+      break;
+  }
+}
+
+static int x87_memory(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  uint8_t opcode = instr->imm64;
+  uint8_t reg = instr->modrm.reg;
+  uint32_t size = x87_memory_size(opcode, reg);
+  uint64_t address = effective_address(cpu, instr);
+  bool reads = (opcode == 0xD8 || opcode == 0xDC || reg == 0 || reg == 5);
+  bool is_int = (opcode == 0xDB && reg != 5 && reg != 7) || opcode == 0xDF || (opcode == 0xDD && reg == 1);
+
+  // fldcw/fnstcw
+  if (opcode == 0xD9 && (reg == 5 || reg == 7)) {
+    if (reg == 7) {
+      return write_u16(address, cpu->fcw) ? 0 : -CPU_ERR_INVALID_MEMORY_ACCESS;
+    }
+    uint16_t fcw;
+    if (!read_u16(address, &fcw)) {
+      return -CPU_ERR_INVALID_MEMORY_ACCESS;
+    }
+    cpu->fcw = fcw;
+    asm volatile("fldcw %0" : : "m"(fcw));
+    return 0;
+  }
+
+  uint8_t bytes[16] = {0};
+  long double value;
+  int ret;
+
+  if (reads) {
+    for (uint32_t i = 0; i < size; i++) {
+      if (!read_u8(address + i, &bytes[i])) {
+        return -CPU_ERR_INVALID_MEMORY_ACCESS;
+      }
+    }
+
+    if (is_int) {
+      int16_t i16; int32_t i32; int64_t i64;
+      switch (size) {
+        case 2: memcpy(&i16, bytes, 2); value = i16; break;
+        case 4: memcpy(&i32, bytes, 4); value = i32; break;
+        default: memcpy(&i64, bytes, 8); value = i64; break;
+      }
+    } else {
+      float f32; double f64;
+      switch (size) {
+        case 4: memcpy(&f32, bytes, 4); value = f32; break;
+        case 8: memcpy(&f64, bytes, 8); value = f64; break;
+        default: memcpy(&value, bytes, 10); break;
+      }
+    }
+
+    // Loads push, arithmetic combines into st(0)
+    if (opcode == 0xD8 || opcode == 0xDC) {
+      long double st0;
+      ret = x87_get(cpu, 0, &st0);
+      if (ret != 0) return ret;
+      x87_set(cpu, 0, x87_arith(reg, st0, value));
+      return 0;
+    }
+    return x87_push(cpu, value);
+  }
+
+  // Stores
+  ret = x87_get(cpu, 0, &value);
+  if (ret != 0) {
+    return ret;
+  }
+
+  if (is_int) {
+    x87_store_int(value, reg, size, bytes);
+  } else {
+    // Narrowing rounds by the control word, so it's done by fst itself
+    float f32; double f64;
+    switch (size) {
+      case 4: asm volatile("fsts %0" : "=m"(f32) : "t"(value)); memcpy(bytes, &f32, 4); break;
+      case 8: asm volatile("fstl %0" : "=m"(f64) : "t"(value)); memcpy(bytes, &f64, 8); break;
+      default: memcpy(bytes, &value, 10); break;
+    }
+  }
+
+  for (uint32_t i = 0; i < size; i++) {
+    if (!write_u8(address + i, bytes[i])) {
+      return -CPU_ERR_INVALID_MEMORY_ACCESS;
+    }
+  }
+
+  // Everything but fst and fist pops
+  if (reg != 2) {
+    x87_pop(cpu);
+  }
+  return 0;
+}
+
+#define X87_COMPARE(insn, a, b)                                                  \
+  asm volatile(insn " %%st(1), %%st"                                             \
+               : "=@ccz"(zf), "=@ccp"(pf), "=@ccc"(cf)                           \
+               : "t"(a), "u"(b))
+
+static int x87_register(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  uint8_t opcode = instr->imm64;
+  uint8_t byte = modrm_byte(instr);
+  uint8_t reg = instr->modrm.reg;
+  uint8_t i = instr->modrm.rm;
+  long double st0, sti;
+  int ret;
+
+  switch (opcode) {
+    case 0xD8:
+    case 0xDC:
+    case 0xDE: {
+      ret = x87_get(cpu, 0, &st0);
+      if (ret == 0) ret = x87_get(cpu, i, &sti);
+      if (ret != 0) return ret;
+
+      if (opcode == 0xD8) {
+        x87_set(cpu, 0, x87_arith(reg, st0, sti));
+        return 0;
+      }
+
+      // With st(i) as the destination, the encodings of sub/subr and div/divr
+      // are the other way round
+      x87_set(cpu, i, x87_arith((reg >= X87_SUB) ? (reg ^ 1) : reg, sti, st0));
+      if (opcode == 0xDE) {
+        x87_pop(cpu);
+      }
+      return 0;
+    }
+
+    case 0xD9: {
+      if (byte == X87_FLD1) return x87_push(cpu, 1.0L);
+      if (byte == X87_FLDZ) return x87_push(cpu, 0.0L);
+
+      if (reg == 0) {
+        // fld st(i)
+        ret = x87_get(cpu, i, &sti);
+        if (ret != 0) return ret;
+        return x87_push(cpu, sti);
+      }
+
+      ret = x87_get(cpu, 0, &st0);
+      if (ret != 0) return ret;
+
+      if (reg == 1) {
+        // fxch st(i)
+        ret = x87_get(cpu, i, &sti);
+        if (ret != 0) return ret;
+        x87_set(cpu, i, st0);
+        x87_set(cpu, 0, sti);
+        return 0;
+      }
+
+      switch (byte) {
+        case X87_FCHS:  asm volatile("fchs" : "+t"(st0)); break;
+        case X87_FABS:  asm volatile("fabs" : "+t"(st0)); break;
+        case X87_FSQRT: asm volatile("fsqrt" : "+t"(st0)); break;
+      }
+      x87_set(cpu, 0, st0);
+      return 0;
+    }
+
+    case 0xDB:
+    case 0xDF: {
+      if (opcode == 0xDB && byte == X87_FNCLEX) {
+        cpu->fsw &= ~(FSW_EXCEPTIONS | FSW_STACK_FAULT | FSW_ES | FSW_BUSY);
+        asm volatile("fnclex");
+        return 0;
+      }
+
+      if (opcode == 0xDF && byte == X87_FNSTSW_AX) {
+        uint16_t host_fsw;
+        asm volatile("fnstsw %0" : "=m"(host_fsw));
+        uint16_t fsw = cpu->fsw | (host_fsw & FSW_EXCEPTIONS);
+        if (fsw & ~cpu->fcw & FSW_EXCEPTIONS) {
+          fsw |= FSW_ES | FSW_BUSY;
+        }
+        reg_write_16(cpu, modrm_rax, fsw);
+        return 0;
+      }
+
+      // f(u)comi(p) st, st(i)
+      ret = x87_get(cpu, 0, &st0);
+      if (ret == 0) ret = x87_get(cpu, i, &sti);
+      if (ret != 0) return ret;
+
+      bool zf, pf, cf;
+      if (reg == 5) {
+        X87_COMPARE("fucomi", st0, sti);
+      } else {
+        X87_COMPARE("fcomi", st0, sti);
+      }
+      set_compare_flags(cpu, zf, pf, cf);
+      if (opcode == 0xDF) {
+        x87_pop(cpu);
+      }
+      return 0;
+    }
+
+    case 0xDD: {
+      // fst/fstp st(i)
+      ret = x87_get(cpu, 0, &st0);
+      if (ret != 0) return ret;
+      x87_set(cpu, i, st0);
+      if (reg == 3) {
+        x87_pop(cpu);
+      }
+      return 0;
+    }
+  }
+  return -CPU_ERR_UNABLE_TO_EXECUTE;
+}
+
+int fpu_execute(cpu_x86_64_t* cpu, const x86_64_instr_t* instr) {
+  int ret;
+  switch (instr->type) {
+    case SSE_MOV:   ret = sse_mov(cpu, instr); break;
+    case SSE_ARITH: ret = sse_arith(cpu, instr); break;
+    case SSE_CVT:   ret = sse_cvt(cpu, instr); break;
+    case SSE_COMI:  ret = sse_comi(cpu, instr); break;
+    case SSE_LOGIC: ret = sse_logic(cpu, instr); break;
+    case SSE_MXCSR: ret = sse_mxcsr(cpu, instr); break;
+    case X87:
+      ret = (instr->ea_kind == EA_REG) ? x87_register(cpu, instr) : x87_memory(cpu, instr);
+      // x87 exceptions are only delivered by the next waiting instruction, so
+      // an unmasked one is made to trap here, in the instruction that raised it
+      asm volatile("fwait");
+      break;
+    default:
+      return -CPU_ERR_UNABLE_TO_EXECUTE;
+  }
+
+  if (ret != 0) {
+    return ret;
+  }
+  cpu->rip = instr->address + instr->size;
+  return 0;
+}
+
+static void switch_to_guest(const cpu_x86_64_t* cpu) {
+  // The guest's x87 exception flags stay in its fsw, so that the host's only
+  // say what's been raised since
+  asm volatile("fnclex");
+  asm volatile("fldcw %0" : : "m"(cpu->fcw));
+  set_mxcsr(cpu->mxcsr);
+}
+
+static void switch_to_host(cpu_x86_64_t* cpu) {
+  uint16_t fsw;
+  asm volatile("fnstsw %0" : "=m"(fsw));
+  cpu->mxcsr |= (get_mxcsr() | trapped_mxcsr_flags) & MXCSR_FLAGS;
+  cpu->fsw |= (fsw | trapped_fsw_flags) & FSW_EXCEPTIONS;
+  trapped_mxcsr_flags = 0;
+  trapped_fsw_flags = 0;
+
+  asm volatile("fninit");
+  asm volatile("fldcw %0" : : "m"(host_fcw));
+  set_mxcsr(host_mxcsr);
+}
+
+void fpu_enter(cpu_x86_64_t* cpu) {
+  host_mxcsr = get_mxcsr();
+  asm volatile("fnstcw %0" : "=m"(host_fcw));
+  entered_cpu = cpu;
+  host_depth = 0;
+  switch_to_guest(cpu);
+}
+
+void fpu_leave(cpu_x86_64_t* cpu) {
+  // A fault inside fpu_host_begin() and fpu_host_end() arrives here with the
+  // host's settings already in
+  if (host_depth == 0) {
+    switch_to_host(cpu);
+  }
+  entered_cpu = NULL;
+  host_depth = 0;
+}
+
+void fpu_host_begin(void) {
+  if (entered_cpu && host_depth++ == 0) {
+    switch_to_host(entered_cpu);
+  }
+}
+
+void fpu_host_end(void) {
+  if (entered_cpu && --host_depth == 0) {
+    switch_to_guest(entered_cpu);
+  }
+}
+
+// A guest floating point exception its MXCSR or control word unmasked. Only
+// the flags are taken from the trapping context, since the host FPU has been
+// reset for the handler.
+static void fp_exception_handler(int sig, siginfo_t* info, void* context) {
+  // Integer division errors, or anything outside the guest (or under one of
+  // the emulator's locks, see ue-memory.h), are genuine crashes in the
+  // emulator itself
+  if (!memory_fault_recovery || memory_fault_recovery_blocked || info->si_code == FPE_INTDIV || info->si_code == FPE_INTOVF) {
+    signal(sig, SIG_DFL);
+    return;
+  }
+
+  ucontext_t* ucontext = context;
+  if (ucontext->uc_mcontext.fpregs) {
+    trapped_mxcsr_flags = ucontext->uc_mcontext.fpregs->mxcsr & MXCSR_FLAGS;
+    trapped_fsw_flags = ucontext->uc_mcontext.fpregs->swd & FSW_EXCEPTIONS;
+  }
+  siglongjmp(*memory_fault_recovery, CPU_ERR_FP_EXCEPTION);
+}
+
+int fpu_install_exception_handler(void) {
+  struct sigaction action = {0};
+  action.sa_sigaction = fp_exception_handler;
+  // As for memory faults, the handler is left by siglongjmp
+  action.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset(&action.sa_mask);
+
+  if (sigaction(SIGFPE, &action, NULL) != 0) {
+    return -FPU_ERR_SIGNAL;
+  }
+  return 0;
+}
+
+static char* fpu_errors[] = {
+  "Unknown",
+  "Unable to install the floating point exception handler",
+};
+
+char* fpu_err_message(int errorIndex) {
+  if (errorIndex < 0) {
+    errorIndex *= -1;
+  }
+
+  if (errorIndex >= FPU_ERR_NUM_ERRORS) {
+    return fpu_errors[FPU_ERR_UNKNOWN];
+  }
+  return fpu_errors[errorIndex];
+}
@@ -0,0 +1,928 @@
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ue-block.h"
+#include "ue-link.h"
+#include "ue-memory.h"
+#include "ue-sched.h"
+
+typedef struct link_object_t {
+  char path[LOADER_MAX_PATH];
+  uint64_t base;
+  loader_image_t image;
+  prelink_object_t identity; // What the prelink cache checks to see if the file has changed
+  // From the dynamic section
+  const Elf64_Dyn* dynamic;
+  const char* strtab;
+  uint64_t strsz;
+  const Elf64_Sym* symtab;
+  const uint32_t* hash;
+  const uint32_t* gnu_hash;
+  uint64_t rela;
+  uint64_t relasz;
+  uint64_t jmprel;
+  uint64_t pltrelsz;
+  uint64_t relr;
+  uint64_t relrsz;
+  const char* runpath;
+  uint64_t init;
+  uint64_t init_array;
+  uint64_t init_arraysz;
+  uint64_t preinit_array;
+  uint64_t preinit_arraysz;
+  // Its block of static TLS ends tls_offset bytes below the thread pointer
+  uint64_t tls_module; // 0 if it has no PT_TLS
+  uint64_t tls_offset;
+} link_object_t;
+
+// The program is objects[0], followed by its libraries in load order
+static link_object_t objects[LINK_MAX_OBJECTS];
+static size_t num_objects = 0;
+
+static prelink_fixup_t* fixups = NULL;
+static size_t num_fixups = 0;
+static size_t fixups_capacity = 0;
+
+// All the static TLS blocks together, which the TCB goes just above
+static uint64_t tls_size = 0;
+static uint64_t tls_align = 1;
+
+// A path, or a relocation type and a path
+#define ERROR_DETAIL_SIZE (LOADER_MAX_PATH + 32)
+static char error_detail[ERROR_DETAIL_SIZE] = "";
+
+static int set_error(int error, const char* detail) {
+  snprintf(error_detail, sizeof(error_detail), "%s", detail);
+  return error;
+}
+
+const char* link_error_detail(void) {
+  return error_detail;
+}
+
+static bool file_identity(const char* path, prelink_object_t* identity_out) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    return false;
+  }
+
+  identity_out->dev = st.st_dev;
+  identity_out->ino = st.st_ino;
+  identity_out->size = st.st_size;
+  identity_out->mtime = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+  return true;
+}
+
+// Adds an object, as the next in load order
+static link_object_t* add_object(const char* path, uint64_t base) {
+  if (num_objects == LINK_MAX_OBJECTS) {
+    return NULL;
+  }
+
+  link_object_t* object = &objects[num_objects++];
+  memset(object, 0, sizeof(link_object_t));
+  snprintf(object->path, sizeof(object->path), "%s", path);
+  object->base = base;
+  file_identity(path, &object->identity);
+  return object;
+}
+
+static const link_object_t* find_object(const char* path) {
+  for (size_t i = 0; i < num_objects; i++) {
+    if (strcmp(objects[i].path, path) == 0) {
+      return &objects[i];
+    }
+  }
+  return NULL;
+}
+
+// The dynamic section's addresses are link-time ones, so they're moved by the bias
+static int parse_dynamic(link_object_t* object) {
+  object->dynamic = guest_to_host(object->image.dynamic);
+  if (!object->image.dynamic || !object->dynamic) {
+    return set_error(-LINK_ERR_DYNAMIC, object->path);
+  }
+
+  uint64_t bias = object->image.bias;
+  uint64_t strtab = 0;
+  uint64_t runpath = 0;
+  uint64_t rpath = 0;
+  for (const Elf64_Dyn* dyn = object->dynamic; dyn->d_tag != DT_NULL; dyn++) {
+    switch (dyn->d_tag) {
+      case DT_STRTAB:   strtab = dyn->d_un.d_ptr + bias; break;
+      case DT_STRSZ:    object->strsz = dyn->d_un.d_val; break;
+      case DT_SYMTAB:   object->symtab = guest_to_host(dyn->d_un.d_ptr + bias); break;
+      case DT_HASH:     object->hash = guest_to_host(dyn->d_un.d_ptr + bias); break;
+      case DT_GNU_HASH: object->gnu_hash = guest_to_host(dyn->d_un.d_ptr + bias); break;
+      case DT_RELA:     object->rela = dyn->d_un.d_ptr + bias; break;
+      case DT_RELASZ:   object->relasz = dyn->d_un.d_val; break;
+      case DT_JMPREL:   object->jmprel = dyn->d_un.d_ptr + bias; break;
+      case DT_PLTRELSZ: object->pltrelsz = dyn->d_un.d_val; break;
+      case DT_RELR:     object->relr = dyn->d_un.d_ptr + bias; break;
+      case DT_RELRSZ:   object->relrsz = dyn->d_un.d_val; break;
+      case DT_RUNPATH:  runpath = dyn->d_un.d_val; break;
+      case DT_RPATH:    rpath = dyn->d_un.d_val; break;
+      case DT_INIT:     object->init = dyn->d_un.d_ptr + bias; break;
+      case DT_INIT_ARRAY:      object->init_array = dyn->d_un.d_ptr + bias; break;
+      case DT_INIT_ARRAYSZ:    object->init_arraysz = dyn->d_un.d_val; break;
+      case DT_PREINIT_ARRAY:   object->preinit_array = dyn->d_un.d_ptr + bias; break;
+      case DT_PREINIT_ARRAYSZ: object->preinit_arraysz = dyn->d_un.d_val; break;
+      case DT_REL:
+      case DT_TEXTREL:
+        return set_error(-LINK_ERR_RELOCATION, object->path);
+      case DT_FLAGS:
+        if (dyn->d_un.d_val & DF_TEXTREL) {
+          return set_error(-LINK_ERR_RELOCATION, object->path);
+        }
+        break;
+      case DT_PLTREL:
+        if (dyn->d_un.d_val != DT_RELA) {
+          return set_error(-LINK_ERR_RELOCATION, object->path);
+        }
+        break;
+    }
+  }
+
+  object->strtab = guest_to_host(strtab);
+  if (!object->strtab || !object->symtab) {
+    return set_error(-LINK_ERR_DYNAMIC, object->path);
+  }
+
+  // DT_RPATH is only used by objects without a DT_RUNPATH
+  uint64_t search = runpath ? runpath : rpath;
+  if ((runpath || rpath) && search < object->strsz) {
+    object->runpath = object->strtab + search;
+  }
+  return 0;
+}
+
+// Searches a colon separated list of directories for name, with $ORIGIN being
+// the directory containing origin
+static bool search_path(const char* list, const char* origin, const char* name, char* path_out) {
+  char origin_dir[LOADER_MAX_PATH];
+  snprintf(origin_dir, sizeof(origin_dir), "%s", origin);
+  char* slash = strrchr(origin_dir, '/');
+  if (slash) {
+    *slash = '\0';
+  } else {
+    strcpy(origin_dir, ".");
+  }
+
+  while (list) {
+    const char* end = strchr(list, ':');
+    size_t length = end ? (size_t)(end - list) : strlen(list);
+
+    // A directory or candidate too long to be a path is skipped, rather than
+    // truncated into some other path
+    char dir[LOADER_MAX_PATH];
+    int dir_length;
+    if (length >= 7 && strncmp(list, "$ORIGIN", 7) == 0) {
+      dir_length = snprintf(dir, sizeof(dir), "%s%.*s", origin_dir, (int)(length - 7), list + 7);
+    } else if (length >= 9 && strncmp(list, "${ORIGIN}", 9) == 0) {
+      dir_length = snprintf(dir, sizeof(dir), "%s%.*s", origin_dir, (int)(length - 9), list + 9);
+    } else if (length == 0) {
+      dir_length = snprintf(dir, sizeof(dir), ".");
+    } else {
+      dir_length = snprintf(dir, sizeof(dir), "%.*s", (int)length, list);
+    }
+
+    char candidate[LOADER_MAX_PATH];
+    if (dir_length >= 0 && (size_t)dir_length < sizeof(dir)) {
+      int candidate_length = snprintf(candidate, sizeof(candidate), "%s/%s", dir, name);
+      if (candidate_length >= 0 && (size_t)candidate_length < sizeof(candidate)
+          && access(candidate, R_OK) == 0 && realpath(candidate, path_out)) {
+        return true;
+      }
+    }
+
+    list = end ? end + 1 : NULL;
+  }
+  return false;
+}
+
+static bool find_library(const link_object_t* needed_by, const char* name, char* path_out) {
+  if (strchr(name, '/')) {
+    return realpath(name, path_out) != NULL;
+  }
+
+  if (needed_by->runpath && search_path(needed_by->runpath, needed_by->path, name, path_out)) {
+    return true;
+  }
+  const char* library_path = getenv("LD_LIBRARY_PATH");
+  if (library_path && search_path(library_path, needed_by->path, name, path_out)) {
+    return true;
+  }
+  return search_path(LINK_SYSTEM_PATH, needed_by->path, name, path_out);
+}
+
+// Loads every library the program needs, breadth first as ld.so does
+static int load_libraries(void) {
+  uint64_t next_base = LINK_LIBRARY_BASE;
+
+  for (size_t i = 0; i < num_objects; i++) {
+    for (const Elf64_Dyn* dyn = objects[i].dynamic; dyn->d_tag != DT_NULL; dyn++) {
+      if (dyn->d_tag != DT_NEEDED || dyn->d_un.d_val >= objects[i].strsz) continue;
+
+      const char* name = objects[i].strtab + dyn->d_un.d_val;
+      char path[LOADER_MAX_PATH];
+      if (!find_library(&objects[i], name, path)) {
+        return set_error(-LINK_ERR_NOT_FOUND, name);
+      }
+      if (find_object(path)) continue;
+
+      link_object_t* library = add_object(path, next_base);
+      if (!library) {
+        return set_error(-LINK_ERR_TOO_MANY, name);
+      }
+      if (loader_load_file(path, next_base, &library->image) != 0) {
+        return set_error(-LINK_ERR_LOAD, path);
+      }
+      next_base = (library->image.end + LINK_LIBRARY_ALIGN - 1) & ~(LINK_LIBRARY_ALIGN - 1);
+
+      int ret = parse_dynamic(library);
+      if (ret != 0) {
+        return ret;
+      }
+    }
+  }
+  return 0;
+}
+
+// Static TLS is laid out as ld.so does for the initially loaded objects
+// (variant II): each module's block below the previous one, going down from
+// the thread pointer, with modules numbered from 1 in load order
+static void assign_tls(void) {
+  tls_size = 0;
+  tls_align = LINK_TCB_ALIGN;
+  uint64_t next_module = 1;
+
+  for (size_t i = 0; i < num_objects; i++) {
+    const loader_image_t* image = &objects[i].image;
+    if (image->tls_memsz == 0) continue;
+
+    // Offsets stay multiples of each block's alignment, so with the thread
+    // pointer aligned to the largest of them every block is aligned too
+    uint64_t align = image->tls_align;
+    objects[i].tls_module = next_module++;
+    tls_size = (tls_size + image->tls_memsz + align - 1) & ~(align - 1);
+    objects[i].tls_offset = tls_size;
+    if (align > tls_align) {
+      tls_align = align;
+    }
+  }
+}
+
+static uint32_t gnu_hash(const char* name) {
+  uint32_t hash = 5381;
+  for (const uint8_t* c = (const uint8_t*)name; *c; c++) {
+    hash = hash * 33 + *c;
+  }
+  return hash;
+}
+
+static uint32_t sysv_hash(const char* name) {
+  uint32_t hash = 0;
+  for (const uint8_t* c = (const uint8_t*)name; *c; c++) {
+    hash = (hash << 4) + *c;
+    uint32_t high = hash & 0xf0000000;
+    if (high) {
+      hash ^= high >> 24;
+    }
+    hash &= ~high;
+  }
+  return hash;
+}
+
+static bool defines(const link_object_t* object, const Elf64_Sym* sym, const char* name) {
+  return (
+    sym->st_shndx != SHN_UNDEF
+    && ELF64_ST_BIND(sym->st_info) != STB_LOCAL
+    && sym->st_name < object->strsz
+    && strcmp(object->strtab + sym->st_name, name) == 0
+  );
+}
+
+static const Elf64_Sym* find_in_object(const link_object_t* object, const char* name) {
+  if (object->gnu_hash) {
+    uint32_t num_buckets = object->gnu_hash[0];
+    uint32_t sym_offset = object->gnu_hash[1];
+    uint32_t bloom_size = object->gnu_hash[2];
+    const uint32_t* buckets = object->gnu_hash + 4 + bloom_size * 2; // The bloom filter is 64-bit words
+    const uint32_t* chain = buckets + num_buckets;
+    if (num_buckets == 0) return NULL;
+
+    uint32_t hash = gnu_hash(name);
+    uint32_t index = buckets[hash % num_buckets];
+    if (index < sym_offset) return NULL;
+
+    // Each chain ends with the entry whose low bit is set
+    for (;; index++) {
+      uint32_t chain_hash = chain[index - sym_offset];
+      if ((hash | 1) == (chain_hash | 1) && defines(object, &object->symtab[index], name)) {
+        return &object->symtab[index];
+      }
+      if (chain_hash & 1) return NULL;
+    }
+  }
+
+  if (object->hash) {
+    uint32_t num_buckets = object->hash[0];
+    uint32_t num_chain = object->hash[1];
+    const uint32_t* buckets = object->hash + 2;
+    const uint32_t* chain = buckets + num_buckets;
+    if (num_buckets == 0) return NULL;
+
+    for (uint32_t index = buckets[sysv_hash(name) % num_buckets]; index != STN_UNDEF && index < num_chain; index = chain[index]) {
+      if (defines(object, &object->symtab[index], name)) {
+        return &object->symtab[index];
+      }
+    }
+  }
+  return NULL;
+}
+
+typedef struct link_symbol_t {
+  uint64_t value;               // Its address, or for STT_TLS its offset in its module's block
+  const link_object_t* object;  // Where it's defined, NULL for an undefined weak symbol
+  uint8_t type;                 // STT_*
+} link_symbol_t;
+
+static link_symbol_t symbol_definition(const link_object_t* object, const Elf64_Sym* sym) {
+  uint8_t type = ELF64_ST_TYPE(sym->st_info);
+  bool absolute = sym->st_shndx == SHN_ABS || type == STT_TLS;
+  return (link_symbol_t){
+    .value = absolute ? sym->st_value : sym->st_value + object->image.bias,
+    .object = object,
+    .type = type,
+  };
+}
+
+// Resolves symbol index symbol of object. Copy relocations want the definition
+// in a library, which the program's own copy would otherwise shadow.
+static int resolve(const link_object_t* object, uint32_t symbol, bool is_copy, link_symbol_t* symbol_out) {
+  const Elf64_Sym* sym = &object->symtab[symbol];
+  if (ELF64_ST_BIND(sym->st_info) == STB_LOCAL) {
+    *symbol_out = symbol_definition(object, sym);
+    return 0;
+  }
+
+  const char* name = (sym->st_name < object->strsz) ? object->strtab + sym->st_name : "";
+  for (size_t i = is_copy ? 1 : 0; i < num_objects; i++) {
+    const Elf64_Sym* definition = find_in_object(&objects[i], name);
+    if (definition) {
+      *symbol_out = symbol_definition(&objects[i], definition);
+      return 0;
+    }
+  }
+
+  // Undefined weak symbols are null
+  if (ELF64_ST_BIND(sym->st_info) == STB_WEAK) {
+    *symbol_out = (link_symbol_t){0};
+    return 0;
+  }
+  return set_error(-LINK_ERR_SYMBOL, name);
+}
+
+static bool is_writable(uint64_t address, uint64_t size) {
+  for (memory_region_t* region = get_memory_regions(); region; region = region->next) {
+    if (region_contains_address(region, address)) {
+      return region_contains_address(region, address + size - 1) && (region->header.p_flags & PF_W);
+    }
+  }
+  return false;
+}
+
+static int apply_fixup(const prelink_fixup_t* fixup) {
+  uint64_t size = fixup->copy_size ? fixup->copy_size : sizeof(uint64_t);
+  if (!is_writable(fixup->address, size)) {
+    return -LINK_ERR_READ_ONLY;
+  }
+  uint8_t* host = guest_to_host(fixup->address);
+
+  // What an IFUNC resolver returns is only known once the guest is running
+  if (fixup->flags & PRELINK_FIXUP_IFUNC) {
+    return 0;
+  }
+
+  if (fixup->copy_size) {
+    const uint8_t* source = guest_to_host(fixup->value);
+    if (!source || guest_to_host(fixup->value + size - 1) != source + size - 1) {
+      return -LINK_ERR_RELOCATION;
+    }
+    memcpy(host, source, size);
+  } else {
+    memcpy(host, &fixup->value, sizeof(fixup->value));
+  }
+  return 0;
+}
+
+// Fixups are applied as they're made, since later ones can copy from earlier ones
+static int add_fixup(uint64_t address, uint64_t value, uint64_t copy_size, uint64_t flags) {
+  if (num_fixups == fixups_capacity) {
+    size_t capacity = fixups_capacity ? fixups_capacity * 2 : 1024;
+    prelink_fixup_t* grown = realloc(fixups, capacity * sizeof(prelink_fixup_t));
+    if (!grown) {
+      return -LINK_ERR_MALLOC;
+    }
+    fixups = grown;
+    fixups_capacity = capacity;
+  }
+
+  prelink_fixup_t* fixup = &fixups[num_fixups++];
+  *fixup = (prelink_fixup_t){
+    .address = address,
+    .value = value,
+    .copy_size = copy_size,
+    .flags = flags,
+  };
+  return apply_fixup(fixup);
+}
+
+static int relocate_rela(const link_object_t* object, uint64_t table, uint64_t size) {
+  uint64_t bias = object->image.bias;
+
+  for (uint64_t offset = 0; offset + sizeof(Elf64_Rela) <= size; offset += sizeof(Elf64_Rela)) {
+    const Elf64_Rela* rela = guest_to_host(table + offset);
+    if (!rela) {
+      return set_error(-LINK_ERR_DYNAMIC, object->path);
+    }
+
+    uint32_t type = ELF64_R_TYPE(rela->r_info);
+    uint32_t symbol = ELF64_R_SYM(rela->r_info);
+    uint64_t address = rela->r_offset + bias;
+    if (type == R_X86_64_NONE) continue;
+
+    // The TLS relocations use symbol 0 for the object's own module
+    link_symbol_t sym = { .object = object };
+    if (symbol != STN_UNDEF) {
+      int ret = resolve(object, symbol, type == R_X86_64_COPY, &sym);
+      if (ret != 0) {
+        return ret;
+      }
+    }
+
+    // A reference to an IFUNC gets whatever its resolver returns, so there's
+    // nothing to add an addend to
+    uint64_t flags = (sym.type == STT_GNU_IFUNC) ? PRELINK_FIXUP_IFUNC : 0;
+    bool is_tls = type == R_X86_64_DTPMOD64 || type == R_X86_64_DTPOFF64 || type == R_X86_64_TPOFF64;
+    bool supported = (
+      (flags == 0 || type == R_X86_64_GLOB_DAT || type == R_X86_64_JUMP_SLOT || (type == R_X86_64_64 && rela->r_addend == 0))
+      && (!is_tls || (sym.object && sym.object->tls_module && (symbol == STN_UNDEF || sym.type == STT_TLS)))
+    );
+
+    int ret = 0;
+    switch (supported ? type : R_X86_64_NONE) {
+      case R_X86_64_RELATIVE:
+        ret = add_fixup(address, bias + rela->r_addend, 0, 0);
+        break;
+      case R_X86_64_64:
+        ret = add_fixup(address, sym.value + rela->r_addend, 0, flags);
+        break;
+      case R_X86_64_GLOB_DAT:
+      case R_X86_64_JUMP_SLOT:
+        ret = add_fixup(address, sym.value, 0, flags);
+        break;
+      case R_X86_64_COPY:
+        ret = add_fixup(address, sym.value, object->symtab[symbol].st_size, 0);
+        break;
+      case R_X86_64_IRELATIVE:
+        ret = add_fixup(address, bias + rela->r_addend, 0, PRELINK_FIXUP_IFUNC);
+        break;
+      case R_X86_64_DTPMOD64:
+        ret = add_fixup(address, sym.object->tls_module, 0, 0);
+        break;
+      case R_X86_64_DTPOFF64:
+        ret = add_fixup(address, sym.value + rela->r_addend, 0, 0);
+        break;
+      case R_X86_64_TPOFF64:
+        ret = add_fixup(address, sym.value + rela->r_addend - sym.object->tls_offset, 0, 0);
+        break;
+      default: {
+        char detail[ERROR_DETAIL_SIZE];
+        snprintf(detail, sizeof(detail), "type %u in %s", type, object->path);
+        return set_error(-LINK_ERR_RELOCATION, detail);
+      }
+    }
+    if (ret != 0) {
+      return set_error(ret, object->path);
+    }
+  }
+  return 0;
+}
+
+// Packed relative relocations: an address, then bitmaps of which of the next
+// 63 words also need relocating
+static int relocate_relr(const link_object_t* object) {
+  uint64_t bias = object->image.bias;
+  uint64_t where = 0;
+
+  for (uint64_t offset = 0; offset + sizeof(uint64_t) <= object->relrsz; offset += sizeof(uint64_t)) {
+    const uint64_t* entry = guest_to_host(object->relr + offset);
+    if (!entry) {
+      return set_error(-LINK_ERR_DYNAMIC, object->path);
+    }
+
+    uint64_t bitmap = *entry;
+    uint64_t count = 1;
+    if ((bitmap & 1) == 0) {
+      where = bitmap + bias;
+    } else {
+      bitmap >>= 1;
+      count = 63;
+    }
+
+    for (uint64_t i = 0; i < count; i++, bitmap >>= 1) {
+      if (count == 63 && !(bitmap & 1)) continue;
+      // The addend is whatever the word already holds
+      const uint64_t* addend = guest_to_host(where + i * sizeof(uint64_t));
+      int ret = addend ? add_fixup(where + i * sizeof(uint64_t), *addend + bias, 0, 0) : -LINK_ERR_DYNAMIC;
+      if (ret != 0) {
+        return set_error(ret, object->path);
+      }
+    }
+    where += count * sizeof(uint64_t);
+  }
+  return 0;
+}
+
+int link_program(const char* path, const loader_image_t* exe, link_result_t* result_out) {
+  num_objects = 0;
+  num_fixups = 0;
+
+  char program_path[LOADER_MAX_PATH];
+  if (!realpath(path, program_path)) {
+    return set_error(-LINK_ERR_NOT_FOUND, path);
+  }
+
+  link_object_t* program = add_object(program_path, exe->bias);
+  program->image = *exe;
+  int ret = parse_dynamic(program);
+  if (ret == 0) {
+    ret = load_libraries();
+  }
+  if (ret == 0) {
+    assign_tls();
+  }
+
+  // Libraries are relocated before whatever needs them, so the program's copy
+  // relocations see their data already relocated
+  for (size_t i = num_objects; ret == 0 && i-- > 0;) {
+    ret = relocate_relr(&objects[i]);
+    if (ret == 0) {
+      ret = relocate_rela(&objects[i], objects[i].rela, objects[i].relasz);
+    }
+    if (ret == 0) {
+      ret = relocate_rela(&objects[i], objects[i].jmprel, objects[i].pltrelsz);
+    }
+  }
+  if (ret != 0) {
+    return ret;
+  }
+
+  *result_out = (link_result_t){
+    .num_libraries = num_objects - 1,
+    .num_fixups = num_fixups,
+    .from_cache = false,
+  };
+  return 0;
+}
+
+// Calls the guest function at address as the main thread, with up to three
+// arguments, until it returns to LINK_RETURN_ADDRESS. Its registers are put
+// back as they were afterwards, apart from the value it returned.
+static int call_guest(cpu_x86_64_t* cpu, uint64_t address, uint64_t arg0, uint64_t arg1, uint64_t arg2, bool trace, uint64_t* result_out) {
+  uint64_t regs[16];
+  memcpy(regs, cpu->regs, sizeof(regs));
+  uint64_t rip = cpu->rip;
+  rflags_t rflags = cpu->rflags;
+
+  // Pushing the return address leaves rsp as a call from an aligned frame would
+  uint64_t rsp = ((cpu->regs[modrm_rsp] - 128) & ~0xfULL) - sizeof(uint64_t);
+  uint64_t return_address = LINK_RETURN_ADDRESS;
+  uint8_t* host = guest_range_to_host(rsp, sizeof(return_address), true);
+  if (!host) {
+    return -CPU_ERR_SEGMENTATION_FAULT;
+  }
+  memcpy(host, &return_address, sizeof(return_address));
+
+  cpu->regs[modrm_rsp] = rsp;
+  cpu->regs[modrm_rdi] = arg0;
+  cpu->regs[modrm_rsi] = arg1;
+  cpu->regs[modrm_rdx] = arg2;
+  cpu->rip = address;
+
+  // The return lands on an unmapped page, so a successful run ends in the
+  // instruction fetch failing there
+  int ret = run_blocks(cpu, RUN_UNLIMITED, trace);
+  if (ret < 0 && cpu->rip == LINK_RETURN_ADDRESS) {
+    ret = 0;
+  }
+  if (ret != 0) {
+    return ret;
+  }
+
+  if (result_out) {
+    *result_out = cpu->regs[modrm_rax];
+  }
+  memcpy(cpu->regs, regs, sizeof(regs));
+  cpu->rip = rip;
+  cpu->rflags = rflags;
+  return 0;
+}
+
+// fs:0 and fs:0x10 both point at the TCB itself, as glibc and musl expect
+static int set_up_tls(cpu_x86_64_t* cpu) {
+  uint64_t tcb_offset = (tls_size + tls_align - 1) & ~(tls_align - 1);
+  uint64_t size = (tcb_offset + LINK_TCB_SIZE + GUEST_PAGE_SIZE - 1) & ~(uint64_t)(GUEST_PAGE_SIZE - 1);
+  uint64_t address = 0;
+  if (map_guest_memory(&address, size, MAP_PLACE_ANYWHERE, PF_R | PF_W, false, -1, 0) != 0) {
+    return -LINK_ERR_MALLOC;
+  }
+
+  // Fresh anonymous memory, so the blocks' .tbss parts are already zero
+  uint64_t tp = address + tcb_offset;
+  uint8_t* host = guest_to_host(address);
+  for (size_t i = 0; i < num_objects; i++) {
+    const loader_image_t* image = &objects[i].image;
+    if (!objects[i].tls_module || image->tls_filesz == 0) continue;
+
+    const uint8_t* source = guest_range_to_host(image->tls_image, image->tls_filesz, false);
+    if (!source || image->tls_filesz > image->tls_memsz) {
+      return set_error(-LINK_ERR_DYNAMIC, objects[i].path);
+    }
+    memcpy(host + (tp - objects[i].tls_offset - address), source, image->tls_filesz);
+  }
+  memcpy(host + tcb_offset, &tp, sizeof(tp));
+  memcpy(host + tcb_offset + 0x10, &tp, sizeof(tp));
+
+  cpu->seg_base[SEG_FS] = tp;
+  return 0;
+}
+
+// DT_INIT_ARRAY and DT_PREINIT_ARRAY are arrays of function pointers, already relocated
+static int call_init_array(cpu_x86_64_t* cpu, uint64_t array, uint64_t size, const uint64_t* args, bool trace) {
+  for (uint64_t offset = 0; offset + sizeof(uint64_t) <= size; offset += sizeof(uint64_t)) {
+    const uint64_t* function = guest_range_to_host(array + offset, sizeof(uint64_t), false);
+    if (!function) {
+      return -CPU_ERR_SEGMENTATION_FAULT;
+    }
+    // 0 and -1 are left in by some linkers as terminators
+    if (*function == 0 || *function == UINT64_MAX) continue;
+
+    int ret = call_guest(cpu, *function, args[0], args[1], args[2], trace, NULL);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+int link_start_guest(guest_context_t* guest, bool trace) {
+  cpu_x86_64_t* cpu = &guest->cpu;
+
+  int ret = set_up_tls(cpu);
+  if (ret != 0) {
+    return ret;
+  }
+
+  for (size_t i = 0; i < num_fixups; i++) {
+    if (!(fixups[i].flags & PRELINK_FIXUP_IFUNC)) continue;
+
+    prelink_fixup_t resolved = { .address = fixups[i].address };
+    ret = call_guest(cpu, fixups[i].value, 0, 0, 0, trace, &resolved.value);
+    if (ret == 0) {
+      ret = apply_fixup(&resolved);
+    }
+    if (ret != 0) {
+      guest->result = ret;
+      return 0;
+    }
+  }
+
+  // Initializers get argc, argv and envp, from the stack the guest starts with
+  uint64_t rsp = cpu->regs[modrm_rsp];
+  const uint64_t* argc = guest_range_to_host(rsp, sizeof(uint64_t), false);
+  if (!argc) {
+    return -LINK_ERR_DYNAMIC;
+  }
+  uint64_t args[3] = { *argc, rsp + 8, rsp + 8 * (*argc + 2) };
+
+  // The program's preinitializers, then each library's initializers with
+  // their dependencies' first. The program's own are left to its startup
+  // code, as ld.so leaves them to libc's.
+  ret = call_init_array(cpu, objects[0].preinit_array, objects[0].preinit_arraysz, args, trace);
+  for (size_t i = num_objects; ret == 0 && i-- > 1;) {
+    if (objects[i].init) {
+      ret = call_guest(cpu, objects[i].init, args[0], args[1], args[2], trace, NULL);
+    }
+    if (ret == 0) {
+      ret = call_init_array(cpu, objects[i].init_array, objects[i].init_arraysz, args, trace);
+    }
+  }
+
+  // The guest exiting or faulting in there is its own result, not a linking error
+  guest->result = ret;
+  return 0;
+}
+
+uint64_t prelink_key(const char* path, const loader_image_t* exe) {
+  prelink_object_t identity = {0};
+  file_identity(path, &identity);
+
+  uint64_t hash = fnv1a(FNV_OFFSET_BASIS, UE_VERSION, sizeof(UE_VERSION));
+  hash = fnv1a(hash, &identity, sizeof(identity));
+  hash = fnv1a(hash, &exe->bias, sizeof(exe->bias));
+
+  // Which libraries are found can depend on it
+  const char* library_path = getenv("LD_LIBRARY_PATH");
+  if (library_path) {
+    hash = fnv1a(hash, library_path, strlen(library_path));
+  }
+  return hash;
+}
+
+static void cache_path(char* path_out, const char* dir, uint64_t key) {
+  snprintf(path_out, LOADER_MAX_PATH, "%s/%016lx.prelink", dir, key);
+}
+
+static bool header_is_valid(const prelink_header_t* header, uint64_t key, size_t file_size) {
+  return (
+    header->magic == PRELINK_MAGIC
+    && header->format_version == PRELINK_FORMAT_VERSION
+    && strncmp(header->emulator_version, UE_VERSION, sizeof(header->emulator_version)) == 0
+    && header->key == key
+    && header->num_objects >= 1
+    && header->num_objects <= LINK_MAX_OBJECTS
+    && header->num_fixups <= file_size / sizeof(prelink_fixup_t)
+    && header->strings_size > 0
+    && sizeof(prelink_header_t) + header->num_objects * sizeof(prelink_object_t)
+       + header->num_fixups * sizeof(prelink_fixup_t) + header->strings_size == file_size
+  );
+}
+
+int prelink_load(const char* dir, uint64_t key, const char* path, const loader_image_t* exe, link_result_t* result_out) {
+  char file_path[LOADER_MAX_PATH];
+  cache_path(file_path, dir, key);
+
+  FILE* fp = fopen(file_path, "rb");
+  if (!fp) {
+    return -LINK_ERR_CACHE_NOT_FOUND;
+  }
+
+  size_t file_size = GetFileSize(fp);
+  uint8_t* contents = malloc(file_size);
+  if (!contents) {
+    fclose(fp);
+    return -LINK_ERR_MALLOC;
+  }
+  bool ok = file_size >= sizeof(prelink_header_t) && fread(contents, file_size, 1, fp) == 1;
+  fclose(fp);
+
+  const prelink_header_t* header = (const prelink_header_t*)contents;
+  if (!ok || !header_is_valid(header, key, file_size)) {
+    free(contents);
+    return ok ? -LINK_ERR_CACHE_STALE : -LINK_ERR_CACHE_BAD_FILE;
+  }
+
+  const prelink_object_t* records = (const prelink_object_t*)(header + 1);
+  const prelink_fixup_t* cached_fixups = (const prelink_fixup_t*)(records + header->num_objects);
+  const char* strings = (const char*)(cached_fixups + header->num_fixups);
+  if (strings[header->strings_size - 1] != '\0') {
+    free(contents);
+    return -LINK_ERR_CACHE_BAD_FILE;
+  }
+
+  // Every library must be just as it was, before anything is mapped
+  for (size_t i = 0; i < header->num_objects; i++) {
+    prelink_object_t identity = {0};
+    if (records[i].path_offset >= header->strings_size
+        || !file_identity(strings + records[i].path_offset, &identity)
+        || identity.dev != records[i].dev || identity.ino != records[i].ino
+        || identity.size != records[i].size || identity.mtime != records[i].mtime) {
+      free(contents);
+      return -LINK_ERR_CACHE_STALE;
+    }
+  }
+
+  num_objects = 0;
+  num_fixups = 0;
+  link_object_t* program = add_object(strings + records[0].path_offset, records[0].base);
+  program->image = *exe;
+
+  // No symbols are looked up, but the initializers and TLS are still needed
+  // from the dynamic sections
+  int ret = parse_dynamic(program);
+  for (size_t i = 1; ret == 0 && i < header->num_objects; i++) {
+    link_object_t* library = add_object(strings + records[i].path_offset, records[i].base);
+    if (loader_load_file(library->path, library->base, &library->image) != 0) {
+      ret = set_error(-LINK_ERR_LOAD, library->path);
+    } else {
+      ret = parse_dynamic(library);
+    }
+  }
+  if (ret == 0) {
+    assign_tls();
+  }
+
+  for (size_t i = 0; ret == 0 && i < header->num_fixups; i++) {
+    ret = add_fixup(cached_fixups[i].address, cached_fixups[i].value, cached_fixups[i].copy_size, cached_fixups[i].flags);
+    if (ret != 0) {
+      set_error(ret, path);
+    }
+  }
+
+  free(contents);
+  if (ret != 0) {
+    return ret;
+  }
+
+  *result_out = (link_result_t){
+    .num_libraries = num_objects - 1,
+    .num_fixups = num_fixups,
+    .from_cache = true,
+  };
+  return 0;
+}
+
+int prelink_save(const char* dir, uint64_t key) {
+  if (num_objects == 0) {
+    return 0;
+  }
+
+  char path[LOADER_MAX_PATH];
+  char tmp_path[LOADER_MAX_PATH + 32];
+  cache_path(path, dir, key);
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, getpid());
+
+  FILE* fp = fopen(tmp_path, "wb");
+  if (!fp) {
+    return -LINK_ERR_CACHE_WRITE;
+  }
+
+  prelink_header_t header = {
+    .magic = PRELINK_MAGIC,
+    .format_version = PRELINK_FORMAT_VERSION,
+    .key = key,
+    .num_objects = num_objects,
+    .num_fixups = num_fixups,
+  };
+  strncpy(header.emulator_version, UE_VERSION, sizeof(header.emulator_version));
+  for (size_t i = 0; i < num_objects; i++) {
+    header.strings_size += strlen(objects[i].path) + 1;
+  }
+
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+  uint64_t path_offset = 0;
+  for (size_t i = 0; ok && i < num_objects; i++) {
+    prelink_object_t record = objects[i].identity;
+    record.base = objects[i].base;
+    record.path_offset = path_offset;
+    ok = fwrite(&record, sizeof(record), 1, fp) == 1;
+    path_offset += strlen(objects[i].path) + 1;
+  }
+
+  if (ok && num_fixups) {
+    ok = fwrite(fixups, sizeof(prelink_fixup_t), num_fixups, fp) == num_fixups;
+  }
+
+  for (size_t i = 0; ok && i < num_objects; i++) {
+    ok = fwrite(objects[i].path, strlen(objects[i].path) + 1, 1, fp) == 1;
+  }
+
+  ok = (fclose(fp) == 0) && ok;
+
+  // Renaming makes the new file visible atomically to concurrent runs
+  if (!ok || rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+    return -LINK_ERR_CACHE_WRITE;
+  }
+
+  return 0;
+}
+
+static char* link_errors[] = {
+  "Unknown",
+  "Library not found",
+  "Too many libraries",
+  "Library couldn't be loaded",
+  "Bad dynamic section",
+  "Undefined symbol",
+  "Unsupported relocation",
+  "Relocation in read-only memory",
+  "Unable to allocate memory",
+  "No prelink cache file found",
+  "Prelink cache file is malformed",
+  "Prelink cache file is stale",
+  "Unable to write prelink cache file",
+};
+
+char* link_err_message(int errorIndex) {
+  if (errorIndex < 0) {
+    errorIndex *= -1;
+  }
+
+  if (errorIndex >= LINK_ERR_NUM_ERRORS) {
+    return link_errors[LINK_ERR_UNKNOWN];
+  }
+  return link_errors[errorIndex];
+}
@@ -0,0 +1,223 @@
+#include <sys/auxv.h>
+#include <unistd.h>
+#include "ue-loader.h"
+#include "ue-memory.h"
+
+#define PAGE_MASK         (~0xfffULL)
+#define MAX_AUXV_ENTRIES  (24)
+
+int loader_load_image(FILE* fp, const Elf64_Ehdr* header, uint64_t base, loader_image_t* image_out, char* interp_out) {
+  memset(image_out, 0, sizeof(loader_image_t));
+  if (interp_out) {
+    interp_out[0] = '\0';
+  }
+
+  if (header->e_phentsize != sizeof(Elf64_Phdr) || header->e_phnum == 0) {
+    return -LOADER_ERR_ELF;
+  }
+
+  Elf64_Phdr* phdrs = malloc(header->e_phnum * sizeof(Elf64_Phdr));
+  if (!phdrs) {
+    return -LOADER_ERR_MALLOC;
+  }
+  if (elf_parse_program_headers(fp, header, phdrs) != 0) {
+    free(phdrs);
+    return -LOADER_ERR_ELF;
+  }
+
+  // A position independent file is moved as a whole so its first page lands on base
+  uint64_t lowest = UINT64_MAX;
+  for (size_t i = 0; i < header->e_phnum; i++) {
+    if (phdrs[i].p_type == PT_LOAD && phdrs[i].p_vaddr < lowest) {
+      lowest = phdrs[i].p_vaddr;
+    }
+  }
+  if (lowest == UINT64_MAX) {
+    free(phdrs);
+    return -LOADER_ERR_ELF;
+  }
+
+  uint64_t bias = (header->e_type == ET_DYN) ? base - (lowest & PAGE_MASK) : 0;
+  image_out->bias = bias;
+  image_out->entry = header->e_entry + bias;
+  image_out->phnum = header->e_phnum;
+
+  int ret = 0;
+  for (size_t i = 0; i < header->e_phnum && ret == 0; i++) {
+    Elf64_Phdr phdr = phdrs[i];
+
+    if (phdr.p_type == PT_LOAD) {
+      phdr.p_vaddr += bias;
+      phdr.p_paddr += bias;
+      if (load_memory_region(&phdr, fp) != 0) {
+        ret = -LOADER_ERR_MAP;
+      }
+      if (phdr.p_vaddr + phdr.p_memsz > image_out->end) {
+        image_out->end = phdr.p_vaddr + phdr.p_memsz;
+      }
+
+      // Without a PT_PHDR, the headers are found in whichever segment maps them
+      uint64_t phdrs_end = header->e_phoff + header->e_phnum * sizeof(Elf64_Phdr);
+      if (!image_out->phdr && header->e_phoff >= phdr.p_offset && phdrs_end <= phdr.p_offset + phdr.p_filesz) {
+        image_out->phdr = phdr.p_vaddr + (header->e_phoff - phdr.p_offset);
+      }
+    } else if (phdr.p_type == PT_PHDR) {
+      image_out->phdr = phdr.p_vaddr + bias;
+    } else if (phdr.p_type == PT_DYNAMIC) {
+      image_out->dynamic = phdr.p_vaddr + bias;
+    } else if (phdr.p_type == PT_TLS) {
+      image_out->tls_image = phdr.p_vaddr + bias;
+      image_out->tls_filesz = phdr.p_filesz;
+      image_out->tls_memsz = phdr.p_memsz;
+      image_out->tls_align = phdr.p_align ? phdr.p_align : 1;
+    } else if (phdr.p_type == PT_INTERP && interp_out) {
+      if (phdr.p_filesz == 0 || phdr.p_filesz > LOADER_MAX_PATH
+          || fseek(fp, phdr.p_offset, SEEK_SET) != 0
+          || fread(interp_out, phdr.p_filesz, 1, fp) != 1) {
+        ret = -LOADER_ERR_INTERP;
+      } else {
+        interp_out[phdr.p_filesz - 1] = '\0';
+      }
+    }
+  }
+
+  free(phdrs);
+  return ret;
+}
+
+int loader_load_file(const char* path, uint64_t base, loader_image_t* image_out) {
+  FILE* fp = fopen(path, "rb");
+  if (!fp) {
+    return -LOADER_ERR_OPEN;
+  }
+
+  // The segments stay mapped once the file is closed
+  Elf64_Ehdr header;
+  int ret = elf_parse_header(fp, &header);
+  if (ret != 0) {
+    ret = -LOADER_ERR_ELF;
+  } else {
+    ret = loader_load_image(fp, &header, base, image_out, NULL);
+  }
+
+  fclose(fp);
+  return ret;
+}
+
+typedef struct stack_builder_t {
+  uint8_t* buffer;  // Host copy of the top size bytes
+  uint64_t size;
+  uint64_t address; // Lowest guest address pushed so far
+  uint64_t top;
+} stack_builder_t;
+
+static uint8_t* builder_host(stack_builder_t* builder, uint64_t address) {
+  return builder->buffer + (address - (builder->top - builder->size));
+}
+
+// Copies bytes to just below everything pushed so far, returning their guest address
+static uint64_t push_bytes(stack_builder_t* builder, const void* data, size_t size) {
+  builder->address -= size;
+  memcpy(builder_host(builder, builder->address), data, size);
+  return builder->address;
+}
+
+int loader_build_stack(int argc, char** argv, const uint8_t* random, const loader_image_t* exe, const loader_image_t* interp, uint64_t stack_top, uint64_t* rsp_out) {
+  // Everything is put together on the host first, then copied in one go
+  uint64_t strings_size = 0;
+  for (int i = 0; i < argc; i++) {
+    strings_size += strlen(argv[i]) + 1;
+  }
+  if (argc < 1 || strings_size > LOADER_MAX_ARGS_SIZE) {
+    return -LOADER_ERR_STACK;
+  }
+
+  // argc, argv and its null, an empty envp, then the auxiliary vector
+  size_t max_words = 1 + (argc + 1) + 1 + MAX_AUXV_ENTRIES * 2;
+  stack_builder_t builder = {
+    .size = strings_size + sizeof(LOADER_PLATFORM) + LOADER_RANDOM_BYTES + (max_words + 2) * sizeof(uint64_t),
+    .address = stack_top,
+    .top = stack_top,
+  };
+  builder.buffer = calloc(1, builder.size);
+  uint64_t* words = calloc(max_words, sizeof(uint64_t));
+  if (!builder.buffer || !words) {
+    free(builder.buffer);
+    free(words);
+    return -LOADER_ERR_MALLOC;
+  }
+
+  // The strings and random bytes go at the very top, in order from argv[0]
+  // up as under the kernel. AT_EXECFN points at argv[0].
+  size_t num_words = 0;
+  words[num_words++] = argc;
+  for (int i = argc - 1; i >= 0; i--) {
+    words[1 + i] = push_bytes(&builder, argv[i], strlen(argv[i]) + 1);
+  }
+  num_words += argc;
+  words[num_words++] = 0;
+  words[num_words++] = 0;
+  uint64_t path_address = words[1];
+  uint64_t platform_address = push_bytes(&builder, LOADER_PLATFORM, sizeof(LOADER_PLATFORM));
+  uint64_t random_address = push_bytes(&builder, random, LOADER_RANDOM_BYTES);
+
+#define AUXV(type, value) do { words[num_words++] = (type); words[num_words++] = (value); } while (0)
+  AUXV(AT_PHDR, exe->phdr);
+  AUXV(AT_PHENT, sizeof(Elf64_Phdr));
+  AUXV(AT_PHNUM, exe->phnum);
+  AUXV(AT_PAGESZ, GUEST_PAGE_SIZE);
+  AUXV(AT_BASE, interp ? interp->bias : 0);
+  AUXV(AT_FLAGS, 0);
+  AUXV(AT_ENTRY, exe->entry);
+  AUXV(AT_UID, getuid());
+  AUXV(AT_EUID, geteuid());
+  AUXV(AT_GID, getgid());
+  AUXV(AT_EGID, getegid());
+  AUXV(AT_SECURE, 0);
+  AUXV(AT_RANDOM, random_address);
+  AUXV(AT_HWCAP, getauxval(AT_HWCAP));
+  AUXV(AT_CLKTCK, sysconf(_SC_CLK_TCK));
+  AUXV(AT_PLATFORM, platform_address);
+  AUXV(AT_EXECFN, path_address);
+  AUXV(AT_NULL, 0);
+#undef AUXV
+
+  // rsp points at argc, and is 16-byte aligned as the ABI requires
+  builder.address = (builder.address - num_words * sizeof(uint64_t)) & ~0xfULL;
+  memcpy(builder_host(&builder, builder.address), words, num_words * sizeof(uint64_t));
+  free(words);
+
+  // The stack is a single region, so both ends being mapped means all of it is
+  uint64_t size = stack_top - builder.address;
+  uint8_t* host = guest_to_host(builder.address);
+  if (!host || guest_to_host(stack_top - 1) != host + size - 1) {
+    free(builder.buffer);
+    return -LOADER_ERR_STACK;
+  }
+  memcpy(host, builder_host(&builder, builder.address), size);
+
+  *rsp_out = builder.address;
+  free(builder.buffer);
+  return 0;
+}
+
+static char* loader_errors[] = {
+  "Unknown",
+  "Couldn't open the file",
+  "Not a loadable ELF file",
+  "Unable to allocate memory",
+  "Couldn't map a segment",
+  "Bad program interpreter",
+  "Initial stack doesn't fit",
+};
+
+char* loader_err_message(int errorIndex) {
+  if (errorIndex < 0) {
+    errorIndex *= -1;
+  }
+
+  if (errorIndex >= LOADER_ERR_NUM_ERRORS) {
+    return loader_errors[LOADER_ERR_UNKNOWN];
+  }
+  return loader_errors[errorIndex];
+}
@@ -1,7 +1,65 @@
+#include <sys/mman.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
 #include "ue-memory.h"
+#include "ue-block.h"
+#include "ue-stats.h"
+#include "ue-watch.h"
 
 static memory_region_t* region_ll = NULL;
 static size_t num_regions = 0;
+static uint64_t brk_start = 0;
+static uint64_t brk_end = 0;
+// The span of every range whose decoded code has been thrown away because it
+// changed, empty (start == end) until something has
+static uint64_t code_modified_start = 0;
+static uint64_t code_modified_end = 0;
+static pthread_mutex_t code_modified_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool use_hugepages = false;
+
+// Host address of guest address 0, and one byte of PAGE_* flags for every guest
+// page. Both are reserved in full up front, but only cost anything once touched.
+static uint8_t* guest_base = NULL;
+static uint8_t* page_flags = NULL;
+static uint8_t* space_mapping = NULL;
+static size_t space_mapping_size = 0;
+
+#define PAGE_FLAGS_SIZE  ((GUEST_SPACE_SIZE >> GUEST_PAGE_SHIFT) + 1)
+
+__thread sigjmp_buf* memory_fault_recovery = NULL;
+__thread int memory_fault_recovery_blocked = 0;
+static __thread uint64_t last_fault_address = 0;
+
+// The region list changes at run time (mmap() and friends), while other guest
+// threads look things up in it. Guest accesses never need it, so it's only
+// taken on the emulator's own slow paths. Nothing under it touches guest memory
+// except replay restores, and a fault there is a crash (see ue-memory.h).
+static pthread_rwlock_t regions_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void code_write_slow_path(uint64_t address, uint64_t size);
+
+static void lock_regions(bool write) {
+  if (write) {
+    pthread_rwlock_wrlock(&regions_lock);
+  } else {
+    pthread_rwlock_rdlock(&regions_lock);
+  }
+  block_fault_recovery();
+}
+
+static void unlock_regions(void) {
+  allow_fault_recovery();
+  pthread_rwlock_unlock(&regions_lock);
+}
+
+bool was_code_modified(uint64_t address, uint64_t size) {
+  pthread_mutex_lock(&code_modified_lock);
+  bool modified = (address < code_modified_end) && (code_modified_start < address + size);
+  pthread_mutex_unlock(&code_modified_lock);
+  return modified;
+}
 
 memory_region_t* get_memory_regions(void) {
   return region_ll;
@@ -14,9 +72,6 @@ size_t get_num_memory_regions(void) {
 int free_memory_regions(void) {
   memory_region_t* temp;
   while (region_ll) {
-    // Free the actual memory
-    free(region_ll->buffer);
-
     // Keep track of the region so we can move the pointer to the next region
     temp = region_ll;
     region_ll = region_ll->next;
@@ -24,89 +79,314 @@ int free_memory_regions(void) {
     // Free the region data itself
     free(temp);
   }
+  num_regions = 0;
+
+  // The memory itself all goes at once
+  if (space_mapping) {
+    munmap(space_mapping, space_mapping_size);
+    munmap(page_flags, PAGE_FLAGS_SIZE);
+    space_mapping = NULL;
+    guest_base = NULL;
+    page_flags = NULL;
+  }
   return 0;
 }
 
-static memory_region_t* get_last_region(void) {
-  if (region_ll == NULL) return NULL;
+static void append_region(memory_region_t* region) {
+  if (region_ll == NULL) {
+    region_ll = region;
+  } else {
+    memory_region_t* ptr = region_ll;
+    while (ptr->next != NULL) {
+      ptr = ptr->next;
+    }
+    ptr->next = region;
+  }
+  num_regions++;
+}
+
+void set_memory_hugepages(bool enabled) {
+  use_hugepages = enabled;
+}
+
+static inline uint64_t page_floor(uint64_t address) {
+  return address & ~(GUEST_PAGE_SIZE - 1);
+}
+
+static inline uint64_t page_ceil(uint64_t address) {
+  return (address + GUEST_PAGE_SIZE - 1) & ~(GUEST_PAGE_SIZE - 1);
+}
+
+static inline size_t page_index(uint64_t address) {
+  return address >> GUEST_PAGE_SHIFT;
+}
+
+// Flags are changed atomically by other threads, so they're loaded atomically
+// too. A relaxed byte load costs the same as a plain one.
+static inline uint8_t page_flags_at(uint64_t address) {
+  return __atomic_load_n(&page_flags[page_index(address)], __ATOMIC_RELAXED);
+}
+
+static inline bool in_space(uint64_t address, uint64_t size) {
+  return address < GUEST_SPACE_SIZE && size <= GUEST_SPACE_SIZE - address;
+}
+
+// Reserves the guest address space on first use. One page past the end is kept
+// as a guard, so an access starting in the last page can run off it and fault.
+// The base is aligned to HUGE_PAGE_SIZE, so host and guest addresses are
+// congruent modulo it, and every 2MiB-aligned guest range can land on a single
+// (transparent) huge page on the host.
+static int reserve_space(void) {
+  if (guest_base) return 0;
+
+  space_mapping_size = GUEST_SPACE_SIZE + GUEST_PAGE_SIZE + HUGE_PAGE_SIZE;
+  space_mapping = mmap(NULL, space_mapping_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (space_mapping == MAP_FAILED) {
+    space_mapping = NULL;
+    return -MEM_ERR_MMAP;
+  }
 
-  memory_region_t* ptr = region_ll;
-  while (ptr->next != NULL) {
-    ptr = ptr->next;
+  page_flags = mmap(NULL, PAGE_FLAGS_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (page_flags == MAP_FAILED) {
+    munmap(space_mapping, space_mapping_size);
+    space_mapping = NULL;
+    page_flags = NULL;
+    return -MEM_ERR_MMAP;
   }
-  return ptr;
+
+  guest_base = (uint8_t*)(((uint64_t)space_mapping + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+  return 0;
 }
 
-int load_memory_region(Elf64_Phdr* program_header, FILE* fp) {
-  // Allocate memory for a memory_region_t to hold region data
-  memory_region_t* region = calloc(1, sizeof(memory_region_t));
-  if (!region) {
-    return -MEM_ERR_MALLOC;
+// Zeroed, writable pages over [start, end), both page aligned
+static int map_anonymous(uint64_t start, uint64_t end) {
+  if (end <= start) return 0;
+  if (mmap(guest_base + start, end - start, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+    return -MEM_ERR_MMAP;
   }
+  return 0;
+}
 
-  // If this is the first region, just set it in the list
-  if (region_ll == NULL) {
-    region_ll = region;
-  } else {
-    // Otherwise, append to the end of the linked list
-    get_last_region()->next = region;
+static bool region_overlaps(const memory_region_t* region, uint64_t address, uint64_t size) {
+  return (address < region->header.p_vaddr + region->header.p_memsz) && (region->header.p_vaddr < address + size);
+}
+
+// PF_X implies PROT_READ, since the emulator needs to read code in order to decode it
+static int region_prot(const memory_region_t* region) {
+  int prot = PROT_NONE;
+  if (region->header.p_flags & (PF_R | PF_X)) prot |= PROT_READ;
+  if (region->header.p_flags & PF_W) prot |= PROT_WRITE;
+  return prot;
+}
+
+// Every permission needed by any region on the page
+static int page_prot(uint64_t page) {
+  int prot = PROT_NONE;
+  for (memory_region_t* region = region_ll; region; region = region->next) {
+    if (region_overlaps(region, page, GUEST_PAGE_SIZE)) prot |= region_prot(region);
   }
+  return prot;
+}
 
-  // We're only going to allocate memory in this region if the segment specifies it
-  if (program_header->p_memsz > 0) {
-  // Allocate a buffer with enough space for the bytes (according to p_memsz)
-    region->buffer = calloc(1, program_header->p_memsz);
-    if (!region->buffer) {
-      return -MEM_ERR_MALLOC;
+// Asks for the region to be backed by transparent huge pages. This has to come
+// after the region's final mapping is in place, since mapping over part of a
+// range with MAP_FIXED replaces it with a new mapping, which doesn't keep the
+// advice. Regions smaller than HUGEPAGE_MIN_REGION_SIZE (which includes the
+// stack, and most segments of ordinary programs) are left on small pages.
+// Failure isn't fatal, we just keep using small pages.
+static void advise_hugepages(memory_region_t* region) {
+  uint64_t start = page_floor(region->header.p_vaddr);
+  uint64_t end = page_ceil(region->header.p_vaddr + region->header.p_memsz);
+  if (use_hugepages && end - start >= HUGEPAGE_MIN_REGION_SIZE) {
+    madvise(guest_base + start, end - start, MADV_HUGEPAGE);
+  }
+}
+
+// Takes write permission away on the host from a writable page with code in
+// it. The flag goes on after the protection, so a store which faults always
+// finds it.
+static void write_protect_code_page(uint64_t page) {
+  if (mprotect(guest_base + page, GUEST_PAGE_SIZE, PROT_READ) == 0) {
+    __atomic_fetch_or(&page_flags[page_index(page)], PAGE_WRITE_PROTECTED, __ATOMIC_RELAXED);
+  }
+}
+
+// Applies the segment's permissions to the host pages backing it. Segments can
+// share a page at either end with their neighbours, as under the kernel, and
+// those pages get the permissions of both.
+static int protect_region(memory_region_t* region) {
+  uint64_t start = page_floor(region->header.p_vaddr);
+  uint64_t end = page_ceil(region->header.p_vaddr + region->header.p_memsz);
+
+  if (mprotect(guest_base + start, end - start, region_prot(region)) != 0
+      || mprotect(guest_base + start, GUEST_PAGE_SIZE, page_prot(start)) != 0
+      || mprotect(guest_base + end - GUEST_PAGE_SIZE, GUEST_PAGE_SIZE, page_prot(end - GUEST_PAGE_SIZE)) != 0) {
+    return -MEM_ERR_MMAP;
+  }
+
+  // Pages with code in them stay read-only, whatever the segment allows
+  if (region->header.p_flags & PF_W) {
+    for (uint64_t page = start; page < end; page += GUEST_PAGE_SIZE) {
+      if (page_flags_at(page) & PAGE_HAS_CODE) {
+        write_protect_code_page(page);
+      }
     }
+  }
+  return 0;
+}
 
-    // Seek to the offset for this segments data
-    if (fseek(fp, program_header->p_offset, SEEK_SET) != 0) {
+// Whether any region other than the one being loaded already uses the page
+static bool page_in_use(uint64_t page) {
+  for (memory_region_t* region = region_ll; region; region = region->next) {
+    if (region_overlaps(region, page, GUEST_PAGE_SIZE)) return true;
+  }
+  return false;
+}
+
+// Segments are mapped straight from the ELF file with MAP_PRIVATE, rather than
+// read into a private buffer. Pages which are never written (all of the code,
+// and most read-only data) stay shared with the page cache, so any number of
+// concurrent instances of the same binary share one copy of them. Written pages
+// are copied on write.
+//
+// As under the kernel, each segment lands exactly at its guest address, so
+// segments which are adjacent in the guest (.data and .bss, say) are adjacent
+// on the host too, with nothing in between.
+static int map_segment(const Elf64_Phdr* program_header, FILE* fp) {
+  uint64_t start = page_floor(program_header->p_vaddr);
+  uint64_t file_end = program_header->p_vaddr + program_header->p_filesz;
+  uint64_t mem_end = program_header->p_vaddr + program_header->p_memsz;
+  uint64_t anonymous_start = start;
+
+  if (program_header->p_filesz > 0) {
+    // ELF guarantees p_offset and p_vaddr are congruent modulo the page size, so
+    // the mapping starts at the page containing p_offset
+    uint64_t page_delta = program_header->p_vaddr - start;
+    if ((program_header->p_offset & (GUEST_PAGE_SIZE - 1)) != page_delta) {
       return -MEM_ERR_ELF_READ;
     }
 
-    // Read p_filesz bytes from the file into the buffer
-    if (fread(region->buffer, program_header->p_filesz, 1, fp) != 1) {
+    void* file_mapping = mmap(
+      guest_base + start,
+      page_delta + program_header->p_filesz,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_FIXED,
+      fileno(fp),
+      program_header->p_offset - page_delta
+    );
+    if (file_mapping == MAP_FAILED) {
       return -MEM_ERR_ELF_READ;
     }
+    anonymous_start = page_ceil(file_end);
+  } else if (page_in_use(start)) {
+    // The first page belongs to the previous segment too, and keeps its contents
+    if (mprotect(guest_base + start, GUEST_PAGE_SIZE, PROT_READ | PROT_WRITE) != 0) {
+      return -MEM_ERR_MMAP;
+    }
+    anonymous_start = start + GUEST_PAGE_SIZE;
   }
 
-  // Copy the header data to the region struct
-  memcpy(&region->header, program_header, sizeof(Elf64_Phdr));
+  // The rest of the last file page (or the shared first page) can contain
+  // bytes from beyond p_filesz, which must read as zero
+  uint64_t zero_end = (anonymous_start < mem_end) ? anonymous_start : mem_end;
+  if (zero_end > file_end) {
+    memset(guest_base + file_end, 0, zero_end - file_end);
+  }
 
-  // Success
-  return 0;
+  // Then the .bss part of the segment, beyond p_filesz, as zeroed anonymous memory
+  return map_anonymous(anonymous_start, page_ceil(mem_end));
 }
 
-int create_stack_region(const uint64_t start_address) {
+// Brings PAGE_EXECUTABLE and PAGE_WRITABLE up to date over [start, end), after
+// the regions there have changed. Each flag is only ever set or cleared once,
+// with no moment in between where a page looks like it has lost a permission
+// it keeps, since other threads fetch and fault without the regions lock.
+static void update_page_permissions(uint64_t start, uint64_t end) {
+  start = page_floor(start);
+  end = page_ceil(end);
+
+  bool any_overlap = false;
+  for (memory_region_t* region = region_ll; region && !any_overlap; region = region->next) {
+    any_overlap = (region->header.p_flags & (PF_X | PF_W)) && region_overlaps(region, start, end - start);
+  }
+
+  for (uint64_t page = start; page < end; page += GUEST_PAGE_SIZE) {
+    uint8_t wanted = 0;
+    for (memory_region_t* region = region_ll; any_overlap && region; region = region->next) {
+      if (region_overlaps(region, page, GUEST_PAGE_SIZE)) {
+        if (region->header.p_flags & PF_X) wanted |= PAGE_EXECUTABLE;
+        if (region->header.p_flags & PF_W) wanted |= PAGE_WRITABLE;
+      }
+    }
+
+    // A page the guest can't write any more is read-only on the host anyway
+    uint8_t flags = page_flags_at(page);
+    uint8_t set = wanted & ~flags & (PAGE_EXECUTABLE | PAGE_WRITABLE);
+    uint8_t clear = ~wanted & flags & (PAGE_EXECUTABLE | PAGE_WRITABLE);
+    if (clear & PAGE_WRITABLE) clear |= (flags & PAGE_WRITE_PROTECTED);
+    if (set) __atomic_fetch_or(&page_flags[page_index(page)], set, __ATOMIC_RELAXED);
+    if (clear) __atomic_fetch_and(&page_flags[page_index(page)], (uint8_t)~clear, __ATOMIC_RELAXED);
+  }
+}
+
+// Maps a region, from fp if there is one and as zeroed memory otherwise, then
+// puts it in the list
+static int add_region(const Elf64_Phdr* program_header, FILE* fp) {
+  int ret = reserve_space();
+  if (ret != 0) {
+    return ret;
+  }
+  if (!in_space(program_header->p_vaddr, program_header->p_memsz)) {
+    return -MEM_ERR_RANGE;
+  }
+
   // Allocate memory for a memory_region_t to hold region data
   memory_region_t* region = calloc(1, sizeof(memory_region_t));
   if (!region) {
     return -MEM_ERR_MALLOC;
   }
+  memcpy(&region->header, program_header, sizeof(Elf64_Phdr));
+  region->buffer = guest_base + program_header->p_vaddr;
 
-  // If this is the first region, just set it in the list
-  if (region_ll == NULL) {
-    region_ll = region;
-  } else {
-    // Otherwise, append to the end of the linked list
-    get_last_region()->next = region;
+  // We're only going to map memory for this region if the segment specifies it
+  if (program_header->p_memsz > 0) {
+    ret = fp ? map_segment(program_header, fp) : map_anonymous(page_floor(program_header->p_vaddr), page_ceil(program_header->p_vaddr + program_header->p_memsz));
+    if (ret != 0) {
+      free(region);
+      return ret;
+    }
   }
+  append_region(region);
+  update_page_permissions(program_header->p_vaddr, program_header->p_vaddr + program_header->p_memsz);
 
-  // Allocate the buffer
-  region->buffer = calloc(1, STACK_SIZE);
-  if (!region->buffer) {
-    return -MEM_ERR_MALLOC;
+  // Now that the contents are loaded, lock the pages down to the segment's permissions
+  if (program_header->p_memsz > 0) {
+    advise_hugepages(region);
+    return protect_region(region);
   }
+  return 0;
+}
+
+int load_memory_region(Elf64_Phdr* program_header, FILE* fp) {
+  lock_regions(true);
+  int ret = add_region(program_header, fp);
+  unlock_regions();
+  return ret;
+}
 
+int create_stack_region(const uint64_t start_address) {
   // This isn't a real program header, but we can treat it as one
-  region->header.p_vaddr = start_address - STACK_SIZE;
-  region->header.p_paddr = start_address - STACK_SIZE;
-  region->header.p_memsz = STACK_SIZE;
-  region->header.p_type = PT_LOAD;
-  region->header.p_flags = PF_R | PF_W; // Read and write, but not execute
+  Elf64_Phdr header = {0};
+  header.p_vaddr = start_address - STACK_SIZE;
+  header.p_paddr = start_address - STACK_SIZE;
+  header.p_memsz = STACK_SIZE;
+  header.p_type = PT_LOAD;
+  header.p_flags = PF_R | PF_W; // Read and write, but not execute
 
-  return 0;
+  lock_regions(true);
+  int ret = add_region(&header, NULL);
+  unlock_regions();
+  return ret;
 }
 
 bool region_contains_address(memory_region_t* region, uint64_t address) {
@@ -117,6 +397,7 @@ bool region_contains_address(memory_region_t* region, uint64_t address) {
   );
 }
 
+// Only for the emulator's own bookkeeping, never for the guest's accesses
 static memory_region_t* find_region(uint64_t address) {
   memory_region_t* region = get_memory_regions();
   while (region) {
@@ -126,81 +407,831 @@ static memory_region_t* find_region(uint64_t address) {
   return region;
 }
 
-bool read_u8(uint64_t address, uint8_t* data_out) {
+bool is_executable_address(uint64_t address) {
+  lock_regions(false);
   memory_region_t* region = find_region(address);
-    if (!region) return false;
+  bool executable = region && (region->header.p_flags & PF_X);
+  unlock_regions();
+  return executable;
+}
+
+bool can_fetch(uint64_t address, uint64_t size) {
+  if (!in_space(address, size)) {
+    last_fault_address = address;
+    return false;
+  }
+  if (!(page_flags_at(address) & PAGE_EXECUTABLE)) {
+    last_fault_address = address;
+    return false;
+  }
+  if (!(page_flags_at(address + (size - 1)) & PAGE_EXECUTABLE)) {
+    last_fault_address = page_floor(address + (size - 1));
+    return false;
+  }
+  return true;
+}
+
+// Moves the start of a region up to address, within it
+static void trim_region_start(memory_region_t* region, uint64_t address) {
+  uint64_t delta = address - region->header.p_vaddr;
+  region->header.p_vaddr += delta;
+  region->header.p_paddr += delta;
+  region->header.p_offset += delta;
+  region->header.p_memsz -= delta;
+  region->header.p_filesz = (region->header.p_filesz > delta) ? region->header.p_filesz - delta : 0;
+  region->buffer += delta;
+}
+
+// Moves the end of a region down to address, within it
+static void trim_region_end(memory_region_t* region, uint64_t address) {
+  region->header.p_memsz = address - region->header.p_vaddr;
+  if (region->header.p_filesz > region->header.p_memsz) {
+    region->header.p_filesz = region->header.p_memsz;
+  }
+}
+
+// Splits a region in two at address, which must be inside it, returning the
+// second half (which follows it in the list)
+static memory_region_t* split_region(memory_region_t* region, uint64_t address) {
+  memory_region_t* tail = malloc(sizeof(memory_region_t));
+  if (!tail) {
+    return NULL;
+  }
+  *tail = *region;
+  trim_region_start(tail, address);
+  trim_region_end(region, address);
+  region->next = tail;
+  num_regions++;
+  return tail;
+}
+
+// Takes [start, end) out of the list, trimming the regions which overlap it,
+// and splitting any which straddle it in two. Must be called with the regions
+// lock held for writing.
+static int carve_regions(uint64_t start, uint64_t end) {
+  memory_region_t** link = &region_ll;
+  while (*link) {
+    memory_region_t* region = *link;
+    uint64_t region_start = region->header.p_vaddr;
+    uint64_t region_end = region_start + region->header.p_memsz;
+
+    if (region_end <= start || region_start >= end || region->header.p_memsz == 0) {
+      link = &region->next;
+    } else if (region_start < start && region_end > end) {
+      memory_region_t* tail = split_region(region, end);
+      if (!tail) {
+        return -MEM_ERR_MALLOC;
+      }
+      trim_region_end(region, start);
+      link = &tail->next;
+    } else if (region_start < start) {
+      trim_region_end(region, start);
+      link = &region->next;
+    } else if (region_end > end) {
+      trim_region_start(region, end);
+      link = &region->next;
+    } else {
+      *link = region->next;
+      free(region);
+      num_regions--;
+    }
+  }
+  return 0;
+}
+
+static bool range_is_free(uint64_t address, uint64_t size) {
+  for (memory_region_t* region = region_ll; region; region = region->next) {
+    if (region_overlaps(region, address, size)) return false;
+  }
+  return true;
+}
+
+// The highest free range of size bytes below GUEST_MMAP_TOP, or 0 if there isn't one
+static uint64_t find_free_range(uint64_t size) {
+  uint64_t end = GUEST_MMAP_TOP;
+  while (end >= GUEST_MMAP_BOTTOM + size) {
+    uint64_t start = end - size;
+    memory_region_t* region = region_ll;
+    while (region && !region_overlaps(region, start, size)) {
+      region = region->next;
+    }
+    if (!region) {
+      return start;
+    }
+    end = page_floor(region->header.p_vaddr);
+  }
+  return 0;
+}
+
+// A new anonymous region directly after one just like it just makes that one
+// longer, so a growing program break stays one region
+static memory_region_t* extend_region(uint64_t address, uint64_t size, uint32_t p_flags, bool shared, int fd) {
+  if (fd >= 0 || shared) return NULL;
+  for (memory_region_t* region = region_ll; region; region = region->next) {
+    if (region->dynamic && !region->shared && region->header.p_filesz == 0 && region->header.p_flags == p_flags
+        && region->header.p_vaddr + region->header.p_memsz == address) {
+      region->header.p_memsz += size;
+      return region;
+    }
+  }
+  return NULL;
+}
+
+static int map_dynamic_region(uint64_t* address_inout, uint64_t size, int placement, uint32_t p_flags, bool shared, int fd, uint64_t offset) {
+  uint64_t address = *address_inout;
+  bool fits = (address & (GUEST_PAGE_SIZE - 1)) == 0 && address >= GUEST_MMAP_BOTTOM && in_space(address, size);
+  if (placement == MAP_PLACE_ANYWHERE && (!fits || !range_is_free(address, size))) {
+    address = find_free_range(size);
+    fits = (address != 0);
+  } else if (placement == MAP_PLACE_EXACT && fits) {
+    fits = range_is_free(address, size);
+  }
+  if (!fits) {
+    return -MEM_ERR_RANGE;
+  }
+
+  memory_region_t* region = calloc(1, sizeof(memory_region_t));
+  if (!region) {
+    return -MEM_ERR_MALLOC;
+  }
+  region->header.p_type = PT_LOAD;
+  region->header.p_flags = p_flags;
+  region->header.p_vaddr = address;
+  region->header.p_paddr = address;
+  region->header.p_memsz = size;
+  region->header.p_offset = (fd >= 0) ? offset : 0;
+  region->header.p_filesz = (fd >= 0) ? size : 0;
+  region->buffer = guest_base + address;
+  region->dynamic = true;
+  region->shared = shared;
+
+  // The host mapping goes in first, since a failed MAP_FIXED leaves what was
+  // there before alone
+  int flags = MAP_FIXED | (shared ? MAP_SHARED : MAP_PRIVATE) | ((fd < 0) ? MAP_ANONYMOUS : 0);
+  if (mmap(guest_base + address, size, region_prot(region), flags, fd, (fd >= 0) ? offset : 0) == MAP_FAILED) {
+    free(region);
+    return -MEM_ERR_MMAP;
+  }
+
+  int ret = carve_regions(address, address + size);
+  if (ret != 0) {
+    free(region);
+    return ret;
+  }
+  memory_region_t* extended = extend_region(address, size, p_flags, shared, fd);
+  if (extended) {
+    free(region);
+    region = extended;
+  } else {
+    append_region(region);
+  }
+  update_page_permissions(address, address + size);
+  advise_hugepages(region);
+
+  *address_inout = address;
+  return 0;
+}
+
+int map_guest_memory(uint64_t* address_inout, uint64_t size, int placement, uint32_t p_flags, bool shared, int fd, uint64_t offset) {
+  if (size == 0 || (size & (GUEST_PAGE_SIZE - 1)) != 0) {
+    return -MEM_ERR_RANGE;
+  }
+
+  lock_regions(true);
+  int ret = map_dynamic_region(address_inout, size, placement, p_flags, shared, fd, offset);
+  unlock_regions();
+
+  // Whatever code was there before is gone
+  if (ret == 0) {
+    code_write_slow_path(*address_inout, size);
+  }
+  return ret;
+}
 
-  uint64_t region_offset = address - region->header.p_vaddr;
-  *data_out = region->buffer[region_offset];
+int unmap_guest_memory(uint64_t address, uint64_t size) {
+  if ((address & (GUEST_PAGE_SIZE - 1)) != 0 || !in_space(address, size)) {
+    return -MEM_ERR_RANGE;
+  }
+  size = page_ceil(size);
+  if (size == 0) {
+    return 0;
+  }
+
+  lock_regions(true);
+  int ret = carve_regions(address, address + size);
+  if (ret == 0) {
+    update_page_permissions(address, address + size);
+    // The memory goes back to the host, and the range is as inaccessible as the
+    // rest of the unmapped space
+    if (mmap(guest_base + address, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+      ret = -MEM_ERR_MMAP;
+    }
+  }
+  unlock_regions();
+
+  code_write_slow_path(address, size);
+  return ret;
+}
+
+// Whether every page of [start, end) is in some region
+static bool range_is_mapped(uint64_t start, uint64_t end) {
+  for (uint64_t page = start; page < end; ) {
+    uint64_t reach = 0;
+    for (memory_region_t* region = region_ll; region; region = region->next) {
+      uint64_t region_end = region->header.p_vaddr + region->header.p_memsz;
+      if (region_overlaps(region, page, GUEST_PAGE_SIZE) && region_end > reach) {
+        reach = region_end;
+      }
+    }
+    if (reach == 0) {
+      return false;
+    }
+    page = page_ceil(reach);
+  }
+  return true;
+}
+
+int protect_guest_memory(uint64_t address, uint64_t size, uint32_t p_flags) {
+  if ((address & (GUEST_PAGE_SIZE - 1)) != 0 || !in_space(address, size)) {
+    return -MEM_ERR_RANGE;
+  }
+  size = page_ceil(size);
+  if (size == 0) {
+    return 0;
+  }
+  uint64_t end = address + size;
+
+  lock_regions(true);
+  if (!range_is_mapped(address, end)) {
+    unlock_regions();
+    return -MEM_ERR_RANGE;
+  }
+
+  // The regions are split at both ends of the range, so that only the part
+  // inside it changes
+  int ret = 0;
+  bool lost_exec = false;
+  for (memory_region_t* region = region_ll; region && ret == 0; region = region->next) {
+    if (region->header.p_memsz == 0 || !region_overlaps(region, address, size)) continue;
+    if (region->header.p_vaddr < address) {
+      region = split_region(region, address);
+    }
+    if (region && region->header.p_vaddr + region->header.p_memsz > end && !split_region(region, end)) {
+      region = NULL;
+    }
+    if (!region) {
+      ret = -MEM_ERR_MALLOC;
+      break;
+    }
+    lost_exec |= (region->header.p_flags & PF_X) && !(p_flags & PF_X);
+    region->header.p_flags = p_flags;
+  }
+  if (ret == 0) {
+    update_page_permissions(address, end);
+  }
+
+  // Only once every region has its new permissions, since pages at the ends
+  // can be shared with neighbours
+  for (memory_region_t* region = region_ll; region && ret == 0; region = region->next) {
+    if (region->header.p_memsz > 0 && region_overlaps(region, address, size)) {
+      ret = protect_region(region);
+    }
+  }
+  unlock_regions();
+
+  // Blocks decoded from code which is no longer executable mustn't run again
+  if (lost_exec) {
+    code_write_slow_path(address, size);
+  }
+  return ret;
+}
+
+void set_guest_brk_start(uint64_t address) {
+  brk_start = page_ceil(address);
+  brk_end = brk_start;
+}
+
+// Only the pages wholly past the new break are unmapped when it moves down,
+// and only whole pages are mapped when it moves up
+uint64_t set_guest_brk(uint64_t address) {
+  static pthread_mutex_t brk_lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_mutex_lock(&brk_lock);
+
+  if (address >= brk_start) {
+    uint64_t old_top = page_ceil(brk_end);
+    uint64_t new_top = page_ceil(address);
+    int ret = 0;
+    if (new_top > old_top) {
+      ret = map_guest_memory(&old_top, new_top - old_top, MAP_PLACE_EXACT, PF_R | PF_W, false, -1, 0);
+    } else if (new_top < old_top) {
+      ret = unmap_guest_memory(new_top, old_top - new_top);
+    }
+    if (ret == 0) {
+      brk_end = address;
+    }
+  }
+
+  uint64_t result = brk_end;
+  pthread_mutex_unlock(&brk_lock);
+  return result;
+}
+
+// A store to a write protected page (see PAGE_WRITE_PROTECTED). Returns false
+// if the page couldn't be made writable, and the fault is a real one after all.
+static bool handle_code_write(uint64_t address) {
+  STATS_INC(code_write_faults);
+  uint64_t page = page_floor(address);
+  code_write_slow_path(page, GUEST_PAGE_SIZE);
+  if (page_flags_at(page) & PAGE_WRITE_PROTECTED) {
+    return false;
+  }
+
+  // The block making the store can't carry on past it, since what follows may
+  // be what's about to be overwritten
+  if (block_executing_in(page, GUEST_PAGE_SIZE) && memory_fault_recovery && !memory_fault_recovery_blocked) {
+    siglongjmp(*memory_fault_recovery, MEMORY_FAULT_CODE_WRITE);
+  }
   return true;
 }
 
-// TODO: Scan other regions to see if this crosses a segment boundary
-#define ValidateMultiByteRegion(region, address, size) \
-  if (!region) return false; \
-  if (!region_contains_address(region, address + (size - 1))) return false;
+// The last address a fault was retried at, for a page which had just stopped
+// being write protected (see handle_fault_race())
+static __thread uint64_t retried_fault_address = GUEST_SPACE_SIZE;
+
+// A writable page can still fault once after losing its protection, if the
+// store faulted while the block cache was making it writable again. Retrying
+// the same address twice in a row means it wasn't that.
+static bool handle_fault_race(uint64_t address) {
+  if (!(page_flags_at(address) & PAGE_WRITABLE) || address == retried_fault_address) {
+    return false;
+  }
+  retried_fault_address = address;
+  return true;
+}
+
+// Every fault in the guest address space is the guest's own, since nothing
+// else is ever mapped there. The guest address is just the offset into it.
+static void memory_fault_handler(int sig, siginfo_t* info, void* context) {
+  uint8_t* host_address = info->si_addr;
+  bool in_guest = guest_base && host_address >= guest_base && host_address < guest_base + GUEST_SPACE_SIZE + GUEST_PAGE_SIZE;
+
+  // Returning makes the faulting store run again
+  if (in_guest && host_address < guest_base + GUEST_SPACE_SIZE) {
+    uint64_t address = host_address - guest_base;
+    if (page_flags_at(address) & PAGE_WRITE_PROTECTED) {
+      if (handle_code_write(address)) {
+        retried_fault_address = GUEST_SPACE_SIZE;
+        return;
+      }
+    } else if (handle_fault_race(address)) {
+      return;
+    }
+  }
+
+  // Not a guest access, or one which can't be recovered from, so this is a
+  // genuine crash in the emulator itself. Returning with the default action
+  // restored re-raises it.
+  if (!in_guest || !memory_fault_recovery || memory_fault_recovery_blocked) {
+    signal(sig, SIG_DFL);
+    return;
+  }
+
+  last_fault_address = host_address - guest_base;
+  siglongjmp(*memory_fault_recovery, CPU_ERR_SEGMENTATION_FAULT);
+}
+
+int install_memory_fault_handler(void) {
+  struct sigaction action = {0};
+  action.sa_sigaction = memory_fault_handler;
+  // SA_NODEFER, since we leave the handler by siglongjmp without restoring the mask
+  action.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset(&action.sa_mask);
+
+  if (sigaction(SIGSEGV, &action, NULL) != 0 || sigaction(SIGBUS, &action, NULL) != 0) {
+    return -MEM_ERR_SIGNAL;
+  }
+  return 0;
+}
+
+uint64_t get_last_fault_address(void) {
+  return last_fault_address;
+}
+
+// Outside the guest address space altogether, which the host MMU can't catch
+static bool out_of_space(uint64_t address) {
+  last_fault_address = address;
+  return false;
+}
+
+// Accesses do no bounds or permission checks of their own beyond staying inside
+// the guest address space; anything unmapped or against the segment's
+// permissions is caught by the host MMU and comes back through
+// memory_fault_handler
+// Loads only look at the page flags at all while there are read watchpoints
+#define CheckRead(address, size, host) \
+  if (watch_reads && ((page_flags_at(address) | page_flags_at(address + (size - 1))) & PAGE_WATCHED)) { \
+    watch_access(address, size, false, host, NULL); \
+  }
+
+bool read_u8(uint64_t address, uint8_t* data_out) {
+  if (address >= GUEST_SPACE_SIZE) return out_of_space(address);
+  uint8_t* host = guest_base + address;
+  CheckRead(address, 1, host);
+  *data_out = *host;
+  return true;
+}
 
 bool read_u16(uint64_t address, uint16_t* data_out) {
-  memory_region_t* region = find_region(address);
-  ValidateMultiByteRegion(region, address, 2);
-  uint64_t region_offset = address - region->header.p_vaddr;
-  *data_out =  *((uint16_t*)(region->buffer + region_offset));
+  if (address >= GUEST_SPACE_SIZE) return out_of_space(address);
+  uint8_t* host = guest_base + address;
+  CheckRead(address, 2, host);
+  *data_out = *((uint16_t*)host);
   return true;
 }
 
 bool read_u32(uint64_t address, uint32_t* data_out) {
-  memory_region_t* region = find_region(address);
-  ValidateMultiByteRegion(region, address, 4);
-  uint64_t region_offset = address - region->header.p_vaddr;
-  *data_out =  *((uint32_t*)(region->buffer + region_offset));
+  if (address >= GUEST_SPACE_SIZE) return out_of_space(address);
+  uint8_t* host = guest_base + address;
+  CheckRead(address, 4, host);
+  *data_out = *((uint32_t*)host);
   return true;
 }
 
 bool read_u64(uint64_t address, uint64_t* data_out) {
-  memory_region_t* region = find_region(address);
-  ValidateMultiByteRegion(region, address, 8);
-  uint64_t region_offset = address - region->header.p_vaddr;
-  *data_out =  *((uint64_t*)(region->buffer + region_offset));
+  if (address >= GUEST_SPACE_SIZE) return out_of_space(address);
+  uint8_t* host = guest_base + address;
+  CheckRead(address, 8, host);
+  *data_out = *((uint64_t*)host);
   return true;
 }
 
-bool write_u8(uint64_t address, uint8_t data) {
+// Called by the block cache for every block it holds, so writes to those pages
+// can be caught (see CheckWrite). Page flags are shared by every guest thread,
+// so they're only ever changed atomically.
+// Called by the block cache before the block can be found, so that by the time
+// it can run, any store to its bytes faults
+void mark_code_pages(uint64_t address, uint64_t size) {
+  if (!in_space(address, size)) return;
+  for (uint64_t page = page_floor(address); page < address + size; page += GUEST_PAGE_SIZE) {
+    uint8_t flags = __atomic_fetch_or(&page_flags[page_index(page)], PAGE_HAS_CODE, __ATOMIC_RELAXED);
+    if ((flags & PAGE_WRITABLE) && !(flags & PAGE_WRITE_PROTECTED)) {
+      write_protect_code_page(page);
+    }
+  }
+}
+
+// Called by the block cache, under the same lock as mark_code_pages(), once no
+// block covers the page holding address. The page is made writable before
+// its flag goes, the reverse of write_protect_code_page().
+void unmark_code_page(uint64_t address) {
+  if (address >= GUEST_SPACE_SIZE) return;
+  uint64_t page = page_floor(address);
+  uint8_t flags = __atomic_fetch_and(&page_flags[page_index(page)], (uint8_t)~PAGE_HAS_CODE, __ATOMIC_RELAXED);
+  if (flags & PAGE_WRITE_PROTECTED) {
+    mprotect(guest_base + page, GUEST_PAGE_SIZE, PROT_READ | PROT_WRITE);
+    __atomic_fetch_and(&page_flags[page_index(page)], (uint8_t)~PAGE_WRITE_PROTECTED, __ATOMIC_RELAXED);
+  }
+}
+
+// Returns false unless the whole range is within one region. A watched range
+// is at most WATCH_MAX_SIZE bytes, so it spans at most two pages.
+bool mark_watched_pages(uint64_t address, uint64_t size) {
+  lock_regions(false);
   memory_region_t* region = find_region(address);
-  if (!region) return false;
+  bool found = region && region_contains_address(region, address + (size - 1));
+  unlock_regions();
+  if (!found) {
+    return false;
+  }
+  __atomic_fetch_or(&page_flags[page_index(address)], PAGE_WATCHED, __ATOMIC_RELAXED);
+  __atomic_fetch_or(&page_flags[page_index(address + (size - 1))], PAGE_WATCHED, __ATOMIC_RELAXED);
+  return true;
+}
+
+// Throws away the blocks overlapping [address, address + size). Once no blocks
+// remain in a page, the block cache clears its flag, and if it was write
+// protected, stores to it go back to being free.
+static void code_write_slow_path(uint64_t address, uint64_t size) {
+  if (block_invalidate_range(address, size) > 0) {
+    pthread_mutex_lock(&code_modified_lock);
+    bool empty = (code_modified_start == code_modified_end);
+    if (empty || address < code_modified_start) code_modified_start = address;
+    if (empty || address + size > code_modified_end) code_modified_end = address + size;
+    pthread_mutex_unlock(&code_modified_lock);
+  }
+}
 
-  uint64_t region_offset = address - region->header.p_vaddr;
-  region->buffer[region_offset] = data;
+// Code invalidation alone, for restoring snapshots, which watchpoints mustn't see
+#define InvalidateIfCode(address, size) \
+  if ((page_flags_at(address) | page_flags_at(address + (size - 1))) & PAGE_HAS_CODE) { \
+    code_write_slow_path(address, size); \
+  }
+
+// Stores only look at the page flags at all while there are write watchpoints,
+// as loads do for read ones. data is what's about to be stored.
+#define CheckWrite(address, size, data) \
+  if (watch_writes && ((page_flags_at(address) | page_flags_at(address + (size - 1))) & PAGE_WATCHED)) { \
+    watch_access(address, size, true, guest_base + address, data); \
+  }
+
+bool write_u8(uint64_t address, uint8_t data) {
+  if (address >= GUEST_SPACE_SIZE) return out_of_space(address);
+  CheckWrite(address, 1, &data);
+  guest_base[address] = data;
   return true;
 }
 
 bool write_u16(uint64_t address, uint16_t data) {
-  memory_region_t* region = find_region(address);
-  ValidateMultiByteRegion(region, address, 2);
-  uint64_t region_offset = address - region->header.p_vaddr;
-  *((uint16_t*)(region->buffer + region_offset)) = data;
+  if (address >= GUEST_SPACE_SIZE) return out_of_space(address);
+  CheckWrite(address, 2, &data);
+  *((uint16_t*)(guest_base + address)) = data;
   return true;
 }
 
 bool write_u32(uint64_t address, uint32_t data) {
-  memory_region_t* region = find_region(address);
-  ValidateMultiByteRegion(region, address, 4);
-  uint64_t region_offset = address - region->header.p_vaddr;
-  *((uint32_t*)(region->buffer + region_offset)) = data;
+  if (address >= GUEST_SPACE_SIZE) return out_of_space(address);
+  CheckWrite(address, 4, &data);
+  *((uint32_t*)(guest_base + address)) = data;
   return true;
 }
 
 bool write_u64(uint64_t address, uint64_t data) {
-  memory_region_t* region = find_region(address);
-  ValidateMultiByteRegion(region, address, 8);
-  uint64_t region_offset = address - region->header.p_vaddr;
-  *((uint64_t*)(region->buffer + region_offset)) = data;
+  if (address >= GUEST_SPACE_SIZE) return out_of_space(address);
+  CheckWrite(address, 8, &data);
+  *((uint64_t*)(guest_base + address)) = data;
   return true;
 }
 
+void* guest_to_host(uint64_t address) {
+  lock_regions(false);
+  memory_region_t* region = find_region(address);
+  unlock_regions();
+  if (!region) return NULL;
+  return guest_base + address;
+}
+
+// As guest_to_host(), but treated as a write of size bytes for the purposes of
+// code invalidation and watchpoints. Anything unmapped is left to fault.
+void* guest_to_host_for_write(uint64_t address, uint64_t size) {
+  if (!in_space(address, size)) {
+    out_of_space(address);
+    return NULL;
+  }
+
+  // Syscall buffers can span pages between the first and last, so every page
+  // is looked at
+  uint8_t flags = 0;
+  for (size_t page = page_index(address); page <= page_index(address + (size - 1)); page++) {
+    flags |= __atomic_load_n(&page_flags[page], __ATOMIC_RELAXED);
+  }
+  if (flags & PAGE_WATCHED) {
+    watch_access(address, size, true, guest_base + address, NULL);
+  }
+  // The host kernel doesn't fault on a write protected page, it fails with
+  // EFAULT, so the pages' code goes before a syscall can write to them. Stores
+  // through the pointer from the emulator itself would be caught either way.
+  if (flags & PAGE_HAS_CODE) {
+    uint64_t start = page_floor(address);
+    code_write_slow_path(start, page_ceil(address + size) - start);
+  }
+  return guest_base + address;
+}
+
+// Any region overlapping the page which the guest can access as asked, taking
+// the one which reaches furthest
+static memory_region_t* find_accessible_region(uint64_t page, bool for_write) {
+  uint32_t needed = for_write ? PF_W : (PF_R | PF_W | PF_X);
+  memory_region_t* found = NULL;
+  for (memory_region_t* region = region_ll; region; region = region->next) {
+    if (region_overlaps(region, page, GUEST_PAGE_SIZE) && (region->header.p_flags & needed)
+        && (!found || region->header.p_vaddr + region->header.p_memsz > found->header.p_vaddr + found->header.p_memsz)) {
+      found = region;
+    }
+  }
+  return found;
+}
+
+// Permissions are a page at a time on the host, so the range is checked a page
+// at a time too, and can run across any number of adjacent regions
+void* guest_range_to_host(uint64_t address, uint64_t size, bool for_write) {
+  if (!in_space(address, size) || !guest_base) {
+    return NULL;
+  }
+
+  bool accessible = true;
+  lock_regions(false);
+  for (uint64_t page = page_floor(address); page < address + size && accessible; ) {
+    memory_region_t* region = find_accessible_region(page, for_write);
+    if (region) {
+      page = page_ceil(region->header.p_vaddr + region->header.p_memsz);
+    } else {
+      accessible = false;
+    }
+  }
+  unlock_regions();
+
+  if (!accessible) {
+    return NULL;
+  }
+  if (for_write && size > 0) {
+    return guest_to_host_for_write(address, size);
+  }
+  return guest_base + address;
+}
+
+// A snapshot starts with the layout: a snapshot_header_t, then a
+// snapshot_region_t for each region in list order. The contents of every
+// region the guest can read follow, in the same order. Regions the guest can't
+// access at all (guard pages, reservations) only have their place kept.
+typedef struct snapshot_header_t {
+  uint64_t num_regions;
+  uint64_t brk_start;
+  uint64_t brk_end;
+} snapshot_header_t;
+
+typedef struct snapshot_region_t {
+  Elf64_Phdr header;
+  bool dynamic;
+  bool shared;
+} snapshot_region_t;
+
+static bool has_contents(const Elf64_Phdr* header) {
+  return (header->p_flags & (PF_R | PF_W | PF_X)) && header->p_memsz > 0;
+}
+
+static size_t snapshot_size_locked(void) {
+  size_t size = sizeof(snapshot_header_t);
+  for (memory_region_t* region = region_ll; region; region = region->next) {
+    size += sizeof(snapshot_region_t);
+    if (has_contents(&region->header)) size += region->header.p_memsz;
+  }
+  return size;
+}
+
+size_t memory_snapshot_size(void) {
+  lock_regions(false);
+  size_t size = snapshot_size_locked();
+  unlock_regions();
+  return size;
+}
+
+// Other guest threads can map and unmap memory in between, so a buffer sized
+// by memory_snapshot_size() is only big enough while they're stopped, as they
+// are during replay
+void memory_snapshot(uint8_t* buffer_out) {
+  lock_regions(false);
+
+  snapshot_header_t* header = (snapshot_header_t*)buffer_out;
+  *header = (snapshot_header_t){ .num_regions = num_regions, .brk_start = brk_start, .brk_end = brk_end };
+  snapshot_region_t* layout = (snapshot_region_t*)(header + 1);
+  uint8_t* contents = (uint8_t*)(layout + num_regions);
+
+  for (memory_region_t* region = region_ll; region; region = region->next) {
+    *layout++ = (snapshot_region_t){ .header = region->header, .dynamic = region->dynamic, .shared = region->shared };
+    if (has_contents(&region->header)) {
+      memcpy(contents, region->buffer, region->header.p_memsz);
+      contents += region->header.p_memsz;
+    }
+  }
+
+  unlock_regions();
+}
+
+static bool same_region(const memory_region_t* region, const snapshot_region_t* saved) {
+  return (
+    memcmp(&region->header, &saved->header, sizeof(Elf64_Phdr)) == 0
+    && region->dynamic == saved->dynamic
+    && region->shared == saved->shared
+  );
+}
+
+// Writes size bytes at address (within one page) if they differ, opening the
+// page up for the copy if the guest can't write it itself
+static void restore_bytes(uint64_t address, uint64_t size, const uint8_t* data) {
+  uint8_t* host = guest_base + address;
+  if (memcmp(host, data, size) == 0) {
+    return;
+  }
+
+  InvalidateIfCode(address, size);
+  int prot = page_prot(page_floor(address));
+  if (!(prot & PROT_WRITE)) {
+    mprotect(guest_base + page_floor(address), GUEST_PAGE_SIZE, PROT_READ | PROT_WRITE);
+  }
+  memcpy(host, data, size);
+  if (!(prot & PROT_WRITE)) {
+    mprotect(guest_base + page_floor(address), GUEST_PAGE_SIZE, prot);
+  }
+}
+
+// Regions which are still exactly as they were keep their mappings, and only
+// pages which differ from the snapshot are written, a page at a time, so code
+// pages which haven't changed keep their blocks. Everything mapped since is
+// unmapped, and everything unmapped since is mapped again, as private memory
+// (a MAP_SHARED region unmapped since doesn't get its file back).
+void memory_restore(const uint8_t* buffer) {
+  lock_regions(true);
+
+  const snapshot_header_t* header = (const snapshot_header_t*)buffer;
+  const snapshot_region_t* layout = (const snapshot_region_t*)(header + 1);
+  const uint8_t* contents = (const uint8_t*)(layout + header->num_regions);
+
+  // The current list is swapped for the snapshot's, keeping the regions which
+  // are unchanged
+  memory_region_t* old_regions = region_ll;
+  region_ll = NULL;
+  num_regions = 0;
+  for (size_t i = 0; i < header->num_regions; i++) {
+    memory_region_t* region = NULL;
+    for (memory_region_t** link = &old_regions; *link; link = &(*link)->next) {
+      if (same_region(*link, &layout[i])) {
+        region = *link;
+        *link = region->next;
+        break;
+      }
+    }
+
+    if (!region) {
+      region = calloc(1, sizeof(memory_region_t));
+      if (!region) {
+        // Not much can be done here, other than leave the region out
+        continue;
+      }
+      region->header = layout[i].header;
+      region->dynamic = layout[i].dynamic;
+      region->shared = layout[i].shared;
+      region->buffer = guest_base + region->header.p_vaddr;
+
+      // Fresh pages to copy the contents into. Pages shared with other regions
+      // get their bytes back when those are copied below.
+      uint64_t start = page_floor(region->header.p_vaddr);
+      uint64_t end = page_ceil(region->header.p_vaddr + region->header.p_memsz);
+      if (end > start) {
+        code_write_slow_path(start, end - start);
+        map_anonymous(start, end);
+      }
+    }
+    region->next = NULL;
+    append_region(region);
+  }
+
+  // Whatever's left wasn't there when the snapshot was taken. Pages it shares
+  // with a restored region stay mapped.
+  while (old_regions) {
+    memory_region_t* region = old_regions;
+    old_regions = region->next;
+
+    for (uint64_t page = page_floor(region->header.p_vaddr); page < region->header.p_vaddr + region->header.p_memsz; page += GUEST_PAGE_SIZE) {
+      if (!page_in_use(page)) {
+        update_page_permissions(page, page + GUEST_PAGE_SIZE);
+        code_write_slow_path(page, GUEST_PAGE_SIZE);
+        mmap(guest_base + page, GUEST_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+      }
+    }
+    free(region);
+  }
+
+  // The list is in snapshot order now, less any region which couldn't be put back
+  memory_region_t* region = region_ll;
+  for (size_t i = 0; i < header->num_regions; i++) {
+    bool restored = region && same_region(region, &layout[i]);
+    if (!has_contents(&layout[i].header)) {
+      // Nothing to copy
+    } else if (restored) {
+      uint64_t address = region->header.p_vaddr;
+      uint64_t end = address + region->header.p_memsz;
+      while (address < end) {
+        uint64_t page_end = page_floor(address) + GUEST_PAGE_SIZE;
+        uint64_t size = ((page_end < end) ? page_end : end) - address;
+        restore_bytes(address, size, contents);
+        contents += size;
+        address += size;
+      }
+    } else {
+      contents += layout[i].header.p_memsz;
+    }
+
+    // Newly mapped regions are still writable here, so they're only locked
+    // down once their contents are back
+    if (restored) {
+      update_page_permissions(region->header.p_vaddr, region->header.p_vaddr + region->header.p_memsz);
+      if (region->header.p_memsz > 0) protect_region(region);
+      region = region->next;
+    }
+  }
+
+  brk_start = header->brk_start;
+  brk_end = header->brk_end;
+  unlock_regions();
+}
+
 static char* mem_errors[] = {
   "Unknown",
   "Unable to allocate memory for memory region",
   "Unable to read ELF data into memory region",
+  "Unable to map memory for memory region",
+  "Unable to install the memory fault handler",
+  "Region lies outside the guest address space",
 };
 
 char* memory_err_message(int errorIndex) {
@@ -208,8 +1239,8 @@ char* memory_err_message(int errorIndex) {
     errorIndex *= -1;
   }
 
-  if (errorIndex >= ELF_ERR_NUM_ERRORS) {
-    return mem_errors[ELF_ERR_UNKNOWN];
+  if (errorIndex >= MEM_ERR_NUM_ERRORS) {
+    return mem_errors[MEM_ERR_UNKNOWN];
   }
   return mem_errors[errorIndex];
 }
\ No newline at end of file
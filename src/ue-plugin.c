@@ -0,0 +1,294 @@
+#include <dlfcn.h>
+#include "ue-plugin.h"
+#include "ue-block.h"
+#include "ue-fpu.h"
+
+typedef struct plugin_t {
+  void* handle;
+  ue_translate_cb_t on_translate;
+  void* translate_userdata;
+  ue_syscall_cb_t on_syscall;
+  void* syscall_userdata;
+  ue_exit_cb_t on_exit;
+  void* exit_userdata;
+} plugin_t;
+
+static plugin_t plugins[PLUGIN_MAX_PLUGINS];
+static size_t num_plugins = 0;
+
+bool plugins_instrumenting = false;
+bool plugins_watching_syscalls = false;
+
+// Drops a plugin whose install failed, along with whatever it subscribed to
+// before failing. That's always the last one loaded.
+static void remove_last_plugin(void) {
+  plugin_t* plugin = &plugins[--num_plugins];
+  if (plugin->handle) {
+    dlclose(plugin->handle);
+  }
+  *plugin = (plugin_t){0};
+
+  plugins_instrumenting = false;
+  plugins_watching_syscalls = false;
+  for (size_t i = 0; i < num_plugins; i++) {
+    if (plugins[i].on_translate) plugins_instrumenting = true;
+    if (plugins[i].on_syscall) plugins_watching_syscalls = true;
+  }
+}
+
+int plugin_load(const char* path, const char* args) {
+  if (num_plugins == PLUGIN_MAX_PLUGINS) {
+    return -PLUGIN_ERR_TOO_MANY;
+  }
+
+  void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!handle) {
+    return -PLUGIN_ERR_DLOPEN;
+  }
+
+  const int* version = dlsym(handle, UE_PLUGIN_VERSION_SYMBOL);
+  if (!version || *version != UE_PLUGIN_API_VERSION) {
+    dlclose(handle);
+    return -PLUGIN_ERR_VERSION;
+  }
+
+  ue_plugin_install_t install = (ue_plugin_install_t)dlsym(handle, UE_PLUGIN_INSTALL_SYMBOL);
+  if (!install) {
+    dlclose(handle);
+    return -PLUGIN_ERR_NO_INSTALL;
+  }
+
+  ue_plugin_id_t id = num_plugins++;
+  plugins[id] = (plugin_t){ .handle = handle };
+  if (install(id, args ? args : "") != 0) {
+    remove_last_plugin();
+    return -PLUGIN_ERR_INSTALL;
+  }
+  return 0;
+}
+
+// For analyses built into the emulator itself, which use the same API
+int plugin_install_builtin(ue_plugin_install_t install, const char* args) {
+  if (num_plugins == PLUGIN_MAX_PLUGINS) {
+    return -PLUGIN_ERR_TOO_MANY;
+  }
+
+  ue_plugin_id_t id = num_plugins++;
+  plugins[id] = (plugin_t){ .handle = NULL };
+  if (install(id, args ? args : "") != 0) {
+    remove_last_plugin();
+    return -PLUGIN_ERR_INSTALL;
+  }
+  return 0;
+}
+
+void ue_plugin_on_translate(ue_plugin_id_t id, ue_translate_cb_t cb, void* userdata) {
+  plugins[id].on_translate = cb;
+  plugins[id].translate_userdata = userdata;
+  plugins_instrumenting = true;
+}
+
+void ue_plugin_on_syscall(ue_plugin_id_t id, ue_syscall_cb_t cb, void* userdata) {
+  plugins[id].on_syscall = cb;
+  plugins[id].syscall_userdata = userdata;
+  plugins_watching_syscalls = true;
+}
+
+void ue_plugin_on_exit(ue_plugin_id_t id, ue_exit_cb_t cb, void* userdata) {
+  plugins[id].on_exit = cb;
+  plugins[id].exit_userdata = userdata;
+}
+
+uint64_t ue_block_address(const ue_block_t* block) {
+  return block->address;
+}
+
+size_t ue_block_num_instrs(const ue_block_t* block) {
+  return block->num_instrs;
+}
+
+const x86_64_instr_t* ue_block_instr(const ue_block_t* block, size_t index) {
+  return (index < block->num_instrs) ? &block->instrs[index] : NULL;
+}
+
+bool ue_instr_accesses_memory(const x86_64_instr_t* instr) {
+  switch (instr->type) {
+    case LEA_8D:
+      return false;
+    case PUSH_50:
+    case POP_58:
+    case CALL_E8:
+    case CALL_FF:
+    case RET_C3:
+      return true;
+  }
+  return instr->ea_kind != EA_REG;
+}
+
+static void add_callback(ue_block_t* block, size_t index, uint8_t kind, void* fn, void* userdata) {
+  if (index >= block->num_instrs) return;
+
+  block_instrumentation_t* instrumentation = block->instrumentation;
+  if (!instrumentation) {
+    instrumentation = calloc(1, sizeof(block_instrumentation_t));
+    if (!instrumentation) return;
+    block->instrumentation = instrumentation;
+  }
+
+  if (instrumentation->count == instrumentation->capacity) {
+    size_t capacity = instrumentation->capacity ? instrumentation->capacity * 2 : 4;
+    plugin_callback_t* callbacks = realloc(instrumentation->callbacks, capacity * sizeof(plugin_callback_t));
+    if (!callbacks) return;
+    instrumentation->callbacks = callbacks;
+    instrumentation->capacity = capacity;
+  }
+
+  // Insertion keeps them in order, and callbacks of the same kind on the same
+  // instruction run in the order they were added
+  size_t i = instrumentation->count;
+  while (i > 0) {
+    const plugin_callback_t* prev = &instrumentation->callbacks[i - 1];
+    if (prev->index < index || (prev->index == index && prev->kind <= kind)) break;
+    instrumentation->callbacks[i] = *prev;
+    i--;
+  }
+  instrumentation->callbacks[i] = (plugin_callback_t){
+    .index = index,
+    .kind = kind,
+    .fn = fn,
+    .userdata = userdata,
+  };
+  instrumentation->count++;
+}
+
+void ue_block_on_entry(ue_block_t* block, ue_block_cb_t cb, void* userdata) {
+  add_callback(block, 0, PLUGIN_CB_ENTRY, cb, userdata);
+}
+
+void ue_block_instr_on_exec(ue_block_t* block, size_t index, ue_instr_cb_t cb, void* userdata) {
+  add_callback(block, index, PLUGIN_CB_EXEC, cb, userdata);
+}
+
+void ue_block_instr_on_mem(ue_block_t* block, size_t index, ue_mem_cb_t cb, void* userdata) {
+  if (index < block->num_instrs && ue_instr_accesses_memory(&block->instrs[index])) {
+    add_callback(block, index, PLUGIN_CB_MEM, cb, userdata);
+  }
+}
+
+void plugin_translate_block(struct block_t* block) {
+  for (size_t i = 0; i < num_plugins; i++) {
+    if (plugins[i].on_translate) {
+      plugins[i].on_translate(i, block, plugins[i].translate_userdata);
+    }
+  }
+}
+
+void plugin_free_instrumentation(block_instrumentation_t* instrumentation) {
+  if (!instrumentation) return;
+  free(instrumentation->callbacks);
+  free(instrumentation);
+}
+
+static bool is_read_only(const x86_64_instr_t* instr) {
+  switch (instr->type) {
+    case MOV_8B:
+    case JMP_FF:
+    case CMP_83:
+    case CMP_39:
+    case CMP_3B:
+    case TEST_85:
+      return true;
+  }
+  return false;
+}
+
+static bool is_write_only(const x86_64_instr_t* instr) {
+  return instr->type == MOV_89 || instr->type == MOV_C7;
+}
+
+// The memory an instruction is about to access, worked out from the state
+// before it runs. Stack operations always move 8 bytes.
+size_t plugin_memory_accesses(const cpu_x86_64_t* cpu, const x86_64_instr_t* instr, plugin_mem_access_t* accesses_out) {
+  uint64_t rsp = cpu->regs[modrm_rsp];
+  switch (instr->type) {
+    case PUSH_50:
+    case CALL_E8: {
+      accesses_out[0] = (plugin_mem_access_t){ rsp - 8, 8, true };
+      return 1;
+    }
+    case POP_58:
+    case RET_C3: {
+      accesses_out[0] = (plugin_mem_access_t){ rsp, 8, false };
+      return 1;
+    }
+    case CALL_FF: {
+      // The target, if it's in memory, then the return address
+      size_t count = 0;
+      if (instr->ea_kind != EA_REG) {
+        accesses_out[count++] = (plugin_mem_access_t){ effective_address(cpu, instr), 8, false };
+      }
+      accesses_out[count++] = (plugin_mem_access_t){ rsp - 8, 8, true };
+      return count;
+    }
+  }
+
+  if (!ue_instr_accesses_memory(instr)) {
+    return 0;
+  }
+
+  uint64_t address = effective_address(cpu, instr);
+  if (instr->type >= SSE_MOV && instr->type <= X87) {
+    // Their operand sizes depend on the opcode rather than on opsize
+    bool reads, writes;
+    uint32_t size = fpu_memory_operand(instr, &reads, &writes);
+    accesses_out[0] = (plugin_mem_access_t){ address, size, writes };
+    return 1;
+  }
+  if (is_read_only(instr)) {
+    accesses_out[0] = (plugin_mem_access_t){ address, instr->opsize, false };
+    return 1;
+  }
+  if (is_write_only(instr)) {
+    accesses_out[0] = (plugin_mem_access_t){ address, instr->opsize, true };
+    return 1;
+  }
+  accesses_out[0] = (plugin_mem_access_t){ address, instr->opsize, false };
+  accesses_out[1] = (plugin_mem_access_t){ address, instr->opsize, true };
+  return 2;
+}
+
+void plugin_syscall(cpu_x86_64_t* cpu) {
+  for (size_t i = 0; i < num_plugins; i++) {
+    if (plugins[i].on_syscall) {
+      plugins[i].on_syscall(cpu, cpu->regs[modrm_rax], plugins[i].syscall_userdata);
+    }
+  }
+}
+
+void plugin_exit(void) {
+  for (size_t i = 0; i < num_plugins; i++) {
+    if (plugins[i].on_exit) {
+      plugins[i].on_exit(i, plugins[i].exit_userdata);
+    }
+  }
+}
+
+static char* plugin_errors[] = {
+  "Unknown",
+  "Too many plugins",
+  "Unable to load the plugin",
+  "Plugin was built for a different API version",
+  "Plugin has no install function",
+  "Plugin failed to install",
+};
+
+char* plugin_err_message(int errorIndex) {
+  if (errorIndex < 0) {
+    errorIndex *= -1;
+  }
+
+  if (errorIndex >= PLUGIN_ERR_NUM_ERRORS) {
+    return plugin_errors[PLUGIN_ERR_UNKNOWN];
+  }
+  return plugin_errors[errorIndex];
+}
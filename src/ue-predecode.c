@@ -0,0 +1,156 @@
+#include <pthread.h>
+#include <unistd.h>
+#include "ue-predecode.h"
+#include "ue-memory.h"
+#include "ue-block.h"
+
+// Ahead-of-time pre-decoding. Starting from the entry point and every function
+// symbol, blocks are built by recursive descent over the executable segments
+// using a pool of worker threads, so that the block cache is already warm by
+// the time the guest starts running.
+
+typedef struct predecode_queue_t {
+  uint64_t* addresses;
+  size_t count;
+  size_t capacity;
+  int active_workers;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} predecode_queue_t;
+
+// Must be called with the queue lock held
+static void queue_push(predecode_queue_t* queue, uint64_t address) {
+  if (!is_executable_address(address) || block_lookup(address)) {
+    return;
+  }
+
+  if (queue->count == queue->capacity) {
+    size_t capacity = queue->capacity * 2;
+    uint64_t* addresses = realloc(queue->addresses, capacity * sizeof(uint64_t));
+    // Dropping work is harmless; the block will be built lazily instead
+    if (!addresses) return;
+    queue->addresses = addresses;
+    queue->capacity = capacity;
+  }
+
+  queue->addresses[queue->count++] = address;
+  pthread_cond_signal(&queue->cond);
+}
+
+static void* predecode_worker(void* arg) {
+  predecode_queue_t* queue = arg;
+  // decode_at_address() doesn't touch the cpu state, so a scratch one will do
+  cpu_x86_64_t cpu = {0};
+
+  pthread_mutex_lock(&queue->lock);
+  while (true) {
+    while (queue->count == 0 && queue->active_workers > 0) {
+      pthread_cond_wait(&queue->cond, &queue->lock);
+    }
+
+    // Nothing left to do, and nobody else can produce more work
+    if (queue->count == 0) {
+      pthread_cond_broadcast(&queue->cond);
+      break;
+    }
+
+    uint64_t address = queue->addresses[--queue->count];
+    queue->active_workers++;
+    pthread_mutex_unlock(&queue->lock);
+
+    block_t* block = NULL;
+    bool built = !block_lookup(address) && block_build(&cpu, address, BLOCK_TIER_OPTIMIZED, &block) == 0;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->active_workers--;
+
+    if (built) {
+      // Follow the block's successors
+      const x86_64_instr_t* last = &block->instrs[block->num_instrs - 1];
+      switch (last->type) {
+        case JCC:
+        case CALL_E8: {
+          queue_push(queue, last->imm64);
+          queue_push(queue, last->address + last->size);
+          break;
+        }
+        case CALL_FF: {
+          // Only the return address is known ahead of time
+          queue_push(queue, last->address + last->size);
+          break;
+        }
+        case JMP: {
+          queue_push(queue, last->imm64);
+          break;
+        }
+        case RET_C3:
+        case JMP_FF: {
+          break;
+        }
+        default: {
+          queue_push(queue, block->address + block->size);
+          break;
+        }
+      }
+    }
+
+    if (queue->count == 0 && queue->active_workers == 0) {
+      pthread_cond_broadcast(&queue->cond);
+    }
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return NULL;
+}
+
+int predecode_executable(uint64_t entry, const elf_symtab_t* symtab, int num_threads) {
+  if (num_threads <= 0) {
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads <= 0) num_threads = 1;
+  }
+
+  predecode_queue_t queue = {
+    .capacity = PREDECODE_QUEUE_SIZE,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+  };
+  queue.addresses = malloc(queue.capacity * sizeof(uint64_t));
+  if (!queue.addresses) {
+    return -1;
+  }
+
+  // Seed the queue with every known code entry point
+  queue_push(&queue, entry);
+  if (symtab) {
+    for (size_t i = 0; i < symtab->num_symbols; i++) {
+      if (symtab->symbols[i].type == STT_FUNC) {
+        queue_push(&queue, symtab->symbols[i].address);
+      }
+    }
+  }
+
+  pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+  if (!threads) {
+    free(queue.addresses);
+    return -1;
+  }
+
+  int num_started = 0;
+  for (int i = 0; i < num_threads; i++) {
+    if (pthread_create(&threads[i], NULL, predecode_worker, &queue) != 0) break;
+    num_started++;
+  }
+
+  // Fall back to doing the work on this thread if no workers could be started
+  if (num_started == 0) {
+    predecode_worker(&queue);
+  }
+
+  for (int i = 0; i < num_started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(threads);
+  free(queue.addresses);
+  return 0;
+}
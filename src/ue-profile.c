@@ -0,0 +1,408 @@
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "ue-profile.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define STACK_TABLE_INITIAL_CAPACITY  (1024)
+
+typedef struct profile_buffer_t {
+  // Variable length records of [num_frames, outermost frame, ..., rip]. The
+  // frames other than rip are return addresses.
+  uint64_t* entries;
+  size_t used;
+  uint64_t num_samples;
+  uint64_t num_dropped;
+  uint64_t num_truncated; // Samples whose call stack was deeper than SHADOW_STACK_SIZE
+  // The host thread's own CPU time sampling timer, in timer mode
+  timer_t timer;
+  bool has_timer;
+  struct profile_buffer_t* next;
+} profile_buffer_t;
+
+static bool profiling = false;
+static uint64_t instruction_interval = 0;
+static uint64_t timer_interval_us = 0;
+static struct sigaction previous_action;
+static profile_buffer_t* buffers = NULL;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The buffer belonging to the calling host thread, and the guest cpu it's
+// currently running, if any. These are all the signal handler looks at.
+static __thread profile_buffer_t* thread_buffer = NULL;
+static __thread const cpu_x86_64_t* volatile thread_cpu = NULL;
+
+// For jittering the instruction count sampling interval
+static __thread uint64_t jitter_state = 0;
+
+// Called from the SIGPROF handler as well, so this only copies into the
+// preallocated buffer. If the buffer is full the sample is dropped.
+static void record_sample(profile_buffer_t* buffer, const cpu_x86_64_t* cpu) {
+  uint64_t rip = cpu->rip;
+  uint32_t depth = cpu->shadow_depth;
+  // Only the outermost SHADOW_STACK_SIZE frames were kept
+  if (depth > SHADOW_STACK_SIZE) {
+    depth = SHADOW_STACK_SIZE;
+    buffer->num_truncated++;
+  }
+
+  // A timer sample can land in the middle of a call or ret, after the shadow
+  // stack has been updated but before rip has (or vice versa). Either way the
+  // top return address is just past rip, so dropping it gives the state from
+  // just before the call or just after the return.
+  if (depth > 0) {
+    uint64_t top = cpu->shadow_stack[depth - 1];
+    if (top >= rip && top - rip <= MAX_INSTRUCTIONS_BYTES) {
+      depth--;
+    }
+  }
+
+  size_t needed = depth + 2;
+  if (buffer->used + needed > PROFILE_BUFFER_ENTRIES) {
+    buffer->num_dropped++;
+    return;
+  }
+
+  uint64_t* record = buffer->entries + buffer->used;
+  record[0] = depth + 1;
+  for (uint32_t i = 0; i < depth; i++) {
+    record[1 + i] = cpu->shadow_stack[i];
+  }
+  record[1 + depth] = rip;
+
+  buffer->used += needed;
+  buffer->num_samples++;
+}
+
+static void profile_signal_handler(int sig) {
+  const cpu_x86_64_t* cpu = thread_cpu;
+  if (cpu && thread_buffer) {
+    record_sample(thread_buffer, cpu);
+  }
+}
+
+int profile_start(const profile_config_t* config) {
+  __atomic_store_n(&instruction_interval, config->instruction_interval, __ATOMIC_RELAXED);
+  __atomic_store_n(&profiling, true, __ATOMIC_RELEASE);
+
+  if (config->instruction_interval) {
+    return 0;
+  }
+  timer_interval_us = config->interval_us ? config->interval_us : PROFILE_DEFAULT_INTERVAL_US;
+
+  struct sigaction action = {0};
+  action.sa_handler = profile_signal_handler;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, &previous_action) != 0) {
+    return -PROFILE_ERR_SIGNAL;
+  }
+  return 0;
+}
+
+// Each host thread gets a timer on its own CPU time clock, delivering SIGPROF
+// to that thread only, so every sample is of the guest the thread is running
+static int start_thread_timer(profile_buffer_t* buffer) {
+  struct sigevent event = {0};
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = SIGPROF;
+  event.sigev_notify_thread_id = syscall(SYS_gettid);
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &buffer->timer) != 0) {
+    return -PROFILE_ERR_TIMER;
+  }
+  buffer->has_timer = true;
+
+  struct itimerspec spec = {
+    .it_interval = { .tv_sec = timer_interval_us / 1000000, .tv_nsec = (timer_interval_us % 1000000) * 1000 },
+    .it_value    = { .tv_sec = timer_interval_us / 1000000, .tv_nsec = (timer_interval_us % 1000000) * 1000 },
+  };
+  if (timer_settime(buffer->timer, 0, &spec, NULL) != 0) {
+    return -PROFILE_ERR_TIMER;
+  }
+  return 0;
+}
+
+void profile_stop(void) {
+  __atomic_store_n(&profiling, false, __ATOMIC_RELEASE);
+  __atomic_store_n(&instruction_interval, 0, __ATOMIC_RELAXED);
+  if (!timer_interval_us) {
+    return;
+  }
+
+  // Keep SIGPROF blocked until any that's already pending here has been taken
+  // off the queue, since the previous action may well be the default (which
+  // would kill the process)
+  sigset_t sigprof;
+  sigset_t old_mask;
+  sigemptyset(&sigprof);
+  sigaddset(&sigprof, SIGPROF);
+  pthread_sigmask(SIG_BLOCK, &sigprof, &old_mask);
+
+  pthread_mutex_lock(&buffers_lock);
+  for (profile_buffer_t* buffer = buffers; buffer; buffer = buffer->next) {
+    if (buffer->has_timer) {
+      timer_delete(buffer->timer);
+      buffer->has_timer = false;
+    }
+  }
+  pthread_mutex_unlock(&buffers_lock);
+
+  struct timespec no_wait = {0};
+  while (sigtimedwait(&sigprof, NULL, &no_wait) == SIGPROF) {}
+  sigaction(SIGPROF, &previous_action, NULL);
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  timer_interval_us = 0;
+}
+
+// Called by run_blocks() on entry, so that samples land in this thread's buffer
+void profile_attach(const cpu_x86_64_t* cpu) {
+  if (!__atomic_load_n(&profiling, __ATOMIC_ACQUIRE)) return;
+
+  if (!thread_buffer) {
+    profile_buffer_t* buffer = calloc(1, sizeof(profile_buffer_t));
+    if (!buffer) return;
+    buffer->entries = malloc(PROFILE_BUFFER_ENTRIES * sizeof(uint64_t));
+    if (!buffer->entries) {
+      free(buffer);
+      return;
+    }
+
+    pthread_mutex_lock(&buffers_lock);
+    buffer->next = buffers;
+    buffers = buffer;
+    pthread_mutex_unlock(&buffers_lock);
+
+    thread_buffer = buffer;
+    if (timer_interval_us) {
+      // Without a timer this thread simply isn't sampled
+      start_thread_timer(buffer);
+    }
+  }
+
+  thread_cpu = cpu;
+}
+
+void profile_detach(void) {
+  thread_cpu = NULL;
+}
+
+void profile_sample(const cpu_x86_64_t* cpu) {
+  if (thread_buffer && __atomic_load_n(&profiling, __ATOMIC_RELAXED)) {
+    record_sample(thread_buffer, cpu);
+  }
+}
+
+static uint64_t next_jitter(void) {
+  // xorshift64, seeded per thread
+  if (!jitter_state) {
+    jitter_state = (uint64_t)(uintptr_t)&jitter_state | 1;
+  }
+  jitter_state ^= jitter_state << 13;
+  jitter_state ^= jitter_state >> 7;
+  jitter_state ^= jitter_state << 17;
+  return jitter_state;
+}
+
+// The next block exit run_blocks() needs to stop at: the end of its budget, or
+// the next sample if that comes first. Samples are taken between 0.5x and 1.5x
+// the interval apart, so that they don't lock onto the period of a guest loop.
+uint64_t profile_next_event(const cpu_x86_64_t* cpu) {
+  uint64_t interval = __atomic_load_n(&instruction_interval, __ATOMIC_RELAXED);
+  if (!interval) return cpu->budget_end;
+
+  uint64_t next_sample = cpu->instructions_retired + interval / 2 + next_jitter() % interval + 1;
+  return (next_sample < cpu->budget_end) ? next_sample : cpu->budget_end;
+}
+
+uint64_t profile_num_samples(uint64_t* dropped_out, uint64_t* truncated_out) {
+  uint64_t samples = 0;
+  uint64_t dropped = 0;
+  uint64_t truncated = 0;
+
+  pthread_mutex_lock(&buffers_lock);
+  for (profile_buffer_t* buffer = buffers; buffer; buffer = buffer->next) {
+    samples += buffer->num_samples;
+    dropped += buffer->num_dropped;
+    truncated += buffer->num_truncated;
+  }
+  pthread_mutex_unlock(&buffers_lock);
+
+  if (dropped_out) *dropped_out = dropped;
+  if (truncated_out) *truncated_out = truncated;
+  return samples;
+}
+
+// Identical stacks are merged into a single line with a count
+typedef struct stack_count_t {
+  char* stack;
+  uint64_t count;
+} stack_count_t;
+
+typedef struct stack_table_t {
+  stack_count_t* slots;
+  size_t capacity; // Always a power of two
+  size_t num_used;
+} stack_table_t;
+
+static stack_count_t* stack_table_find(stack_count_t* slots, size_t capacity, const char* stack) {
+  size_t index = fnv1a(FNV_OFFSET_BASIS, stack, strlen(stack)) & (capacity - 1);
+  while (slots[index].stack && strcmp(slots[index].stack, stack) != 0) {
+    index = (index + 1) & (capacity - 1);
+  }
+  return &slots[index];
+}
+
+static int stack_table_add(stack_table_t* table, const char* stack) {
+  // Keep the load factor under a half
+  if ((table->num_used + 1) * 2 > table->capacity) {
+    size_t new_capacity = table->capacity ? table->capacity * 2 : STACK_TABLE_INITIAL_CAPACITY;
+    stack_count_t* new_slots = calloc(new_capacity, sizeof(stack_count_t));
+    if (!new_slots) {
+      return -PROFILE_ERR_MALLOC;
+    }
+    for (size_t i = 0; i < table->capacity; i++) {
+      if (table->slots[i].stack) {
+        *stack_table_find(new_slots, new_capacity, table->slots[i].stack) = table->slots[i];
+      }
+    }
+    free(table->slots);
+    table->slots = new_slots;
+    table->capacity = new_capacity;
+  }
+
+  stack_count_t* slot = stack_table_find(table->slots, table->capacity, stack);
+  if (!slot->stack) {
+    slot->stack = strdup(stack);
+    if (!slot->stack) {
+      return -PROFILE_ERR_MALLOC;
+    }
+    table->num_used++;
+  }
+  slot->count++;
+  return 0;
+}
+
+static void stack_table_free(stack_table_t* table) {
+  for (size_t i = 0; i < table->capacity; i++) {
+    free(table->slots[i].stack);
+  }
+  free(table->slots);
+}
+
+// Appends a frame to the collapsed stack in *buf, growing it as needed
+static int append_frame(char** buf, size_t* len, size_t* capacity, const char* name) {
+  size_t name_len = strlen(name);
+  size_t needed = *len + name_len + 2; // Separator and terminator
+  if (needed > *capacity) {
+    size_t new_capacity = *capacity ? *capacity : 256;
+    while (new_capacity < needed) new_capacity *= 2;
+    char* new_buf = realloc(*buf, new_capacity);
+    if (!new_buf) {
+      return -PROFILE_ERR_MALLOC;
+    }
+    *buf = new_buf;
+    *capacity = new_capacity;
+  }
+
+  if (*len > 0) {
+    (*buf)[(*len)++] = ';';
+  }
+  memcpy(*buf + *len, name, name_len + 1);
+  *len += name_len;
+  return 0;
+}
+
+static const char* symbolize(const elf_symtab_t* symtab, uint64_t address, char* fallback, size_t fallback_size) {
+  const elf_symbol_t* sym = symtab ? elf_find_function(symtab, address) : NULL;
+  if (sym) {
+    return sym->name;
+  }
+  snprintf(fallback, fallback_size, "0x%lx", address);
+  return fallback;
+}
+
+// Writes every sample as "outer;...;inner count" lines, the input format of
+// flamegraph.pl and most other flamegraph tools. Return addresses are
+// symbolized one byte back, so they land inside the call instruction rather
+// than whatever follows it.
+int profile_write_collapsed(const char* path, const elf_symtab_t* symtab) {
+  FILE* out = fopen(path, "w");
+  if (!out) {
+    return -PROFILE_ERR_OPEN;
+  }
+
+  stack_table_t table = {0};
+  char* stack = NULL;
+  size_t stack_capacity = 0;
+  char fallback[32];
+  int ret = 0;
+
+  pthread_mutex_lock(&buffers_lock);
+  for (profile_buffer_t* buffer = buffers; buffer && ret == 0; buffer = buffer->next) {
+    size_t used = buffer->used;
+    size_t pos = 0;
+    while (pos < used && ret == 0) {
+      uint64_t num_frames = buffer->entries[pos];
+      const uint64_t* frames = &buffer->entries[pos + 1];
+      pos += 1 + num_frames;
+
+      size_t stack_len = 0;
+      for (uint64_t i = 0; i < num_frames && ret == 0; i++) {
+        bool is_return_address = i + 1 < num_frames;
+        uint64_t address = is_return_address ? frames[i] - 1 : frames[i];
+        ret = append_frame(&stack, &stack_len, &stack_capacity, symbolize(symtab, address, fallback, sizeof(fallback)));
+      }
+      if (ret == 0) {
+        ret = stack_table_add(&table, stack);
+      }
+    }
+  }
+  pthread_mutex_unlock(&buffers_lock);
+
+  for (size_t i = 0; i < table.capacity && ret == 0; i++) {
+    if (table.slots[i].stack) {
+      fprintf(out, "%s %lu\n", table.slots[i].stack, table.slots[i].count);
+    }
+  }
+
+  free(stack);
+  stack_table_free(&table);
+  fclose(out);
+  return ret;
+}
+
+void profile_free(void) {
+  pthread_mutex_lock(&buffers_lock);
+  while (buffers) {
+    profile_buffer_t* temp = buffers;
+    buffers = buffers->next;
+    free(temp->entries);
+    free(temp);
+  }
+  pthread_mutex_unlock(&buffers_lock);
+  thread_buffer = NULL;
+}
+
+static char* profile_errors[] = {
+  "Unknown",
+  "Unable to install the profiling signal handler",
+  "Unable to start the profiling timer",
+  "Unable to allocate memory",
+  "Unable to open the profile output file",
+};
+
+char* profile_err_message(int errorIndex) {
+  if (errorIndex < 0) {
+    errorIndex *= -1;
+  }
+
+  if (errorIndex >= PROFILE_ERR_NUM_ERRORS) {
+    return profile_errors[PROFILE_ERR_UNKNOWN];
+  }
+  return profile_errors[errorIndex];
+}
@@ -0,0 +1,306 @@
+#include <unistd.h>
+#include <sys/random.h>
+#include <x86intrin.h>
+#include "ue-replay.h"
+#include "ue-sched.h"
+#include "ue-block.h"
+#include "ue-memory.h"
+#include "ue-watch.h"
+
+// The log is a replay_header_t followed by a stream of replay_event_t's, in the
+// order the guest consumed them. Nothing is indexed by instruction count: the
+// guest is single threaded and deterministic between events, so it asks for
+// them in exactly the order they were written.
+
+#define LOG_BUFFER_SIZE  (64 * 1024)
+
+typedef struct replay_checkpoint_t {
+  uint64_t instructions;
+  cpu_x86_64_t cpu;
+  uint64_t clear_child_tid;
+  uint64_t robust_list;
+  long log_offset;
+  uint8_t* memory; // See memory_snapshot()
+} replay_checkpoint_t;
+
+int replay_mode = REPLAY_OFF;
+
+static FILE* log_fp = NULL;
+static bool log_error = false;
+static replay_header_t header;
+
+static replay_checkpoint_t checkpoints[REPLAY_MAX_CHECKPOINTS];
+static size_t num_checkpoints = 0;
+static uint64_t checkpoint_interval = REPLAY_CHECKPOINT_INTERVAL;
+static bool checkpoints_enabled = true;
+
+int replay_record_start(const char* path, uint64_t key) {
+  log_fp = fopen(path, "wb");
+  if (!log_fp) {
+    return -REPLAY_ERR_OPEN;
+  }
+  setvbuf(log_fp, NULL, _IOFBF, LOG_BUFFER_SIZE);
+
+  header = (replay_header_t){
+    .magic = REPLAY_MAGIC,
+    .format_version = REPLAY_FORMAT_VERSION,
+    .pid = getpid(),
+    .key = key,
+  };
+  if (fwrite(&header, sizeof(header), 1, log_fp) != 1) {
+    fclose(log_fp);
+    log_fp = NULL;
+    return -REPLAY_ERR_WRITE;
+  }
+
+  replay_mode = REPLAY_RECORDING;
+  return 0;
+}
+
+int replay_open(const char* path, uint64_t key) {
+  log_fp = fopen(path, "rb");
+  if (!log_fp) {
+    return -REPLAY_ERR_OPEN;
+  }
+  setvbuf(log_fp, NULL, _IOFBF, LOG_BUFFER_SIZE);
+
+  int ret = 0;
+  if (fread(&header, sizeof(header), 1, log_fp) != 1
+      || header.magic != REPLAY_MAGIC
+      || header.format_version != REPLAY_FORMAT_VERSION) {
+    ret = -REPLAY_ERR_BAD_HEADER;
+  } else if (header.key != key) {
+    ret = -REPLAY_ERR_WRONG_BINARY;
+  }
+
+  if (ret != 0) {
+    fclose(log_fp);
+    log_fp = NULL;
+    return ret;
+  }
+
+  replay_mode = REPLAY_REPLAYING;
+  return 0;
+}
+
+int replay_close(void) {
+  for (size_t i = 0; i < num_checkpoints; i++) {
+    free(checkpoints[i].memory);
+  }
+  num_checkpoints = 0;
+
+  if (log_fp && fclose(log_fp) != 0) {
+    log_error = true;
+  }
+  log_fp = NULL;
+
+  bool was_recording = (replay_mode == REPLAY_RECORDING);
+  replay_mode = REPLAY_OFF;
+  return (was_recording && log_error) ? -REPLAY_ERR_WRITE : 0;
+}
+
+// The guest sees the same process (and so thread) ids in a replay as it did
+// when it was recorded
+uint32_t replay_process_id(void) {
+  return (replay_mode == REPLAY_REPLAYING) ? header.pid : (uint32_t)getpid();
+}
+
+void replay_write_event(uint16_t kind, uint16_t number, int64_t value, const void* data, uint32_t size) {
+  replay_event_t event = {
+    .kind = kind,
+    .number = number,
+    .size = size,
+    .value = value,
+  };
+  // data can be guest memory, and a fault recovered from inside stdio would
+  // leave the stream locked
+  block_fault_recovery();
+  if (fwrite(&event, sizeof(event), 1, log_fp) != 1
+      || (size > 0 && fwrite(data, size, 1, log_fp) != 1)) {
+    log_error = true;
+  }
+  allow_fault_recovery();
+}
+
+int replay_read_event(uint16_t kind, uint16_t number, int64_t* value_out, uint32_t* size_out) {
+  replay_event_t event;
+  if (fread(&event, sizeof(event), 1, log_fp) != 1
+      || event.kind != kind
+      || event.number != number) {
+    return -CPU_ERR_REPLAY_DIVERGED;
+  }
+
+  *value_out = event.value;
+  *size_out = event.size;
+  return 0;
+}
+
+int replay_read_data(void* data_out, uint32_t size) {
+  // As in replay_write_event(), data_out can be guest memory
+  block_fault_recovery();
+  bool ok = (size == 0 || fread(data_out, size, 1, log_fp) == 1);
+  allow_fault_recovery();
+  return ok ? 0 : -CPU_ERR_REPLAY_DIVERGED;
+}
+
+int replay_rdtsc(uint64_t* tsc_out) {
+  if (replay_mode == REPLAY_REPLAYING) {
+    int64_t value;
+    uint32_t size;
+    int ret = replay_read_event(REPLAY_EVENT_RDTSC, 0, &value, &size);
+    if (ret != 0) {
+      return ret;
+    }
+    if (size != 0) {
+      return -CPU_ERR_REPLAY_DIVERGED;
+    }
+    *tsc_out = value;
+    return 0;
+  }
+
+  *tsc_out = __rdtsc();
+  if (replay_mode == REPLAY_RECORDING) {
+    replay_write_event(REPLAY_EVENT_RDTSC, 0, *tsc_out, NULL, 0);
+  }
+  return 0;
+}
+
+int replay_random(void* data_out, uint32_t size) {
+  if (replay_mode == REPLAY_REPLAYING) {
+    int64_t value;
+    uint32_t recorded_size;
+    int ret = replay_read_event(REPLAY_EVENT_RANDOM, 0, &value, &recorded_size);
+    if (ret != 0) {
+      return ret;
+    }
+    if (recorded_size != size) {
+      return -CPU_ERR_REPLAY_DIVERGED;
+    }
+    return replay_read_data(data_out, size);
+  }
+
+  if (getrandom(data_out, size, 0) != (ssize_t)size) {
+    return -CPU_ERR_UNKNOWN;
+  }
+  if (replay_mode == REPLAY_RECORDING) {
+    replay_write_event(REPLAY_EVENT_RANDOM, 0, 0, data_out, size);
+  }
+  return 0;
+}
+
+// Once the checkpoints are full, every other one is dropped and they're taken
+// half as often from then on, so any length of replay is covered evenly
+static void take_checkpoint(guest_context_t* guest) {
+  if (num_checkpoints == REPLAY_MAX_CHECKPOINTS) {
+    for (size_t i = 1; i < REPLAY_MAX_CHECKPOINTS; i += 2) {
+      free(checkpoints[i].memory);
+    }
+    for (size_t i = 1; i < REPLAY_MAX_CHECKPOINTS / 2; i++) {
+      checkpoints[i] = checkpoints[i * 2];
+    }
+    num_checkpoints = REPLAY_MAX_CHECKPOINTS / 2;
+    checkpoint_interval *= 2;
+  }
+
+  uint8_t* memory = malloc(memory_snapshot_size());
+  if (!memory) {
+    // Seeking back just has to start further back from now on
+    checkpoints_enabled = false;
+    return;
+  }
+  memory_snapshot(memory);
+
+  checkpoints[num_checkpoints++] = (replay_checkpoint_t){
+    .instructions = guest->cpu.instructions_retired,
+    .cpu = guest->cpu,
+    .clear_child_tid = guest->clear_child_tid,
+    .robust_list = guest->robust_list,
+    .log_offset = ftell(log_fp),
+    .memory = memory,
+  };
+}
+
+static void restore_checkpoint(guest_context_t* guest, const replay_checkpoint_t* checkpoint) {
+  memory_restore(checkpoint->memory);
+  guest->cpu = checkpoint->cpu;
+  guest->clear_child_tid = checkpoint->clear_child_tid;
+  guest->robust_list = checkpoint->robust_list;
+  fseek(log_fp, checkpoint->log_offset, SEEK_SET);
+}
+
+// Blocks run at full speed until the target is less than a block away, and the
+// rest is single stepped so that it's reached exactly. Checkpoints are taken at
+// block exits along the way.
+int replay_run(guest_context_t* guest, uint64_t instructions, bool trace) {
+  cpu_x86_64_t* cpu = &guest->cpu;
+
+  while (cpu->instructions_retired < instructions) {
+    uint64_t next_checkpoint = RUN_UNLIMITED;
+    if (checkpoints_enabled) {
+      next_checkpoint = (num_checkpoints > 0) ? checkpoints[num_checkpoints - 1].instructions + checkpoint_interval : 0;
+      if (cpu->instructions_retired >= next_checkpoint) {
+        take_checkpoint(guest);
+        continue;
+      }
+    }
+
+    uint64_t remaining = instructions - cpu->instructions_retired;
+    int ret;
+    if (remaining > BLOCK_MAX_INSTRUCTIONS) {
+      uint64_t budget = remaining - BLOCK_MAX_INSTRUCTIONS;
+      if (budget > next_checkpoint - cpu->instructions_retired) {
+        budget = next_checkpoint - cpu->instructions_retired;
+      }
+      ret = run_blocks(cpu, budget, trace);
+      if (ret == RUN_BUDGET_EXHAUSTED) {
+        ret = 0;
+      }
+    } else {
+      ret = step_instruction(cpu);
+    }
+
+    if (ret != 0) {
+      return ret;
+    }
+    if (watch_take_stop()) {
+      guest->stop_reason = GUEST_STOP_WATCHPOINT;
+      return RUN_BUDGET_EXHAUSTED;
+    }
+  }
+
+  return 0;
+}
+
+int replay_seek(guest_context_t* guest, uint64_t instructions, bool trace) {
+  if (instructions < guest->cpu.instructions_retired) {
+    size_t i = num_checkpoints;
+    while (i > 0 && checkpoints[i - 1].instructions > instructions) {
+      i--;
+    }
+    if (i == 0) {
+      return -CPU_ERR_UNABLE_TO_EXECUTE;
+    }
+    restore_checkpoint(guest, &checkpoints[i - 1]);
+  }
+
+  return replay_run(guest, instructions, trace);
+}
+
+static char* replay_errors[] = {
+  "Unknown",
+  "Unable to open the replay log",
+  "Unable to write the replay log",
+  "Not a replay log, or one from a different version",
+  "The replay log was recorded from a different binary",
+};
+
+char* replay_err_message(int errorIndex) {
+  if (errorIndex < 0) {
+    errorIndex *= -1;
+  }
+
+  if (errorIndex >= REPLAY_ERR_NUM_ERRORS) {
+    return replay_errors[REPLAY_ERR_UNKNOWN];
+  }
+  return replay_errors[errorIndex];
+}
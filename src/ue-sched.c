@@ -0,0 +1,429 @@
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include "ue-sched.h"
+#include "ue-block.h"
+#include "ue-watch.h"
+
+struct sched_worker_t {
+  pthread_t thread;
+  struct scheduler_t* sched;
+  guest_context_t* running;
+};
+
+typedef struct sched_worker_t sched_worker_t;
+
+typedef struct scheduler_t {
+  guest_context_t* head;
+  guest_context_t* tail;
+  guest_context_t* sleeping; // Parked guests with a deadline, in no order
+  size_t num_live;
+  uint64_t slice;
+  bool trace;
+  void (*finished)(guest_context_t* guest);
+  sched_worker_t* workers;
+  int num_workers;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} scheduler_t;
+
+// Only one scheduler runs at a time; parking and waking need to reach it
+static scheduler_t* active_scheduler = NULL;
+
+static const char* stop_messages[GUEST_NUM_STOP_REASONS] = {
+  "",
+  "instruction limit reached",
+  "timed out",
+  "watchpoint hit",
+};
+
+static const int stop_statuses[GUEST_NUM_STOP_REASONS] = {
+  0,
+  SCHED_STATUS_INSTRUCTION_LIMIT,
+  SCHED_STATUS_TIMEOUT,
+  SCHED_STATUS_WATCHPOINT,
+};
+
+uint64_t sched_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const char* sched_stop_message(int stop_reason) {
+  return stop_messages[stop_reason];
+}
+
+int sched_stop_status(int stop_reason) {
+  return stop_statuses[stop_reason];
+}
+
+bool sched_running(void) {
+  return active_scheduler != NULL;
+}
+
+// Must be called with the scheduler lock held
+static void enqueue(scheduler_t* sched, guest_context_t* guest) {
+  guest->state = GUEST_RUNNABLE;
+  guest->next = NULL;
+  if (sched->tail) {
+    sched->tail->next = guest;
+  } else {
+    sched->head = guest;
+  }
+  sched->tail = guest;
+  pthread_cond_signal(&sched->cond);
+}
+
+// When a parked guest has to be run again whether it's woken or not: its own
+// deadline or the guest's overall one, whichever is first. Must be called with
+// the scheduler lock held.
+static uint64_t wake_deadline(const guest_context_t* guest) {
+  uint64_t deadline = guest->park_deadline_ns;
+  if (guest->deadline_ns && (!deadline || guest->deadline_ns < deadline)) {
+    deadline = guest->deadline_ns;
+  }
+  return deadline;
+}
+
+// Must be called with the scheduler lock held
+static void remove_sleeping(scheduler_t* sched, guest_context_t* guest) {
+  for (guest_context_t** link = &sched->sleeping; *link; link = &(*link)->next) {
+    if (*link == guest) {
+      *link = guest->next;
+      break;
+    }
+  }
+}
+
+// Requeues parked guests whose deadlines have passed, and returns the earliest
+// deadline still to come, or 0 if there are none. Must be called with the
+// scheduler lock held.
+static uint64_t wake_expired(scheduler_t* sched) {
+  uint64_t now = sched_now_ns();
+  uint64_t earliest = 0;
+  guest_context_t** link = &sched->sleeping;
+  while (*link) {
+    guest_context_t* guest = *link;
+    uint64_t deadline = wake_deadline(guest);
+    if (deadline <= now) {
+      *link = guest->next;
+      guest->park_timed_out = true;
+      enqueue(sched, guest);
+      continue;
+    }
+    if (!earliest || deadline < earliest) {
+      earliest = deadline;
+    }
+    link = &guest->next;
+  }
+  return earliest;
+}
+
+// Sends each running guest which is still to stop its signal again, in case
+// it was between checking for the stop and blocking in a host syscall when it
+// was last sent. Returns whether there were any. Must be called with the
+// scheduler lock held.
+static bool reinterrupt(scheduler_t* sched) {
+  bool any = false;
+  for (int i = 0; i < sched->num_workers; i++) {
+    guest_context_t* guest = sched->workers[i].running;
+    if (guest && guest->interrupt_signal) {
+      pthread_kill(sched->workers[i].thread, guest->interrupt_signal);
+      any = true;
+    }
+  }
+  return any;
+}
+
+// Runs one slice of a guest, returning true if it should be scheduled again
+static bool run_slice(scheduler_t* sched, guest_context_t* guest) {
+  // The parked guest's own deadline has passed, so let it find out before
+  // anything else runs it (or stops it)
+  if (guest->park_timed_out) {
+    guest->park_timed_out = false;
+    if (guest->timed_out) {
+      guest->timed_out(guest);
+    }
+  }
+
+  // Asked to stop while it was queued or parked
+  if (__atomic_load_n(&guest->cpu.exit_requested, __ATOMIC_SEQ_CST)) {
+    guest->result = RUN_GUEST_EXITED;
+    return false;
+  }
+
+  if (guest->deadline_ns && sched_now_ns() >= guest->deadline_ns) {
+    guest->stop_reason = GUEST_STOP_TIMEOUT;
+    return false;
+  }
+
+  uint64_t budget = sched->slice;
+
+  // Don't let the slice overshoot the guest's overall limit (by more than a block)
+  if (guest->instruction_limit) {
+    uint64_t remaining = guest->instruction_limit - guest->cpu.instructions_retired;
+    if (remaining < budget) budget = remaining;
+  }
+
+  int ret = run_blocks(&guest->cpu, budget, sched->trace);
+  if (ret != RUN_BUDGET_EXHAUSTED) {
+    guest->result = ret;
+    return false;
+  }
+
+  if (watch_take_stop()) {
+    guest->stop_reason = GUEST_STOP_WATCHPOINT;
+    return false;
+  }
+
+  if (guest->instruction_limit && guest->cpu.instructions_retired >= guest->instruction_limit) {
+    guest->stop_reason = GUEST_STOP_INSTRUCTION_LIMIT;
+    return false;
+  }
+
+  if (guest->deadline_ns && sched_now_ns() >= guest->deadline_ns) {
+    guest->stop_reason = GUEST_STOP_TIMEOUT;
+    return false;
+  }
+
+  return true;
+}
+
+// Waits for a guest to be queued, a parked one's deadline, or (while a running
+// guest still has to be interrupted) the next time to interrupt it. Must be
+// called with the scheduler lock held.
+static void wait_for_work(scheduler_t* sched, uint64_t deadline) {
+  if (reinterrupt(sched)) {
+    uint64_t retry = sched_now_ns() + SCHED_INTERRUPT_INTERVAL_NS;
+    if (!deadline || retry < deadline) deadline = retry;
+  }
+
+  if (!deadline) {
+    pthread_cond_wait(&sched->cond, &sched->lock);
+    return;
+  }
+  struct timespec ts = {
+    .tv_sec = deadline / 1000000000ULL,
+    .tv_nsec = deadline % 1000000000ULL,
+  };
+  pthread_cond_timedwait(&sched->cond, &sched->lock, &ts);
+}
+
+static void* sched_worker(void* arg) {
+  sched_worker_t* worker = arg;
+  scheduler_t* sched = worker->sched;
+
+  pthread_mutex_lock(&sched->lock);
+  while (true) {
+    uint64_t deadline = wake_expired(sched);
+    if (sched->num_live == 0) break;
+    if (!sched->head) {
+      wait_for_work(sched, deadline);
+      continue;
+    }
+
+    guest_context_t* guest = sched->head;
+    sched->head = guest->next;
+    if (!sched->head) sched->tail = NULL;
+    guest->state = GUEST_RUNNING;
+    guest->worker = worker;
+    worker->running = guest;
+    pthread_mutex_unlock(&sched->lock);
+
+    bool again = run_slice(sched, guest);
+
+    pthread_mutex_lock(&sched->lock);
+    guest->worker = NULL;
+    worker->running = NULL;
+    if (!again) {
+      guest->state = GUEST_DONE;
+      pthread_mutex_unlock(&sched->lock);
+      if (sched->finished) {
+        sched->finished(guest);
+      }
+      pthread_mutex_lock(&sched->lock);
+      sched->num_live--;
+      if (sched->num_live == 0) {
+        pthread_cond_broadcast(&sched->cond);
+      }
+    } else if (guest->park_requested && !guest->wake_pending) {
+      // Parked during the slice; sched_wake() or its deadline will requeue it
+      guest->park_requested = false;
+      guest->state = GUEST_BLOCKED;
+      if (wake_deadline(guest)) {
+        guest->next = sched->sleeping;
+        sched->sleeping = guest;
+        // An idle worker may be waiting for a later deadline
+        pthread_cond_signal(&sched->cond);
+      }
+    } else {
+      guest->park_requested = false;
+      guest->wake_pending = false;
+      enqueue(sched, guest);
+    }
+  }
+  pthread_mutex_unlock(&sched->lock);
+
+  return NULL;
+}
+
+int sched_spawn(guest_context_t* guest, const guest_context_t* parent) {
+  scheduler_t* sched = active_scheduler;
+  if (!sched) {
+    return -SCHED_ERR_NOT_RUNNING;
+  }
+
+  pthread_mutex_lock(&sched->lock);
+  guest->deadline_ns = parent->deadline_ns;
+  guest->park_requested = false;
+  guest->wake_pending = false;
+  guest->park_timed_out = false;
+  guest->result = 0;
+  guest->stop_reason = GUEST_STOP_NONE;
+  sched->num_live++;
+  enqueue(sched, guest);
+  pthread_mutex_unlock(&sched->lock);
+  return 0;
+}
+
+// Called from the guest's own worker, by an emulated syscall which would block,
+// to end its slice at the next block exit and take it off the run queue until
+// sched_wake(), or until deadline_ns (if it's not 0) has passed. In that case
+// timed_out is called on the worker which next runs it, before it runs. The
+// syscall completes as though it had been woken, so the guest carries on from
+// after it either way.
+void sched_park(guest_context_t* guest, uint64_t deadline_ns, void (*timed_out)(guest_context_t* guest)) {
+  if (!active_scheduler) return;
+
+  pthread_mutex_lock(&active_scheduler->lock);
+  guest->park_requested = true;
+  guest->park_deadline_ns = deadline_ns;
+  guest->timed_out = timed_out;
+  guest->cpu.budget_end = 0;
+  guest->cpu.next_event = 0;
+  pthread_mutex_unlock(&active_scheduler->lock);
+}
+
+// Wakes a parked guest. A guest which isn't parked, or hasn't got as far as
+// parking, isn't affected.
+void sched_wake(guest_context_t* guest) {
+  if (!active_scheduler) return;
+
+  pthread_mutex_lock(&active_scheduler->lock);
+  if (guest->state == GUEST_BLOCKED) {
+    remove_sleeping(active_scheduler, guest);
+    enqueue(active_scheduler, guest);
+  } else if (guest->state == GUEST_RUNNING && guest->park_requested) {
+    // Still finishing its slice on a worker, which will requeue it
+    guest->wake_pending = true;
+  }
+  pthread_mutex_unlock(&active_scheduler->lock);
+}
+
+// Called from the guest's own worker, to end its slice at the next block exit
+// and put it at the back of the run queue
+void sched_preempt(guest_context_t* guest) {
+  if (!active_scheduler) return;
+
+  guest->cpu.budget_end = 0;
+  guest->cpu.next_event = 0;
+}
+
+// Interrupts whatever host syscall the guest is blocked in with signal, which
+// is sent again every SCHED_INTERRUPT_INTERVAL_NS until the guest stops
+void sched_interrupt(guest_context_t* guest, int signal) {
+  if (!active_scheduler) return;
+
+  pthread_mutex_lock(&active_scheduler->lock);
+  guest->interrupt_signal = signal;
+  if (guest->worker && !pthread_equal(guest->worker->thread, pthread_self())) {
+    pthread_kill(guest->worker->thread, signal);
+    // Idle workers take turns to send it again
+    pthread_cond_signal(&active_scheduler->cond);
+  }
+  pthread_mutex_unlock(&active_scheduler->lock);
+}
+
+int sched_run(guest_context_t* guests, size_t num_guests, const sched_config_t* config) {
+  scheduler_t sched = {
+    .slice = config->slice ? config->slice : SCHED_DEFAULT_SLICE,
+    .trace = config->trace,
+    .finished = config->finished,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+  };
+
+  // Deadlines are CLOCK_MONOTONIC
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&sched.cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  int num_threads = config->num_threads;
+  if (num_threads <= 0) {
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads <= 0) num_threads = 1;
+  }
+
+  sched.workers = calloc(num_threads, sizeof(sched_worker_t));
+  if (!sched.workers) {
+    pthread_cond_destroy(&sched.cond);
+    return -SCHED_ERR_THREAD;
+  }
+
+  uint64_t start = sched_now_ns();
+  for (size_t i = 0; i < num_guests; i++) {
+    guests[i].deadline_ns = guests[i].timeout_ns ? start + guests[i].timeout_ns : 0;
+    guests[i].park_requested = false;
+    guests[i].wake_pending = false;
+    guests[i].park_timed_out = false;
+    guests[i].result = 0;
+    guests[i].stop_reason = GUEST_STOP_NONE;
+    enqueue(&sched, &guests[i]);
+    sched.num_live++;
+  }
+
+  // The calling thread acts as the first worker. The rest are only counted
+  // once started, and don't start until the lock is released.
+  pthread_mutex_lock(&sched.lock);
+  sched.workers[0].thread = pthread_self();
+  sched.workers[0].sched = &sched;
+  sched.num_workers = 1;
+  for (int i = 1; i < num_threads; i++) {
+    sched.workers[i].sched = &sched;
+    if (pthread_create(&sched.workers[i].thread, NULL, sched_worker, &sched.workers[i]) != 0) break;
+    sched.num_workers++;
+  }
+  active_scheduler = &sched;
+  pthread_mutex_unlock(&sched.lock);
+
+  sched_worker(&sched.workers[0]);
+
+  for (int i = 1; i < sched.num_workers; i++) {
+    pthread_join(sched.workers[i].thread, NULL);
+  }
+
+  active_scheduler = NULL;
+  free(sched.workers);
+  pthread_cond_destroy(&sched.cond);
+  return 0;
+}
+
+static char* sched_errors[] = {
+  "Unknown",
+  "Unable to start scheduler threads",
+  "Scheduler not running",
+};
+
+char* sched_err_message(int errorIndex) {
+  if (errorIndex < 0) {
+    errorIndex *= -1;
+  }
+
+  if (errorIndex >= SCHED_ERR_NUM_ERRORS) {
+    return sched_errors[SCHED_ERR_UNKNOWN];
+  }
+  return sched_errors[errorIndex];
+}
@@ -0,0 +1,315 @@
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "ue-stats.h"
+
+#ifdef UE_STATS
+
+static const char* instr_type_names[NUM_INSTR_TYPES] = {
+  [ENDBR64]          = "endbr64",
+  [XOR_31]           = "xor r/m, r",
+  [MOV_89]           = "mov r/m, r",
+  [MOV_8B]           = "mov r, r/m",
+  [MOV_C7]           = "mov r/m, imm",
+  [LEA_8D]           = "lea",
+  [POP_58]           = "pop",
+  [PUSH_50]          = "push",
+  [ADD_83]           = "add r/m, imm8",
+  [OR_83]            = "or r/m, imm8",
+  [ADC_83]           = "adc r/m, imm8",
+  [SBB_83]           = "sbb r/m, imm8",
+  [AND_83]           = "and r/m, imm8",
+  [SUB_83]           = "sub r/m, imm8",
+  [XOR_83]           = "xor r/m, imm8",
+  [CMP_83]           = "cmp r/m, imm8",
+  [CMP_39]           = "cmp r/m, r",
+  [CMP_3B]           = "cmp r, r/m",
+  [TEST_85]          = "test r/m, r",
+  [JCC]              = "jcc",
+  [JMP]              = "jmp",
+  [CALL_E8]          = "call",
+  [RET_C3]           = "ret",
+  [CALL_FF]          = "call r/m",
+  [JMP_FF]           = "jmp r/m",
+  [SYSCALL]          = "syscall",
+  [XCHG_87]          = "xchg",
+  [CMPXCHG_B1]       = "cmpxchg",
+  [XADD_C1]          = "xadd",
+  [RDTSC]            = "rdtsc",
+  [SSE_MOV]          = "sse mov",
+  [SSE_ARITH]        = "sse arithmetic",
+  [SSE_CVT]          = "sse convert",
+  [SSE_COMI]         = "sse compare",
+  [SSE_LOGIC]        = "sse logic",
+  [SSE_MXCSR]        = "ldmxcsr/stmxcsr",
+  [X87]              = "x87",
+  [FUSED_ZERO_REG]   = "(fused) xor zeroing",
+  [FUSED_PUSH_FRAME] = "(fused) push rbp; mov rbp, rsp",
+  [FUSED_CMP_JCC]    = "(fused) cmp/test; jcc",
+  [FUSED_POP_RET]    = "(fused) pop; ret",
+};
+
+static const char* tier_names[STATS_NUM_TIERS] = {
+  "build",
+  "blocks",
+  "syscall",
+};
+
+__thread stats_counters_t stats_thread_counters;
+__thread bool stats_thread_registered = false;
+
+typedef struct stats_thread_t {
+  stats_counters_t* counters;
+  struct stats_thread_t* next;
+} stats_thread_t;
+
+// Every live thread's counters, plus the totals of threads which have exited
+static stats_thread_t* threads = NULL;
+static size_t num_threads = 0;
+static stats_counters_t exited_totals;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+static void add_counters(stats_counters_t* totals, const stats_counters_t* counters) {
+  // The struct is nothing but uint64_t counters
+  const uint64_t* src = (const uint64_t*)counters;
+  uint64_t* dst = (uint64_t*)totals;
+  for (size_t i = 0; i < sizeof(stats_counters_t) / sizeof(uint64_t); i++) {
+    dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+  }
+}
+
+// Runs as a thread exits, while its thread-local counters are still valid
+static void unregister_thread(void* arg) {
+  stats_counters_t* counters = arg;
+
+  pthread_mutex_lock(&threads_lock);
+  stats_thread_t** link = &threads;
+  while (*link) {
+    if ((*link)->counters == counters) {
+      stats_thread_t* temp = *link;
+      *link = temp->next;
+      free(temp);
+      num_threads--;
+      break;
+    }
+    link = &(*link)->next;
+  }
+  add_counters(&exited_totals, counters);
+  pthread_mutex_unlock(&threads_lock);
+}
+
+static void create_thread_key(void) {
+  pthread_key_create(&thread_key, unregister_thread);
+}
+
+void stats_register_thread(void) {
+  stats_thread_t* entry = malloc(sizeof(stats_thread_t));
+  if (!entry) return;
+  entry->counters = &stats_thread_counters;
+
+  pthread_once(&thread_key_once, create_thread_key);
+  pthread_setspecific(thread_key, entry->counters);
+
+  pthread_mutex_lock(&threads_lock);
+  entry->next = threads;
+  threads = entry;
+  num_threads++;
+  pthread_mutex_unlock(&threads_lock);
+
+  stats_thread_registered = true;
+}
+
+uint64_t stats_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_snapshot(stats_counters_t* out, uint64_t* num_threads_out) {
+  memset(out, 0, sizeof(stats_counters_t));
+
+  pthread_mutex_lock(&threads_lock);
+  add_counters(out, &exited_totals);
+  for (stats_thread_t* thread = threads; thread; thread = thread->next) {
+    add_counters(out, thread->counters);
+  }
+  if (num_threads_out) *num_threads_out = num_threads;
+  pthread_mutex_unlock(&threads_lock);
+}
+
+static stats_page_t* page = NULL;
+static char* page_path = NULL;
+static pthread_t publisher;
+static bool publisher_running = false;
+static pthread_mutex_t publisher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t publisher_cond = PTHREAD_COND_INITIALIZER;
+
+static void publish(void) {
+  stats_counters_t counters;
+  uint64_t live_threads;
+  stats_snapshot(&counters, &live_threads);
+
+  __atomic_store_n(&page->sequence, page->sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  page->timestamp_ns = stats_now_ns();
+  page->num_threads = live_threads;
+  memcpy(&page->counters, &counters, sizeof(stats_counters_t));
+  __atomic_store_n(&page->sequence, page->sequence + 1, __ATOMIC_RELEASE);
+}
+
+static void* publisher_main(void* arg) {
+  pthread_mutex_lock(&publisher_lock);
+  while (publisher_running) {
+    publish();
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += STATS_PUBLISH_INTERVAL_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&publisher_cond, &publisher_lock, &deadline);
+  }
+  pthread_mutex_unlock(&publisher_lock);
+  return NULL;
+}
+
+int stats_publish_start(const char* path) {
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return -STATS_ERR_OPEN;
+  }
+
+  if (ftruncate(fd, sizeof(stats_page_t)) != 0) {
+    close(fd);
+    return -STATS_ERR_OPEN;
+  }
+
+  page = mmap(NULL, sizeof(stats_page_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (page == MAP_FAILED) {
+    page = NULL;
+    unlink(path);
+    return -STATS_ERR_MMAP;
+  }
+
+  memcpy(page->magic, STATS_PAGE_MAGIC, sizeof(STATS_PAGE_MAGIC));
+  page->version = STATS_PAGE_VERSION;
+  page->num_instr_types = NUM_INSTR_TYPES;
+  page->pid = getpid();
+  page_path = strdup(path);
+
+  publisher_running = true;
+  if (pthread_create(&publisher, NULL, publisher_main, NULL) != 0) {
+    publisher_running = false;
+    stats_publish_stop();
+    return -STATS_ERR_THREAD;
+  }
+  return 0;
+}
+
+// The page is removed once the guest has finished; the summary at exit takes over
+void stats_publish_stop(void) {
+  if (!page) return;
+
+  pthread_mutex_lock(&publisher_lock);
+  bool was_running = publisher_running;
+  publisher_running = false;
+  pthread_cond_signal(&publisher_cond);
+  pthread_mutex_unlock(&publisher_lock);
+  if (was_running) {
+    pthread_join(publisher, NULL);
+  }
+
+  munmap(page, sizeof(stats_page_t));
+  page = NULL;
+  if (page_path) {
+    unlink(page_path);
+    free(page_path);
+    page_path = NULL;
+  }
+}
+
+static double percent(uint64_t part, uint64_t total) {
+  return total ? (100.0 * part) / total : 0.0;
+}
+
+void print_stats_summary(FILE* fp) {
+  stats_counters_t totals;
+  uint64_t live_threads;
+  stats_snapshot(&totals, &live_threads);
+
+  uint64_t lookups = totals.block_cache_hits + totals.block_cache_misses;
+  fprintf(fp, "Instructions retired: %lu\n", totals.instructions_retired);
+  fprintf(fp, "Blocks executed: %lu\n", totals.blocks_executed);
+  fprintf(fp, "Blocks interpreted: %lu\n", totals.blocks_interpreted);
+  fprintf(fp, "Block cache hits: %lu/%lu (%.1f%%)\n", totals.block_cache_hits, lookups, percent(totals.block_cache_hits, lookups));
+  fprintf(fp, "Code write faults: %lu\n", totals.code_write_faults);
+
+  uint64_t total_ns = 0;
+  for (size_t i = 0; i < STATS_NUM_TIERS; i++) {
+    total_ns += totals.tier_ns[i];
+  }
+  fprintf(fp, "Time per tier:\n");
+  for (size_t i = 0; i < STATS_NUM_TIERS; i++) {
+    fprintf(fp, "  %-24s %10.3f ms (%.1f%%)\n", tier_names[i], totals.tier_ns[i] / 1e6, percent(totals.tier_ns[i], total_ns));
+  }
+
+#ifdef UE_STATS_INSTR_TYPES
+  fprintf(fp, "Instructions executed by type:\n");
+  for (size_t i = 0; i < NUM_INSTR_TYPES; i++) {
+    if (totals.instr_types[i]) {
+      fprintf(fp, "  %-32s %lu\n", instr_type_names[i], totals.instr_types[i]);
+    }
+  }
+#endif
+
+  fprintf(fp, "Syscalls:\n");
+  for (size_t i = 0; i < STATS_NUM_SYSCALLS; i++) {
+    if (totals.syscalls[i]) {
+      fprintf(fp, "  %-32zu %lu\n", i, totals.syscalls[i]);
+    }
+  }
+}
+
+#else
+
+void stats_snapshot(stats_counters_t* out, uint64_t* num_threads_out) {
+  memset(out, 0, sizeof(stats_counters_t));
+  if (num_threads_out) *num_threads_out = 0;
+}
+
+int stats_publish_start(const char* path) {
+  return -STATS_ERR_DISABLED;
+}
+
+void stats_publish_stop(void) {
+}
+
+void print_stats_summary(FILE* fp) {
+  fprintf(fp, "Execution statistics not compiled in (build with STATS=1)\n");
+}
+
+#endif // UE_STATS
+
+static char* stats_errors[] = {
+  "Unknown",
+  "Statistics not compiled in (build with STATS=1)",
+  "Unable to create the stats page",
+  "Unable to map the stats page",
+  "Unable to start the stats publishing thread",
+};
+
+char* stats_err_message(int errorIndex) {
+  if (errorIndex < 0) {
+    errorIndex *= -1;
+  }
+
+  if (errorIndex >= STATS_ERR_NUM_ERRORS) {
+    return stats_errors[STATS_ERR_UNKNOWN];
+  }
+  return stats_errors[errorIndex];
+}
@@ -0,0 +1,1180 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <linux/futex.h>
+#include <linux/sched.h>
+#include <asm/prctl.h>
+#include "ue-syscall.h"
+#include "ue-sched.h"
+#include "ue-block.h"
+#include "ue-memory.h"
+#include "ue-stats.h"
+#include "ue-replay.h"
+#include "ue-plugin.h"
+#include "ue-watch.h"
+#include "ue-fpu.h"
+
+// Guest threads are guest contexts run by the M:N scheduler (see ue-sched.h),
+// over the shared guest address space, so the guest's atomics (see cpu.c)
+// operate on the same memory from whichever host threads run them. Futexes are
+// emulated here: a waiting thread is parked by the scheduler, not blocked in
+// the host kernel, and is woken by the thread which wakes its futex.
+//
+// The process ends the way a Linux one does. exit() ends just the calling
+// thread, even the main one, and the process ends with the last of them.
+// exit_group(), or a fatal error or stop in any thread, ends every thread: each
+// is stopped at its next block exit, woken from its futex wait, or interrupted
+// in the host syscall it's blocked in, and the scheduler returns once they're
+// all gone (see syscall_thread_finished()).
+
+// clone() is only supported for creating threads, not processes
+#define CLONE_REQUIRED_FLAGS  (CLONE_VM | CLONE_SIGHAND | CLONE_THREAD)
+
+// The kernel rejects any other size of struct robust_list_head
+#define ROBUST_LIST_HEAD_SIZE (24)
+
+// Sent to a guest thread's host thread to interrupt whatever host syscall it's
+// blocked in when the thread group exits. Its handler does nothing, and isn't
+// SA_RESTART, so the syscall fails with EINTR.
+#define SYSCALL_KICK_SIGNAL   (SIGUSR2)
+
+static uint64_t tgid = 0;
+static uint64_t next_tid = 0;
+static int exit_status = 0;
+static int fatal_signal = 0;
+
+// Every guest thread still running, main thread included, and whether the
+// thread group as a whole is exiting
+static guest_context_t* thread_list = NULL;
+static guest_context_t* main_guest = NULL;
+static bool group_exiting = false;
+static bool main_exited = false;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Guest threads waiting on futexes, oldest first. Waiters are added, and
+// removed to be woken, under the lock, which is what makes checking the futex
+// word and waiting atomic with respect to waking.
+static guest_context_t* futex_waiters = NULL;
+static pthread_mutex_t futex_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline guest_context_t* guest_of(cpu_x86_64_t* cpu) {
+  return (guest_context_t*)((uint8_t*)cpu - offsetof(guest_context_t, cpu));
+}
+
+// The initial guest thread takes the host process id (or the recorded one, when
+// replaying), like the real thread group leader, and threads created later
+// count up from there
+static void kick_handler(int sig) {
+  (void)sig;
+}
+
+// Must be called with the threads lock held
+static void add_thread(guest_context_t* guest) {
+  guest->next_thread = thread_list;
+  thread_list = guest;
+  if (group_exiting) {
+    __atomic_store_n(&guest->cpu.exit_requested, true, __ATOMIC_SEQ_CST);
+  }
+}
+
+// Must be called with the threads lock held
+static void remove_thread(guest_context_t* guest) {
+  for (guest_context_t** link = &thread_list; *link; link = &(*link)->next_thread) {
+    if (*link == guest) {
+      *link = guest->next_thread;
+      break;
+    }
+  }
+}
+
+// Must be called with the futex lock held
+static void remove_waiter(guest_context_t* guest) {
+  for (guest_context_t** link = &futex_waiters; *link; link = &(*link)->next_waiter) {
+    if (*link == guest) {
+      *link = guest->next_waiter;
+      break;
+    }
+  }
+  guest->futex_word = NULL;
+}
+
+// Takes the thread off its futex's wait list, if it's on one, and wakes it
+static void cancel_futex_wait(guest_context_t* guest) {
+  pthread_mutex_lock(&futex_lock);
+  if (guest->futex_word) {
+    remove_waiter(guest);
+    sched_wake(guest);
+  }
+  pthread_mutex_unlock(&futex_lock);
+}
+
+// Stops every guest thread at its next block exit, and wakes or interrupts any
+// which are blocked. Must be called with the threads lock held.
+static void kick_threads(void) {
+  for (guest_context_t* guest = thread_list; guest; guest = guest->next_thread) {
+    __atomic_store_n(&guest->cpu.exit_requested, true, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&guest->cpu.budget_end, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&guest->cpu.next_event, 0, __ATOMIC_SEQ_CST);
+    cancel_futex_wait(guest);
+    sched_interrupt(guest, SYSCALL_KICK_SIGNAL);
+  }
+}
+
+// The first exit_group() (or fatal error) sets the process's exit status
+static void start_group_exit(int status) {
+  pthread_mutex_lock(&threads_lock);
+  if (!group_exiting) {
+    group_exiting = true;
+    exit_status = status;
+  }
+  kick_threads();
+  pthread_mutex_unlock(&threads_lock);
+}
+
+// As start_group_exit(), for a thread killed by a signal, which takes the whole
+// group with it
+static void start_group_kill(int signal) {
+  pthread_mutex_lock(&threads_lock);
+  if (!group_exiting) {
+    fatal_signal = signal;
+  }
+  pthread_mutex_unlock(&threads_lock);
+  start_group_exit(128 + signal);
+}
+
+// The initial guest thread takes the host process id (or the recorded one, when
+// replaying), like the real thread group leader, and threads created later
+// count up from there
+void syscall_init_process(guest_context_t* main_thread) {
+  tgid = replay_process_id();
+  next_tid = tgid + 1;
+  main_thread->tid = tgid;
+
+  struct sigaction action = {0};
+  action.sa_handler = kick_handler;
+  sigemptyset(&action.sa_mask);
+  sigaction(SYSCALL_KICK_SIGNAL, &action, NULL);
+
+  pthread_mutex_lock(&threads_lock);
+  main_guest = main_thread;
+  add_thread(main_thread);
+  pthread_mutex_unlock(&threads_lock);
+}
+
+// Once every guest thread has stopped, whether they were run by the scheduler
+// or not
+void syscall_end_process(void) {
+  pthread_mutex_lock(&threads_lock);
+  if (main_guest) {
+    remove_thread(main_guest);
+    main_guest = NULL;
+  }
+  pthread_mutex_unlock(&threads_lock);
+}
+
+int get_guest_exit_status(void) {
+  return exit_status;
+}
+
+int get_guest_fatal_signal(void) {
+  return fatal_signal;
+}
+
+static bool store_u32(uint64_t address, uint32_t value) {
+  uint32_t* host = guest_range_to_host(address, sizeof(uint32_t), true);
+  if (!host) return false;
+  *host = value;
+  return true;
+}
+
+static bool store_u64(uint64_t address, uint64_t value) {
+  uint64_t* host = guest_range_to_host(address, sizeof(uint64_t), true);
+  if (!host) return false;
+  *host = value;
+  return true;
+}
+
+static bool load_u64(uint64_t address, uint64_t* value_out) {
+  const uint64_t* host = guest_range_to_host(address, sizeof(uint64_t), false);
+  if (!host) return false;
+  *value_out = *host;
+  return true;
+}
+
+// Wakes up to max threads waiting on the futex at host whose bitsets
+// intersect bitset, oldest first, returning how many were woken
+static int64_t wake_futex(const uint32_t* host, int64_t max, uint32_t bitset) {
+  int64_t woken = 0;
+  pthread_mutex_lock(&futex_lock);
+  guest_context_t** link = &futex_waiters;
+  while (*link && woken < max) {
+    guest_context_t* waiter = *link;
+    if (waiter->futex_word == host && (waiter->futex_bitset & bitset)) {
+      *link = waiter->next_waiter;
+      waiter->futex_word = NULL;
+      sched_wake(waiter);
+      woken++;
+    } else {
+      link = &waiter->next_waiter;
+    }
+  }
+  pthread_mutex_unlock(&futex_lock);
+  return woken;
+}
+
+// A robust futex the exiting thread still holds is marked as abandoned, and
+// one of its waiters woken to find that out, as the kernel does
+static void release_robust_futex(uint64_t address, uint64_t tid) {
+  uint32_t* host = guest_range_to_host(address, sizeof(uint32_t), true);
+  if (!host) return;
+
+  uint32_t value = __atomic_load_n(host, __ATOMIC_SEQ_CST);
+  while ((value & FUTEX_TID_MASK) == tid) {
+    uint32_t released = (value & FUTEX_WAITERS) | FUTEX_OWNER_DIED;
+    if (__atomic_compare_exchange_n(host, &value, released, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      if (value & FUTEX_WAITERS) {
+        wake_futex(host, 1, FUTEX_BITSET_MATCH_ANY);
+      }
+      break;
+    }
+  }
+}
+
+// struct robust_list_head is the list's head entry, then the offset from each
+// entry to its futex word, then an entry which may be part way through being
+// added or removed. The low bit of each entry pointer marks a PI futex.
+static void release_robust_list(guest_context_t* guest) {
+  uint64_t head = guest->robust_list;
+  uint64_t entry;
+  uint64_t futex_offset;
+  uint64_t pending;
+  if (!head || !load_u64(head, &entry) || !load_u64(head + 8, &futex_offset) || !load_u64(head + 16, &pending)) {
+    return;
+  }
+  pending &= ~1ULL;
+
+  // ROBUST_LIST_LIMIT is the kernel's, so a circular list can't hang the exit
+  for (size_t i = 0; i < ROBUST_LIST_LIMIT && (entry & ~1ULL) != head; i++) {
+    entry &= ~1ULL;
+    uint64_t next;
+    if (!load_u64(entry, &next)) {
+      return;
+    }
+    if (entry != pending) {
+      release_robust_futex(entry + futex_offset, guest->tid);
+    }
+    entry = next;
+  }
+
+  if (pending) {
+    release_robust_futex(pending + futex_offset, guest->tid);
+  }
+}
+
+// What the kernel does for a thread which exits by itself
+static void release_thread(guest_context_t* guest) {
+  release_robust_list(guest);
+
+  // CLONE_CHILD_CLEARTID, which is how pthread_join() finds out the thread has gone
+  if (guest->clear_child_tid) {
+    uint32_t* host = guest_range_to_host(guest->clear_child_tid, sizeof(uint32_t), true);
+    if (host) {
+      __atomic_store_n(host, 0, __ATOMIC_SEQ_CST);
+      wake_futex(host, 1, FUTEX_BITSET_MATCH_ANY);
+    }
+  }
+}
+
+// Called by the scheduler once a guest thread has stopped (see sched_config_t).
+// A thread which didn't exit by itself takes the whole thread group with it,
+// as a fault does on real hardware, unless it's the main thread, which the
+// emulator reports on itself.
+void syscall_thread_finished(guest_context_t* guest) {
+  cpu_x86_64_t* cpu = &guest->cpu;
+
+  // It may have been stopped while it was waiting
+  cancel_futex_wait(guest);
+
+  pthread_mutex_lock(&threads_lock);
+  remove_thread(guest);
+  bool is_main = (guest == main_guest);
+  bool main_stopped = is_main && (guest->result != RUN_GUEST_EXITED || !main_exited);
+  if (is_main) {
+    main_guest = NULL;
+  }
+  pthread_mutex_unlock(&threads_lock);
+
+  if (is_main) {
+    if (main_stopped) {
+      start_group_exit(1);
+    }
+    return;
+  }
+
+  if (guest->stop_reason != GUEST_STOP_NONE) {
+    printf("Stopped in thread %lu at 0x%016lx after %lu instructions: %s\n", guest->tid, cpu->rip,
+           cpu->instructions_retired, sched_stop_message(guest->stop_reason));
+    start_group_exit(sched_stop_status(guest->stop_reason));
+  } else if (guest->result == -CPU_ERR_SEGMENTATION_FAULT) {
+    printf("Segmentation fault in thread %lu at 0x%016lx, accessing 0x%016lx\n", guest->tid, cpu->rip, get_last_fault_address());
+    start_group_kill(SIGSEGV);
+  } else if (guest->result != RUN_GUEST_EXITED) {
+    printf("Execution error in thread %lu at 0x%016lx: %s\n", guest->tid, cpu->rip, cpu_err_message(guest->result));
+    start_group_exit(1);
+  }
+  free(guest);
+}
+
+// clone(flags, stack, parent_tid, child_tid, tls)
+static int64_t emulate_clone(guest_context_t* parent, uint64_t flags, uint64_t stack, uint64_t parent_tid, uint64_t child_tid, uint64_t tls) {
+  if ((flags & CLONE_REQUIRED_FLAGS) != CLONE_REQUIRED_FLAGS) {
+    return -ENOSYS;
+  }
+
+  guest_context_t* child = calloc(1, sizeof(guest_context_t));
+  if (!child) {
+    return -ENOMEM;
+  }
+
+  // The child resumes from the same syscall, seeing 0 as its result
+  child->cpu = parent->cpu;
+  child->cpu.regs[modrm_rax] = 0;
+  child->cpu.instructions_retired = 0;
+  if (stack) {
+    child->cpu.regs[modrm_rsp] = stack;
+  }
+  if (flags & CLONE_SETTLS) {
+    child->cpu.seg_base[SEG_FS] = tls;
+  }
+
+  child->tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+  if (flags & CLONE_CHILD_CLEARTID) {
+    child->clear_child_tid = child_tid;
+  }
+
+  if (((flags & CLONE_PARENT_SETTID) && !store_u32(parent_tid, child->tid))
+      || ((flags & CLONE_CHILD_SETTID) && !store_u32(child_tid, child->tid))) {
+    free(child);
+    return -EFAULT;
+  }
+
+  // Read the tid now, since the child may already have exited and been freed
+  // by the time sched_spawn() returns
+  int64_t tid = child->tid;
+  pthread_mutex_lock(&threads_lock);
+  add_thread(child);
+  pthread_mutex_unlock(&threads_lock);
+
+  if (sched_spawn(child, parent) != 0) {
+    pthread_mutex_lock(&threads_lock);
+    remove_thread(child);
+    pthread_mutex_unlock(&threads_lock);
+    free(child);
+    return -EAGAIN;
+  }
+
+  return tid;
+}
+
+// futex(uaddr, op, val, timeout/val2, uaddr2, val3), for a guest which can
+// only be the one thread. Every guest pointer is translated to its host address
+// and the rest is left to the host kernel.
+static int64_t host_futex(uint64_t uaddr, int op, uint32_t val, uint64_t timeout_or_val2, uint64_t uaddr2, uint32_t val3) {
+  void* host = guest_range_to_host(uaddr, sizeof(uint32_t), false);
+  if (!host) {
+    return -EFAULT;
+  }
+
+  void* host2 = NULL;
+  const void* timeout = NULL;
+  switch (op & FUTEX_CMD_MASK) {
+    case FUTEX_WAIT:
+    case FUTEX_WAIT_BITSET: {
+      if (timeout_or_val2) {
+        timeout = guest_range_to_host(timeout_or_val2, sizeof(struct timespec), false);
+        if (!timeout) return -EFAULT;
+      }
+      break;
+    }
+    case FUTEX_WAKE:
+    case FUTEX_WAKE_BITSET: {
+      break;
+    }
+    case FUTEX_REQUEUE:
+    case FUTEX_CMP_REQUEUE:
+    case FUTEX_WAKE_OP: {
+      host2 = guest_range_to_host(uaddr2, sizeof(uint32_t), (op & FUTEX_CMD_MASK) == FUTEX_WAKE_OP);
+      if (!host2) return -EFAULT;
+      // Not a pointer for these operations, but val2
+      timeout = (const void*)timeout_or_val2;
+      break;
+    }
+    default: {
+      return -ENOSYS;
+    }
+  }
+
+  long ret = syscall(SYS_futex, host, op, val, timeout, host2, val3);
+  return (ret < 0) ? -errno : ret;
+}
+
+// When a thread parked in a futex wait reaches its deadline before it's woken
+static void futex_timed_out(guest_context_t* guest) {
+  pthread_mutex_lock(&futex_lock);
+  if (guest->futex_word) {
+    remove_waiter(guest);
+    guest->cpu.regs[modrm_rax] = -ETIMEDOUT;
+  }
+  pthread_mutex_unlock(&futex_lock);
+}
+
+// The CLOCK_MONOTONIC deadline of a wait, from FUTEX_WAIT's relative timeout or
+// FUTEX_WAIT_BITSET's absolute one. One too far off to matter is left at 0.
+static int64_t futex_deadline(uint64_t address, int op, uint64_t* deadline_out) {
+  const struct timespec* timeout = guest_range_to_host(address, sizeof(struct timespec), false);
+  if (!timeout) {
+    return -EFAULT;
+  }
+  if (timeout->tv_sec < 0 || timeout->tv_nsec < 0 || timeout->tv_nsec >= 1000000000) {
+    return -EINVAL;
+  }
+  if (timeout->tv_sec > INT32_MAX) {
+    *deadline_out = 0;
+    return 0;
+  }
+
+  uint64_t ns = (uint64_t)timeout->tv_sec * 1000000000ULL + timeout->tv_nsec;
+  uint64_t now = sched_now_ns();
+  if ((op & FUTEX_CMD_MASK) == FUTEX_WAIT) {
+    *deadline_out = now + ns;
+  } else if (op & FUTEX_CLOCK_REALTIME) {
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    uint64_t real_ns = (uint64_t)real.tv_sec * 1000000000ULL + real.tv_nsec;
+    *deadline_out = (ns > real_ns) ? now + (ns - real_ns) : now;
+  } else {
+    *deadline_out = ns ? ns : 1;
+  }
+  return 0;
+}
+
+// The value is checked, and the thread added to the wait list, under the futex
+// lock, so a wake can't come between them. The thread is parked once it leaves
+// the syscall, which ends its block, and carries on with 0 as the result when
+// it's woken (or -ETIMEDOUT, see futex_timed_out()).
+static int64_t wait_futex(guest_context_t* guest, uint32_t* host, int op, uint32_t val, uint64_t timeout, uint32_t bitset) {
+  if (bitset == 0) {
+    return -EINVAL;
+  }
+  uint64_t deadline = 0;
+  if (timeout) {
+    int64_t ret = futex_deadline(timeout, op, &deadline);
+    if (ret != 0) return ret;
+  }
+
+  pthread_mutex_lock(&futex_lock);
+  if (__atomic_load_n(host, __ATOMIC_SEQ_CST) != val) {
+    pthread_mutex_unlock(&futex_lock);
+    return -EAGAIN;
+  }
+  if (deadline && deadline <= sched_now_ns()) {
+    pthread_mutex_unlock(&futex_lock);
+    return -ETIMEDOUT;
+  }
+
+  guest->futex_word = host;
+  guest->futex_bitset = bitset;
+  guest->next_waiter = NULL;
+  guest_context_t** link = &futex_waiters;
+  while (*link) {
+    link = &(*link)->next_waiter;
+  }
+  *link = guest;
+  sched_park(guest, deadline, futex_timed_out);
+  pthread_mutex_unlock(&futex_lock);
+  return 0;
+}
+
+// Wakes up to max_wake threads waiting on host and moves up to max_requeue of
+// the rest to wait on host2 instead, returning how many were woken and moved
+// together (as Linux does for both FUTEX_REQUEUE and FUTEX_CMP_REQUEUE). For
+// FUTEX_CMP_REQUEUE, expected is what the word at host has to hold.
+static int64_t requeue_futex(uint32_t* host, uint32_t* host2, int64_t max_wake, int64_t max_requeue, const uint32_t* expected) {
+  int64_t woken = 0;
+  int64_t requeued = 0;
+  pthread_mutex_lock(&futex_lock);
+  if (expected && __atomic_load_n(host, __ATOMIC_SEQ_CST) != *expected) {
+    pthread_mutex_unlock(&futex_lock);
+    return -EAGAIN;
+  }
+  guest_context_t** link = &futex_waiters;
+  while (*link && (woken < max_wake || requeued < max_requeue)) {
+    guest_context_t* waiter = *link;
+    if (waiter->futex_word != host) {
+      link = &waiter->next_waiter;
+    } else if (woken < max_wake) {
+      *link = waiter->next_waiter;
+      waiter->futex_word = NULL;
+      sched_wake(waiter);
+      woken++;
+    } else {
+      waiter->futex_word = host2;
+      requeued++;
+      link = &waiter->next_waiter;
+    }
+  }
+  pthread_mutex_unlock(&futex_lock);
+  return woken + requeued;
+}
+
+// FUTEX_WAKE_OP: applies the operation encoded in val3 to the word at host2,
+// wakes up to max_wake threads waiting on host, and, if the word's old value
+// passes the comparison encoded in val3, up to max_wake2 waiting on host2
+static int64_t wake_op_futex(uint32_t* host, uint32_t* host2, int64_t max_wake, int64_t max_wake2, uint32_t val3) {
+  int op = (val3 >> 28) & 0x7;
+  int cmp = (val3 >> 24) & 0xf;
+  // Both arguments are sign extended from 12 bits
+  int32_t oparg = (int32_t)(val3 << 8) >> 20;
+  int32_t cmparg = (int32_t)(val3 << 20) >> 20;
+  if ((val3 >> 28) & FUTEX_OP_OPARG_SHIFT) {
+    if (oparg < 0 || oparg > 31) return -EINVAL;
+    oparg = 1 << oparg;
+  }
+
+  uint32_t old = __atomic_load_n(host2, __ATOMIC_SEQ_CST);
+  uint32_t new;
+  do {
+    switch (op) {
+      case FUTEX_OP_SET: new = oparg; break;
+      case FUTEX_OP_ADD: new = old + oparg; break;
+      case FUTEX_OP_OR: new = old | oparg; break;
+      case FUTEX_OP_ANDN: new = old & ~oparg; break;
+      case FUTEX_OP_XOR: new = old ^ oparg; break;
+      default: return -ENOSYS;
+    }
+  } while (!__atomic_compare_exchange_n(host2, &old, new, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+  bool passed;
+  switch (cmp) {
+    case FUTEX_OP_CMP_EQ: passed = ((int32_t)old == cmparg); break;
+    case FUTEX_OP_CMP_NE: passed = ((int32_t)old != cmparg); break;
+    case FUTEX_OP_CMP_LT: passed = ((int32_t)old < cmparg); break;
+    case FUTEX_OP_CMP_LE: passed = ((int32_t)old <= cmparg); break;
+    case FUTEX_OP_CMP_GT: passed = ((int32_t)old > cmparg); break;
+    case FUTEX_OP_CMP_GE: passed = ((int32_t)old >= cmparg); break;
+    default: return -ENOSYS;
+  }
+
+  int64_t woken = wake_futex(host, max_wake, FUTEX_BITSET_MATCH_ANY);
+  if (passed) {
+    woken += wake_futex(host2, max_wake2, FUTEX_BITSET_MATCH_ANY);
+  }
+  return woken;
+}
+
+// futex(uaddr, op, val, timeout/val2, uaddr2, val3). Guest threads are all in
+// this process, so private and shared futexes are the same thing: a guest
+// word, known by the host address backing it.
+static int64_t emulate_futex(guest_context_t* guest, uint64_t uaddr, int op, uint32_t val, uint64_t timeout_or_val2, uint64_t uaddr2, uint32_t val3) {
+  // Replay runs one thread, outside the scheduler (clone() isn't allowed), and
+  // needs each wait's result by the time it's logged
+  if (!sched_running() || replay_mode != REPLAY_OFF) {
+    return host_futex(uaddr, op, val, timeout_or_val2, uaddr2, val3);
+  }
+
+  uint32_t* host = guest_range_to_host(uaddr, sizeof(uint32_t), false);
+  if (!host) {
+    return -EFAULT;
+  }
+
+  int cmd = op & FUTEX_CMD_MASK;
+  switch (cmd) {
+    case FUTEX_WAIT: {
+      return wait_futex(guest, host, op, val, timeout_or_val2, FUTEX_BITSET_MATCH_ANY);
+    }
+    case FUTEX_WAIT_BITSET: {
+      return wait_futex(guest, host, op, val, timeout_or_val2, val3);
+    }
+    case FUTEX_WAKE: {
+      return wake_futex(host, val, FUTEX_BITSET_MATCH_ANY);
+    }
+    case FUTEX_WAKE_BITSET: {
+      return (val3 == 0) ? -EINVAL : wake_futex(host, val, val3);
+    }
+    case FUTEX_REQUEUE:
+    case FUTEX_CMP_REQUEUE:
+    case FUTEX_WAKE_OP: {
+      uint32_t* host2 = guest_range_to_host(uaddr2, sizeof(uint32_t), cmd == FUTEX_WAKE_OP);
+      if (!host2) return -EFAULT;
+      // val2 is passed in place of the timeout
+      int64_t val2 = (uint32_t)timeout_or_val2;
+      if (cmd == FUTEX_WAKE_OP) {
+        return wake_op_futex(host, host2, val, val2, val3);
+      }
+
+      return requeue_futex(host, host2, val, val2, (cmd == FUTEX_CMP_REQUEUE) ? &val3 : NULL);
+    }
+    default: {
+      return -ENOSYS;
+    }
+  }
+}
+
+// read() and write() go straight to the host file descriptor, once the whole
+// buffer has been checked against the guest's mappings
+static int64_t emulate_read(int fd, uint64_t buf, uint64_t count) {
+  void* host = guest_range_to_host(buf, count, true);
+  if (!host) {
+    return -EFAULT;
+  }
+  ssize_t ret = read(fd, host, count);
+  return (ret < 0) ? -errno : ret;
+}
+
+static int64_t emulate_write(int fd, uint64_t buf, uint64_t count) {
+  const void* host = guest_range_to_host(buf, count, false);
+  if (!host) {
+    return -EFAULT;
+  }
+  ssize_t ret = write(fd, host, count);
+  return (ret < 0) ? -errno : ret;
+}
+
+static int64_t emulate_pread64(int fd, uint64_t buf, uint64_t count, int64_t offset) {
+  void* host = guest_range_to_host(buf, count, true);
+  if (!host) {
+    return -EFAULT;
+  }
+  ssize_t ret = pread(fd, host, count, offset);
+  return (ret < 0) ? -errno : ret;
+}
+
+// Copies a path out of guest memory, a page at a time since it may end
+// anywhere
+static int64_t load_path(uint64_t address, char* path_out) {
+  size_t length = 0;
+  while (length < PATH_MAX) {
+    uint64_t chunk = GUEST_PAGE_SIZE - ((address + length) & (GUEST_PAGE_SIZE - 1));
+    if (chunk > PATH_MAX - length) {
+      chunk = PATH_MAX - length;
+    }
+    const char* host = guest_range_to_host(address + length, chunk, false);
+    if (!host) {
+      return -EFAULT;
+    }
+
+    const char* end = memchr(host, '\0', chunk);
+    memcpy(path_out + length, host, end ? (size_t)(end - host) + 1 : chunk);
+    if (end) {
+      return 0;
+    }
+    length += chunk;
+  }
+  return -ENAMETOOLONG;
+}
+
+// Files are opened on the host, and the guest gets the host file descriptor,
+// as it does for stdin/stdout/stderr. open() is openat() from the current
+// directory.
+static int64_t emulate_openat(int dirfd, uint64_t pathname, int flags, mode_t mode) {
+  char path[PATH_MAX];
+  int64_t ret = load_path(pathname, path);
+  if (ret != 0) {
+    return ret;
+  }
+  int fd = openat(dirfd, path, flags, mode);
+  return (fd < 0) ? -errno : fd;
+}
+
+static int64_t emulate_newfstatat(int dirfd, uint64_t pathname, uint64_t statbuf, int flags) {
+  char path[PATH_MAX];
+  int64_t ret = load_path(pathname, path);
+  if (ret != 0) {
+    return ret;
+  }
+  struct stat* host = guest_range_to_host(statbuf, sizeof(struct stat), true);
+  if (!host) {
+    return -EFAULT;
+  }
+  return (fstatat(dirfd, path, host, flags) != 0) ? -errno : 0;
+}
+
+static int64_t emulate_fstat(int fd, uint64_t statbuf) {
+  struct stat* host = guest_range_to_host(statbuf, sizeof(struct stat), true);
+  if (!host) {
+    return -EFAULT;
+  }
+  return (fstat(fd, host) != 0) ? -errno : 0;
+}
+
+static int64_t emulate_access(uint64_t pathname, int mode) {
+  char path[PATH_MAX];
+  int64_t ret = load_path(pathname, path);
+  if (ret != 0) {
+    return ret;
+  }
+  return (access(path, mode) != 0) ? -errno : 0;
+}
+
+static int64_t emulate_getrandom(uint64_t buf, uint64_t count, unsigned int flags) {
+  void* host = guest_range_to_host(buf, count, true);
+  if (!host) {
+    return -EFAULT;
+  }
+  ssize_t ret = getrandom(host, count, flags);
+  return (ret < 0) ? -errno : ret;
+}
+
+// The timezone argument is obsolete, and is left alone
+static int64_t emulate_gettimeofday(uint64_t tv) {
+  if (tv) {
+    struct timeval* host = guest_range_to_host(tv, sizeof(struct timeval), true);
+    if (!host) return -EFAULT;
+    gettimeofday(host, NULL);
+  }
+  return 0;
+}
+
+static int64_t emulate_clock_gettime(clockid_t clock, uint64_t tp) {
+  struct timespec* host = guest_range_to_host(tp, sizeof(struct timespec), true);
+  if (!host) {
+    return -EFAULT;
+  }
+  return (clock_gettime(clock, host) != 0) ? -errno : 0;
+}
+
+static int64_t emulate_arch_prctl(cpu_x86_64_t* cpu, int code, uint64_t address) {
+  switch (code) {
+    case ARCH_SET_FS: cpu->seg_base[SEG_FS] = address; return 0;
+    case ARCH_SET_GS: cpu->seg_base[SEG_GS] = address; return 0;
+    case ARCH_GET_FS: return store_u64(address, cpu->seg_base[SEG_FS]) ? 0 : -EFAULT;
+    case ARCH_GET_GS: return store_u64(address, cpu->seg_base[SEG_GS]) ? 0 : -EFAULT;
+  }
+  return -EINVAL;
+}
+
+static uint32_t prot_to_flags(int prot) {
+  uint32_t p_flags = 0;
+  if (prot & PROT_READ) p_flags |= PF_R;
+  if (prot & PROT_WRITE) p_flags |= PF_W;
+  if (prot & PROT_EXEC) p_flags |= PF_X;
+  return p_flags;
+}
+
+// mmap(addr, length, prot, flags, fd, offset). File mappings are of the host
+// file descriptor, which is the guest's too. Flags which only affect how the
+// kernel backs the memory (MAP_NORESERVE, MAP_POPULATE, MAP_STACK and so on)
+// are ignored.
+static int64_t emulate_mmap(uint64_t address, uint64_t length, int prot, int flags, int fd, uint64_t offset) {
+  int type = flags & MAP_TYPE;
+  if (length == 0 || (offset & (GUEST_PAGE_SIZE - 1)) != 0 || (type != MAP_PRIVATE && type != MAP_SHARED && type != MAP_SHARED_VALIDATE)) {
+    return -EINVAL;
+  }
+  if (length > GUEST_SPACE_SIZE) {
+    return -ENOMEM;
+  }
+  length = (length + GUEST_PAGE_SIZE - 1) & ~(GUEST_PAGE_SIZE - 1);
+  if (flags & MAP_ANONYMOUS) {
+    fd = -1;
+    offset = 0;
+  } else if (fd < 0) {
+    return -EBADF;
+  }
+
+  int placement = MAP_PLACE_ANYWHERE;
+  if (flags & (MAP_FIXED | MAP_FIXED_NOREPLACE)) {
+    if ((address & (GUEST_PAGE_SIZE - 1)) != 0) {
+      return -EINVAL;
+    }
+    placement = (flags & MAP_FIXED) ? MAP_PLACE_REPLACE : MAP_PLACE_EXACT;
+  } else {
+    address &= ~(GUEST_PAGE_SIZE - 1);
+  }
+
+  int ret = map_guest_memory(&address, length, placement, prot_to_flags(prot), type != MAP_PRIVATE, fd, offset);
+  if (ret == -MEM_ERR_MMAP) {
+    return -errno;
+  } else if (ret == -MEM_ERR_RANGE && placement == MAP_PLACE_EXACT) {
+    return -EEXIST;
+  } else if (ret != 0) {
+    return -ENOMEM;
+  }
+  return address;
+}
+
+static int64_t emulate_mprotect(uint64_t address, uint64_t length, int prot) {
+  if ((address & (GUEST_PAGE_SIZE - 1)) != 0 || (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0) {
+    return -EINVAL;
+  }
+  int ret = protect_guest_memory(address, length, prot_to_flags(prot));
+  if (ret == -MEM_ERR_RANGE) {
+    return -ENOMEM;
+  }
+  return (ret != 0) ? -EACCES : 0;
+}
+
+static int64_t emulate_munmap(uint64_t address, uint64_t length) {
+  if (length == 0 || (address & (GUEST_PAGE_SIZE - 1)) != 0) {
+    return -EINVAL;
+  }
+  int ret = unmap_guest_memory(address, length);
+  if (ret == -MEM_ERR_RANGE) {
+    return -EINVAL;
+  }
+  return (ret != 0) ? -ENOMEM : 0;
+}
+
+// Syscalls whose results depend on the world outside the guest. These are
+// logged when recording and answered from the log when replaying (see
+// ue-replay.h); the rest only depend on guest state, so they simply run again.
+// close() and file mappings only depend on which descriptors are open, which
+// replaying keeps the same (see reopen_for_replay()).
+static bool is_logged_syscall(uint64_t nr) {
+  switch (nr) {
+    case SYSCALL_NR_READ:
+    case SYSCALL_NR_WRITE:
+    case SYSCALL_NR_OPEN:
+    case SYSCALL_NR_FSTAT:
+    case SYSCALL_NR_LSEEK:
+    case SYSCALL_NR_PREAD64:
+    case SYSCALL_NR_ACCESS:
+    case SYSCALL_NR_FUTEX:
+    case SYSCALL_NR_GETTIMEOFDAY:
+    case SYSCALL_NR_CLOCK_GETTIME:
+    case SYSCALL_NR_OPENAT:
+    case SYSCALL_NR_NEWFSTATAT:
+    case SYSCALL_NR_GETRANDOM:
+      return true;
+  }
+  return false;
+}
+
+// The guest memory a logged syscall filled in, given its result
+static uint64_t syscall_output(const cpu_x86_64_t* cpu, uint64_t nr, int64_t result, uint32_t* size_out) {
+  const uint64_t* args = cpu->regs;
+  *size_out = 0;
+  switch (nr) {
+    case SYSCALL_NR_READ:
+    case SYSCALL_NR_PREAD64: {
+      if (result > 0) *size_out = result;
+      return args[modrm_rsi];
+    }
+    case SYSCALL_NR_GETRANDOM: {
+      if (result > 0) *size_out = result;
+      return args[modrm_rdi];
+    }
+    case SYSCALL_NR_FSTAT: {
+      if (result == 0) *size_out = sizeof(struct stat);
+      return args[modrm_rsi];
+    }
+    case SYSCALL_NR_NEWFSTATAT: {
+      if (result == 0) *size_out = sizeof(struct stat);
+      return args[modrm_rdx];
+    }
+    case SYSCALL_NR_GETTIMEOFDAY: {
+      if (result == 0 && args[modrm_rdi]) *size_out = sizeof(struct timeval);
+      return args[modrm_rdi];
+    }
+    case SYSCALL_NR_CLOCK_GETTIME: {
+      if (result == 0) *size_out = sizeof(struct timespec);
+      return args[modrm_rsi];
+    }
+  }
+  return 0;
+}
+
+static void record_syscall(const cpu_x86_64_t* cpu, uint64_t nr, int64_t result) {
+  uint32_t size;
+  uint64_t address = syscall_output(cpu, nr, result, &size);
+  replay_write_event(REPLAY_EVENT_SYSCALL, nr, result, size ? guest_range_to_host(address, size, false) : NULL, size);
+}
+
+// A replay reads nothing from the files the guest opened, but may still map
+// them, so each is opened again under the descriptor the recording got. Files
+// opened for writing aren't touched, and /dev/null stands in for them.
+static void reopen_for_replay(const cpu_x86_64_t* cpu, uint64_t nr, int fd) {
+  const uint64_t* args = cpu->regs;
+  bool at = (nr == SYSCALL_NR_OPENAT);
+  int dirfd = at ? (int)args[modrm_rdi] : AT_FDCWD;
+  int flags = at ? args[modrm_rdx] : args[modrm_rsi];
+
+  char path[PATH_MAX];
+  int host_fd = -1;
+  if ((flags & O_ACCMODE) == O_RDONLY && load_path(at ? args[modrm_rsi] : args[modrm_rdi], path) == 0) {
+    host_fd = openat(dirfd, path, O_RDONLY | (flags & (O_CLOEXEC | O_DIRECTORY)));
+  }
+  if (host_fd < 0) {
+    host_fd = open("/dev/null", O_RDWR);
+  }
+  if (host_fd >= 0 && host_fd != fd) {
+    dup2(host_fd, fd);
+    close(host_fd);
+    if (flags & O_CLOEXEC) {
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+  }
+}
+
+static int replay_syscall(cpu_x86_64_t* cpu, uint64_t nr) {
+  int64_t result;
+  uint32_t size;
+  int ret = replay_read_event(REPLAY_EVENT_SYSCALL, nr, &result, &size);
+  if (ret != 0) {
+    return ret;
+  }
+
+  uint32_t expected_size;
+  uint64_t address = syscall_output(cpu, nr, result, &expected_size);
+  void* host = size ? guest_range_to_host(address, size, true) : NULL;
+  if (size != expected_size || (size && !host)) {
+    return -CPU_ERR_REPLAY_DIVERGED;
+  }
+
+  ret = replay_read_data(host, size);
+  if (ret != 0) {
+    return ret;
+  }
+
+  if ((nr == SYSCALL_NR_OPEN || nr == SYSCALL_NR_OPENAT) && result >= 0) {
+    reopen_for_replay(cpu, nr, result);
+  }
+
+  // Output to the terminal is shown again, everything else is left alone
+  int fd = cpu->regs[modrm_rdi];
+  if (nr == SYSCALL_NR_WRITE && result > 0 && (fd == STDOUT_FILENO || fd == STDERR_FILENO)) {
+    const void* data = guest_range_to_host(cpu->regs[modrm_rsi], result, false);
+    if (data) {
+      write(fd, data, result);
+    }
+  }
+
+  cpu->regs[modrm_rax] = result;
+  return 0;
+}
+
+static int dispatch_syscall(cpu_x86_64_t* cpu) {
+  guest_context_t* guest = guest_of(cpu);
+  uint64_t* args = cpu->regs;
+
+  // syscall saves the return address in rcx and rflags in r11
+  materialize_flags(cpu);
+  uint64_t rflags;
+  memcpy(&rflags, &cpu->rflags, sizeof(rflags));
+  cpu->regs[modrm_rcx] = cpu->rip;
+  cpu->regs[modrm_r11] = rflags;
+
+  uint64_t nr = cpu->regs[modrm_rax];
+  if (replay_mode == REPLAY_REPLAYING && is_logged_syscall(nr)) {
+    return replay_syscall(cpu, nr);
+  }
+
+  int64_t result;
+  switch (nr) {
+    case SYSCALL_NR_READ: {
+      result = emulate_read(args[modrm_rdi], args[modrm_rsi], args[modrm_rdx]);
+      break;
+    }
+
+    case SYSCALL_NR_WRITE: {
+      result = emulate_write(args[modrm_rdi], args[modrm_rsi], args[modrm_rdx]);
+      break;
+    }
+
+    case SYSCALL_NR_OPEN: {
+      result = emulate_openat(AT_FDCWD, args[modrm_rdi], args[modrm_rsi], args[modrm_rdx]);
+      break;
+    }
+
+    case SYSCALL_NR_OPENAT: {
+      result = emulate_openat(args[modrm_rdi], args[modrm_rsi], args[modrm_rdx], args[modrm_r10]);
+      break;
+    }
+
+    case SYSCALL_NR_CLOSE: {
+      result = (close(args[modrm_rdi]) != 0) ? -errno : 0;
+      break;
+    }
+
+    case SYSCALL_NR_FSTAT: {
+      result = emulate_fstat(args[modrm_rdi], args[modrm_rsi]);
+      break;
+    }
+
+    case SYSCALL_NR_NEWFSTATAT: {
+      result = emulate_newfstatat(args[modrm_rdi], args[modrm_rsi], args[modrm_rdx], args[modrm_r10]);
+      break;
+    }
+
+    case SYSCALL_NR_LSEEK: {
+      off_t offset = lseek(args[modrm_rdi], args[modrm_rsi], args[modrm_rdx]);
+      result = (offset < 0) ? -errno : offset;
+      break;
+    }
+
+    case SYSCALL_NR_PREAD64: {
+      result = emulate_pread64(args[modrm_rdi], args[modrm_rsi], args[modrm_rdx], args[modrm_r10]);
+      break;
+    }
+
+    case SYSCALL_NR_ACCESS: {
+      result = emulate_access(args[modrm_rdi], args[modrm_rsi]);
+      break;
+    }
+
+    case SYSCALL_NR_GETRANDOM: {
+      result = emulate_getrandom(args[modrm_rdi], args[modrm_rsi], args[modrm_rdx]);
+      break;
+    }
+
+    case SYSCALL_NR_MMAP: {
+      result = emulate_mmap(args[modrm_rdi], args[modrm_rsi], args[modrm_rdx], args[modrm_r10], args[modrm_r8], args[modrm_r9]);
+      break;
+    }
+
+    case SYSCALL_NR_MPROTECT: {
+      result = emulate_mprotect(args[modrm_rdi], args[modrm_rsi], args[modrm_rdx]);
+      break;
+    }
+
+    case SYSCALL_NR_MUNMAP: {
+      result = emulate_munmap(args[modrm_rdi], args[modrm_rsi]);
+      break;
+    }
+
+    case SYSCALL_NR_BRK: {
+      result = set_guest_brk(args[modrm_rdi]);
+      break;
+    }
+
+    case SYSCALL_NR_SCHED_YIELD: {
+      // Gives up the rest of the guest's slice, or its host thread's, if it
+      // isn't run by the scheduler
+      if (sched_running()) {
+        sched_preempt(guest);
+        result = 0;
+      } else {
+        result = sched_yield();
+      }
+      break;
+    }
+
+    case SYSCALL_NR_GETPID: {
+      result = tgid;
+      break;
+    }
+
+    case SYSCALL_NR_GETTID: {
+      result = guest->tid;
+      break;
+    }
+
+    case SYSCALL_NR_GETTIMEOFDAY: {
+      result = emulate_gettimeofday(args[modrm_rdi]);
+      break;
+    }
+
+    case SYSCALL_NR_CLOCK_GETTIME: {
+      result = emulate_clock_gettime(args[modrm_rdi], args[modrm_rsi]);
+      break;
+    }
+
+    case SYSCALL_NR_CLONE: {
+      // Replay can't reproduce the interleaving of threads
+      if (replay_mode != REPLAY_OFF) {
+        result = -ENOSYS;
+        break;
+      }
+      result = emulate_clone(guest, args[modrm_rdi], args[modrm_rsi], args[modrm_rdx], args[modrm_r10], args[modrm_r8]);
+      break;
+    }
+
+    case SYSCALL_NR_FUTEX: {
+      result = emulate_futex(guest, args[modrm_rdi], args[modrm_rsi], args[modrm_rdx], args[modrm_r10], args[modrm_r8], args[modrm_r9]);
+      break;
+    }
+
+    case SYSCALL_NR_ARCH_PRCTL: {
+      result = emulate_arch_prctl(cpu, args[modrm_rdi], args[modrm_rsi]);
+      break;
+    }
+
+    case SYSCALL_NR_SET_TID_ADDRESS: {
+      guest->clear_child_tid = args[modrm_rdi];
+      result = guest->tid;
+      break;
+    }
+
+    case SYSCALL_NR_SET_ROBUST_LIST: {
+      // Walked when the thread exits (see release_robust_list())
+      if (args[modrm_rsi] != ROBUST_LIST_HEAD_SIZE) {
+        result = -EINVAL;
+        break;
+      }
+      guest->robust_list = args[modrm_rdi];
+      result = 0;
+      break;
+    }
+
+    case SYSCALL_NR_EXIT: {
+      // The main thread's status is the process's, unless it's ended by exit_group()
+      release_thread(guest);
+      if (guest->tid == tgid) {
+        pthread_mutex_lock(&threads_lock);
+        main_exited = true;
+        if (!group_exiting) {
+          exit_status = args[modrm_rdi] & 0xff;
+        }
+        pthread_mutex_unlock(&threads_lock);
+      }
+      return RUN_GUEST_EXITED;
+    }
+
+    case SYSCALL_NR_EXIT_GROUP: {
+      start_group_exit(args[modrm_rdi] & 0xff);
+      return RUN_GUEST_EXITED;
+    }
+
+    default: {
+      result = -ENOSYS;
+      break;
+    }
+  }
+
+  if (replay_mode == REPLAY_RECORDING && is_logged_syscall(nr)) {
+    record_syscall(cpu, nr, result);
+  }
+  cpu->regs[modrm_rax] = result;
+  return 0;
+}
+
+// Called with rip already past the syscall instruction. Returns 0 to carry on
+// with the result in rax, or RUN_GUEST_EXITED if the calling thread has exited,
+// including when the thread group exited while it was blocked.
+int emulate_syscall(cpu_x86_64_t* cpu) {
+  STATS_INC(syscalls[(cpu->regs[modrm_rax] < STATS_NUM_SYSCALLS) ? cpu->regs[modrm_rax] : STATS_NUM_SYSCALLS - 1]);
+  STATS_TIME_START(syscall_start);
+  fpu_host_begin();
+
+  if (plugins_watching_syscalls) {
+    plugin_syscall(cpu);
+  }
+  int ret = dispatch_syscall(cpu);
+  watch_finish_in_place();
+  fpu_host_end();
+  if (ret == 0 && __atomic_load_n(&cpu->exit_requested, __ATOMIC_SEQ_CST)) {
+    ret = RUN_GUEST_EXITED;
+  }
+
+  STATS_TIME_END(STATS_TIER_SYSCALL, syscall_start);
+  return ret;
+}
@@ -0,0 +1,339 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ue-tcache.h"
+#include "ue-memory.h"
+#include "ue-block.h"
+
+static void* mapping = NULL;
+static size_t mapping_size = 0;
+
+// The executable segments the key was taken over. Only blocks inside them are
+// saved, since code mapped later (libraries loaded by ld.so, JIT buffers) isn't
+// part of the key and needn't be there on the next run.
+typedef struct keyed_range_t {
+  uint64_t start;
+  uint64_t end;
+} keyed_range_t;
+
+static keyed_range_t keyed_ranges[TCACHE_MAX_KEYED_RANGES];
+static size_t num_keyed_ranges = 0;
+
+// Hash of every executable segment (address, size and contents), along with
+// the emulator version, so that any change to either produces a new cache file
+uint64_t tcache_key(void) {
+  uint64_t hash = fnv1a(FNV_OFFSET_BASIS, UE_VERSION, sizeof(UE_VERSION));
+
+  num_keyed_ranges = 0;
+  memory_region_t* region = get_memory_regions();
+  while (region) {
+    if ((region->header.p_flags & PF_X) && region->buffer) {
+      hash = fnv1a(hash, &region->header.p_vaddr, sizeof(region->header.p_vaddr));
+      hash = fnv1a(hash, &region->header.p_memsz, sizeof(region->header.p_memsz));
+      hash = fnv1a(hash, region->buffer, region->header.p_memsz);
+      // Past the limit nothing more is saved, though all of it is still hashed
+      if (num_keyed_ranges < TCACHE_MAX_KEYED_RANGES) {
+        keyed_ranges[num_keyed_ranges].start = region->header.p_vaddr;
+        keyed_ranges[num_keyed_ranges].end = region->header.p_vaddr + region->header.p_memsz;
+        num_keyed_ranges++;
+      }
+    }
+    region = region->next;
+  }
+
+  return hash;
+}
+
+static bool in_keyed_range(uint64_t address, uint64_t size) {
+  for (size_t i = 0; i < num_keyed_ranges; i++) {
+    if (address >= keyed_ranges[i].start && address + size <= keyed_ranges[i].end) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void cache_path(char* path_out, const char* dir, uint64_t key) {
+  snprintf(path_out, TCACHE_MAX_PATH, "%s/%016lx.uecache", dir, key);
+}
+
+static bool header_is_valid(const tcache_header_t* header, uint64_t key) {
+  return (
+    header->magic == TCACHE_MAGIC
+    && header->format_version == TCACHE_FORMAT_VERSION
+    && header->instr_size == sizeof(x86_64_instr_t)
+    && strncmp(header->emulator_version, UE_VERSION, sizeof(header->emulator_version)) == 0
+    && header->key == key
+  );
+}
+
+// Whether the fused types' absorbed instructions are still there, following them
+static uint8_t expected_num_fused(uint16_t type) {
+  switch (type) {
+    case FUSED_PUSH_FRAME:
+    case FUSED_CMP_JCC:
+    case FUSED_POP_RET:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+// The instructions are executed as they are, indexing tables and registers with
+// their fields, so anything a decoder couldn't have produced is rejected. That
+// covers a corrupt file, not a malicious one: a well formed instruction can
+// still do anything the guest could.
+static bool instrs_are_valid(const tcache_block_t* record, const x86_64_instr_t* instrs) {
+  for (size_t i = 0; i < record->num_instrs; i++) {
+    const x86_64_instr_t* instr = &instrs[i];
+    size_t remaining = record->num_instrs - i - 1;
+
+    bool valid = (
+      instr->type < NUM_INSTR_TYPES
+      && instr->fused_type < NUM_INSTR_TYPES
+      && instr->num_fused == expected_num_fused(instr->type)
+      && instr->num_fused <= remaining
+      && instr->size > 0 && instr->size <= MAX_INSTRUCTIONS_BYTES
+      && instr->address >= record->address
+      && instr->address + instr->size <= record->address + record->size
+      && (instr->opsize == 2 || instr->opsize == 4 || instr->opsize == 8)
+      && instr->reg_index < 8
+      && instr->cc < 16
+      && instr->prefixes.seg < SEG_NUM_OVERRIDES
+      && instr->ea_kind < EA_NUM_KINDS
+      && instr->ea_base < 16
+      && instr->ea_index < 16
+      && instr->ea_scale <= 3
+    );
+    if (!valid) {
+      return false;
+    }
+
+    // The branch half of a fused compare is read through the compare
+    if (instr->type == FUSED_CMP_JCC && (instr[1].type != JCC || instr[1].cc >= 16)) {
+      return false;
+    }
+    i += instr->num_fused;
+  }
+  return true;
+}
+
+static bool record_is_valid(const tcache_block_t* record, const void* base, size_t file_size) {
+  uint64_t instrs_end = record->instrs_offset + record->num_instrs * sizeof(x86_64_instr_t);
+  return (
+    record->num_instrs > 0 && record->num_instrs <= BLOCK_MAX_INSTRUCTIONS
+    && record->num_guest_instrs >= record->num_instrs
+    && record->tier < BLOCK_NUM_TIERS
+    && record->size > 0 && in_keyed_range(record->address, record->size)
+    && record->instrs_offset % _Alignof(x86_64_instr_t) == 0
+    && instrs_end <= file_size && instrs_end > record->instrs_offset
+    && instrs_are_valid(record, (const x86_64_instr_t*)((const uint8_t*)base + record->instrs_offset))
+  );
+}
+
+int tcache_load(const char* dir, uint64_t key) {
+  char path[TCACHE_MAX_PATH];
+  cache_path(path, dir, key);
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -TCACHE_ERR_NOT_FOUND;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(tcache_header_t)) {
+    close(fd);
+    return -TCACHE_ERR_BAD_FILE;
+  }
+
+  // The instructions are used straight out of the mapping, without copying
+  void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return -TCACHE_ERR_BAD_FILE;
+  }
+
+  const tcache_header_t* header = base;
+  if (!header_is_valid(header, key)) {
+    munmap(base, st.st_size);
+    return -TCACHE_ERR_STALE;
+  }
+
+  const tcache_block_t* records = (const tcache_block_t*)(header + 1);
+  if (header->num_blocks > (st.st_size - sizeof(tcache_header_t)) / sizeof(tcache_block_t)) {
+    munmap(base, st.st_size);
+    return -TCACHE_ERR_BAD_FILE;
+  }
+
+  // Every record is checked and every block allocated before any of them go
+  // into the block cache, so a bad file is discarded whole and leaves the cache
+  // as it was
+  block_t** blocks = calloc(header->num_blocks ? header->num_blocks : 1, sizeof(block_t*));
+  if (!blocks) {
+    munmap(base, st.st_size);
+    return -TCACHE_ERR_MALLOC;
+  }
+
+  int ret = 0;
+  for (size_t i = 0; i < header->num_blocks; i++) {
+    const tcache_block_t* record = &records[i];
+    if (!record_is_valid(record, base, st.st_size)) {
+      ret = -TCACHE_ERR_BAD_FILE;
+      break;
+    }
+
+    block_t* block = calloc(1, sizeof(block_t));
+    if (!block) {
+      ret = -TCACHE_ERR_MALLOC;
+      break;
+    }
+
+    block->address = record->address;
+    block->size = record->size;
+    block->num_instrs = record->num_instrs;
+    block->num_guest_instrs = record->num_guest_instrs;
+    block->tier = record->tier;
+    block->instrs = (x86_64_instr_t*)((uint8_t*)base + record->instrs_offset);
+    block->mapped = true;
+    blocks[i] = block;
+  }
+
+  if (ret != 0) {
+    for (size_t i = 0; i < header->num_blocks; i++) {
+      free(blocks[i]);
+    }
+    free(blocks);
+    munmap(base, st.st_size);
+    return ret;
+  }
+
+  mapping = base;
+  mapping_size = st.st_size;
+  for (size_t i = 0; i < header->num_blocks; i++) {
+    block_insert(blocks[i]);
+  }
+  free(blocks);
+  return 0;
+}
+
+typedef struct block_list_t {
+  const block_t** blocks;
+  size_t count;
+  size_t capacity;
+} block_list_t;
+
+static void collect_block(const block_t* block, void* ctx) {
+  block_list_t* list = ctx;
+
+  // Blocks decoded from code which has since changed don't match the file they'd
+  // be keyed by, and code outside the keyed segments isn't covered by it at all
+  if (!in_keyed_range(block->address, block->size) || was_code_modified(block->address, block->size)) {
+    return;
+  }
+
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+    const block_t** blocks = realloc(list->blocks, capacity * sizeof(block_t*));
+    if (!blocks) return;
+    list->blocks = blocks;
+    list->capacity = capacity;
+  }
+
+  list->blocks[list->count++] = block;
+}
+
+int tcache_save(const char* dir, uint64_t key) {
+  // If nothing new was decoded the existing file is already up to date
+  if (get_block_stats()->blocks_built == 0) {
+    return 0;
+  }
+
+  block_list_t list = {0};
+  for_each_block(collect_block, &list);
+  if (list.count == 0) {
+    free(list.blocks);
+    return 0;
+  }
+
+  char path[TCACHE_MAX_PATH];
+  char tmp_path[TCACHE_MAX_PATH + 16]; // Room for ".<pid>.tmp"
+  cache_path(path, dir, key);
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, getpid());
+
+  FILE* fp = fopen(tmp_path, "wb");
+  if (!fp) {
+    free(list.blocks);
+    return -TCACHE_ERR_WRITE;
+  }
+
+  tcache_header_t header = {
+    .magic = TCACHE_MAGIC,
+    .format_version = TCACHE_FORMAT_VERSION,
+    .instr_size = sizeof(x86_64_instr_t),
+    .key = key,
+    .num_blocks = list.count,
+  };
+  strncpy(header.emulator_version, UE_VERSION, sizeof(header.emulator_version));
+
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+  // The block table comes first, followed by all of the instruction arrays
+  uint64_t instrs_offset = sizeof(header) + list.count * sizeof(tcache_block_t);
+  for (size_t i = 0; ok && i < list.count; i++) {
+    tcache_block_t record = {
+      .address = list.blocks[i]->address,
+      .size = list.blocks[i]->size,
+      .num_instrs = list.blocks[i]->num_instrs,
+      .num_guest_instrs = list.blocks[i]->num_guest_instrs,
+      .tier = list.blocks[i]->tier,
+      .instrs_offset = instrs_offset,
+    };
+    ok = fwrite(&record, sizeof(record), 1, fp) == 1;
+    instrs_offset += record.num_instrs * sizeof(x86_64_instr_t);
+  }
+
+  for (size_t i = 0; ok && i < list.count; i++) {
+    ok = fwrite(list.blocks[i]->instrs, sizeof(x86_64_instr_t), list.blocks[i]->num_instrs, fp) == list.blocks[i]->num_instrs;
+  }
+
+  free(list.blocks);
+  ok = (fclose(fp) == 0) && ok;
+
+  // Renaming makes the new file visible atomically to concurrent runs
+  if (!ok || rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+    return -TCACHE_ERR_WRITE;
+  }
+
+  return 0;
+}
+
+// Must only be called once the blocks pointing into the mapping have been freed
+void tcache_unmap(void) {
+  if (mapping) {
+    munmap(mapping, mapping_size);
+    mapping = NULL;
+    mapping_size = 0;
+  }
+}
+
+static char* tcache_errors[] = {
+  "Unknown",
+  "No translation cache file found",
+  "Translation cache file is malformed",
+  "Translation cache file is stale",
+  "Unable to allocate memory for cached blocks",
+  "Unable to write translation cache file",
+};
+
+char* tcache_err_message(int errorIndex) {
+  if (errorIndex < 0) {
+    errorIndex *= -1;
+  }
+
+  if (errorIndex >= TCACHE_ERR_NUM_ERRORS) {
+    return tcache_errors[TCACHE_ERR_UNKNOWN];
+  }
+  return tcache_errors[errorIndex];
+}
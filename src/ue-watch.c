@@ -0,0 +1,187 @@
+#include "ue-watch.h"
+#include "ue-memory.h"
+#include "ue-block.h"
+#include "ue-fpu.h"
+
+// An in-place store which hit a watchpoint, waiting for the store to be made
+typedef struct in_place_hit_t {
+  size_t index;
+  uint64_t rip;
+  uint64_t old_value;
+  const uint8_t* host; // The watched bytes
+} in_place_hit_t;
+
+bool watch_reads = false;
+bool watch_writes = false;
+
+// Only changed before the guest starts
+static watchpoint_t watchpoints[WATCH_MAX_WATCHPOINTS];
+static size_t num_watchpoints = 0;
+
+static __thread cpu_x86_64_t* attached_cpu = NULL;
+static __thread bool stop_requested = false;
+
+__thread size_t watch_num_in_place = 0;
+static __thread in_place_hit_t in_place_hits[WATCH_MAX_WATCHPOINTS];
+
+int watch_parse(const char* spec, watchpoint_t* watchpoint_out) {
+  *watchpoint_out = (watchpoint_t){
+    .size = WATCH_MAX_SIZE,
+    .kinds = WATCH_WRITE,
+    .action = WATCH_ACTION_LOG,
+  };
+
+  char* end;
+  watchpoint_out->address = strtoull(spec, &end, 0);
+  if (end == spec) {
+    return -WATCH_ERR_SPEC;
+  }
+
+  while (*end == ',') {
+    const char* field = end + 1;
+    size_t length = strcspn(field, ",");
+    if (length == 1 && field[0] == 'r') {
+      watchpoint_out->kinds = WATCH_READ;
+    } else if (length == 1 && field[0] == 'w') {
+      watchpoint_out->kinds = WATCH_WRITE;
+    } else if (length == 2 && strncmp(field, "rw", 2) == 0) {
+      watchpoint_out->kinds = WATCH_READ | WATCH_WRITE;
+    } else if (length == 4 && strncmp(field, "stop", 4) == 0) {
+      watchpoint_out->action = WATCH_ACTION_STOP;
+    } else if (length == 3 && strncmp(field, "log", 3) == 0) {
+      watchpoint_out->action = WATCH_ACTION_LOG;
+    } else {
+      char* size_end;
+      watchpoint_out->size = strtoull(field, &size_end, 0);
+      if (size_end != field + length) {
+        return -WATCH_ERR_SPEC;
+      }
+    }
+    end = (char*)field + length;
+  }
+
+  return (*end == '\0') ? 0 : -WATCH_ERR_SPEC;
+}
+
+int watch_add(const watchpoint_t* watchpoint) {
+  if (watchpoint->size == 0 || watchpoint->size > WATCH_MAX_SIZE) {
+    return -WATCH_ERR_SIZE;
+  }
+  if (num_watchpoints == WATCH_MAX_WATCHPOINTS) {
+    return -WATCH_ERR_TOO_MANY;
+  }
+  if (!mark_watched_pages(watchpoint->address, watchpoint->size)) {
+    return -WATCH_ERR_NOT_MAPPED;
+  }
+
+  watchpoints[num_watchpoints++] = *watchpoint;
+  if (watchpoint->kinds & WATCH_READ) {
+    watch_reads = true;
+  }
+  if (watchpoint->kinds & WATCH_WRITE) {
+    watch_writes = true;
+  }
+  return 0;
+}
+
+// Anything left over from an access which faulted never happened
+void watch_attach(cpu_x86_64_t* cpu) {
+  attached_cpu = cpu;
+  watch_num_in_place = 0;
+}
+
+bool watch_take_stop(void) {
+  bool stop = stop_requested;
+  stop_requested = false;
+  return stop;
+}
+
+static void report_hit(size_t index, uint64_t rip, bool is_write, uint64_t old_value, uint64_t new_value) {
+  const watchpoint_t* watchpoint = &watchpoints[index];
+  int digits = watchpoint->size * 2;
+  fpu_host_begin();
+  if (is_write) {
+    printf("Watchpoint %zu: 0x%016lx written at rip 0x%016lx: 0x%0*lx -> 0x%0*lx\n",
+           index, watchpoint->address, rip, digits, old_value, digits, new_value);
+  } else {
+    printf("Watchpoint %zu: 0x%016lx read at rip 0x%016lx: 0x%0*lx\n",
+           index, watchpoint->address, rip, digits, old_value);
+  }
+  fpu_host_end();
+
+  // Ends the run at the next block exit, as sched_park() does
+  if (watchpoint->action == WATCH_ACTION_STOP && attached_cpu) {
+    stop_requested = true;
+    attached_cpu->budget_end = 0;
+    attached_cpu->next_event = 0;
+  }
+}
+
+void watch_access(uint64_t address, uint64_t size, bool is_write, const void* host, const void* data) {
+  // Instructions being decoded aren't the guest reading its memory
+  uint64_t rip = current_instr_address();
+  if (rip == 0) return;
+
+  int kind = is_write ? WATCH_WRITE : WATCH_READ;
+  uint64_t end = address + size;
+  for (size_t i = 0; i < num_watchpoints; i++) {
+    const watchpoint_t* watchpoint = &watchpoints[i];
+    uint64_t watch_end = watchpoint->address + watchpoint->size;
+    if (!(watchpoint->kinds & kind) || watchpoint->address >= end || watch_end <= address) {
+      continue;
+    }
+
+    // The whole of the watched value, of which the access may only cover part
+    const uint8_t* watched = (const uint8_t*)host + (int64_t)(watchpoint->address - address);
+    uint64_t old_value = 0;
+    memcpy(&old_value, watched, watchpoint->size);
+
+    if (!is_write) {
+      report_hit(i, rip, false, old_value, old_value);
+    } else if (data) {
+      uint64_t overlap_start = (watchpoint->address > address) ? watchpoint->address : address;
+      uint64_t overlap_end = (watch_end < end) ? watch_end : end;
+      uint64_t new_value = old_value;
+      memcpy((uint8_t*)&new_value + (overlap_start - watchpoint->address),
+             (const uint8_t*)data + (overlap_start - address),
+             overlap_end - overlap_start);
+      report_hit(i, rip, true, old_value, new_value);
+    } else if (watch_num_in_place < WATCH_MAX_WATCHPOINTS) {
+      in_place_hits[watch_num_in_place++] = (in_place_hit_t){
+        .index = i,
+        .rip = rip,
+        .old_value = old_value,
+        .host = watched,
+      };
+    }
+  }
+}
+
+void watch_report_in_place(void) {
+  for (size_t i = 0; i < watch_num_in_place; i++) {
+    const in_place_hit_t* hit = &in_place_hits[i];
+    uint64_t new_value = 0;
+    memcpy(&new_value, hit->host, watchpoints[hit->index].size);
+    report_hit(hit->index, hit->rip, true, hit->old_value, new_value);
+  }
+  watch_num_in_place = 0;
+}
+
+static char* watch_errors[] = {
+  "Unknown",
+  "Watchpoints are address[,size][,r|w|rw][,stop]",
+  "Watchpoints cover 1 to 8 bytes",
+  "Too many watchpoints",
+  "Watched address isn't mapped",
+};
+
+char* watch_err_message(int errorIndex) {
+  if (errorIndex < 0) {
+    errorIndex *= -1;
+  }
+
+  if (errorIndex >= WATCH_ERR_NUM_ERRORS) {
+    return watch_errors[WATCH_ERR_UNKNOWN];
+  }
+  return watch_errors[errorIndex];
+}
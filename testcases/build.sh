@@ -1,16 +1,43 @@
 #!/bin/bash
 
-# Assume each C or S file is standalone
+# Assume each C or S file is standalone, apart from the shared libraries and
+# the emulator plugins
 
-C_FILES=`find . -name "*.c"`
-S_FILES=`find . -name "*.S"`
+C_FILES=`find . -name "*.c" ! -name "plugin-*.c"`
+S_FILES=`find . -name "*.S" ! -name "lib*.S"`
+LIB_FILES=`find . -name "lib*.S"`
 
 for cfile in $C_FILES; do
   out_name=${cfile%.*}
   gcc -g -no-pie $cfile -o $out_name -static
 done
 
+# lib*.S are shared libraries, for the dynamically linked testcases to find
+# next to themselves
+for lfile in $LIB_FILES; do
+  out_name=${lfile%.*}.so
+  gcc -nostdlib -shared -fPIC $lfile -o $out_name
+done
+
+# plugin-*.c are emulator plugins (see inc/ue-plugin.h), loaded with -x
+for pfile in `find . -name "plugin-*.c"`; do
+  out_name=${pfile%.*}.so
+  gcc -g -shared -fPIC -I ../inc $pfile -o $out_name
+done
+
+# Assembly testcases are whole programs, starting at _start without libc.
+# dynamic.S is linked against the libraries, interp.S is a position
+# independent program interpreter, which interpreted.S asks for (relative to
+# the directory it's run from), and everything else is linked statically.
 for sfile in $S_FILES; do
   out_name=${sfile%.*}
-  as $sfile -o $out_name.o
-done
\ No newline at end of file
+  if [ "$out_name" == "./dynamic" ]; then
+    gcc -nostdlib -no-pie $sfile -o $out_name -L. -ldyn -Wl,-rpath,'$ORIGIN'
+  elif [ "$out_name" == "./interp" ]; then
+    gcc -nostdlib -static-pie $sfile -o $out_name
+  elif [ "$out_name" == "./interpreted" ]; then
+    gcc -nostdlib -pie $sfile -o $out_name -Wl,--dynamic-linker=./interp
+  else
+    gcc -nostdlib -no-pie $sfile -o $out_name -static
+  fi
+done
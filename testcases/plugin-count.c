@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <string.h>
+#include "ue-plugin.h"
+
+// A test plugin (built as a shared object by build.sh, not as a guest): counts
+// the blocks entered, instructions executed, memory accesses and syscalls it
+// sees, and prints them, with the arguments it was given, once the guest is
+// done. With the argument "fail" its install fails instead, after subscribing.
+
+int ue_plugin_version = UE_PLUGIN_API_VERSION;
+
+static uint64_t blocks = 0;
+static uint64_t instrs = 0;
+static uint64_t reads = 0;
+static uint64_t writes = 0;
+static uint64_t syscalls = 0;
+static char plugin_args[64];
+
+static void on_block(cpu_x86_64_t* cpu, uint64_t address, void* userdata) {
+  blocks++;
+}
+
+static void on_instr(cpu_x86_64_t* cpu, uint64_t address, void* userdata) {
+  instrs++;
+}
+
+static void on_mem(cpu_x86_64_t* cpu, uint64_t address, uint64_t mem_address, uint32_t size, bool is_write, void* userdata) {
+  if (is_write) {
+    writes++;
+  } else {
+    reads++;
+  }
+}
+
+static void on_translate(ue_plugin_id_t id, ue_block_t* block, void* userdata) {
+  ue_block_on_entry(block, on_block, NULL);
+  for (size_t i = 0; i < ue_block_num_instrs(block); i++) {
+    ue_block_instr_on_exec(block, i, on_instr, NULL);
+    if (ue_instr_accesses_memory(ue_block_instr(block, i))) {
+      ue_block_instr_on_mem(block, i, on_mem, NULL);
+    }
+  }
+}
+
+static void on_syscall(cpu_x86_64_t* cpu, uint64_t number, void* userdata) {
+  syscalls++;
+}
+
+static void on_guest_exit(ue_plugin_id_t id, void* userdata) {
+  printf("Plugin counted %lu blocks, %lu instructions, %lu reads, %lu writes, %lu syscalls (args \"%s\")\n",
+         blocks, instrs, reads, writes, syscalls, plugin_args);
+}
+
+int ue_plugin_install(ue_plugin_id_t id, const char* args) {
+  ue_plugin_on_translate(id, on_translate, NULL);
+  ue_plugin_on_syscall(id, on_syscall, NULL);
+  ue_plugin_on_exit(id, on_guest_exit, NULL);
+  if (args) {
+    snprintf(plugin_args, sizeof(plugin_args), "%s", args);
+  }
+  return (args && strcmp(args, "fail") == 0) ? -1 : 0;
+}
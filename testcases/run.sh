@@ -0,0 +1,233 @@
+#!/bin/bash
+
+# Runs the testcases (see build.sh) under the emulator given, checking what
+# each one exits with and, for some, what it or the emulator writes. The
+# guests write to stderr, the emulator (block traces and reports) to stdout.
+#
+# true isn't run: it's glibc's static startup code, which uses instructions
+# the emulator doesn't decode yet. For the same reason no program is run
+# through glibc's own ld.so, only through the emulator's linker (-D) and a
+# stand-in interpreter (interp.S).
+
+EMU=${1:-../build/userspace-emu}
+TMP_DIR=`mktemp -d`
+trap 'rm -rf "$TMP_DIR"' EXIT
+failures=0
+
+# check name expected actual
+check() {
+  if [ "$2" == "$3" ]; then
+    echo "PASS $1"
+  else
+    echo "FAIL $1: expected $2, got $3"
+    failures=$((failures + 1))
+  fi
+}
+
+# expect_status name status emulator-args...
+expect_status() {
+  local name=$1
+  local expected=$2
+  shift 2
+  # The braces keep the shell's own report of a guest killed by a signal quiet
+  { "$EMU" "$@" < /dev/null > "$TMP_DIR/$name.out" 2> "$TMP_DIR/$name.err"; } 2> /dev/null
+  check "$name" "$expected" "$?"
+}
+
+# count_lines name pattern: how many lines of the emulator's output matched
+count_lines() {
+  grep -c "$2" "$TMP_DIR/$1.out"
+}
+
+# check_same name file file
+check_same() {
+  if cmp -s "$2" "$3"; then
+    check "$1" same same
+  else
+    check "$1" same different
+  fi
+}
+
+# seek_dump name n: the registers shown at the nth seek target
+seek_dump() {
+  awk -v n="$2" '/^Instruction / { i++ } i == n' "$TMP_DIR/$1.out" > "$TMP_DIR/$1.$2"
+  echo "$TMP_DIR/$1.$2"
+}
+
+expect_status regs 0 ./regs
+expect_status address 0 ./address
+expect_status fusion 0 ./fusion
+expect_status fpu-sse 0 ./fpu-sse
+expect_status fpu-x87 0 ./fpu-x87
+# An unmasked exception stops the guest, which the emulator reports as an error
+expect_status fpu-trap 1 ./fpu-trap
+expect_status threads 0 ./threads
+# Eight guest threads waiting on each other, on one host thread and on two
+expect_status sched 0 -j 1 ./sched
+expect_status sched-pool 0 -j 2 ./sched
+# Thread ids, requeueing and bitset waits, and a robust futex left held
+expect_status futex 0 -j 1 ./futex
+expect_status futex-pool 0 -j 2 ./futex
+
+# A run the emulator cuts short exits with its own status, not the guest's
+expect_status instruction-limit 123 -l 50 ./fusion
+check instruction-limit-report 1 `count_lines instruction-limit "after 50 instructions: instruction limit reached$"`
+expect_status timeout 124 -T 100 ./sched forever
+check timeout-report 1 `count_lines timeout ": timed out$"`
+# Code patched from outside its block and from inside it, interpreted first
+# and then with blocks built straight away, whose pages are write protected
+expect_status smc 0 ./smc
+expect_status smc-blocks 0 -B 0 ./smc
+
+# Pre-decoding builds the block only a function symbol leads to as well, and
+# blocks built before the guest runs are still invalidated when it patches them
+expect_status predecode 0 -p -s ./predecode
+check predecode-built 1 `count_lines predecode "^Blocks built: 4$"`
+expect_status smc-predecoded 0 -p ./smc
+
+# Segments are mapped from the file copy-on-write: what the guest writes stays
+# out of the file, and out of the next run
+cp segments "$TMP_DIR/segments"
+expect_status segments 0 ./segments
+expect_status segments-again 0 ./segments
+check_same segments-file segments "$TMP_DIR/segments"
+
+# Big mappings advised to use huge pages behave like any other
+expect_status hugepages 0 -H ./hugepages
+
+# Sampled every 1000 instructions, all the samples land in inner, symbolized
+# under the calls that led there
+expect_status profile 0 -P "$TMP_DIR/profile.txt" -I 1000 ./profile
+check profile-report 1 `count_lines profile "^Profile: [1-9][0-9]* samples (0 dropped) written to "`
+check profile-stacks "_start;outer;inner" "`cut -d ' ' -f 1 "$TMP_DIR/profile.txt"`"
+
+# Counted on the hot path: every instruction, the exiting syscall's block's
+# too, and each syscall. The live stats page carries the emulator's pid while
+# the guest runs, and is removed once it's done. A build without statistics
+# only says so.
+expect_status stats 0 -s ./profile
+if [ `count_lines stats "not compiled in"` == 0 ]; then
+  check stats-instructions 1 `count_lines stats "^Instructions retired: 300008$"`
+  check stats-syscalls 1 `count_lines stats "^  60  *1$"`
+  "$EMU" -M "$TMP_DIR/stats-page" -T 1000 ./sched forever > /dev/null 2>&1 &
+  emu_pid=$!
+  sleep 0.3
+  check stats-page-magic UESTATS "`head -c 7 "$TMP_DIR/stats-page"`"
+  check stats-page-pid $emu_pid `od -An -t u8 -j 16 -N 8 "$TMP_DIR/stats-page" | tr -d ' '`
+  wait $emu_pid
+  check stats-page-removed no `[ -e "$TMP_DIR/stats-page" ] && echo yes || echo no`
+else
+  check stats-disabled 1 `count_lines stats "^Execution statistics not compiled in"`
+fi
+
+# Edges come out the same whether blocks are interpreted first or built
+# straight away, and an argument takes the guest down more of them
+expect_status coverage 0 -C ./coverage
+check coverage-edges 1 `count_lines coverage "^Coverage: 2 edges$"`
+expect_status coverage-blocks 0 -C -B 0 ./coverage
+check coverage-blocks-edges 1 `count_lines coverage-blocks "^Coverage: 2 edges$"`
+expect_status coverage-more 0 -C ./coverage more
+check coverage-more-edges 1 `count_lines coverage-more "^Coverage: 10 edges$"`
+
+# A block is built once it has run as many times as -B says, interpreted
+# until then: at 0 all seven are built, by default only the loop is. A
+# threshold past the highest is clamped to it, so the loop runs interpreted
+# 255 times before it's built.
+expect_status tiers-build-all 0 -B 0 -s ./profile
+check tiers-build-all-built 1 `count_lines tiers-build-all "^Blocks built: 7$"`
+expect_status tiers-default 0 -s ./profile
+check tiers-default-built 1 `count_lines tiers-default "^Blocks built: 1$"`
+expect_status tiers-clamped 0 -B 1000 -s ./profile
+check tiers-clamped-built 1 `count_lines tiers-clamped "^Blocks built: 1$"`
+if [ `count_lines tiers-clamped "not compiled in"` == 0 ]; then
+  check tiers-clamped-interpreted 1 `count_lines tiers-clamped "^Blocks interpreted: 261$"`
+fi
+
+# A plugin sees every block entered, instruction run, memory access (the two
+# calls and two returns) and syscall, and gets its arguments. One whose
+# install fails stops the run, and its callbacks never run.
+expect_status plugin 0 -x ./plugin-count.so,hello ./profile
+check plugin-counts 1 `count_lines plugin '^Plugin counted 100005 blocks, 300008 instructions, 2 reads, 2 writes, 1 syscalls (args "hello")$'`
+expect_status plugin-fail 1 -x ./plugin-count.so,fail ./profile
+check plugin-fail-report 1 `count_lines plugin-fail "^Plugin ./plugin-count.so not loaded: Plugin failed to install$"`
+check plugin-fail-counts 0 `count_lines plugin-fail "^Plugin counted"`
+
+# A buffer twice the size of L1 misses it on every read, and L2 only on the
+# first sweep; one that fits in L1 misses it only on the first. A level
+# without its ways, or with a number of sets that isn't a power of two, is an
+# error.
+expect_status cachesim-small 0 -A l1=32k:8,l2=1m:16 ./cachesim
+check cachesim-small-sweep 1 `count_lines cachesim-small "^  sweep  *2050  *100.00%  *49.95%  *100.00% "`
+expect_status cachesim-big 0 -A l1=128k:8 ./cachesim
+check cachesim-big-sweep 1 `count_lines cachesim-big "^  sweep  *2050  *49.95%  *100.00%  *100.00% "`
+expect_status cachesim-malformed 1 -A l1=32k ./cachesim
+check cachesim-malformed-report 1 `count_lines cachesim-malformed "^Cache simulation not started: Invalid "`
+expect_status cachesim-geometry 1 -A l1=3k:8 ./cachesim
+check cachesim-geometry-report 1 `count_lines cachesim-geometry "^Cache simulation not started: .* power of two "`
+
+# Code on the (non-executable) stack faults rather than running
+expect_status stack-exec 139 ./stack-exec
+check stack-exec-report 1 `count_lines stack-exec "^Segmentation fault at \(0x[0-9a-f]*\), accessing \1$"`
+
+expect_status args 3 ./args A "b c"
+check args-output "Ab" "`cat "$TMP_DIR/args.err"`"
+
+# Six writes, one of them atomic, and six reads, to a watched counter.
+# Stopping ends the run at the end of the block with the first write, with the
+# emulator's status for a watchpoint stop.
+COUNTER=0x`nm watch | awk '/ counter$/ { print $1 }'`
+expect_status watch-write 18 -w $COUNTER,8,w ./watch
+check watch-write-hits 6 `count_lines watch-write "^Watchpoint 0: .* written"`
+expect_status watch-read 18 -w $COUNTER,8,r ./watch
+check watch-read-hits 6 `count_lines watch-read "^Watchpoint 0: .* read"`
+expect_status watch-stop 125 -w $COUNTER,8,w,stop ./watch
+check watch-stop-hits 1 `count_lines watch-stop "^Watchpoint 0: "`
+check watch-stop-report 1 `count_lines watch-stop "watchpoint hit$"`
+# One more than fits is an error, not the program to run
+expect_status watch-too-many 1 `for i in $(seq 0 16); do echo -w $COUNTER; done` ./watch
+check watch-too-many-report 1 `count_lines watch-too-many "^Watchpoint .* not set: "`
+
+# Loaded through the program interpreter it names, which runs first
+expect_status interpreted 0 ./interpreted
+
+# Linked by the emulator, then again from the prelink cache it saved
+expect_status dynamic 0 -D ./dynamic
+expect_status dynamic-prelink 0 -L "$TMP_DIR" ./dynamic
+expect_status dynamic-prelinked 0 -L "$TMP_DIR" ./dynamic
+
+# The second run starts with every block it needs from the cache the first
+# saved. A cache with an instruction no decoder would produce is thrown away
+# whole, and the run decodes everything again.
+expect_status tcache-save 0 -c "$TMP_DIR" -s ./fusion
+expect_status tcache-load 0 -c "$TMP_DIR" -s ./fusion
+check tcache-load-built 1 `count_lines tcache-load "^Blocks built: 0$"`
+CACHE=`ls "$TMP_DIR"/*.uecache`
+INSTRS_OFFSET=`od -An -t u8 -j 88 -N 8 "$CACHE"` # The first block's, past the 48 byte header
+printf '\377\377' | dd of="$CACHE" bs=1 seek=$((INSTRS_OFFSET + 8)) conv=notrunc 2> /dev/null # Its first type
+expect_status tcache-corrupt 0 -c "$TMP_DIR" -s ./fusion
+check tcache-corrupt-report 1 `count_lines tcache-corrupt "^Translation cache not loaded: .* malformed$"`
+check tcache-corrupt-built 0 `count_lines tcache-corrupt "^Blocks built: 0$"`
+
+# Replaying has to reproduce everything the recording got from the host,
+# with nothing to read this time
+echo "recorded input" | "$EMU" -r "$TMP_DIR/replay.log" ./replay > /dev/null 2> "$TMP_DIR/recorded"
+recorded_status=$?
+expect_status replay "$recorded_status" -R "$TMP_DIR/replay.log" ./replay
+check_same replay-output "$TMP_DIR/recorded" "$TMP_DIR/replay.err"
+
+# Seeking forwards, back past a checkpoint, forwards again and back to
+# just after one has to land where replaying straight there does
+"$EMU" -r "$TMP_DIR/seek.log" ./seek > /dev/null 2>&1
+expect_status seek 0 -R "$TMP_DIR/seek.log" -S 20000000 -S 5000000 -S 20000000 -S 15000000 ./seek
+expect_status seek-direct 0 -R "$TMP_DIR/seek.log" -S 15000000 ./seek
+check seek-targets 4 `count_lines seek "^Instruction [0-9]*000000: "`
+check_same seek-again `seek_dump seek 1` `seek_dump seek 3`
+check_same seek-back `seek_dump seek 4` `seek_dump seek-direct 1`
+expect_status seek-too-many 1 -R "$TMP_DIR/seek.log" `for i in $(seq 0 16); do echo -S $i; done` ./seek
+check seek-too-many-report 1 `count_lines seek-too-many "^Seek to .* not made: "`
+
+if [ $failures -ne 0 ]; then
+  echo "$failures failed"
+  exit 1
+fi
+echo "All passed"